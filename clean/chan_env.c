@@ -0,0 +1,344 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Envelope files.  See chan_env.h.
+
+   All of the levels are built in one pass over the samples.  Each level
+   has the bin it is building.  When a bin is full it is written out and
+   added to the bin of the next level up.  The means are carried up as sums
+   and counts, so every level's means are of the samples themselves, not
+   means of rounded means.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "chan_env.h"
+
+#define OUT_BINS 4096     // bins buffered per level before writing
+
+
+static void env_free(ChanEnv *env)
+{
+   if (env->fd != -1)
+      close(env->fd);
+   free(env->name);
+   free(env->out);
+   free(env->out_len);
+   free(env->written);
+   free(env->sum);
+   free(env->cnt);
+   free(env->lo);
+   free(env->hi);
+   free(env);
+}
+
+static bool write_all(int fd, const void *buf, size_t len, off_t where)
+{
+   const char *p = buf;
+
+   while (len)
+   {
+      ssize_t res = pwrite(fd, p, len, where);
+      if (res <= 0)
+         return false;
+      p += res;
+      len -= res;
+      where += res;
+   }
+   return true;
+}
+
+   // fill in the bin counts and offsets from the header
+static void layout(ChanEnv *env)
+{
+   off_t    where = sizeof(env->hdr);
+   uint32_t level;
+
+   for (level = 0; level < env->hdr.levels; ++level)
+   {
+      uint64_t size = (uint64_t) 1 << (env->hdr.first_shift + level);
+
+      env->bins[level] = (env->hdr.samples + size - 1) / size;
+      env->offset[level] = where;
+      where += env->bins[level] * sizeof(ChanEnvBin);
+   }
+}
+
+   // the mean of cnt samples that add up to sum, rounded
+static short mean_of(int64_t sum, uint64_t cnt)
+{
+   int64_t half = cnt / 2;
+
+   return (sum >= 0 ? sum + half : sum - half) / (int64_t) cnt;
+}
+
+static bool flush_level(ChanEnv *env, int level)
+{
+   ChanEnvBin *out = env->out + (size_t) level * OUT_BINS;
+   size_t      len = env->out_len[level];
+
+   if (len == 0)
+      return true;
+   if (!write_all(env->fd, out, len * sizeof(ChanEnvBin),
+                  env->offset[level] + env->written[level] * sizeof(ChanEnvBin)))
+   {
+      printf("Error writing to %s, %s\n", env->name, strerror(errno));
+      return false;
+   }
+   env->written[level] += len;
+   env->out_len[level] = 0;
+   return true;
+}
+
+/* Write out the bin level is building and add it to the next level's.
+*/
+static bool finish_bin(ChanEnv *env, int level)
+{
+   ChanEnvBin *out = env->out + (size_t) level * OUT_BINS + env->out_len[level];
+   int         up = level + 1;
+
+   out->min = env->lo[level];
+   out->max = env->hi[level];
+   out->mean = mean_of(env->sum[level], env->cnt[level]);
+   if (++env->out_len[level] == OUT_BINS && !flush_level(env, level))
+      return false;
+
+   if (up < (int) env->hdr.levels)
+   {
+      if (env->cnt[up] == 0 || env->lo[level] < env->lo[up])
+         env->lo[up] = env->lo[level];
+      if (env->cnt[up] == 0 || env->hi[level] > env->hi[up])
+         env->hi[up] = env->hi[level];
+      env->sum[up] += env->sum[level];
+      env->cnt[up] += env->cnt[level];
+   }
+   env->sum[level] = 0;
+   env->cnt[level] = 0;
+
+   if (up < (int) env->hdr.levels
+       && env->cnt[up] == (uint64_t) 1 << (env->hdr.first_shift + up))
+      return finish_bin(env, up);
+   return true;
+}
+
+
+ChanEnv *chan_env_create(const char *name, uint64_t samples)
+{
+   ChanEnv *env = calloc(1, sizeof(*env));
+   uint32_t levels = 0;
+
+   if (!env)
+   {
+      printf("Out of memory\n");
+      return NULL;
+   }
+   env->fd = -1;
+   memcpy(env->hdr.magic, ENV_MAGIC, sizeof(env->hdr.magic));
+   env->hdr.version = ENV_VERSION;
+   env->hdr.first_shift = ENV_FIRST_SHIFT;
+   env->hdr.samples = samples;
+      // up to the level with a single bin
+   while (levels < ENV_MAX_LEVELS)
+      if (samples <= (uint64_t) 1 << (ENV_FIRST_SHIFT + levels++))
+         break;
+   env->hdr.levels = levels;
+   layout(env);
+
+   env->name = strdup(name);
+   env->out = malloc(levels * OUT_BINS * sizeof(ChanEnvBin));
+   env->out_len = calloc(levels, sizeof(size_t));
+   env->written = calloc(levels, sizeof(uint64_t));
+   env->sum = calloc(levels, sizeof(int64_t));
+   env->cnt = calloc(levels, sizeof(uint64_t));
+   env->lo = calloc(levels, sizeof(short));
+   env->hi = calloc(levels, sizeof(short));
+   if (!env->name || !env->out || !env->out_len || !env->written || !env->sum
+       || !env->cnt || !env->lo || !env->hi)
+   {
+      printf("Out of memory\n");
+      env_free(env);
+      return NULL;
+   }
+
+   if ((env->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      env_free(env);
+      return NULL;
+   }
+   if (!write_all(env->fd, &env->hdr, sizeof(env->hdr), 0))
+   {
+      printf("Error writing to %s, %s\n", name, strerror(errno));
+      env_free(env);
+      return NULL;
+   }
+   return env;
+}
+
+
+bool chan_env_put(ChanEnv *env, const short *samps, size_t n)
+{
+   uint64_t full = (uint64_t) 1 << env->hdr.first_shift;
+   size_t   k;
+
+   if (env->put + n > env->hdr.samples)
+   {
+      printf("%s has more samples than expected\n", env->name);
+      return false;
+   }
+   env->put += n;
+
+      // the first level straight from the samples, the rest from its bins
+   for (k = 0; k < n; ++k)
+   {
+      short val = samps[k];
+
+      if (env->cnt[0] == 0)
+         env->lo[0] = env->hi[0] = val;
+      else if (val < env->lo[0])
+         env->lo[0] = val;
+      else if (val > env->hi[0])
+         env->hi[0] = val;
+      env->sum[0] += val;
+      if (++env->cnt[0] == full && !finish_bin(env, 0))
+         return false;
+   }
+   return true;
+}
+
+
+ChanEnv *chan_env_open(const char *name)
+{
+   ChanEnv *env = calloc(1, sizeof(*env));
+
+   if (!env)
+   {
+      printf("Out of memory\n");
+      return NULL;
+   }
+   env->fd = -1;
+   if (!(env->name = strdup(name)))
+   {
+      printf("Out of memory\n");
+      env_free(env);
+      return NULL;
+   }
+   if ((env->fd = open(name, O_RDONLY)) == -1)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      env_free(env);
+      return NULL;
+   }
+   if (pread(env->fd, &env->hdr, sizeof(env->hdr), 0) != sizeof(env->hdr)
+       || memcmp(env->hdr.magic, ENV_MAGIC, sizeof(env->hdr.magic)) != 0
+       || env->hdr.version != ENV_VERSION || env->hdr.levels > ENV_MAX_LEVELS
+       || env->hdr.first_shift + env->hdr.levels > 63)
+   {
+      printf("%s is not an envelope file\n", name);
+      env_free(env);
+      return NULL;
+   }
+   layout(env);
+   return env;
+}
+
+
+int chan_env_level(const ChanEnv *env, double samps_per_bin)
+{
+   int level = -1;
+
+   while (level + 1 < (int) env->hdr.levels
+          && (double) ((uint64_t) 1 << (env->hdr.first_shift + level + 1)) <= samps_per_bin)
+      ++level;
+   return level;
+}
+
+
+size_t chan_env_read(const ChanEnv *env, int level, uint64_t start, size_t n, ChanEnvBin *dest)
+{
+   ssize_t res;
+
+   if (level < 0 || level >= (int) env->hdr.levels || start >= env->bins[level])
+      return 0;
+   if (n > env->bins[level] - start)
+      n = env->bins[level] - start;
+   res = pread(env->fd, dest, n * sizeof(ChanEnvBin),
+               env->offset[level] + start * sizeof(ChanEnvBin));
+   return res <= 0 ? 0 : res / sizeof(ChanEnvBin);
+}
+
+
+bool chan_env_close(ChanEnv *env)
+{
+   bool     ok = true;
+   uint32_t level;
+
+   if (!env)
+      return true;
+   if (env->out)
+   {
+      if (env->put != env->hdr.samples)
+      {
+         printf("%s is missing samples\n", env->name);
+         ok = false;
+      }
+         // the partial bins at the end, smallest first so each one is
+         // added to the next before that is finished
+      for (level = 0; ok && level < env->hdr.levels; ++level)
+         if (env->cnt[level] && !finish_bin(env, level))
+            ok = false;
+      for (level = 0; ok && level < env->hdr.levels; ++level)
+         ok = flush_level(env, level);
+      if (close(env->fd) != 0 && ok)
+      {
+         printf("Error closing %s, %s\n", env->name, strerror(errno));
+         ok = false;
+      }
+      env->fd = -1;
+   }
+   env_free(env);
+   return ok;
+}
+
+
+char *chan_env_name(const char *chan_name)
+{
+   const char *ext = strrchr(chan_name, '.');
+   char *name;
+
+   if (ext && (strcmp(ext, ".chan") == 0 || strcmp(ext, ".chz") == 0))
+   {
+      if (asprintf(&name, "%.*s%s", (int)(ext - chan_name), chan_name, ENV_EXT) == -1)
+         return NULL;
+   }
+   else if (asprintf(&name, "%s%s", chan_name, ENV_EXT) == -1)
+      return NULL;
+   return name;
+}
@@ -0,0 +1,112 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Envelope files, .env.  A summary of a chan for drawing it zoomed out.
+   The samples are cut into bins and each bin is kept as its min, max, and
+   mean.  There is a level for bins of 2^ENV_FIRST_SHIFT samples, another
+   for bins twice that size, and so on up to one bin for the whole chan.
+   A viewer picks the level with about one bin per pixel, so drawing an
+   hour of data reads about as much as drawing a screen of samples.
+
+      header   "DAQ2ENV1", version, first shift, number of levels, samples
+      levels   the bins of each level, smallest bins first.  Level i has
+               ceil(samples / 2^(first shift + i)) bins, each a short min,
+               max, and mean, in the machine's byte order.
+
+   The last bin of a level may cover fewer samples than the others.
+*/
+
+#ifndef CHAN_ENV_H
+#define CHAN_ENV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define ENV_MAGIC "DAQ2ENV1"
+#define ENV_VERSION 1
+#define ENV_EXT ".env"
+#define ENV_FIRST_SHIFT 4      // 16 samples per bin in the first level
+#define ENV_MAX_LEVELS 48
+
+typedef struct
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t first_shift;
+   uint32_t levels;
+   uint32_t pad;
+   uint64_t samples;
+} ChanEnvHeader;
+
+typedef struct
+{
+   short min;
+   short max;
+   short mean;
+} ChanEnvBin;
+
+typedef struct
+{
+   int           fd;
+   char         *name;
+   ChanEnvHeader hdr;
+   uint64_t      bins[ENV_MAX_LEVELS];    // per level
+   off_t         offset[ENV_MAX_LEVELS];  // of each level's first bin
+      // writing only
+   ChanEnvBin   *out;        // a buffer of finished bins per level
+   size_t       *out_len;
+   uint64_t     *written;    // bins written per level
+   int64_t      *sum;        // the bin being built, per level
+   uint64_t     *cnt;
+   short        *lo;
+   short        *hi;
+   uint64_t      put;        // samples put so far
+} ChanEnv;
+
+/* Start an envelope file for a chan of samples samples.  Then give it all of
+   the samples, in order, with chan_env_put.  Prints a message and returns
+   NULL if something goes wrong.
+*/
+ChanEnv *chan_env_create(const char *name, uint64_t samples);
+bool chan_env_put(ChanEnv *env, const short *samps, size_t n);
+
+/* Open an existing envelope file.  Prints a message and returns NULL if it
+   isn't one.
+*/
+ChanEnv *chan_env_open(const char *name);
+
+   // the level with the biggest bins that are no bigger than samps_per_bin,
+   // or -1 if that is smaller than the first level's bins
+int chan_env_level(const ChanEnv *env, double samps_per_bin);
+
+   // read n bins of level starting at bin start, returns how many there were
+size_t chan_env_read(const ChanEnv *env, int level, uint64_t start, size_t n, ChanEnvBin *dest);
+
+/* Close the file.  When writing, this writes out the last partial bins.
+   Returns false if the writing fails or not all of the samples were put.
+*/
+bool chan_env_close(ChanEnv *env);
+
+   // name with .chan or .chz changed to .env.  Free it when done.
+char *chan_env_name(const char *chan_name);
+
+#endif
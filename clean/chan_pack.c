@@ -0,0 +1,550 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Pack files and chan readers.  See chan_pack.h.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "chan_pack.h"
+
+#define READ_BUF_SAMPS (16 * 1024)
+
+
+static void pack_free(ChanPack *pack)
+{
+   if (pack->fd != -1)
+      close(pack->fd);
+   free(pack->name);
+   free(pack->chans);
+   free(pack->block);
+   free(pack->fill);
+   free(pack);
+}
+
+static bool write_all(int fd, const void *buf, size_t len, off_t where)
+{
+   const char *p = buf;
+
+   while (len)
+   {
+      ssize_t res = pwrite(fd, p, len, where);
+      if (res <= 0)
+         return false;
+      p += res;
+      len -= res;
+      where += res;
+   }
+   return true;
+}
+
+   // byte offset of sample start of directory entry idx
+static off_t sample_offset(const ChanPackHeader *hdr, int idx, uint64_t start)
+{
+   uint64_t block = start / hdr->block_samps;
+   uint64_t first = block * hdr->block_samps;
+   uint64_t len = hdr->samples - first < hdr->block_samps ? hdr->samples - first : hdr->block_samps;
+
+   return hdr->data_offset + first * hdr->nchans * sizeof(short)
+          + (idx * len + (start - first)) * sizeof(short);
+}
+
+
+ChanPack *chan_pack_create(const char *name, const int *chans, int nchans)
+{
+   ChanPack *pack = calloc(1, sizeof(*pack));
+   int       idx;
+
+   if (!pack)
+   {
+      printf("Out of memory\n");
+      return NULL;
+   }
+   pack->fd = -1;
+   memcpy(pack->hdr.magic, CHAN_PACK_MAGIC, sizeof(pack->hdr.magic));
+   pack->hdr.version = CHAN_PACK_VERSION;
+   pack->hdr.nchans = nchans;
+   pack->hdr.block_samps = CHAN_PACK_BLOCK;
+   pack->hdr.data_offset = sizeof(pack->hdr) + nchans * sizeof(int32_t);
+   pack->name = strdup(name);
+   pack->chans = malloc(nchans * sizeof(int32_t) + 1);
+   pack->block = malloc(2 * (size_t)CHAN_PACK_BLOCK * nchans * sizeof(short) + 1);
+   pack->fill = calloc(nchans + 1, sizeof(uint64_t));
+   if (!pack->name || !pack->chans || !pack->block || !pack->fill)
+   {
+      printf("Out of memory\n");
+      pack_free(pack);
+      return NULL;
+   }
+   for (idx = 0; idx < nchans; ++idx)
+      pack->chans[idx] = chans[idx];
+
+   if ((pack->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      pack_free(pack);
+      return NULL;
+   }
+      // the header is written again at the end with the sample count
+   if (!write_all(pack->fd, &pack->hdr, sizeof(pack->hdr), 0)
+       || !write_all(pack->fd, pack->chans, nchans * sizeof(int32_t), sizeof(pack->hdr)))
+   {
+      printf("Error writing to %s, %s\n", name, strerror(errno));
+      pack_free(pack);
+      return NULL;
+   }
+   return pack;
+}
+
+
+/* Write out block number pack->written, len samples of each chan.
+*/
+static bool write_block(ChanPack *pack, size_t len)
+{
+   const ChanPackHeader *hdr = &pack->hdr;
+   short  *slot = pack->block + (pack->written % 2) * (size_t)hdr->block_samps * hdr->nchans;
+   off_t   where = hdr->data_offset + pack->written * hdr->block_samps * hdr->nchans * sizeof(short);
+   uint32_t idx;
+
+   if (len < hdr->block_samps)   // the last one, close up the gaps
+      for (idx = 1; idx < hdr->nchans; ++idx)
+         memmove(slot + idx * len, slot + (size_t)idx * hdr->block_samps, len * sizeof(short));
+   if (!write_all(pack->fd, slot, len * hdr->nchans * sizeof(short), where))
+   {
+      printf("Error writing to %s, %s\n", pack->name, strerror(errno));
+      return false;
+   }
+   ++pack->written;
+   return true;
+}
+
+bool chan_pack_put(ChanPack *pack, int idx, const short *samps, size_t n)
+{
+   const uint32_t bsize = pack->hdr.block_samps;
+   uint64_t least;
+   uint32_t chan;
+
+   while (n)
+   {
+      uint64_t pos = pack->fill[idx];
+      uint64_t block = pos / bsize;
+      size_t   in = pos % bsize;
+      size_t   cnt = n < bsize - in ? n : bsize - in;
+
+      if (block >= pack->written + 2)
+      {
+         printf("Chan %d is too far ahead of the others in %s\n", pack->chans[idx], pack->name);
+         return false;
+      }
+      memcpy(pack->block + ((block % 2) * pack->hdr.nchans + idx) * (size_t)bsize + in,
+             samps, cnt * sizeof(short));
+      pack->fill[idx] += cnt;
+      samps += cnt;
+      n -= cnt;
+
+         // if every chan has filled the oldest block, out it goes
+      least = pack->fill[0];
+      for (chan = 1; chan < pack->hdr.nchans; ++chan)
+         if (pack->fill[chan] < least)
+            least = pack->fill[chan];
+      while (least >= (pack->written + 1) * bsize)
+         if (!write_block(pack, bsize))
+            return false;
+   }
+   return true;
+}
+
+
+ChanPack *chan_pack_open(const char *name)
+{
+   ChanPack   *pack = calloc(1, sizeof(*pack));
+   struct stat info;
+
+   if (!pack)
+   {
+      printf("Out of memory\n");
+      return NULL;
+   }
+   if ((pack->fd = open(name, O_RDONLY)) == -1)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      pack->fd = -1;
+      pack_free(pack);
+      return NULL;
+   }
+   pack->name = strdup(name);
+   if (pread(pack->fd, &pack->hdr, sizeof(pack->hdr), 0) != sizeof(pack->hdr)
+       || memcmp(pack->hdr.magic, CHAN_PACK_MAGIC, sizeof(pack->hdr.magic)) != 0
+       || pack->hdr.version != CHAN_PACK_VERSION || pack->hdr.block_samps == 0
+       || pack->hdr.data_offset < sizeof(pack->hdr) + pack->hdr.nchans * sizeof(int32_t))
+   {
+      printf("%s is not a pack file\n", name);
+      pack_free(pack);
+      return NULL;
+   }
+   if (fstat(pack->fd, &info) == 0
+       && (uint64_t)info.st_size < pack->hdr.data_offset + pack->hdr.samples * pack->hdr.nchans * sizeof(short))
+   {
+      printf("%s is cut short\n", name);
+      pack_free(pack);
+      return NULL;
+   }
+   pack->chans = malloc(pack->hdr.nchans * sizeof(int32_t) + 1);
+   if (!pack->chans
+       || pread(pack->fd, pack->chans, pack->hdr.nchans * sizeof(int32_t), sizeof(pack->hdr))
+          != (ssize_t)(pack->hdr.nchans * sizeof(int32_t)))
+   {
+      printf("Error reading %s\n", name);
+      pack_free(pack);
+      return NULL;
+   }
+   return pack;
+}
+
+
+int chan_pack_open_pair(const char *prefix, ChanPack **packs)
+{
+   char *name;
+   int   cnt = 0;
+   int   half;
+
+   packs[0] = packs[1] = NULL;
+   for (half = 0; half < 2; ++half)
+   {
+      if (asprintf(&name, "%s%s%s", prefix, half ? "65-128" : "1-64", CHAN_PACK_EXT) == -1)
+         continue;
+      if (access(name, F_OK) == 0 && (packs[cnt] = chan_pack_open(name)) != NULL)
+         ++cnt;
+      free(name);
+   }
+   return cnt;
+}
+
+
+int chan_pack_find(const ChanPack *pack, int chan)
+{
+   uint32_t idx;
+
+   for (idx = 0; idx < pack->hdr.nchans; ++idx)
+      if (pack->chans[idx] == chan)
+         return idx;
+   return -1;
+}
+
+
+size_t chan_pack_read(const ChanPack *pack, int idx, uint64_t start, size_t n, short *dest)
+{
+   const ChanPackHeader *hdr = &pack->hdr;
+   size_t done = 0;
+
+   if (start >= hdr->samples)
+      return 0;
+   if (n > hdr->samples - start)
+      n = hdr->samples - start;
+   while (done < n)
+   {
+      uint64_t pos = start + done;
+      size_t   cnt = hdr->block_samps - pos % hdr->block_samps;
+      ssize_t  res;
+
+      if (cnt > n - done)
+         cnt = n - done;
+      res = pread(pack->fd, dest + done, cnt * sizeof(short), sample_offset(hdr, idx, pos));
+      if (res <= 0)
+         break;
+      done += res / sizeof(short);
+   }
+   return done;
+}
+
+
+bool chan_pack_close(ChanPack *pack)
+{
+   bool ok = true;
+
+   if (!pack)
+      return true;
+   if (pack->fill)
+   {
+      uint64_t least = pack->hdr.nchans ? pack->fill[0] : 0;
+      uint32_t chan;
+
+      for (chan = 1; chan < pack->hdr.nchans; ++chan)
+         if (pack->fill[chan] < least)
+            least = pack->fill[chan];
+      if (least > pack->written * pack->hdr.block_samps)
+         ok = write_block(pack, least - pack->written * pack->hdr.block_samps);
+      pack->hdr.samples = least;
+      if (ok && !write_all(pack->fd, &pack->hdr, sizeof(pack->hdr), 0))
+      {
+         printf("Error writing to %s, %s\n", pack->name, strerror(errno));
+         ok = false;
+      }
+      if (close(pack->fd) != 0 && ok)
+      {
+         printf("Error closing %s, %s\n", pack->name, strerror(errno));
+         ok = false;
+      }
+      pack->fd = -1;
+   }
+   pack_free(pack);
+   return ok;
+}
+
+
+bool chan_reader_open(ChanReader *rd, const char *chan_name, ChanPack *const *packs, int npacks, int chan)
+{
+   int p;
+
+   char *zname;
+
+   memset(rd, 0, sizeof(*rd));
+   rd->nc.fd = -1;
+   if ((rd->fd = fopen(chan_name, "r")) != NULL)
+   {
+      nocache_open(&rd->nc, fileno(rd->fd), 0);
+      return true;
+   }
+   if ((zname = chz_name(chan_name)) != NULL)
+   {
+      if (access(zname, F_OK) == 0)
+         rd->z = chz_open(zname);
+      free(zname);
+      if (rd->z)
+         return true;
+   }
+   for (p = 0; p < npacks; ++p)
+      if (packs[p] && (rd->idx = chan_pack_find(packs[p], chan)) != -1)
+      {
+         if ((rd->buf = malloc(READ_BUF_SAMPS * sizeof(short))) == NULL)
+            return false;
+         rd->pack = packs[p];
+         return true;
+      }
+   return false;
+}
+
+
+   // start reads of the next two blocks from rd->pos into buf and ahead
+static void ahead_start(ChanReader *rd)
+{
+   size_t bytes = CHAN_AHEAD_SAMPS * sizeof(short);
+
+   uring_read(rd->io, fileno(rd->fd), rd->buf, bytes, rd->pos * sizeof(short));
+   uring_read(rd->io, fileno(rd->fd), rd->ahead, bytes, (rd->pos + CHAN_AHEAD_SAMPS) * sizeof(short));
+   rd->pos += 2 * CHAN_AHEAD_SAMPS;
+   rd->buf_busy = rd->ahead_busy = true;
+   rd->eof = false;
+   rd->len = rd->at = 0;
+}
+
+
+   // wait out any reads still in flight
+static void ahead_stop(ChanReader *rd)
+{
+   if (rd->buf_busy)
+      uring_wait(rd->io, rd->buf);
+   if (rd->ahead_busy)
+      uring_wait(rd->io, rd->ahead);
+   rd->buf_busy = rd->ahead_busy = false;
+}
+
+
+/* buf is used up.  Swap in the block read ahead, start the read of the
+   one after it, and wait for the block if it isn't in yet.  Returns false
+   at the end of the file.
+*/
+static bool ahead_fill(ChanReader *rd)
+{
+   ssize_t got;
+
+   if (!rd->buf_busy)
+   {
+      short *used = rd->buf;
+      if (!rd->ahead_busy)
+         return false;
+      rd->buf = rd->ahead;
+      rd->ahead = used;
+      rd->buf_busy = true;
+      rd->ahead_busy = false;
+      if (!rd->eof)
+      {
+         uring_read(rd->io, fileno(rd->fd), rd->ahead, CHAN_AHEAD_SAMPS * sizeof(short),
+                    rd->pos * sizeof(short));
+         rd->pos += CHAN_AHEAD_SAMPS;
+         rd->ahead_busy = true;
+      }
+   }
+   got = uring_wait(rd->io, rd->buf);
+   rd->buf_busy = false;
+   if (rd->pos > 2 * CHAN_AHEAD_SAMPS)     // what came before buf is used up
+      nocache_read(&rd->nc, (rd->pos - 2 * CHAN_AHEAD_SAMPS) * sizeof(short));
+   rd->at = 0;
+   rd->len = got > 0 ? got / sizeof(short) : 0;
+   if (got < 0)
+      errno = -got;
+   if (rd->len < CHAN_AHEAD_SAMPS)
+      rd->eof = true;     // nothing past here to read ahead
+   return rd->len > 0;
+}
+
+
+size_t chan_reader_read(ChanReader *rd, short *dest, size_t n)
+{
+   size_t done = 0;
+
+   if (rd->io)
+   {
+      while (done < n)
+      {
+         if (rd->at == rd->len && !ahead_fill(rd))
+            break;
+         size_t cnt = rd->len - rd->at < n - done ? rd->len - rd->at : n - done;
+         memcpy(dest + done, rd->buf + rd->at, cnt * sizeof(short));
+         rd->at += cnt;
+         done += cnt;
+      }
+      return done;
+   }
+   if (rd->fd)
+   {
+      done = fread(dest, sizeof(short), n, rd->fd);
+      rd->pos += done;
+      nocache_read(&rd->nc, rd->pos * sizeof(short));
+      return done;
+   }
+   if (rd->z)
+      return chz_read(rd->z, dest, n);
+   if (!rd->pack)
+      return 0;
+
+      // big reads go straight to the caller, small ones through the buffer
+   while (done < n)
+   {
+      if (rd->at == rd->len)
+      {
+         if (n - done >= READ_BUF_SAMPS)
+         {
+            size_t got = chan_pack_read(rd->pack, rd->idx, rd->pos, n - done, dest + done);
+            rd->pos += got;
+            done += got;
+            break;
+         }
+         rd->len = chan_pack_read(rd->pack, rd->idx, rd->pos, READ_BUF_SAMPS, rd->buf);
+         rd->pos += rd->len;
+         rd->at = 0;
+         if (rd->len == 0)
+            break;
+      }
+      size_t cnt = rd->len - rd->at < n - done ? rd->len - rd->at : n - done;
+      memcpy(dest + done, rd->buf + rd->at, cnt * sizeof(short));
+      rd->at += cnt;
+      done += cnt;
+   }
+   return done;
+}
+
+
+bool chan_reader_seek(ChanReader *rd, uint64_t sample)
+{
+   if (rd->io)
+   {
+      ahead_stop(rd);
+      rd->pos = sample;
+      ahead_start(rd);
+      return true;
+   }
+   if (rd->fd)
+   {
+      rd->pos = sample;
+      return fseeko(rd->fd, sample * sizeof(short), SEEK_SET) == 0;
+   }
+   if (rd->z)
+      return chz_seek(rd->z, sample);
+   if (!rd->pack || sample > rd->pack->hdr.samples)
+      return false;
+   rd->pos = sample;
+   rd->len = rd->at = 0;
+   return true;
+}
+
+
+uint64_t chan_reader_samples(const ChanReader *rd)
+{
+   struct stat info;
+
+   if (rd->fd)
+      return fstat(fileno(rd->fd), &info) == 0 ? info.st_size / sizeof(short) : 0;
+   if (rd->z)
+      return rd->z->hdr.samples;
+   return rd->pack ? rd->pack->hdr.samples : 0;
+}
+
+
+bool chan_reader_ahead(ChanReader *rd, UringIo *io)
+{
+   off_t at;
+
+   if (!io || !rd->fd || (at = ftello(rd->fd)) == -1)
+      return false;
+   if ((rd->buf = uring_get(io)) == NULL)
+      return false;
+   if ((rd->ahead = uring_get(io)) == NULL)
+   {
+      uring_put(io, rd->buf);
+      rd->buf = NULL;
+      return false;
+   }
+   rd->io = io;
+   rd->pos = at / sizeof(short);
+   ahead_start(rd);
+   return true;
+}
+
+
+void chan_reader_close(ChanReader *rd)
+{
+   if (rd->io)
+   {
+      ahead_stop(rd);
+      uring_put(rd->io, rd->buf);
+      uring_put(rd->io, rd->ahead);
+      rd->buf = NULL;
+   }
+   if (rd->fd)
+   {
+      nocache_close(&rd->nc, rd->pos * sizeof(short));
+      fclose(rd->fd);
+   }
+   chz_close_reader(rd->z);
+   free(rd->buf);
+   memset(rd, 0, sizeof(*rd));
+}
@@ -0,0 +1,147 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Pack files.  All of the chans split from one .daq file go in one file
+   instead of one .chan file each, e.g.
+
+      split.001/2012-02-21_001_r_1-64.pack
+
+   The file is a header, a directory of the chan numbers in the file, and
+   then the samples in blocks of CHAN_PACK_BLOCK samples per chan.  Within a
+   block, each chan's samples are together, first chan first.  The last
+   block is shorter, it has just what is left of each chan.  Samples are
+   shorts in the machine's byte order, the same as .chan files.
+
+   Every chan has the same number of samples, so the location of any
+   sample of any chan can be computed without reading anything else.
+
+   There is also a ChanReader, which reads a chan from a .chan file, a
+   compressed .chz file, or a pack file, whichever there is.  A .chan file
+   can be read ahead with io_uring, see uring_io.h.
+*/
+
+#ifndef CHAN_PACK_H
+#define CHAN_PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "chan_z.h"
+#include "uring_io.h"
+#include "nocache.h"
+
+#define CHAN_PACK_MAGIC "DAQ2PACK"
+#define CHAN_PACK_VERSION 1
+#define CHAN_PACK_EXT ".pack"
+#define CHAN_PACK_BLOCK (64 * 1024)     // samples per chan per block
+#define CHAN_AHEAD_SAMPS (64 * 1024)    // samples per read with chan_reader_ahead
+
+typedef struct
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t nchans;
+   uint32_t block_samps;
+   uint32_t data_offset;   // bytes from the start of the file to the first block
+   uint64_t samples;       // per chan
+} ChanPackHeader;
+
+typedef struct
+{
+   int             fd;
+   char           *name;
+   ChanPackHeader  hdr;
+   int32_t        *chans;     // the directory
+      // writing only
+   short          *block;     // two blocks, the one being filled and the next
+   uint64_t       *fill;      // samples put for each chan
+   uint64_t        written;   // blocks written
+} ChanPack;
+
+/* Start a new pack file for these chans.  Samples are added with
+   chan_pack_put, a chan can get at most one block ahead of the others.
+   Prints a message and returns NULL if something goes wrong.
+*/
+ChanPack *chan_pack_create(const char *name, const int *chans, int nchans);
+
+   // add n samples to directory entry idx
+bool chan_pack_put(ChanPack *pack, int idx, const short *samps, size_t n);
+
+/* Open an existing pack file for reading.  Prints a message and returns
+   NULL if it isn't one.
+*/
+ChanPack *chan_pack_open(const char *name);
+
+/* Open prefix1-64.pack and prefix65-128.pack, if they are there, into
+   packs[0] and [1].  Returns how many there were.
+*/
+int chan_pack_open_pair(const char *prefix, ChanPack **packs);
+
+   // the directory entry for chan, or -1 if it isn't in the pack
+int chan_pack_find(const ChanPack *pack, int chan);
+
+   // read n samples of directory entry idx starting at sample start
+size_t chan_pack_read(const ChanPack *pack, int idx, uint64_t start, size_t n, short *dest);
+
+/* Close the file.  When writing, this writes out the last block and fills
+   in the header.  Chans that have more samples than the shortest one are
+   cut off.  Returns false if the writing fails.
+*/
+bool chan_pack_close(ChanPack *pack);
+
+
+typedef struct
+{
+   FILE      *fd;
+   ChzReader *z;
+   ChanPack  *pack;
+   int        idx;
+   uint64_t   pos;
+   short     *buf;
+   size_t     len;
+   size_t     at;
+      // chan_reader_ahead
+   UringIo   *io;
+   short     *ahead;      // the read after buf
+   bool       buf_busy, ahead_busy, eof;
+   NoCache    nc;         // .chan files only
+} ChanReader;
+
+/* Read chan from the .chan file chan_name if it exists, otherwise from
+   the .chz file of the same name, otherwise from the first of the packs
+   that has it.  Returns false if none of them do.
+*/
+bool chan_reader_open(ChanReader *rd, const char *chan_name, ChanPack *const *packs, int npacks, int chan);
+size_t chan_reader_read(ChanReader *rd, short *dest, size_t n);
+   // the next read starts at sample
+bool chan_reader_seek(ChanReader *rd, uint64_t sample);
+uint64_t chan_reader_samples(const ChanReader *rd);
+
+/* Read a .chan file through io, a read ahead of the one being used.  With
+   a reader on each chan, there is a read in flight for all of them at
+   once.  It takes two of io's buffers of CHAN_AHEAD_SAMPS samples.
+   Returns false, and the reader goes on reading with stdio, if the chan
+   is not from a .chan file or io is NULL or out of buffers.
+*/
+bool chan_reader_ahead(ChanReader *rd, UringIo *io);
+void chan_reader_close(ChanReader *rd);
+
+#endif
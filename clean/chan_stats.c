@@ -0,0 +1,297 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Per second chan statistics and .cstats files.  See chan_stats.h.
+
+   The sums, min, max, and counts are one pass over the samples with no
+   branches, a run of STATS_RUN at a time.  The runs of zeros need a sample
+   at a time, but only for a run that has a zero in it.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "chan_stats.h"
+
+#define CLIP_LO -32768
+#define CLIP_HI 32767
+#define STATS_RUN 64            // samples added up at once
+
+
+static void start_second(ChanStats *cs)
+{
+   cs->sum = cs->sumsq = 0;
+   cs->min = CLIP_HI;
+   cs->max = CLIP_LO;
+   cs->clip_lo = cs->clip_hi = cs->zeros = cs->n = 0;
+   cs->longest = cs->run;
+}
+
+
+void chan_stats_init(ChanStats *cs, int rate)
+{
+   memset(cs, 0, sizeof(*cs));
+   cs->rate = rate;
+   start_second(cs);
+}
+
+
+static uint16_t count16(unsigned cnt)
+{
+   return cnt > UINT16_MAX ? UINT16_MAX : cnt;
+}
+
+static bool end_second(ChanStats *cs)
+{
+   ChanStatsRec *rec;
+
+   if (cs->nrecs == cs->size)
+   {
+      size_t size = cs->size ? cs->size * 2 : 1024;
+      ChanStatsRec *recs = realloc(cs->recs, sizeof(*recs) * size);
+      if (!recs)
+         return false;
+      cs->recs = recs;
+      cs->size = size;
+   }
+   rec = &cs->recs[cs->nrecs++];
+   rec->mean = (double) cs->sum / cs->n;
+   rec->sd = cs->n > 1 ? sqrt(((double) cs->sumsq - (double) cs->sum * cs->sum / cs->n) / (cs->n - 1))
+                       : 0;
+   rec->min = cs->min;
+   rec->max = cs->max;
+   rec->clip_lo = count16(cs->clip_lo);
+   rec->clip_hi = count16(cs->clip_hi);
+   rec->zeros = count16(cs->zeros);
+   rec->zero_run = count16(cs->longest);
+   start_second(cs);
+   return true;
+}
+
+
+/* Add up n samples.  This is called with STATS_RUN for all but the last
+   few samples of a piece.  The zero runs are looked for only if there are
+   zeros.
+*/
+static inline void add_up(ChanStats *cs, const short *samps, size_t n)
+{
+   int64_t  sum = 0, sumsq = 0;
+   int      min = cs->min, max = cs->max;
+   unsigned clip_lo = 0, clip_hi = 0, zeros = 0;
+   size_t   t;
+
+   for (t = 0; t < n; ++t)
+   {
+      int s = samps[t];
+      sum += s;
+      sumsq += s * s;
+      min = s < min ? s : min;
+      max = s > max ? s : max;
+      clip_lo += s == CLIP_LO;
+      clip_hi += s == CLIP_HI;
+      zeros += s == 0;
+   }
+   cs->sum += sum;
+   cs->sumsq += sumsq;
+   cs->min = min;
+   cs->max = max;
+   cs->clip_lo += clip_lo;
+   cs->clip_hi += clip_hi;
+   cs->zeros += zeros;
+   cs->n += n;
+
+   if (zeros == 0)
+      cs->run = 0;
+   else
+   {
+      for (t = 0; t < n; ++t)
+      {
+         if (samps[t] != 0)
+            cs->run = 0;
+         else if (++cs->run > cs->longest)
+            cs->longest = cs->run;
+      }
+   }
+}
+
+
+   // add n samples, all in the same second
+static void put_piece(ChanStats *cs, const short *samps, size_t n)
+{
+   for ( ; n >= STATS_RUN; samps += STATS_RUN, n -= STATS_RUN)
+      add_up(cs, samps, STATS_RUN);
+   if (n)
+      add_up(cs, samps, n);
+}
+
+
+bool chan_stats_put(ChanStats *cs, const short *samps, size_t n)
+{
+   while (n)
+   {
+      size_t len = cs->rate - cs->n;
+      if (len > n)
+         len = n;
+      put_piece(cs, samps, len);
+      cs->samples += len;
+      samps += len;
+      n -= len;
+      if (cs->n == (unsigned) cs->rate && !end_second(cs))
+         return false;
+   }
+   return true;
+}
+
+
+void chan_stats_free(ChanStats *cs)
+{
+   free(cs->recs);
+   cs->recs = NULL;
+   cs->nrecs = cs->size = 0;
+}
+
+
+bool chan_stats_write(const char *name, const int *chans, ChanStats *const *stats, int nchans)
+{
+   ChanStatsHeader hdr;
+   ChanStatsDir    dir;
+   FILE *fd;
+   bool  ok = true;
+   int   i;
+
+   for (i = 0; i < nchans; ++i)
+      if (stats[i]->n && !end_second(stats[i]))
+      {
+         printf("Out of memory writing %s\n", name);
+         return false;
+      }
+   if ((fd = fopen(name, "w")) == NULL)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      return false;
+   }
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, CST_MAGIC, sizeof(hdr.magic));
+   hdr.version = CST_VERSION;
+   hdr.nchans = nchans;
+   hdr.rate = nchans ? stats[0]->rate : 0;
+   ok = fwrite(&hdr, sizeof(hdr), 1, fd) == 1;
+   for (i = 0; i < nchans && ok; ++i)
+   {
+      memset(&dir, 0, sizeof(dir));
+      dir.chan = chans[i];
+      dir.samples = stats[i]->samples;
+      ok = fwrite(&dir, sizeof(dir), 1, fd) == 1;
+   }
+   for (i = 0; i < nchans && ok; ++i)
+      ok = fwrite(stats[i]->recs, sizeof(*stats[i]->recs), stats[i]->nrecs, fd) == stats[i]->nrecs;
+   if (fclose(fd) != 0)
+      ok = false;
+   if (!ok)
+      printf("Error writing %s, %s\n", name, strerror(errno));
+   return ok;
+}
+
+
+ChanStatsFile *chan_stats_open(const char *name)
+{
+   ChanStatsFile *csf = calloc(1, sizeof(*csf));
+   off_t offset;
+   unsigned i;
+
+   if (!csf)
+   {
+      printf("Out of memory\n");
+      return NULL;
+   }
+   if ((csf->fd = fopen(name, "r")) == NULL)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      free(csf);
+      return NULL;
+   }
+   if (fread(&csf->hdr, sizeof(csf->hdr), 1, csf->fd) != 1
+       || memcmp(csf->hdr.magic, CST_MAGIC, sizeof(csf->hdr.magic)) != 0
+       || csf->hdr.version != CST_VERSION || csf->hdr.rate == 0)
+   {
+      printf("%s is not a chan statistics file\n", name);
+      chan_stats_close(csf);
+      return NULL;
+   }
+   csf->dir = malloc(sizeof(*csf->dir) * (csf->hdr.nchans + 1));
+   csf->offset = malloc(sizeof(*csf->offset) * (csf->hdr.nchans + 1));
+   if (!csf->dir || !csf->offset
+       || fread(csf->dir, sizeof(*csf->dir), csf->hdr.nchans, csf->fd) != csf->hdr.nchans)
+   {
+      printf("Error reading %s\n", name);
+      chan_stats_close(csf);
+      return NULL;
+   }
+   offset = sizeof(csf->hdr) + sizeof(*csf->dir) * csf->hdr.nchans;
+   for (i = 0; i < csf->hdr.nchans; ++i)
+   {
+      csf->offset[i] = offset;
+      offset += (csf->dir[i].samples + csf->hdr.rate - 1) / csf->hdr.rate * sizeof(ChanStatsRec);
+   }
+   return csf;
+}
+
+
+int chan_stats_find(const ChanStatsFile *csf, int chan)
+{
+   unsigned i;
+
+   for (i = 0; i < csf->hdr.nchans; ++i)
+      if (csf->dir[i].chan == chan)
+         return i;
+   return -1;
+}
+
+
+size_t chan_stats_read(const ChanStatsFile *csf, int idx, uint64_t start, size_t n, ChanStatsRec *dest)
+{
+   uint64_t seconds = (csf->dir[idx].samples + csf->hdr.rate - 1) / csf->hdr.rate;
+
+   if (start >= seconds)
+      return 0;
+   if (n > seconds - start)
+      n = seconds - start;
+   if (fseeko(csf->fd, csf->offset[idx] + start * sizeof(*dest), SEEK_SET) != 0)
+      return 0;
+   return fread(dest, sizeof(*dest), n, csf->fd);
+}
+
+
+void chan_stats_close(ChanStatsFile *csf)
+{
+   if (!csf)
+      return;
+   if (csf->fd)
+      fclose(csf->fd);
+   free(csf->dir);
+   free(csf->offset);
+   free(csf);
+}
@@ -0,0 +1,133 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Statistics for each second of each chan, kept as the chans are split so
+   nothing has to read the samples again to find a dead or saturated chan
+   or to know how noisy a chan is.  For each second there is:
+
+      mean and standard deviation (n - 1) of the samples
+      min and max
+      the samples at -32768 and at 32767, clipped
+      the samples that are 0, the value of a lost frame or of a chan with
+         nothing plugged in
+      the longest run of zeros, counted from where the run started, so a
+         run that goes on from the second before counts those zeros too,
+         up to 65535
+
+   A .cstats file has them for the chans of one .daq file:
+
+      header   "DAQ2CST1", version, number of chans, samples per second
+      chans    for each chan, its number, and how many samples it has
+      seconds  for each chan in turn, a ChanStatsRec for each second,
+               ceil(samples / samples per second) of them
+
+   The last second of a chan may have fewer samples than the others.
+   Everything is in the machine's byte order.
+*/
+
+#ifndef CHAN_STATS_H
+#define CHAN_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CST_MAGIC "DAQ2CST1"
+#define CST_VERSION 1
+#define CST_EXT ".cstats"
+
+typedef struct
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t nchans;
+   uint32_t rate;
+   uint32_t pad;
+} ChanStatsHeader;
+
+typedef struct
+{
+   int32_t  chan;
+   uint32_t pad;
+   uint64_t samples;
+} ChanStatsDir;
+
+typedef struct
+{
+   float    mean;
+   float    sd;
+   int16_t  min;
+   int16_t  max;
+   uint16_t clip_lo;
+   uint16_t clip_hi;
+   uint16_t zeros;
+   uint16_t zero_run;
+} ChanStatsRec;
+
+   // one chan's statistics as its samples go by
+typedef struct
+{
+   int           rate;
+   uint64_t      samples;
+      // the second being added up
+   int64_t       sum;
+   int64_t       sumsq;
+   int           min, max;
+   unsigned      clip_lo, clip_hi, zeros, longest, n;
+   unsigned      run;           // zeros at the end so far, may go on into the next second
+      // the seconds done
+   ChanStatsRec *recs;
+   size_t        nrecs, size;
+} ChanStats;
+
+void chan_stats_init(ChanStats *cs, int rate);
+
+   // add the next n samples, false if out of memory
+bool chan_stats_put(ChanStats *cs, const short *samps, size_t n);
+void chan_stats_free(ChanStats *cs);
+
+/* Write the statistics of nchans chans, numbered chans[], to name.  The
+   last, partial, second of each is finished first.  Prints a message and
+   returns false if it can't be written.
+*/
+bool chan_stats_write(const char *name, const int *chans, ChanStats *const *stats, int nchans);
+
+/* Read a .cstats file.  Prints a message and returns NULL if it isn't one.
+   The header and chans are in the ChanStatsFile.
+*/
+typedef struct
+{
+   FILE            *fd;
+   ChanStatsHeader  hdr;
+   ChanStatsDir    *dir;
+   off_t           *offset;     // of each chan's first second
+} ChanStatsFile;
+
+ChanStatsFile *chan_stats_open(const char *name);
+
+   // index in dir of chan, or -1 if it isn't in the file
+int chan_stats_find(const ChanStatsFile *csf, int chan);
+
+   // read n seconds of dir entry idx starting at second start, returns how many there were
+size_t chan_stats_read(const ChanStatsFile *csf, int idx, uint64_t start, size_t n, ChanStatsRec *dest);
+void chan_stats_close(ChanStatsFile *csf);
+
+#endif
@@ -0,0 +1,675 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Compressed chan files.  See chan_z.h.
+
+   Each block picks whichever predictor makes the smallest differences:
+
+      order 0   x[n]
+      order 1   x[n] - x[n-1]
+      order 2   x[n] - (2 x[n-1] - x[n-2])
+
+   The differences are folded to unsigned, 0 -1 1 -2 2 ... -> 0 1 2 3 4 ...,
+   and Rice coded with parameter k: the value >> k in unary (that many 1
+   bits, then a 0), then the low k bits.  A value whose unary part would be
+   RICE_ESC or longer is written as RICE_ESC 1 bits and then the value in
+   RAW_BITS bits.  Bits are packed high bit first.
+
+   If none of that helps, which is the case for pure noise, the block is
+   stored as is and its order is STORED.
+
+   Decoding is most of the time it takes to read a .chz file.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "chan_z.h"
+
+#define RICE_ESC 32
+#define RAW_BITS 20        // an order 2 difference is at most 4 * 32768
+#define MAX_K 16
+#define STORED 3
+#define BLOCK_HDR 8        // payload bytes, sample count, order, k
+#define SLACK 16           // the bit reader may look this far past the end
+   // worst case, every sample escaped
+#define MAX_PAYLOAD (2 * 2 + (CHZ_BLOCK * (RICE_ESC + RAW_BITS) + 7) / 8)
+
+
+typedef struct
+{
+   uint8_t *p;
+   uint64_t acc;
+   int      n;      // bits in acc not written yet
+} BitOut;
+
+static inline void put_bits(BitOut *b, uint32_t val, int cnt)
+{
+   b->acc = (b->acc << cnt) | val;
+   b->n += cnt;
+   while (b->n >= 8)
+   {
+      b->n -= 8;
+      *b->p++ = b->acc >> b->n;
+   }
+}
+
+static inline void put_ones(BitOut *b, int cnt)
+{
+   while (cnt >= 16)
+   {
+      put_bits(b, 0xffff, 16);
+      cnt -= 16;
+   }
+   put_bits(b, (1u << cnt) - 1, cnt);
+}
+
+
+static inline int32_t predict(const short *x, size_t t, int order)
+{
+   switch (order)
+   {
+      case 0:  return 0;
+      case 1:  return x[t-1];
+      default: return 2 * x[t-1] - x[t-2];
+   }
+}
+
+static inline uint32_t fold(int32_t diff)
+{
+   return ((uint32_t)diff << 1) ^ (uint32_t)(diff >> 31);
+}
+
+
+/* Compress one block into out.  Returns the number of bytes.
+*/
+static size_t encode_block(const short *x, size_t n, uint8_t *out)
+{
+   uint64_t sum[3] = {0, 0, 0};
+   int      order = 0, k = 0, o;
+   size_t   t;
+   BitOut   b;
+
+   for (o = 0; o < 3; ++o)
+      for (t = o; t < n; ++t)
+         sum[o] += fold(x[t] - predict(x, t, o));
+   for (o = 1; o < 3; ++o)
+      if ((size_t)o < n && sum[o] < sum[order])
+         order = o;
+   if (order >= (int)n)
+      order = 0;
+
+      // the best k is about log2 of the mean
+   if (n > (size_t)order)
+   {
+      uint64_t mean = sum[order] / (n - order);
+      while (k < MAX_K && (1ull << (k + 1)) <= mean)
+         ++k;
+   }
+
+   b.p = out + BLOCK_HDR;
+   b.acc = 0;
+   b.n = 0;
+   for (t = 0; t < (size_t)order && t < n; ++t)
+      put_bits(&b, (uint16_t)x[t], 16);
+   for ( ; t < n; ++t)
+   {
+      uint32_t val = fold(x[t] - predict(x, t, order));
+      uint32_t q = val >> k;
+      if (q < RICE_ESC)
+      {
+         put_ones(&b, q);
+         put_bits(&b, 0, 1);
+         if (k)
+            put_bits(&b, val & ((1u << k) - 1), k);
+      }
+      else
+      {
+         put_ones(&b, RICE_ESC);
+         put_bits(&b, val, RAW_BITS);
+      }
+   }
+   if (b.n)
+      put_bits(&b, 0, 8 - b.n);
+
+   uint32_t bytes = b.p - out - BLOCK_HDR;
+   if (bytes >= n * sizeof(short))
+   {
+      bytes = n * sizeof(short);
+      memcpy(out + BLOCK_HDR, x, bytes);
+      order = STORED;
+   }
+   uint16_t cnt = n;
+   memcpy(out, &bytes, 4);
+   memcpy(out + 4, &cnt, 2);
+   out[6] = order;
+   out[7] = k;
+   return BLOCK_HDR + bytes;
+}
+
+
+/* Undo encode_block.  in is the payload, with SLACK readable bytes after it.
+   acc holds the next bits from the top down, bits of them are good.  It is
+   topped up 8 bytes at a time when there may not be enough for a code.
+   The build is not optimized, so everything is kept in locals.
+*/
+static void decode_block(const uint8_t *in, size_t n, int order, int k, short *x)
+{
+   const uint8_t *p = in;
+   uint64_t acc = 0, word;
+   int      bits = 0, len, q;
+   int32_t  c1 = order, c2 = order == 2;    // x[t-1] and x[t-2] in the prediction
+   int32_t  x1 = 0, x2 = 0;
+   uint32_t val;
+   size_t   t;
+
+   if (order == STORED)
+   {
+      memcpy(x, in, n * sizeof(short));
+      return;
+   }
+   for (t = 0; t < (size_t)order && t < n; ++t)
+   {
+      memcpy(&word, p, sizeof(word));
+      acc |= __builtin_bswap64(word) >> bits;
+      p += (63 - bits) >> 3;
+      bits |= 56;
+      x[t] = acc >> 48;
+      acc <<= 16;
+      bits -= 16;
+      x2 = x1;
+      x1 = x[t];
+   }
+   for ( ; t < n; ++t)
+   {
+      if (bits < RICE_ESC + RAW_BITS)
+      {
+         memcpy(&word, p, sizeof(word));
+         acc |= __builtin_bswap64(word) >> bits;
+         p += (63 - bits) >> 3;
+         bits |= 56;
+      }
+      q = __builtin_clzll(~acc | 1);
+      if (q < RICE_ESC)
+      {
+         len = q + 1 + k;
+         val = ((uint32_t)q << k) | (uint32_t)(acc << (q + 1) >> (63 - k) >> 1);
+      }
+      else
+      {
+         len = RICE_ESC + RAW_BITS;
+         val = acc << RICE_ESC >> (64 - RAW_BITS);
+      }
+      acc <<= len;
+      bits -= len;
+      x[t] = c1 * x1 - c2 * x2 + ((int32_t)(val >> 1) ^ -(int32_t)(val & 1));
+      x2 = x1;
+      x1 = x[t];
+   }
+}
+
+
+   // a version 1 header ends at the sample count
+static size_t header_size(const ChzHeader *hdr)
+{
+   return hdr->version == 1 ? offsetof(ChzHeader, index) : sizeof(*hdr);
+}
+
+   // either version, a version 1 header has no index
+static bool read_header(FILE *fd, ChzHeader *hdr)
+{
+   size_t v1 = offsetof(ChzHeader, index);
+
+   memset(hdr, 0, sizeof(*hdr));
+   return fread(hdr, v1, 1, fd) == 1
+          && memcmp(hdr->magic, CHZ_MAGIC, sizeof(hdr->magic)) == 0
+          && (hdr->version == 1
+              || (hdr->version == CHZ_VERSION
+                  && fread((char *) hdr + v1, sizeof(*hdr) - v1, 1, fd) == 1));
+}
+
+static bool write_header(ChzWriter *z)
+{
+   if (fseeko(z->fd, 0, SEEK_SET) != 0 || fwrite(&z->hdr, header_size(&z->hdr), 1, z->fd) != 1)
+   {
+      printf("Error writing to %s, %s\n", z->name, strerror(errno));
+      return false;
+   }
+   return true;
+}
+
+static bool add_block(ChzIndex **index, uint64_t *blocks, size_t *room, off_t offset, uint64_t first)
+{
+   if (*blocks == *room)
+   {
+      size_t    more = *room ? 2 * *room : 256;
+      ChzIndex *bigger = realloc(*index, more * sizeof(**index));
+
+      if (!bigger)
+      {
+         printf("Out of memory\n");
+         return false;
+      }
+      *index = bigger;
+      *room = more;
+   }
+   (*index)[*blocks].offset = offset;
+   (*index)[*blocks].first = first;
+   ++*blocks;
+   return true;
+}
+
+/* Go through the block headers from the first one until there are samples
+   samples, for a file with no index or one that is being continued.
+   Returns false if the blocks run out or are bad first.  end is where the
+   last one ends.
+*/
+static bool find_blocks(int fd, const ChzHeader *hdr, uint64_t samples, ChzIndex **index,
+                        uint64_t *blocks, size_t *room, off_t *end)
+{
+   off_t    at = header_size(hdr);
+   uint64_t first = 0;
+
+   *blocks = 0;
+   while (first < samples)
+   {
+      uint8_t  bh[BLOCK_HDR];
+      uint32_t bytes;
+      uint16_t cnt;
+
+      if (pread(fd, bh, BLOCK_HDR, at) != BLOCK_HDR)
+         return false;
+      memcpy(&bytes, bh, 4);
+      memcpy(&cnt, bh + 4, 2);
+      if (bytes > MAX_PAYLOAD || cnt == 0 || cnt > CHZ_BLOCK
+          || !add_block(index, blocks, room, at, first))
+         return false;
+      first += cnt;
+      at += BLOCK_HDR + bytes;
+   }
+   *end = at;
+   return first == samples;
+}
+
+static bool flush_block(ChzWriter *z)
+{
+   size_t bytes;
+
+   if (z->len == 0)
+      return true;
+   bytes = encode_block(z->buf, z->len, z->out);
+   if (!add_block(&z->index, &z->hdr.blocks, &z->room, z->end, z->hdr.samples))
+      return false;
+   if (fwrite(z->out, 1, bytes, z->fd) != bytes)
+   {
+      printf("Error writing to %s, %s\n", z->name, strerror(errno));
+      return false;
+   }
+   z->hdr.samples += z->len;
+   z->end += bytes;
+   z->len = 0;
+   return true;
+}
+
+/* The index goes after the last block.  The next block is written over it,
+   and it is written again after that one at the next flush or close.
+*/
+static bool write_index(ChzWriter *z)
+{
+   if (z->hdr.version == 1)
+      return true;
+   if (fseeko(z->fd, z->end, SEEK_SET) != 0
+       || fwrite(z->index, sizeof(*z->index), z->hdr.blocks, z->fd) != z->hdr.blocks)
+   {
+      printf("Error writing to %s, %s\n", z->name, strerror(errno));
+      return false;
+   }
+   z->hdr.index = z->end;
+   return true;
+}
+
+
+ChzWriter *chz_create(const char *name)
+{
+   ChzWriter *z = calloc(1, sizeof(*z));
+
+   if (!z || !(z->name = strdup(name)) || !(z->buf = malloc(CHZ_BLOCK * sizeof(short)))
+       || !(z->out = malloc(BLOCK_HDR + MAX_PAYLOAD)))
+   {
+      printf("Out of memory\n");
+      if (z)
+      {
+         free(z->name);
+         free(z->buf);
+         free(z);
+      }
+      return NULL;
+   }
+   memcpy(z->hdr.magic, CHZ_MAGIC, sizeof(z->hdr.magic));
+   z->hdr.version = CHZ_VERSION;
+   z->hdr.block_samps = CHZ_BLOCK;
+   z->end = sizeof(z->hdr);
+   if ((z->fd = fopen(name, "w")) == NULL)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      chz_close(z);
+      return NULL;
+   }
+   if (!write_header(z))   // again at the end with the sample count
+   {
+      chz_close(z);
+      return NULL;
+   }
+   return z;
+}
+
+
+bool chz_write(ChzWriter *z, const short *samps, size_t n)
+{
+   while (n)
+   {
+      size_t cnt = CHZ_BLOCK - z->len < n ? CHZ_BLOCK - z->len : n;
+      memcpy(z->buf + z->len, samps, cnt * sizeof(short));
+      z->len += cnt;
+      samps += cnt;
+      n -= cnt;
+      if (z->len == CHZ_BLOCK && !flush_block(z))
+         return false;
+   }
+   return true;
+}
+
+
+bool chz_flush(ChzWriter *z)
+{
+   if (!flush_block(z) || !write_index(z) || !write_header(z)
+       || fseeko(z->fd, z->end, SEEK_SET) != 0 || fflush(z->fd) != 0)
+   {
+      printf("Error writing to %s, %s\n", z->name, strerror(errno));
+      return false;
+   }
+   return true;
+}
+
+
+/* The header and index on the disk may be from a later flush than the one
+   bytes and samples are from, and blocks may have been written over the
+   index since, so the blocks are found from samples.  They were all on the
+   disk at that flush.
+*/
+ChzWriter *chz_append(const char *name, off_t bytes, uint64_t samples)
+{
+   ChzWriter *z = calloc(1, sizeof(*z));
+
+   if (!z || !(z->name = strdup(name)) || !(z->buf = malloc(CHZ_BLOCK * sizeof(short)))
+       || !(z->out = malloc(BLOCK_HDR + MAX_PAYLOAD)))
+   {
+      printf("Out of memory\n");
+      if (z)
+      {
+         free(z->name);
+         free(z->buf);
+         free(z);
+      }
+      return NULL;
+   }
+   if ((z->fd = fopen(name, "r+")) == NULL)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      free(z->name);
+      free(z->buf);
+      free(z->out);
+      free(z);
+      return NULL;
+   }
+   if (!read_header(z->fd, &z->hdr)
+       || !find_blocks(fileno(z->fd), &z->hdr, samples, &z->index, &z->hdr.blocks, &z->room, &z->end)
+       || z->end > bytes || ftruncate(fileno(z->fd), z->end) != 0
+       || fseeko(z->fd, z->end, SEEK_SET) != 0)
+   {
+      printf("Can't continue %s\n", name);
+      fclose(z->fd);
+      z->fd = NULL;
+      chz_close(z);
+      return NULL;
+   }
+   z->hdr.samples = samples;
+   z->hdr.index = 0;
+   return z;
+}
+
+
+bool chz_close(ChzWriter *z)
+{
+   bool ok = true;
+
+   if (!z)
+      return true;
+   if (z->fd)
+   {
+      ok = flush_block(z) && write_index(z) && write_header(z);
+      if (fclose(z->fd) != 0 && ok)
+      {
+         printf("Error closing %s, %s\n", z->name, strerror(errno));
+         ok = false;
+      }
+   }
+   free(z->name);
+   free(z->buf);
+   free(z->out);
+   free(z->index);
+   free(z);
+   return ok;
+}
+
+
+/* Read the index and check that it goes with the blocks.  If the file was
+   being written when it was opened, blocks may have been written over it.
+*/
+static bool read_index(ChzReader *z)
+{
+   uint64_t n = z->hdr.blocks, i;
+   size_t   size = n * sizeof(*z->index);
+
+   if (n == 0 || n > z->hdr.samples || (z->index = malloc(size)) == NULL
+       || pread(fileno(z->fd), z->index, size, z->hdr.index) != (ssize_t) size
+       || z->index[0].offset != sizeof(z->hdr) || z->index[0].first != 0)
+      return false;
+   for (i = 1; i < n; ++i)
+      if (z->index[i].offset <= z->index[i-1].offset || z->index[i].first <= z->index[i-1].first)
+         return false;
+   return z->index[n-1].offset < z->hdr.index && z->index[n-1].first < z->hdr.samples;
+}
+
+
+ChzReader *chz_open(const char *name)
+{
+   ChzReader *z = calloc(1, sizeof(*z));
+
+   if (!z || !(z->name = strdup(name)) || !(z->buf = malloc(CHZ_BLOCK * sizeof(short)))
+       || !(z->in = calloc(1, MAX_PAYLOAD + SLACK)))
+   {
+      printf("Out of memory\n");
+      chz_close_reader(z);
+      return NULL;
+   }
+   if ((z->fd = fopen(name, "r")) == NULL)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      chz_close_reader(z);
+      return NULL;
+   }
+   if (!read_header(z->fd, &z->hdr) || z->hdr.block_samps > CHZ_BLOCK)
+   {
+      printf("%s is not a compressed chan file\n", name);
+      chz_close_reader(z);
+      return NULL;
+   }
+      // otherwise it is made from the blocks when a seek needs it
+   if (z->hdr.index && !read_index(z))
+   {
+      free(z->index);
+      z->index = NULL;
+   }
+   return z;
+}
+
+
+/* Read the header of the next block.  Returns false at the end of the file
+   or if the header is bad.
+*/
+static bool block_header(ChzReader *z, uint8_t *hdr, uint32_t *bytes, uint16_t *cnt)
+{
+   if (fread(hdr, BLOCK_HDR, 1, z->fd) != 1)
+      return false;
+   memcpy(bytes, hdr, 4);
+   memcpy(cnt, hdr + 4, 2);
+   if (*bytes > MAX_PAYLOAD || *cnt > CHZ_BLOCK || hdr[6] > STORED || hdr[7] > MAX_K)
+   {
+      printf("%s is damaged\n", z->name);
+      return false;
+   }
+   return true;
+}
+
+/* Read and decode the next block.  Returns false at the end of the file or
+   if the block is bad.  In a version 2 file the index comes after the last
+   block, so it stops at the sample count.
+*/
+static bool next_block(ChzReader *z)
+{
+   uint8_t  hdr[BLOCK_HDR];
+   uint32_t bytes;
+   uint16_t cnt;
+
+   z->len = z->at = 0;
+   if (z->hdr.version != 1 && z->next >= z->hdr.samples)
+      return false;
+   if (!block_header(z, hdr, &bytes, &cnt))
+      return false;
+   if (fread(z->in, 1, bytes, z->fd) != bytes)
+   {
+      printf("%s is cut short\n", z->name);
+      return false;
+   }
+   memset(z->in + bytes, 0, SLACK);
+   decode_block(z->in, cnt, hdr[6], hdr[7], z->buf);
+   z->len = cnt;
+   z->next += cnt;
+   return true;
+}
+
+size_t chz_read(ChzReader *z, short *dest, size_t n)
+{
+   size_t done = 0;
+
+   while (done < n)
+   {
+      if (z->at == z->len && !next_block(z))
+         break;
+      size_t cnt = z->len - z->at < n - done ? z->len - z->at : n - done;
+      memcpy(dest + done, z->buf + z->at, cnt * sizeof(short));
+      z->at += cnt;
+      done += cnt;
+   }
+   return done;
+}
+
+
+bool chz_seek(ChzReader *z, uint64_t sample)
+{
+   uint64_t lo = 0, hi, want = sample ? sample - 1 : 0;   // the end is in the last block
+
+   z->len = z->at = 0;
+   if (sample > z->hdr.samples)
+      return false;
+   if (!z->index)
+   {
+      size_t room = 0;
+      off_t  end;
+
+      if (!find_blocks(fileno(z->fd), &z->hdr, z->hdr.samples, &z->index, &z->hdr.blocks, &room, &end))
+      {
+         printf("%s is damaged\n", z->name);
+         free(z->index);
+         z->index = NULL;
+         return false;
+      }
+   }
+   if (z->hdr.blocks == 0)
+   {
+      z->next = 0;
+      return fseeko(z->fd, header_size(&z->hdr), SEEK_SET) == 0;
+   }
+
+      // the last block that starts at or before it
+   hi = z->hdr.blocks - 1;
+   while (lo < hi)
+   {
+      uint64_t mid = (lo + hi + 1) / 2;
+      if (z->index[mid].first <= want)
+         lo = mid;
+      else
+         hi = mid - 1;
+   }
+   z->next = z->index[lo].first;
+   if (fseeko(z->fd, z->index[lo].offset, SEEK_SET) != 0 || !next_block(z))
+      return false;
+   z->at = sample - z->index[lo].first;
+   return true;
+}
+
+
+void chz_close_reader(ChzReader *z)
+{
+   if (!z)
+      return;
+   if (z->fd)
+      fclose(z->fd);
+   free(z->name);
+   free(z->buf);
+   free(z->in);
+   free(z->index);
+   free(z);
+}
+
+
+char *chz_name(const char *chan_name)
+{
+   const char *ext = strrchr(chan_name, '.');
+   char *name;
+
+   if (ext && strcmp(ext, ".chan") == 0)
+   {
+      if (asprintf(&name, "%.*s%s", (int)(ext - chan_name), chan_name, CHZ_EXT) == -1)
+         return NULL;
+   }
+   else if (asprintf(&name, "%s%s", chan_name, CHZ_EXT) == -1)
+      return NULL;
+   return name;
+}
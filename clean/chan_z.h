@@ -0,0 +1,123 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Compressed chan files, .chz.  The same samples as a .chan file, losslessly
+   compressed.  Neighboring samples are close to each other, so each sample
+   is predicted from the ones before it and only the difference is stored,
+   Rice coded.
+
+   The file is a header, blocks of up to CHZ_BLOCK samples, and an index
+   of the blocks.  Each block starts over, so it can be decoded without the
+   ones before it:
+
+      header   "DAQ2CHZ1", version, block size, total samples, where the
+               index is and how many blocks it has
+      block    payload byte count, sample count, predictor order (0-2),
+               Rice parameter, the first order samples as is, then the
+               Rice coded differences.  Or order 3 and just the samples,
+               if that is smaller.
+      index    the file offset and first sample of each block
+
+   chz_flush can leave a short block in the middle, so the blocks aren't
+   all the same size and a seek finds its block in the index.  Version 1
+   files have no index and the header ends at the total samples.  They are
+   still read, and the index is made by going through the blocks once.
+*/
+
+#ifndef CHAN_Z_H
+#define CHAN_Z_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define CHZ_MAGIC "DAQ2CHZ1"
+#define CHZ_VERSION 2
+#define CHZ_EXT ".chz"
+#define CHZ_BLOCK 4096
+
+typedef struct
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t block_samps;
+   uint64_t samples;
+   uint64_t index;    // offset of the index, 0 if there is none yet
+   uint64_t blocks;
+} ChzHeader;
+
+typedef struct
+{
+   uint64_t offset;
+   uint64_t first;
+} ChzIndex;
+
+typedef struct
+{
+   FILE     *fd;
+   char     *name;
+   ChzHeader hdr;
+   short    *buf;     // samples waiting for a whole block
+   size_t    len;
+   uint8_t  *out;
+   ChzIndex *index;   // the blocks written so far
+   size_t    room;
+   off_t     end;     // of the last block
+} ChzWriter;
+
+typedef struct
+{
+   FILE     *fd;
+   char     *name;
+   ChzHeader hdr;
+   short    *buf;     // the current block
+   size_t    len;
+   size_t    at;
+   uint8_t  *in;
+   uint64_t  next;    // first sample of the block after this one
+   ChzIndex *index;   // NULL until a seek needs it, for a version 1 file
+} ChzReader;
+
+/* These print a message and return NULL or false if something goes wrong.
+   chz_close writes out the last block and the sample count.
+*/
+ChzWriter *chz_create(const char *name);
+bool chz_write(ChzWriter *z, const short *samps, size_t n);
+bool chz_close(ChzWriter *z);
+   // write out the samples waiting for a whole block as a short block, and
+   // the sample count so far, so the file can be read as it is
+bool chz_flush(ChzWriter *z);
+   // continue writing a file that was bytes long right after a chz_flush,
+   // with samples samples in it
+ChzWriter *chz_append(const char *name, off_t bytes, uint64_t samples);
+
+ChzReader *chz_open(const char *name);
+size_t chz_read(ChzReader *z, short *dest, size_t n);
+   // the next chz_read starts at sample.  Only the block it is in is read
+   // and decoded, it is found in the index.
+bool chz_seek(ChzReader *z, uint64_t sample);
+void chz_close_reader(ChzReader *z);
+
+   // name with .chan changed to .chz, or .chz added.  Free it when done.
+char *chz_name(const char *chan_name);
+
+#endif
@@ -31,6 +31,8 @@
            ...
 
    Can also be used for old Datamax chan files.
+
+   With -smr, a Spike2 .smr file is written instead, see son_write.h.
 */
 
 
@@ -51,8 +53,16 @@
 #include <getopt.h>
 #include <errno.h>
 #include <dirent.h> 
+#include <limits.h>
+#include "chan_pack.h"
+#include "rec_reader.h"
+#include "tool_stats.h"
+#include "nocache.h"
+#include "son_write.h"
 
 #define MAX_CHANS 128
+#define SAMP_RATE 25000    // samples per second
+#define BLOCK_ROWS (8 * 1024)   // rows put together and written at a time
 
 bool DoOne = true;
 bool DoTwo = true;
@@ -63,15 +73,22 @@ char UsrTag[2048];
 bool Debug = false;
 bool SelList[MAX_CHANS];
 int  SelChans = MAX_CHANS;
+unsigned long long StartSamp = 0;          // window to convert, in samples
+unsigned long long EndSamp = ULLONG_MAX;
+bool Stats = false;
+char *StatsFile = NULL;
+bool Smr = false;
 
 #define RAW_TAG "_r_"
 #define BIN_EXT ".bin"
+#define SMR_EXT ".smr"
 #define CHAN_EXT ".chan"
 
 static void usage(char *name)
 {
    printf (
-"\nUsage: %s [-f] [-t tag_text] [subset of chans, e.g. 2 3 119 127]\n"\
+"\nUsage: %s [-f] [-t tag_text] [-start time] [-end time] [-smr] [-nocache] [-stats[=FILE]]\n"\
+"          [subset of chans, e.g. 2 3 119 127]\n"\
 "\n"\
 "Combine a set of chan files from split recordings into a single \n"\
 "interleaved .bin file that can be imported by the CED spike2 program.\n"\
@@ -88,21 +105,64 @@ static void usage(char *name)
 "OPTIONS\n"\
 "-f to force over-writing existing output files.\n"\
 "-t tag_text to add tag_text to the filename.\n"\
+"-start time and -end time to convert only that part of the chans.  The\n"\
+"   time is in seconds if it ends in s, e.g. 90s or 12.5s, otherwise it is a\n"\
+"   sample number, e.g. 2250000.  There are 25000 samples per second.  The\n"\
+"   end is not included.  Consider a -t tag so the full .bin is not replaced.\n"\
+"-smr writes a Spike2 .smr data file instead of the .bin, which Spike2 opens\n"\
+"   as it is, without importing it.  The chans keep their numbers, and are\n"\
+"   titled from the YYYY-MM-DD_REC.lbl file make_label.sh makes, if it is\n"\
+"   here.  A .smr can hold at most 23.6 hours.\n"\
+"-nocache keeps the files from filling up the page cache, for a shared\n"\
+"   machine.  What has been read or written is let go a few MB behind,\n"\
+"   and the output file gets its space up front.\n"\
+"-stats writes a line of JSON to stderr, or appends it to FILE, at the end\n"\
+"   with the bytes and frames written, the time spent reading, converting,\n"\
+"   and writing, the number of read and write calls, and the throughput.\n"\
 "List of chan numbers in the range of 1-128 to create a .bin with a subset.\n"\
 "NOTE:  When you import the file in Spike2, you have to tell it the number of channels.\n"\
 "\n"\
+"Compressed .chz chan files are read the same as .chan files.  Chans that\n"\
+"are in neither are read from the YYYY-MM-DD_REC_r_1-64.pack and\n"\
+"_r_65-128.pack files that daq2_split --pack makes, if they are there.\n"\
+"\n"\
 "It is not an error for chan files to be missing.  A default value of zero\n"\
 "will be written to the .bin file for those channels.\n",
 name
 );
 }
 
+/* Parse a -start or -end time, seconds if it ends in s, otherwise a sample
+   number.  Returns false if it is neither.
+*/
+static bool parse_time(const char *arg, unsigned long long *samp)
+{
+   char  *end;
+   double secs;
+
+   if (!isdigit(arg[0]) && arg[0] != '.')
+      return false;
+   secs = strtod(arg, &end);
+   if (end != arg && strcmp(end, "s") == 0)
+   {
+      *samp = secs * SAMP_RATE + 0.5;
+      return true;
+   }
+   *samp = strtoull(arg, &end, 10);
+   return end != arg && *end == 0;
+}
+
 static int parse_args(int argc, char *argv[])
 {
    static struct option opts[] = { 
                                    {"f", no_argument, NULL, '1'},
                                    {"d", no_argument, NULL, '2'},
                                    {"t", required_argument, NULL, '3'},
+                                   {"start", required_argument, NULL, '4'},
+                                   {"end", required_argument, NULL, '5'},
+                                   {"stats", optional_argument, NULL, '6'},
+                                   {"nocache", no_argument, NULL, '7'},
+                                   {"smr", no_argument, NULL, '8'},
                                    { 0,0,0,0} };
    int cmd;
    int ret = 1;
@@ -135,6 +195,35 @@ static int parse_args(int argc, char *argv[])
                }
                break;
 
+         case '4':
+               if (!parse_time(optarg,&StartSamp))
+               {
+                  printf("%s is not a valid start time, aborting. . .\n",optarg);
+                  exit(1);
+               }
+               break;
+
+         case '5':
+               if (!parse_time(optarg,&EndSamp))
+               {
+                  printf("%s is not a valid end time, aborting. . .\n",optarg);
+                  exit(1);
+               }
+               break;
+
+         case '6':
+               Stats = true;
+               StatsFile = optarg;
+               break;
+
+         case '7':
+               NoCacheOn = true;
+               break;
+
+         case '8':
+               Smr = true;
+               break;
+
          case '?':
          default:
             printf("Unknown argument, aborting. . .\n");
@@ -143,6 +232,11 @@ static int parse_args(int argc, char *argv[])
       }
    }
 
+   if (ret && EndSamp <= StartSamp)
+   {
+      printf("The end time must be after the start time, aborting. . .\n");
+      ret = 0;
+   }
 
    if (ret)
    {
@@ -212,47 +306,6 @@ static int parse_args(int argc, char *argv[])
 }
 
 
-/* Find a chan file in the current dir if there is one,
-   then return the basename minus the recno.chan fields.
-   Also note if it is a raw file for later.
-   Returns true of it finds one.
-           false otherwise.
-*/
-static bool find_chan(char *basename)
-{
-   DIR    *curr_dir;
-   struct dirent *dir;
-   bool   ret = false;
-   int    match, yr, mon, day, recno;
-   
-   curr_dir = opendir(".");
-   if (curr_dir)
-   {
-       while ((dir = readdir(curr_dir)) != NULL)
-       {
-          if (strstr(dir->d_name,CHAN_EXT))
-          {
-             if (strstr(dir->d_name,RAW_TAG))
-                HaveRaw = true;
-
-             match = sscanf(dir->d_name,"%d-%d-%d_%d", &yr,&mon,&day,&recno);
-             if (match == 4)
-             {
-                sprintf(basename,"%04d-%02d-%02d_%03d", yr,mon,day,recno);
-                ret = true;
-                break;
-             }
-             else
-             {
-                printf("The chan file %s is not in the correct filename format\n",dir->d_name);
-                break;
-             }
-          }
-      }
-      closedir(curr_dir);
-   }
-   return ret;
-}
       
       
 /* What we are here for.  Read all of the chan files selected in the SelList array
@@ -264,18 +317,29 @@ static bool find_chan(char *basename)
 static bool create_bin(char *outname, char* basename)
 {
    FILE  *out_fd;
-   FILE *in_fd[MAX_CHANS] = {NULL};
+   ChanReader in_rd[MAX_CHANS];
+   bool have[MAX_CHANS] = {false};
+   ChanPack *packs[2];
+   int npacks;
+   UringIo *io = NULL;
+   NoCache out_nc;
+   SonChan son_chans[MAX_CHANS];
+   char labels[MAX_CHANS][SON_LABEL_LEN] = {{0}};
+   SonWriter *son = NULL;
+   off_t out_size;
    int chan, chan_files = 0;
    char channame[PATH_MAX];
-   unsigned long long feedback = 0, count = 0;
-   struct stat info;
-   double percent;
+   unsigned long long feedback = 0;
+   double percent = 0;
    char input[256];
-   unsigned short word_to_write[1];
-   size_t res;
+   short *rows = NULL, *bufs = NULL, *chan_buf[MAX_CHANS] = {NULL};
+   unsigned long long samples = 0, words = 0;
+   size_t res, len, n, got, r;
    bool  done = false;
 
         // any chan files?
+   sprintf(channame,"%s%s",basename,HaveRaw ? RAW_TAG : "_");
+   npacks = chan_pack_open_pair(channame,packs);
    for (chan = 0; chan < MAX_CHANS ; chan++)
    {
       if (HaveRaw)
@@ -283,13 +347,10 @@ static bool create_bin(char *outname, char* basename)
       else
          sprintf(channame,"%s_%02d%s",basename,chan+1,CHAN_EXT);
 
-      if (SelList[chan] && (in_fd[chan] = fopen(channame,"r")))
+      if (SelList[chan] && (have[chan] = chan_reader_open(&in_rd[chan],channame,packs,npacks,chan+1)))
       {
          if (!chan_files)  // get 1st chan file size, assumes all are same size
-         {
-            fstat(fileno(in_fd[chan]),&info);
-            percent = info.st_size/2;  // # words in file
-         }
+            percent = chan_reader_samples(&in_rd[chan]);  // # words in file
          ++chan_files;
       }
    }
@@ -297,7 +358,7 @@ static bool create_bin(char *outname, char* basename)
    if (chan_files == 0)
    {
       printf("Could not find any chan files.\n");
-      return false; 
+      goto error;
    }
    else
       printf("Found %d chan files\n", chan_files);
@@ -305,7 +366,29 @@ static bool create_bin(char *outname, char* basename)
    if (percent == 0)
    {
       printf("Could not find any chan files with data, aborting. . . \n");
-      return false; 
+      goto error;
+   }
+
+   if (StartSamp >= percent)
+   {
+      printf("The start time is past the end of the chans (%.1f seconds), aborting. . .\n",
+             percent / SAMP_RATE);
+      percent = 0;
+      goto error;
+   }
+   if (EndSamp < percent)
+      percent = EndSamp;
+   percent -= StartSamp;        // # samples to convert
+
+      // go straight to the start of the window in each chan
+   for (chan = 0; chan < MAX_CHANS ; chan++)
+   {
+      if (have[chan] && !chan_reader_seek(&in_rd[chan],StartSamp))
+      {
+         printf("Could not seek to the start time in chan %d, aborting. . .\n",chan+1);
+         percent = 0;
+         goto error;
+      }
    }
 
    if (!OverWrite && access(outname,F_OK) == 0)
@@ -326,42 +409,104 @@ static bool create_bin(char *outname, char* basename)
       goto error;
    }
 
-   while (!done)
+   if (Smr)
    {
-      for (chan = 0; chan < MAX_CHANS ; chan++)
+      sprintf(channame,"%s%s",basename,SON_LBL_EXT);
+      son_read_labels(channame, labels, MAX_CHANS);
+      for (chan = 0, len = 0; chan < MAX_CHANS ; chan++)
       {
          if (SelList[chan])
          {
-            if (in_fd[chan])
-            {
-               res = fread(word_to_write,sizeof(word_to_write),1,in_fd[chan]);
-               if (res == 0)
-               {
-                  done = true;
-                  break;
-               }
-            }
-            else
-              *word_to_write = 0;  // no chan file
+            son_chans[len].number = chan + 1;
+            strcpy(son_chans[len].label, labels[chan]);
+            ++len;
+         }
+      }
+      son = son_open(out_fd, son_chans, SelChans, SAMP_RATE, percent, basename);
+      if (!son)
+      {
+         if (errno == EFBIG)
+            printf("The chans are too long for a .smr file, use -start and -end, aborting. . .\n");
+         else
+            printf("Problem writing output file %s, aborting. . .\n",outname);
+         fclose(out_fd);
+         goto error;
+      }
+      nocache_open(&out_nc, fileno(out_fd), son_file_size(SelChans, percent));
+   }
+   else
+      nocache_open(&out_nc, fileno(out_fd), percent * SelChans * sizeof(*rows));
 
-            res = fwrite(word_to_write,sizeof(word_to_write),1,out_fd);
-            if (res != 1)
-            {
-               printf("Error writing to output file %s\n",outname);
-               done = true;
-               break;
-            }
+      // a missing chan stays zero in the rows
+   rows = calloc((size_t) BLOCK_ROWS * SelChans, sizeof(*rows));
+   bufs = malloc(sizeof(*bufs) * BLOCK_ROWS * chan_files);
+   if (!rows || !bufs)
+   {
+      printf("Out of memory, aborting. . .\n");
+      fclose(out_fd);
+      percent = 0;
+      goto error;
+   }
+   for (chan = 0, len = 0; chan < MAX_CHANS ; chan++)
+   {
+      if (have[chan])
+         chan_buf[chan] = bufs + BLOCK_ROWS * len++;
+   }
+
+      // read ahead on all of the .chan files at once if we can
+   io = uring_open(2 * chan_files, CHAN_AHEAD_SAMPS * sizeof(short));
+   for (chan = 0; chan < MAX_CHANS ; chan++)
+   {
+      if (have[chan])
+         chan_reader_ahead(&in_rd[chan], io);
+   }
+
+   while (!done && StartSamp + feedback < EndSamp)
+   {
+        // a block of each chan, as much of it as there is
+      n = EndSamp - StartSamp - feedback < BLOCK_ROWS ? EndSamp - StartSamp - feedback : BLOCK_ROWS;
+      stats_phase(STATS_READ);
+      for (chan = 0; chan < MAX_CHANS ; chan++)
+      {
+         if (have[chan] && (got = chan_reader_read(&in_rd[chan],chan_buf[chan],n)) < n)
+         {
+            n = got;
+            done = true;
          }
       }
-      ++feedback;
-      ++count;
+      if (n == 0)
+         break;
+      samples += n * chan_files;
 
-      if (count > 1024)
+      stats_phase(STATS_CONVERT);
+      for (chan = 0, len = 0; chan < MAX_CHANS ; chan++)
       {
-         printf("\r  %3.0f%%",(feedback/percent)*100.0);
-         fflush(stdout);
-         count = 0;
+         if (SelList[chan])
+         {
+            if (have[chan])
+               for (r = 0; r < n; ++r)
+                  rows[r * SelChans + len] = chan_buf[chan][r];
+            ++len;
+         }
       }
+
+      stats_phase(STATS_WRITE);
+      if (son)
+         res = son_write(son, rows, n) ? n : 0;
+      else
+         res = fwrite(rows,sizeof(*rows) * SelChans,n,out_fd);
+      words += res * SelChans;
+      nocache_wrote(&out_nc, son ? son_written(son) : (off_t) (words * sizeof(*rows)));
+      if (res != n)
+      {
+         printf("Error writing to output file %s\n",outname);
+         done = true;
+      }
+      feedback += n;
+
+      stats_phase(STATS_OTHER);
+      printf("\r  %3.0f%%",(feedback/percent)*100.0);
+      fflush(stdout);
    }
 
    if (out_fd)
@@ -369,7 +514,15 @@ static bool create_bin(char *outname, char* basename)
       printf("\r  %3.0f%%",(feedback/percent)*100.0);
       printf("\nCompleting write. . .\n"); // there can be a lot buffered data, 
       fflush(stdout);                      // closing can take many seconds, so reassure user
+      stats_phase(STATS_WRITE);
+      out_size = words * sizeof(*rows);
+      if (son && !son_close(son, &out_size))
+         printf("Error writing to output file %s\n",outname);
+      if (fflush(out_fd) == 0)
+         nocache_close(&out_nc, out_size);
       fclose(out_fd);
+      stats_phase(STATS_OTHER);
+      stats_add(samples * sizeof(*rows), out_size, words / SelChans);
       printf("Creation of %s is complete.\n", outname);
       fflush(stdout);
    }
@@ -377,11 +530,16 @@ static bool create_bin(char *outname, char* basename)
 error:
    for (chan = 0; chan < MAX_CHANS ; chan++)
    {
-      if (in_fd[chan])
-         fclose(in_fd[chan]);
+      if (have[chan])
+         chan_reader_close(&in_rd[chan]);
    }
+   chan_pack_close(packs[0]);
+   chan_pack_close(packs[1]);
+   uring_close(io);
+   free(rows);
+   free(bufs);
 
-   return true;
+   return chan_files != 0 && percent != 0;
 }
 
 
@@ -395,6 +553,8 @@ int main (int argc, char **argv)
 
    if (!parse_args(argc, argv))
       exit(1);
+   if (Stats && !stats_start(StatsFile, argc, argv))
+      error(1, errno, "Can't start -stats");
 
    if (Debug)
    {
@@ -402,7 +562,7 @@ int main (int argc, char **argv)
       getchar();
    }
 
-   if (!find_chan(basename))
+   if (!rec_find_chans(".", basename, &HaveRaw))
    {
       printf("\nCould not find any chan files, exiting. . .\n");
       usage(argv[0]);
@@ -410,9 +570,9 @@ int main (int argc, char **argv)
    }
 
    if (UsrTag[0] !=0)
-      sprintf(binname,"%s_%s_%d_%s%s",basename,OutTag,SelChans,UsrTag,BIN_EXT);
+      sprintf(binname,"%s_%s_%d_%s%s",basename,OutTag,SelChans,UsrTag,Smr ? SMR_EXT : BIN_EXT);
    else
-      sprintf(binname,"%s_%s_%d%s",basename,OutTag,SelChans,BIN_EXT);
+      sprintf(binname,"%s_%s_%d%s",basename,OutTag,SelChans,Smr ? SMR_EXT : BIN_EXT);
    complain = !create_bin(binname , basename);
 
    if (complain)
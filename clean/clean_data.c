@@ -0,0 +1,896 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   This is a C version of the GetCleanedData, pca2, itpca, FindBigStuff, and
+   ReplaceBigStuff cases in CleanData.m.  It follows the .m code step by step,
+   including its quirks, so the output matches what the octave version writes
+   to the clean.REC dirs.
+
+   The steps for each piece of data are:
+     1. pca2 the raw data to get a first cleaned estimate.
+     2. Find the putative spikes in that estimate.
+     3. Zero the spikes in the raw data, pca2 that to get a noise estimate.
+     4. Replace the spikes in the raw data with the noise estimate.
+     5. itpca the spike-free data to get the weights used to clean the raw data.
+
+   The pca steps are all of the same form.  For each channel i, take the
+   covariance of the other channels, find its two largest eigenvectors, and
+   project the centered data onto them to get two principal components.  The
+   weight of each pc for channel i is cov(pc,chan i)/var(pc).  Since the pc's
+   are projections of centered data, both of those come straight from the
+   covariance matrix, so the data itself is only touched to build the
+   covariance and to subtract the weighted pc's at the end.
+
+   The .m file does a full eig of each channel's leave-one-out covariance,
+   which is n eigen problems of size n-1 per pass.  Here the full covariance
+   is solved once, and the top two eigenpairs of each leave-one-out matrix
+   come from it (see top_two_loo).  If that can't be trusted for a channel,
+   it falls back to solving that channel's matrix directly.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include "clean_data.h"
+
+#define JACOBI_SWEEPS 100
+#define DEFLATE_EPS (64 * DBL_EPSILON)  // relative size of terms left out of the secular equation
+#define LOO_CHECK_EPS 1e-9              // relative residual an eigenpair from it must have
+
+typedef struct
+{
+   int chan;      // 0-based channel
+   int start;     // 1-based times, the same as the .m file's biglist
+   int stop;
+} BigEvent;
+
+typedef struct
+{
+   BigEvent *ev;
+   int       count;
+   int       size;
+} BigList;
+
+
+void clean_default_params(CleanParams *params)
+{
+   params->use_sd = true;
+   params->xsd = 2.5;
+   params->highthresh = 100;
+   params->lowthresh = -100;
+   params->prepts = 10;
+   params->postpts = 10;
+}
+
+
+/* Cyclic Jacobi eigen solver for a small symmetric matrix.
+   a is n x n and is destroyed.  On return, val holds the eigenvalues and
+   the columns of vec (vec[row*n+col]) hold the eigenvectors.
+*/
+static void jacobi_eig(double *a, int n, double *val, double *vec)
+{
+   int row, col, k, sweep;
+
+   for (row = 0; row < n; ++row)
+      for (col = 0; col < n; ++col)
+         vec[row*n+col] = (row == col) ? 1.0 : 0.0;
+
+   for (sweep = 0; sweep < JACOBI_SWEEPS; ++sweep)
+   {
+      double off = 0, diag = 0;
+      for (row = 0; row < n; ++row)
+      {
+         diag += a[row*n+row] * a[row*n+row];
+         for (col = row + 1; col < n; ++col)
+            off += a[row*n+col] * a[row*n+col];
+      }
+      if (off <= 1e-30 * diag || off == 0)
+         break;
+
+      for (row = 0; row < n - 1; ++row)
+      {
+         for (col = row + 1; col < n; ++col)
+         {
+            double apq = a[row*n+col];
+            if (apq == 0)
+               continue;
+            double app = a[row*n+row];
+            double aqq = a[col*n+col];
+            double theta = (aqq - app) / (2.0 * apq);
+            double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta + 1.0));
+            double c = 1.0 / sqrt(t*t + 1.0);
+            double s = t * c;
+
+            for (k = 0; k < n; ++k)   // columns p and q
+            {
+               double akp = a[k*n+row];
+               double akq = a[k*n+col];
+               a[k*n+row] = c * akp - s * akq;
+               a[k*n+col] = s * akp + c * akq;
+            }
+            for (k = 0; k < n; ++k)   // rows p and q
+            {
+               double apk = a[row*n+k];
+               double aqk = a[col*n+k];
+               a[row*n+k] = c * apk - s * aqk;
+               a[col*n+k] = s * apk + c * aqk;
+            }
+            for (k = 0; k < n; ++k)
+            {
+               double vkp = vec[k*n+row];
+               double vkq = vec[k*n+col];
+               vec[k*n+row] = c * vkp - s * vkq;
+               vec[k*n+col] = s * vkp + c * vkq;
+            }
+         }
+      }
+   }
+   for (row = 0; row < n; ++row)
+      val[row] = a[row*n+row];
+}
+
+
+/* Find the two largest eigenpairs of the covariance matrix with channel skip
+   left out, i.e. C(j,j) in the .m file.  The eigenvectors are returned in
+   the full n channel space with a zero for the skipped channel so they can
+   be applied directly to the data.
+   work must hold 2*(n-1)*(n-1) + (n-1) doubles.
+*/
+static void top_two(const double *cov, int n, int skip, double *work,
+                    double lam[2], double *w1, double *w2)
+{
+   int    sn = n - 1;
+   double *sub = work;
+   double *vec = sub + sn*sn;
+   double *val = vec + sn*sn;
+   int    row, col, srow, scol, k, first = 0, second = -1;
+
+   for (row = 0, srow = 0; row < n; ++row)
+   {
+      if (row == skip)
+         continue;
+      for (col = 0, scol = 0; col < n; ++col)
+      {
+         if (col == skip)
+            continue;
+         sub[srow*sn+scol] = cov[row*n+col];
+         ++scol;
+      }
+      ++srow;
+   }
+
+   jacobi_eig(sub, sn, val, vec);
+
+   for (k = 1; k < sn; ++k)
+      if (val[k] > val[first])
+         first = k;
+   for (k = 0; k < sn; ++k)
+      if (k != first && (second < 0 || val[k] > val[second]))
+         second = k;
+
+   lam[0] = val[first];
+   lam[1] = val[second];
+   for (row = 0, srow = 0; row < n; ++row)
+   {
+      if (row == skip)
+      {
+         w1[row] = w2[row] = 0;
+         continue;
+      }
+      w1[row] = vec[srow*sn+first];
+      w2[row] = vec[srow*sn+second];
+      ++srow;
+   }
+}
+
+
+/* The eigenpairs of the full covariance matrix, for top_two_loo.
+   order is the eigenvalues' indices, smallest first.
+*/
+typedef struct
+{
+   int     n;
+   double *val;
+   double *vec;     // columns, vec[row*n+col]
+   int    *order;
+   double  scale;   // largest eigenvalue magnitude
+} FullEig;
+
+static void full_eig(const double *cov, int n, double *work, FullEig *eig)
+{
+   int k, j;
+
+   memcpy(work, cov, sizeof(double) * n * n);
+   jacobi_eig(work, n, eig->val, eig->vec);
+   eig->n = n;
+   eig->scale = 0;
+   for (k = 0; k < n; ++k)
+   {
+      int idx = k;
+      for (j = k; j > 0 && eig->val[eig->order[j-1]] > eig->val[idx]; --j)
+         eig->order[j] = eig->order[j-1];
+      eig->order[j] = idx;
+      if (fabs(eig->val[k]) > eig->scale)
+         eig->scale = fabs(eig->val[k]);
+   }
+}
+
+   // sum of z[k]^2 / (d[k] - delta) over the terms in act, d = val - origin
+static double secular(const double *z, const double *d, const int *act, int nact, double delta)
+{
+   double sum = 0;
+   int    k;
+
+   for (k = 0; k < nact; ++k)
+      sum += z[act[k]] * z[act[k]] / (d[act[k]] - delta);
+   return sum;
+}
+
+/* Find the root of the secular equation between the poles lo and hi by
+   bisection.  It is measured from whichever pole it is nearer to, so it is
+   as accurate as the distance to that pole.  Returns the root's offset from
+   *origin, and d holds val - *origin.
+*/
+static double secular_root(const FullEig *eig, const double *z, const int *act, int nact,
+                           int lo, int hi, double *d, double *origin)
+{
+   double gap = eig->val[hi] - eig->val[lo];
+   double left, right, mid;
+   int    k;
+
+   *origin = eig->val[lo];
+   for (k = 0; k < nact; ++k)
+      d[act[k]] = eig->val[act[k]] - *origin;
+   if (secular(z, d, act, nact, gap / 2) >= 0)
+   {
+      left = 0;
+      right = gap / 2;
+   }
+   else
+   {
+      *origin = eig->val[hi];
+      for (k = 0; k < nact; ++k)
+         d[act[k]] = eig->val[act[k]] - *origin;
+      left = -gap / 2;
+      right = 0;
+   }
+   while (true)
+   {
+      mid = left + (right - left) / 2;
+      if (mid <= left || mid >= right)
+         break;
+      if (secular(z, d, act, nact, mid) >= 0)
+         right = mid;
+      else
+         left = mid;
+   }
+   return mid;
+}
+
+   // ||Bx - lam x|| for B the covariance with channel skip left out
+static double loo_residual(const double *cov, int n, int skip, const double *x, double lam)
+{
+   double sum = 0;
+   int    row, col;
+
+   for (row = 0; row < n; ++row)
+   {
+      double y = -lam * x[row];
+      if (row == skip)
+         continue;
+      for (col = 0; col < n; ++col)
+         if (col != skip)
+            y += cov[row*n+col] * x[col];
+      sum += y * y;
+   }
+   return sqrt(sum);
+}
+
+static void normalize_skip(double *x, int n, int skip)
+{
+   double norm = 0;
+   int    k;
+
+   x[skip] = 0;
+   for (k = 0; k < n; ++k)
+      norm += x[k] * x[k];
+   norm = sqrt(norm);
+   for (k = 0; k < n && norm > 0; ++k)
+      x[k] /= norm;
+}
+
+/* top_two from the eigenpairs of the full matrix instead of solving the
+   leave-one-out matrix B.  If A has eigenpairs (val[k], u[k]) and z[k] is
+   u[k]'s entry for the skipped channel, the eigenvalues of B are the roots
+   of
+
+      sum over k of z[k]^2 / (val[k] - lam) = 0
+
+   which has one root between each pair of neighboring val's, and each
+   root's eigenvector is the sum of z[k] / (val[k] - lam) u[k].  Terms with a
+   z[k] of about zero drop out, and their val[k], u[k] are eigenpairs of B
+   as is.  Of two terms with about the same val, one is rotated out the same
+   way.  The top two of all of those are B's top two.
+
+   Returns false, and the caller should use top_two, if either eigenpair
+   does not check out.  work must hold n*n + 4*n doubles and iwork 2*n ints.
+*/
+static bool top_two_loo(const double *cov, const FullEig *eig, int skip, double *work,
+                        int *iwork, double lam[2], double *w1, double *w2)
+{
+   int     n = eig->n;
+   double *u = work;
+   double *z = u + n*n;
+   double *d = z + n;
+   int    *act = iwork;        // terms in the secular equation, smallest val first
+   int    *defl = act + n;     // terms dropped out of it
+   int     nact = 0, ndefl = 0;
+   double  colnorm = 0, tol = DEFLATE_EPS * eig->scale;
+   double  cand_val[4];
+   int     cand_term[4], cand_root[4];
+   int     ncand = 0, best[2], k, j, row;
+   double *w[2] = {w1, w2};
+
+   if (eig->scale == 0)
+      return false;
+   memcpy(u, eig->vec, sizeof(double) * n * n);
+   for (row = 0; row < n; ++row)
+      colnorm += cov[row*n+skip] * cov[row*n+skip];
+   colnorm = sqrt(colnorm);
+   for (k = 0; k < n; ++k)
+      z[k] = u[skip*n+k];
+
+   for (j = 0; j < n; ++j)
+   {
+      int q = eig->order[j];
+      if (fabs(z[q]) * colnorm <= tol)
+         defl[ndefl++] = q;
+      else if (nact && eig->val[q] - eig->val[act[nact-1]] <= tol)
+      {
+            // rotate the lower one's z into this one
+         int    p = act[nact-1];
+         double r = hypot(z[p], z[q]);
+         double c = z[q] / r, s = z[p] / r;
+         for (row = 0; row < n; ++row)
+         {
+            double up = u[row*n+p], uq = u[row*n+q];
+            u[row*n+q] = c * uq + s * up;
+            u[row*n+p] = c * up - s * uq;
+         }
+         z[q] = r;
+         z[p] = 0;
+         defl[ndefl++] = p;
+         act[nact-1] = q;
+      }
+      else
+         act[nact++] = q;
+   }
+
+      // candidates: the top two roots and the top two dropped terms
+   for (j = nact - 1; j >= 1 && j >= nact - 2; --j)
+   {
+      double origin, delta = secular_root(eig, z, act, nact, act[j-1], act[j], d, &origin);
+      cand_val[ncand] = origin + delta;
+      cand_root[ncand] = j;
+      cand_term[ncand++] = -1;
+   }
+   for (j = ndefl - 1; j >= 0 && j >= ndefl - 2; --j)
+   {
+      int best_k = j;    // defl is not quite sorted after rotations
+      for (k = 0; k < j; ++k)
+         if (eig->val[defl[k]] > eig->val[defl[best_k]])
+            best_k = k;
+      k = defl[best_k];
+      defl[best_k] = defl[j];
+      defl[j] = k;
+      cand_val[ncand] = eig->val[k];
+      cand_root[ncand] = -1;
+      cand_term[ncand++] = k;
+   }
+   if (ncand < 2)
+      return false;
+   best[0] = 0;
+   for (k = 1; k < ncand; ++k)
+      if (cand_val[k] > cand_val[best[0]])
+         best[0] = k;
+   best[1] = best[0] == 0 ? 1 : 0;
+   for (k = 0; k < ncand; ++k)
+      if (k != best[0] && cand_val[k] > cand_val[best[1]])
+         best[1] = k;
+
+   for (j = 0; j < 2; ++j)
+   {
+      int c = best[j];
+      double *x = w[j];
+
+      lam[j] = cand_val[c];
+      if (cand_term[c] >= 0)
+      {
+         for (row = 0; row < n; ++row)
+            x[row] = u[row*n+cand_term[c]];
+      }
+      else
+      {
+            // the root again, for its origin and d
+         int    r = cand_root[c];
+         double origin, delta = secular_root(eig, z, act, nact, act[r-1], act[r], d, &origin);
+         memset(x, 0, sizeof(double) * n);
+         for (k = 0; k < nact; ++k)
+         {
+            double coef = z[act[k]] / (d[act[k]] - delta);
+            for (row = 0; row < n; ++row)
+               x[row] += coef * u[row*n+act[k]];
+         }
+      }
+      normalize_skip(x, n, skip);
+      if (loo_residual(cov, n, skip, x, lam[j]) > LOO_CHECK_EPS * eig->scale)
+         return false;
+   }
+   {
+      double dot = 0;
+      for (row = 0; row < n; ++row)
+         dot += w1[row] * w2[row];
+      if (fabs(dot) > LOO_CHECK_EPS)
+         return false;
+   }
+   return true;
+}
+
+
+/* The pca2 and itpca cases.
+   The pc's are built from x.  The weights are the regression of ref on the
+   pc's, and the output is ref minus the weighted pc's.  For pca2, ref is x and
+   is centered first.  For itpca, ref is the original data and is not
+   centered.  If art is not NULL, the two artifact columns are put there.
+   If keep_mean and keep_wts are not NULL, the means of x and the weights
+   are copied there for a CleanFit.  out can be NULL if only they are wanted.
+*/
+static bool pca_pass(const double *x, const double *ref, bool center_ref,
+                     int m, int n, double *out, double *art,
+                     double *keep_mean, double *keep_wts)
+{
+   double *xc = malloc(sizeof(double) * m * n);
+   double *cov = malloc(sizeof(double) * n * n);
+   double *xcov = malloc(sizeof(double) * n * n);
+   double *wts = calloc(n * n, sizeof(double));
+   double *g1 = calloc(n, sizeof(double));
+   double *g2 = calloc(n, sizeof(double));
+   double *w1 = malloc(sizeof(double) * n);
+   double *w2 = malloc(sizeof(double) * n);
+   double *rmean = malloc(sizeof(double) * n);
+   double *work = malloc(sizeof(double) * (2*n*n + 4*n));
+   double *fval = malloc(sizeof(double) * n);
+   double *fvec = malloc(sizeof(double) * n * n);
+   int    *iwork = malloc(sizeof(int) * 3 * n);
+   FullEig eig = {n, fval, fvec, iwork + 2*n, 0};
+   bool   ret = false;
+   int    i, j, k, t;
+
+   if (!xc || !cov || !xcov || !wts || !g1 || !g2 || !w1 || !w2 || !rmean || !work
+       || !fval || !fvec || !iwork)
+      goto error;
+
+   for (i = 0; i < n; ++i)
+   {
+      const double *src = x + (size_t)i*m;
+      double *dst = xc + (size_t)i*m;
+      double sum = 0;
+      for (t = 0; t < m; ++t)
+         sum += src[t];
+      double mean = sum / m;
+      for (t = 0; t < m; ++t)
+         dst[t] = src[t] - mean;
+      if (keep_mean)
+         keep_mean[i] = mean;
+
+      sum = 0;
+      src = ref + (size_t)i*m;
+      for (t = 0; t < m; ++t)
+         sum += src[t];
+      rmean[i] = sum / m;
+   }
+
+   for (j = 0; j < n; ++j)
+   {
+      const double *cj = xc + (size_t)j*m;
+      for (k = j; k < n; ++k)
+      {
+         const double *ck = xc + (size_t)k*m;
+         double sum = 0;
+         for (t = 0; t < m; ++t)
+            sum += cj[t] * ck[t];
+         cov[j*n+k] = cov[k*n+j] = sum / (m - 1);
+      }
+   }
+
+      // cross covariance of the data channels with the ref channels
+   if (ref == x)
+      memcpy(xcov, cov, sizeof(double) * n * n);
+   else
+   {
+      for (j = 0; j < n; ++j)
+      {
+         const double *cj = xc + (size_t)j*m;
+         for (i = 0; i < n; ++i)
+         {
+            const double *ri = ref + (size_t)i*m;
+            double sum = 0;
+            for (t = 0; t < m; ++t)
+               sum += cj[t] * (ri[t] - rmean[i]);
+            xcov[j*n+i] = sum / (m - 1);
+         }
+      }
+   }
+
+   full_eig(cov, n, work, &eig);
+   for (i = 0; i < n; ++i)
+   {
+      double lam[2], c1 = 0, c2 = 0, a1 = 0, a2 = 0;
+
+      if (!top_two_loo(cov, &eig, i, work, iwork, lam, w1, w2))
+         top_two(cov, n, i, work, lam, w1, w2);
+      for (j = 0; j < n; ++j)
+      {
+         c1 += w1[j] * xcov[j*n+i];
+         c2 += w2[j] * xcov[j*n+i];
+      }
+         // a flat or dead group has no variance to regress on, leave it be
+      if (lam[0] > 0)
+         a1 = c1 / lam[0];
+      if (lam[1] > 0)
+         a2 = c2 / lam[1];
+
+      for (j = 0; j < n; ++j)
+      {
+         wts[j*n+i] = a1 * w1[j] + a2 * w2[j];
+         g1[j] += a1 * w1[j];
+         g2[j] += a2 * w2[j];
+      }
+   }
+
+   if (keep_wts)
+      memcpy(keep_wts, wts, sizeof(double) * n * n);
+   if (!out)
+   {
+      ret = true;
+      goto error;
+   }
+
+   for (i = 0; i < n; ++i)
+   {
+      const double *ri = ref + (size_t)i*m;
+      double *oi = out + (size_t)i*m;
+      double mean = center_ref ? rmean[i] : 0;
+
+      for (t = 0; t < m; ++t)
+         oi[t] = ri[t] - mean;
+      for (j = 0; j < n; ++j)
+      {
+         double wt = wts[j*n+i];
+         const double *cj = xc + (size_t)j*m;
+         if (wt == 0)
+            continue;
+         for (t = 0; t < m; ++t)
+            oi[t] -= wt * cj[t];
+      }
+   }
+
+   if (art)
+   {
+      double *art1 = art;
+      double *art2 = art + m;
+      memset(art, 0, sizeof(double) * m * 2);
+      for (j = 0; j < n; ++j)
+      {
+         const double *cj = xc + (size_t)j*m;
+         double wt1 = g1[j] / n;
+         double wt2 = g2[j] / n;
+         for (t = 0; t < m; ++t)
+         {
+            art1[t] += wt1 * cj[t];
+            art2[t] += wt2 * cj[t];
+         }
+      }
+   }
+   ret = true;
+
+error:
+   free(xc);
+   free(cov);
+   free(xcov);
+   free(wts);
+   free(g1);
+   free(g2);
+   free(w1);
+   free(w2);
+   free(rmean);
+   free(work);
+   free(fval);
+   free(fvec);
+   free(iwork);
+   return ret;
+}
+
+
+static bool add_event(BigList *list, int chan, int start, int stop)
+{
+   if (list->count == list->size)
+   {
+      int size = list->size ? list->size * 2 : 256;
+      BigEvent *ev = realloc(list->ev, sizeof(BigEvent) * size);
+      if (!ev)
+         return false;
+      list->ev = ev;
+      list->size = size;
+   }
+   list->ev[list->count].chan = chan;
+   list->ev[list->count].start = start;
+   list->ev[list->count].stop = stop;
+   ++list->count;
+   return true;
+}
+
+
+   // the thresholds FindBigStuff uses for one channel of data
+static void spike_thresholds(const CleanParams *params, const double *di, int m,
+                             double *lo, double *hi)
+{
+   *lo = params->lowthresh;
+   *hi = params->highthresh;
+   if (params->use_sd)
+   {
+      double sum = 0, sumsq = 0, mean, s;
+      int    t;
+      for (t = 0; t < m; ++t)
+         sum += di[t];
+      mean = sum / m;
+      for (t = 0; t < m; ++t)
+         sumsq += (di[t] - mean) * (di[t] - mean);
+      s = sqrt(sumsq / (m - 1));
+      *lo = -s * params->xsd;
+      *hi = s * params->xsd;
+   }
+}
+
+
+/* The FindBigStuff case.  Flag the points above threshold, then pair up the
+   rising and falling edges.  The pairing is the same as the .m file,
+   including an event that runs off the end of the data getting a stop time
+   of 1 (the .m file stores the flag value there), which means it is never
+   replaced.
+*/
+static bool find_big_stuff(const CleanParams *params, const double *data, int m, int n,
+                           BigList *list, unsigned char *flag, int *times, int *times2)
+{
+   int i, t;
+
+   for (i = 0; i < n; ++i)
+   {
+      const double *di = data + (size_t)i*m;
+      double lo, hi;
+      int    ntimes = 0, ntimes2 = 0, k;
+
+      spike_thresholds(params, di, m, &lo, &hi);
+      for (t = 0; t < m; ++t)
+         flag[t] = di[t] < lo || di[t] > hi;
+
+      for (t = 0; t < m - 1; ++t)
+      {
+         if (flag[t+1] && !flag[t])
+            times[ntimes++] = t + 1;
+         else if (!flag[t+1] && flag[t])
+            times2[ntimes2++] = t + 1;
+      }
+
+      if (ntimes == 0)
+         continue;
+
+      if (ntimes2 == ntimes)
+      {
+         for (k = 0; k < ntimes; ++k)
+            if (!add_event(list, i, times[k], times2[k]))
+               return false;
+      }
+      else if (ntimes2 == ntimes - 1)  // end of data in the middle of a big spike
+      {
+         for (k = 0; k < ntimes - 1; ++k)
+            if (!add_event(list, i, times[k], times2[k]))
+               return false;
+         if (!add_event(list, i, times[ntimes-1], flag[m-1]))
+            return false;
+      }
+      else   // beginning of data in a big spike
+      {
+         if (!add_event(list, i, 1, times2[0]))
+            return false;
+         for (k = 0; k < ntimes && k + 1 < ntimes2; ++k)
+            if (!add_event(list, i, times[k], times2[k+1]))
+               return false;
+      }
+   }
+   return true;
+}
+
+
+/* The ReplaceBigStuff case.  Copy tdata to dst, then overwrite the big
+   events plus prepts/postpts points around them with the replacement data,
+   or with zeros if replace is NULL.
+*/
+static void replace_big_stuff(const CleanParams *params, const BigList *list,
+                              const double *tdata, const double *replace,
+                              int m, int n, double *dst)
+{
+   int e, t;
+
+   memcpy(dst, tdata, sizeof(double) * m * n);
+   for (e = 0; e < list->count; ++e)
+   {
+      const BigEvent *ev = &list->ev[e];
+      int a = (ev->start - params->prepts > 0) ? params->prepts : ev->start - 1;
+      int b = (ev->stop + params->postpts < m) ? params->postpts : m - ev->stop;
+      int first = ev->start - a - 1;   // back to 0-based
+      int last = ev->stop + b - 1;
+      double *d = dst + (size_t)ev->chan*m;
+      const double *r = replace ? replace + (size_t)ev->chan*m : NULL;
+
+      for (t = first; t <= last; ++t)
+         d[t] = r ? r[t] : 0;
+   }
+}
+
+
+/* The steps of clean_data.  The output goes to out, or if that is NULL,
+   the thresholds, means, and weights go to fit instead.
+*/
+static bool clean_steps(const CleanParams *params, const double *tdata, int m, int n,
+                        double *out, CleanFit *fit)
+{
+   size_t  sz = (size_t)m * n;
+   double *pcadata = malloc(sizeof(double) * sz);
+   double *nospikes = malloc(sizeof(double) * sz);
+   double *noise = malloc(sizeof(double) * sz);
+   unsigned char *flag = malloc(m);
+   int    *times = malloc(sizeof(int) * m);
+   int    *times2 = malloc(sizeof(int) * m);
+   BigList list = {NULL, 0, 0};
+   bool   ret = false;
+   size_t k;
+
+   if (n < 3 || !pcadata || !nospikes || !noise || !flag || !times || !times2)
+      goto error;
+
+   if (m < 3 && !out)
+      goto error;
+   if (m < 3)   // too short for a covariance, pass it through
+   {
+      memcpy(out, tdata, sizeof(double) * sz);
+      memset(out + sz, 0, sizeof(double) * m * CLEAN_EXTRA_CHANS);
+      ret = true;
+      goto error;
+   }
+
+      // step 2: 1st cleaned estimate
+   if (!pca_pass(tdata, tdata, true, m, n, pcadata, NULL,
+                 fit ? fit->mean[0] : NULL, fit ? fit->wts[0] : NULL))
+      goto error;
+   if (fit)
+      for (k = 0; k < (size_t)n; ++k)
+         spike_thresholds(params, pcadata + k*m, m, &fit->lo[k], &fit->hi[k]);
+
+      // step 3: putative spikes
+   if (!find_big_stuff(params, pcadata, m, n, &list, flag, times, times2))
+      goto error;
+
+      // step 4: zero the spikes to get an uncontaminated noise estimate,
+      // then replace the spikes with it
+   replace_big_stuff(params, &list, tdata, NULL, m, n, nospikes);
+   if (!pca_pass(nospikes, nospikes, true, m, n, pcadata, NULL,
+                 fit ? fit->mean[1] : NULL, fit ? fit->wts[1] : NULL))
+      goto error;
+   for (k = 0; k < sz; ++k)
+      noise[k] = nospikes[k] - pcadata[k];
+   replace_big_stuff(params, &list, tdata, noise, m, n, nospikes);
+
+      // step 5: second order cleaning
+   ret = pca_pass(nospikes, tdata, false, m, n, out, out ? out + sz : NULL,
+                  fit ? fit->mean[2] : NULL, fit ? fit->wts[2] : NULL);
+
+error:
+   free(pcadata);
+   free(nospikes);
+   free(noise);
+   free(flag);
+   free(times);
+   free(times2);
+   free(list.ev);
+   return ret;
+}
+
+
+bool clean_data(const CleanParams *params, const double *tdata, int m, int n, double *out)
+{
+   return clean_steps(params, tdata, m, n, out, NULL);
+}
+
+
+bool clean_fit_alloc(CleanFit *fit, int n)
+{
+   int pass;
+   bool ok;
+
+   memset(fit, 0, sizeof(*fit));
+   fit->n = n;
+   fit->lo = malloc(sizeof(double) * n);
+   fit->hi = malloc(sizeof(double) * n);
+   ok = fit->lo && fit->hi;
+   for (pass = 0; pass < CLEAN_PASSES; ++pass)
+   {
+      fit->mean[pass] = malloc(sizeof(double) * n);
+      fit->wts[pass] = malloc(sizeof(double) * n * n);
+      ok = ok && fit->mean[pass] && fit->wts[pass];
+   }
+   if (!ok)
+      clean_fit_free(fit);
+   return ok;
+}
+
+
+void clean_fit_free(CleanFit *fit)
+{
+   int pass;
+
+   free(fit->lo);
+   free(fit->hi);
+   for (pass = 0; pass < CLEAN_PASSES; ++pass)
+   {
+      free(fit->mean[pass]);
+      free(fit->wts[pass]);
+   }
+   memset(fit, 0, sizeof(*fit));
+}
+
+
+bool clean_fit(const CleanParams *params, const double *tdata, int m, int n, CleanFit *fit)
+{
+   return fit->n == n && clean_steps(params, tdata, m, n, NULL, fit);
+}
+
+
+void clean_to_short(const double *src, int cnt, short *dest)
+{
+   int t;
+
+   for (t = 0; t < cnt; ++t)
+   {
+      double val = src[t];
+      if (val > 32767)
+         val = 32767;
+      else if (val < -32768)
+         val = -32768;
+      dest[t] = floor(val + .5);
+   }
+}
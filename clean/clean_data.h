@@ -0,0 +1,88 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Native version of the CleanData.m principal component cleaner.
+   See clean_data.c for the details.
+*/
+
+#ifndef CLEAN_DATA_H
+#define CLEAN_DATA_H
+
+#include <stdbool.h>
+
+#define CLEAN_PTS_PER_CUT 25000   // CleanData.m's ptspercut, 1 second at 25 KHz
+#define CLEAN_EXTRA_CHANS 2       // the artifact columns, from PC 1 and PC 2 of the final itpca pass
+
+   // the tunables from the 'init' case of CleanData.m
+typedef struct
+{
+   bool   use_sd;       // detect spikes using xsd standard deviations
+   double xsd;
+   double highthresh;   // used only if !use_sd
+   double lowthresh;
+   int    prepts;       // points replaced before a detected event
+   int    postpts;      // points replaced after a detected event
+} CleanParams;
+
+void clean_default_params(CleanParams *params);
+
+/* Clean one ptspercut piece of data.
+   tdata is m samples by n channels, stored one channel after another
+   (tdata[chan*m + t]), which is the way the .chan files are laid out.
+   out must hold m * (n+2) values, laid out the same way.  The first n
+   channels are the cleaned data, the last two are the artifact estimates
+   from PC 1 and PC 2 of the final itpca pass, out = [out2,art] in
+   CleanData2.m.
+   Returns false if n is less than 3 or memory can't be had.
+*/
+bool clean_data(const CleanParams *params, const double *tdata, int m, int n, double *out);
+
+/* What clean_data works out from a piece of data, kept so that it can be
+   used on the data that comes after the piece, the way daq2_online does.
+   For each of the three pca passes there are the means of the chans that
+   went in and the weights, wts[j*n + i] being the weight of chan j in chan
+   i.  With x the data going in and c_j = x_j - mean_j,
+      pass 0, pca2 of the raw data:           x_i - mean_i - sum_j wts_ji c_j
+      pass 1, pca2 with the spikes zeroed:    the same
+      pass 2, itpca of the data with the spikes replaced by the noise from
+              pass 1, out_i = raw_i - sum_j wts_ji c_j
+   lo and hi are the spike thresholds for each chan of pass 0's output.
+*/
+#define CLEAN_PASSES 3
+
+typedef struct
+{
+   int     n;
+   double *lo;
+   double *hi;
+   double *mean[CLEAN_PASSES];
+   double *wts[CLEAN_PASSES];
+} CleanFit;
+
+bool clean_fit_alloc(CleanFit *fit, int n);
+void clean_fit_free(CleanFit *fit);
+
+   // fill in fit, which was allocated for n chans, from m samples of tdata
+bool clean_fit(const CleanParams *params, const double *tdata, int m, int n, CleanFit *fit);
+
+   // round cleaned values to the nearest short for a .chan file, clipping
+void clean_to_short(const double *src, int cnt, short *dest);
+
+#endif
@@ -45,6 +45,33 @@ fi
 
 echo "Start cleaning operations"
 
+# daq2_clean can clean all of the chanlist groups in one process with a
+# thread per cpu, which keeps all of the cpus busy until the end instead of
+# starting a process per group.
+if command -v daq2_clean > /dev/null ; then
+   lists=""
+   for n in 1 2 3 4 5 6 7 8 9 10 ; do
+      if [ -s chanlist_$1_$n ] ; then
+         lists="$lists chanlist_$1_$n"
+      fi
+   done
+   if [ -n "$lists" ] ; then
+      echo "** Start new cleaning operation for ${PWD##*/}_$1 $2 **" >> chanlist_$1.log
+      daq2_clean $2 ${PWD##*/}_$1 $lists >> chanlist_$1.log 2>&1 &
+   fi
+
+   if [ -e nocleanlist_$1 ] ; then
+     echo "** Processing files in the no clean list ${PWD##*/}_$1 $2 **" >> nocleanlist_$1.log
+     do_noclean_data.sh ${PWD##*/}_$1 nocleanlist_$1 $2 >> nocleanlist_$1.log 2>&1 &
+   fi
+
+   echo "The cleaning process has been started in the background."
+   echo "You can view progress by viewing the log file, type:"
+   echo "tail -f chanlist_$1.log"
+   echo
+   exit
+fi
+
 if [ -e chanlist_$1_1 ] ; then
    echo "** Start new cleaning operation for ${PWD##*/}_$1 $2 **" >> chanlist_$1_1.log
    do_clean_data.sh ${PWD##*/}_$1 chanlist_$1_1 $2 >> chanlist_$1_1.log 2>&1 &
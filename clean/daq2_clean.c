@@ -0,0 +1,884 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Clean all of the channels in a chanlist file in one pass.  This replaces
+   the do_clean_data.sh loop that started octave on do_clean_data2.m once per
+   chunk.  The input and output files are the same as the octave version:
+
+      split.REC/YYYY-MM-DD_REC_r_CH.chan   in
+      clean.REC/YYYY-MM-DD_REC_CH.chan     out
+
+   If a raw chan file is not there, the chan is read from a .chz file or
+   the split.REC/YYYY-MM-DD_REC_r_1-64.pack or _65-128.pack file, if any.
+   With --compress, the output is .chz files instead of .chan files.
+
+   The last two numbers in the chanlist file are the channel numbers used for
+   the two artifact estimate files, PC 1 then PC 2 of the final itpca pass
+   (out = [out2,art] in CleanData2.m), in the order make_chan.sh writes them,
+   e.g. 199 198 in chanlist_REC_1.
+
+   Several chanlist files can be cleaned at once.  Each ptspercut piece of
+   each group is cleaned on its own, so the pieces are tasks for a pool of
+   threads.  Each thread has a home group it takes pieces from, in order.
+   When its group runs out, it steals from the group with the most left.
+   Pieces can finish out of order, so each group keeps the ones that are
+   early until the ones before them are written.
+
+   Every CHECKPOINT_PIECES pieces, the output files are synced and their
+   sizes are saved in clean.REC/CHANLIST.progress along with what they were
+   made from.  If the run is stopped, the next one checks the output files
+   against that, cuts off whatever was written after it, and goes on from
+   there.  Once a group is done, its progress file says so, and it is
+   skipped if the output files are still the same.  --restart starts over.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <error.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include "clean_data.h"
+#include "chan_pack.h"
+
+#define MAX_LIST 256
+#define MAX_GROUPS 64
+#define CHECKPOINT_PIECES 30
+#define PROGRESS_EXT ".progress"
+#define PROGRESS_VERSION 1
+
+   // a cleaned piece waiting for the pieces before it to be written
+typedef struct Piece
+{
+   int           num;
+   int           count;     // samples per chan
+   short        *data;      // count samples of each output chan, one after another
+   struct Piece *next;
+} Piece;
+
+   // what a progress file says
+typedef struct
+{
+   char   prefix[PATH_MAX];
+   int    chans[MAX_LIST];
+   int    nchans;
+   int    compress;
+   off_t  input;              // samples in the first input chan
+   int    pieces;
+   off_t  samples;            // per chan
+   int    done;
+   off_t  sizes[MAX_LIST];    // bytes in each output file
+} Progress;
+
+typedef struct
+{
+   char      *list_name;
+   int        chans[MAX_LIST];
+   int        cnt;            // chans to clean, not counting the two noise chans
+   ChanReader in_rd[MAX_LIST];
+   char      *out_name[MAX_LIST];
+   FILE      *out_fd[MAX_LIST];
+   ChzWriter *out_z[MAX_LIST];
+   off_t      in_size;        // samples in the first chan
+   char      *progress;       // progress file name
+   off_t      resumed;        // samples per chan already done by an earlier run
+   bool       was_done;       // all of them
+   int        unsaved;        // pieces written since the last checkpoint
+
+   pthread_mutex_t in_lock;   // the readers and the fields after
+   int        next_read;      // piece number
+   bool       read_done;
+   off_t      claimed;        // samples per chan read so far
+
+   pthread_mutex_t out_lock;  // the writers and the fields after
+   int        next_write;
+   Piece     *waiting;        // sorted by num
+   off_t      written;
+   bool       failed;
+} Group;
+
+typedef struct
+{
+   int     home;              // group index
+   short  *inbuf;
+   double *tdata;
+   double *cleaned;
+} Worker;
+
+bool NoR = false;
+bool Compress = false;
+bool Restart = false;
+bool Debug = false;
+int  Threads;
+char *Prefix;
+char *ChanListNames[MAX_GROUPS];
+Group *Groups[MAX_GROUPS];
+int  GroupCnt;
+int  MaxCnt;              // most chans in a group
+CleanParams Params;
+bool Failed = false;      // any thread can set it, so use __atomic_* until joined
+off_t TotalSize, TotalDone;
+pthread_mutex_t ProgressLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(char *name)
+{
+   printf (
+"\nUsage: %s [--no_r] [--compress] [--restart] [-j threads] filename_prefix chanlist_filename...\n"\
+"\n"\
+"Clean the channels listed in chanlist_filename using principal component\n"\
+"analysis.  This does the same cleaning as do_clean_data2.m and CleanData.m,\n"\
+"but does the whole recording in one pass.\n"\
+"\n"\
+"This must be run from the directory containing the split.REC dirs.\n"\
+"filename_prefix has the form YYYY-MM-DD_REC, e.g. 2012-02-21_001.\n"\
+"The raw chan files are read from split.REC/ and the cleaned chan files\n"\
+"are written to clean.REC/, which is created if it does not exist.\n"\
+"\n"\
+"chanlist_filename holds a list of channel numbers, e.g. 1 2 3 ... 16 199 198\n"\
+"as make_chan.sh writes chanlist_REC_1.  The last two numbers are the\n"\
+"channel numbers used to name the files that hold the noise removed by the\n"\
+"first and second principal components, 199 and 198 here.\n"\
+"\n"\
+"--no_r means the raw chan files do not have _r_ in their names, such as\n"\
+"older datamax files.\n"\
+"\n"\
+"--compress writes losslessly compressed .chz files instead of .chan files.\n"\
+"\n"\
+"If more than one chanlist file is given, they are all cleaned at the same\n"\
+"time by one pool of threads, one per cpu unless -j says how many.\n"\
+"\n"\
+"Progress is saved in clean.REC/CHANLIST.progress every so often.  If a run\n"\
+"is stopped, running it again goes on from the last save, and groups that\n"\
+"were finished are skipped.  --restart starts over from the beginning.\n",
+name
+);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+   static struct option opts[] = { {"no_r", no_argument, NULL, '1'},
+                                   {"d", no_argument, NULL, '2'},
+                                   {"compress", no_argument, NULL, '3'},
+                                   {"j", required_argument, NULL, '4'},
+                                   {"restart", no_argument, NULL, '5'},
+                                   { 0,0,0,0} };
+   int cmd;
+   int ret = 1;
+   opterr = 0;
+
+   while ((cmd = getopt_long_only(argc, argv, "", opts, NULL )) != -1)
+   {
+      switch (cmd)
+      {
+         case '1':
+               NoR = true;
+               break;
+
+         case '2':
+               Debug = true;
+               break;
+
+         case '3':
+               Compress = true;
+               break;
+
+         case '4':
+               Threads = atoi(optarg);
+               if (Threads < 1)
+               {
+                  printf("-j needs a number greater than 0, aborting. . .\n");
+                  ret = 0;
+               }
+               break;
+
+         case '5':
+               Restart = true;
+               break;
+
+         case '?':
+         default:
+            printf("Unknown argument, aborting. . .\n");
+            ret = 0;
+           break;
+      }
+   }
+
+   while (ret && optind < argc)
+   {
+      if (!Prefix)
+         Prefix = argv[optind];
+      else if (GroupCnt < MAX_GROUPS)
+         ChanListNames[GroupCnt++] = argv[optind];
+      else
+      {
+         printf("Too many chanlist files, at most %d\n", MAX_GROUPS);
+         ret = 0;
+      }
+      ++optind;
+   }
+
+   if (!Prefix || !GroupCnt)
+      ret = 0;
+
+   if (!ret)
+      usage(argv[0]);
+
+   return ret;
+}
+
+
+/* Read a chanlist file.  It is just white space separated numbers,
+   the last two are the noise chans.
+*/
+static bool read_chanlist(Group *g)
+{
+   FILE *fd;
+   int  cnt = 0;
+
+   if ((fd = fopen(g->list_name, "r")) == NULL)
+   {
+      printf("Could not open chanlist file %s\n", g->list_name);
+      return false;
+   }
+   while (cnt < MAX_LIST && fscanf(fd, "%d", &g->chans[cnt]) == 1)
+      ++cnt;
+   fclose(fd);
+
+   g->cnt = cnt - CLEAN_EXTRA_CHANS;
+   if (g->cnt < 3)
+   {
+      printf("The chanlist file %s must have at least 3 channels plus the 2 noise channels\n",
+             g->list_name);
+      return false;
+   }
+   return true;
+}
+
+
+/* Save where group g is up to in its progress file, or that it is done.
+   The output files are flushed and synced first, so the sizes in the file
+   are on the disk.  When done, the output files have been closed.  The new
+   file replaces the old one in one step, so there is always a whole one.
+*/
+static bool save_progress(Group *g, bool done)
+{
+   int    outcnt = g->cnt + CLEAN_EXTRA_CHANS;
+   off_t  sizes[MAX_LIST];
+   char  *tmp = NULL;
+   FILE  *fd;
+   struct stat info;
+   int    chan;
+   bool   ok;
+
+   for (chan = 0; chan < outcnt; ++chan)
+   {
+      FILE *out = g->out_z[chan] ? g->out_z[chan]->fd : g->out_fd[chan];
+
+      if (done)
+         ok = stat(g->out_name[chan], &info) == 0;
+      else if (g->out_z[chan])
+         ok = chz_flush(g->out_z[chan]) && fstat(fileno(out), &info) == 0 && fdatasync(fileno(out)) == 0;
+      else
+         ok = fflush(out) == 0 && fstat(fileno(out), &info) == 0 && fdatasync(fileno(out)) == 0;
+      if (!ok)
+      {
+         printf("\nError saving %s, %s\n", g->out_name[chan], strerror(errno));
+         return false;
+      }
+      sizes[chan] = info.st_size;
+   }
+
+   if (asprintf(&tmp, "%s.tmp", g->progress) == -1 || (fd = fopen(tmp, "w")) == NULL)
+   {
+      printf("\nError saving progress in %s, %s\n", g->progress, strerror(errno));
+      free(tmp);
+      return false;
+   }
+   fprintf(fd, "daq2_clean progress %d\n", PROGRESS_VERSION);
+   fprintf(fd, "prefix %s\n", Prefix);
+   fprintf(fd, "chans %d", outcnt);
+   for (chan = 0; chan < outcnt; ++chan)
+      fprintf(fd, " %d", g->chans[chan]);
+   fprintf(fd, "\ncompress %d\n", Compress);
+   fprintf(fd, "input %lld\n", (long long) g->in_size);
+   fprintf(fd, "pieces %d\n", g->next_write);
+   fprintf(fd, "samples %lld\n", (long long) g->written);
+   fprintf(fd, "done %d\n", done);
+   fprintf(fd, "sizes");
+   for (chan = 0; chan < outcnt; ++chan)
+      fprintf(fd, " %lld", (long long) sizes[chan]);
+   fprintf(fd, "\n");
+   ok = fflush(fd) == 0 && fdatasync(fileno(fd)) == 0;
+   if (fclose(fd) != 0 || !ok || rename(tmp, g->progress) != 0)
+   {
+      printf("\nError saving progress in %s, %s\n", g->progress, strerror(errno));
+      unlink(tmp);
+      free(tmp);
+      return false;
+   }
+   free(tmp);
+   g->unsaved = 0;
+   return true;
+}
+
+
+/* Read a progress file.  Returns false if there isn't one or it doesn't
+   make sense.
+*/
+static bool load_progress(const char *name, Progress *prog)
+{
+   FILE *fd;
+   int   version, chan;
+   long long input, samples, size;
+   bool  ok;
+
+   if ((fd = fopen(name, "r")) == NULL)
+      return false;
+   memset(prog, 0, sizeof(*prog));
+   ok = fscanf(fd, "daq2_clean progress %d prefix %4095s chans %d", &version, prog->prefix,
+               &prog->nchans) == 3
+        && version == PROGRESS_VERSION && prog->nchans > 0 && prog->nchans <= MAX_LIST;
+   for (chan = 0; ok && chan < prog->nchans; ++chan)
+      ok = fscanf(fd, "%d", &prog->chans[chan]) == 1;
+   ok = ok && fscanf(fd, " compress %d input %lld pieces %d samples %lld done %d sizes",
+                     &prog->compress, &input, &prog->pieces, &samples, &prog->done) == 5;
+   for (chan = 0; ok && chan < prog->nchans; ++chan)
+   {
+      ok = fscanf(fd, "%lld", &size) == 1;
+      prog->sizes[chan] = size;
+   }
+   fclose(fd);
+   prog->input = input;
+   prog->samples = samples;
+   return ok;
+}
+
+
+/* Can group g go on from where prog says?  It can if prog is for the same
+   prefix, chans, compression, and input, and all of the output files have
+   at least as much in them as prog says.  If prog says done, they have to
+   be just that big and the outputs have to be as long as the input, which
+   is the input and output size check the octave version makes at the end.
+*/
+static bool can_resume(const Group *g, const Progress *prog)
+{
+   int    outcnt = g->cnt + CLEAN_EXTRA_CHANS;
+   struct stat info;
+   int    chan;
+
+   if (strcmp(prog->prefix, Prefix) != 0 || prog->nchans != outcnt || prog->compress != Compress
+       || prog->input != g->in_size || prog->samples > g->in_size
+       || (prog->done && prog->samples != g->in_size)
+       || (!prog->done && prog->samples != (off_t) prog->pieces * CLEAN_PTS_PER_CUT))
+      return false;
+   for (chan = 0; chan < outcnt; ++chan)
+   {
+      if (prog->chans[chan] != g->chans[chan])
+         return false;
+      if (stat(g->out_name[chan], &info) != 0 || info.st_size < prog->sizes[chan]
+          || (prog->done && info.st_size != prog->sizes[chan]))
+         return false;
+      if (!Compress && prog->sizes[chan] != prog->samples * (off_t) sizeof(short))
+         return false;
+   }
+   return true;
+}
+
+
+/* Open a group's input and output chan files.  If an earlier run got part
+   way, cut the outputs back to its last checkpoint and go on from there.
+*/
+static bool open_group(Group *g, const char *srcdir, const char *destdir, int yr, int mon,
+                       int day, int recno, ChanPack **packs, int npacks)
+{
+   char filename[PATH_MAX];
+   int  outcnt = g->cnt + CLEAN_EXTRA_CHANS;
+   const char *list_base = strrchr(g->list_name, '/') ? strrchr(g->list_name, '/') + 1 : g->list_name;
+   Progress prog;
+   bool resume = false;
+   int  chan;
+
+   for (chan = 0; chan < g->cnt; ++chan)
+   {
+      if (NoR)
+         sprintf(filename, "%s/%s_%02d.chan", srcdir, Prefix, g->chans[chan]);
+      else
+         sprintf(filename, "%s/%s_r_%02d.chan", srcdir, Prefix, g->chans[chan]);
+      if (!chan_reader_open(&g->in_rd[chan], filename, packs, npacks, g->chans[chan]))
+      {
+         printf("File %s not found\n", filename);
+         return false;
+      }
+      if (chan == 0)
+         g->in_size = chan_reader_samples(&g->in_rd[chan]);
+   }
+
+   for (chan = 0; chan < outcnt; ++chan)
+   {
+      sprintf(filename, "%s/%04d-%02d-%02d_%03d_%02d.chan", destdir, yr, mon, day, recno, g->chans[chan]);
+      g->out_name[chan] = Compress ? chz_name(filename) : strdup(filename);
+      if (!g->out_name[chan])
+      {
+         printf("Out of memory\n");
+         return false;
+      }
+   }
+   if (asprintf(&g->progress, "%s/%s%s", destdir, list_base, PROGRESS_EXT) == -1)
+   {
+      g->progress = NULL;
+      printf("Out of memory\n");
+      return false;
+   }
+
+   if (Restart)
+      unlink(g->progress);
+   else if (load_progress(g->progress, &prog))
+   {
+      resume = can_resume(g, &prog);
+      if (!resume)
+         printf("%s does not match the files, starting %s over\n", g->progress, g->list_name);
+   }
+   if (resume && prog.done)
+   {
+      printf("%s was already cleaned\n", g->list_name);
+      g->read_done = g->was_done = true;
+      g->written = g->claimed = g->resumed = g->in_size;
+      return true;
+   }
+   if (resume)
+   {
+      printf("Going on with %s from %.0f seconds in\n", g->list_name,
+             (double) prog.samples / CLEAN_PTS_PER_CUT);
+      g->next_read = g->next_write = prog.pieces;
+      g->written = g->claimed = g->resumed = prog.samples;
+      for (chan = 0; chan < g->cnt; ++chan)
+         if (!chan_reader_seek(&g->in_rd[chan], prog.samples))
+         {
+            printf("Could not seek in the input for %s\n", g->list_name);
+            return false;
+         }
+   }
+
+   for (chan = 0; chan < outcnt; ++chan)
+   {
+      const char *name = g->out_name[chan];
+      if (Compress)
+      {
+         sprintf(filename, "%s/%04d-%02d-%02d_%03d_%02d.chan", destdir, yr, mon, day, recno, g->chans[chan]);
+         unlink(filename);    // or it would be read instead of the .chz
+         g->out_z[chan] = resume ? chz_append(name, prog.sizes[chan], prog.samples) : chz_create(name);
+         if (!g->out_z[chan])
+            return false;
+      }
+      else if ((g->out_fd[chan] = fopen(name, resume ? "r+" : "w")) == NULL
+               || (resume && (ftruncate(fileno(g->out_fd[chan]), prog.sizes[chan]) != 0
+                              || fseeko(g->out_fd[chan], 0, SEEK_END) != 0)))
+      {
+         printf("can't open %s: %s\n", name, strerror(errno));
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/* Close a group's files.  Returns false if any of the writing failed.
+*/
+static bool close_group(Group *g)
+{
+   bool ret = !g->failed;
+   int  chan;
+
+   for (chan = 0; chan < MAX_LIST; ++chan)
+   {
+      if (chan < g->cnt)
+         chan_reader_close(&g->in_rd[chan]);
+      if (g->out_fd[chan] && fclose(g->out_fd[chan]) != 0)
+      {
+         printf("Error closing output chan %d, %s\n", g->chans[chan], strerror(errno));
+         ret = false;
+      }
+      if (g->out_z[chan] && !chz_close(g->out_z[chan]))
+         ret = false;
+      g->out_fd[chan] = NULL;
+      g->out_z[chan] = NULL;
+   }
+   while (g->waiting)
+   {
+      Piece *piece = g->waiting;
+      g->waiting = piece->next;
+      free(piece->data);
+      free(piece);
+   }
+   return ret;
+}
+
+
+/* Read the next piece of group g into the worker's tdata, packed to count
+   samples per chan.  Returns the piece number, or -1 if there are no more.
+*/
+static int read_piece(Group *g, Worker *w, int *count)
+{
+   int m = CLEAN_PTS_PER_CUT;
+   int num = -1;
+   int chan, t;
+
+   pthread_mutex_lock(&g->in_lock);
+   if (!g->read_done)
+   {
+      *count = m;
+         // like the octave version, the piece is as long as the shortest chan
+      for (chan = 0; chan < g->cnt; ++chan)
+      {
+         int got = chan_reader_read(&g->in_rd[chan], w->inbuf, m);
+         if (got < *count)
+            *count = got;
+         for (t = 0; t < got; ++t)
+            w->tdata[(size_t)chan*m + t] = w->inbuf[t];
+      }
+      if (*count < m)
+         __atomic_store_n(&g->read_done, true, __ATOMIC_RELAXED);
+      if (*count > 0)
+      {
+         num = g->next_read++;
+         __atomic_add_fetch(&g->claimed, *count, __ATOMIC_RELAXED);
+      }
+   }
+   pthread_mutex_unlock(&g->in_lock);
+
+   if (num >= 0 && *count < m)   // pack the short last piece
+      for (chan = 1; chan < g->cnt; ++chan)
+         memmove(w->tdata + (size_t)chan * *count, w->tdata + (size_t)chan*m,
+                 sizeof(double) * *count);
+   return num;
+}
+
+
+/* Take the next piece, from the worker's home group if it has any left,
+   otherwise from the group with the most left, which becomes its new home.
+*/
+static Group *claim_piece(Worker *w, int *num, int *count)
+{
+   while (!__atomic_load_n(&Failed, __ATOMIC_RELAXED))
+   {
+      Group *g = Groups[w->home];
+      int    best = -1, k;
+      off_t  most = 0;
+
+      if ((*num = read_piece(g, w, count)) >= 0)
+         return g;
+
+         // the counts are read without the locks, read_piece checks again
+      for (k = 0; k < GroupCnt; ++k)
+      {
+         Group *v = Groups[k];
+         off_t  left = v->in_size - __atomic_load_n(&v->claimed, __ATOMIC_RELAXED);
+         if (!__atomic_load_n(&v->read_done, __ATOMIC_RELAXED) && (best < 0 || left > most))
+         {
+            best = k;
+            most = left;
+         }
+      }
+      if (best < 0)
+         break;
+      w->home = best;
+   }
+   return NULL;
+}
+
+
+static bool write_piece(Group *g, const Piece *piece)
+{
+   int chan;
+
+   for (chan = 0; chan < g->cnt + CLEAN_EXTRA_CHANS; ++chan)
+   {
+      const short *src = piece->data + (size_t)chan * piece->count;
+      if (g->out_z[chan] ? !chz_write(g->out_z[chan], src, piece->count)
+                         : fwrite(src, sizeof(short), piece->count, g->out_fd[chan]) != (size_t)piece->count)
+      {
+         printf("\nError writing to output chan %d, %s\n", g->chans[chan], strerror(errno));
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/* Hand a cleaned piece to its group.  If it is the next one to be written,
+   write it and any waiting ones that follow it, otherwise leave it waiting.
+*/
+static bool put_piece(Group *g, Piece *piece)
+{
+   Piece **link;
+   off_t   done = 0;
+   bool    ok = true;
+
+   pthread_mutex_lock(&g->out_lock);
+   for (link = &g->waiting; *link && (*link)->num < piece->num; link = &(*link)->next)
+      ;
+   piece->next = *link;
+   *link = piece;
+
+   while (ok && g->waiting && g->waiting->num == g->next_write)
+   {
+      piece = g->waiting;
+      if (!g->failed && !write_piece(g, piece))
+         g->failed = true;
+      ok = !g->failed;
+      g->waiting = piece->next;
+      g->written += piece->count;
+      done += piece->count;
+      ++g->next_write;
+      ++g->unsaved;
+      free(piece->data);
+      free(piece);
+   }
+   if (ok && g->unsaved >= CHECKPOINT_PIECES && !save_progress(g, false))
+      ok = !(g->failed = true);
+   pthread_mutex_unlock(&g->out_lock);
+
+   pthread_mutex_lock(&ProgressLock);
+   TotalDone += done;
+   if (done && TotalSize)
+   {
+      printf("\r  %3.0f%%", (TotalDone * 100.0) / TotalSize);
+      fflush(stdout);
+   }
+   pthread_mutex_unlock(&ProgressLock);
+   return ok;
+}
+
+
+static void *clean_worker(void *arg)
+{
+   Worker *w = arg;
+   Group  *g;
+   int     num, count, chan;
+
+   while ((g = claim_piece(w, &num, &count)) != NULL)
+   {
+      int    outcnt = g->cnt + CLEAN_EXTRA_CHANS;
+      Piece *piece = malloc(sizeof(*piece));
+
+      if (!piece || !(piece->data = malloc(sizeof(short) * count * outcnt)))
+      {
+         printf("\nOut of memory\n");
+         free(piece);
+         __atomic_store_n(&Failed, true, __ATOMIC_RELAXED);
+         break;
+      }
+      if (!clean_data(&Params, w->tdata, count, g->cnt, w->cleaned))
+      {
+         printf("\nCleaning failed, out of memory?\n");
+         free(piece->data);
+         free(piece);
+         __atomic_store_n(&Failed, true, __ATOMIC_RELAXED);
+         break;
+      }
+      for (chan = 0; chan < outcnt; ++chan)
+         clean_to_short(w->cleaned + (size_t)chan*count, count, piece->data + (size_t)chan*count);
+      piece->num = num;
+      piece->count = count;
+      if (!put_piece(g, piece))
+      {
+         __atomic_store_n(&Failed, true, __ATOMIC_RELAXED);
+         break;
+      }
+   }
+   return NULL;
+}
+
+
+/* What we are here for.  Read ptspercut pieces from every input chan file,
+   clean them, and append them to the output files, using a pool of threads
+   for all of the groups.
+*/
+static bool clean_groups(void)
+{
+   int    yr, mon, day, recno;
+   char   srcdir[PATH_MAX], destdir[PATH_MAX], filename[PATH_MAX];
+   ChanPack *packs[2] = {NULL, NULL};
+   int    npacks;
+   int    m = CLEAN_PTS_PER_CUT;
+   struct stat info;
+   Worker *workers = NULL;
+   pthread_t *tid = NULL;
+   int    started = 0;
+   bool   ret = false;
+   int    k, chan;
+
+   if (sscanf(Prefix, "%d-%d-%d_%d", &yr, &mon, &day, &recno) != 4)
+   {
+      printf("%s is not in the YYYY-MM-DD_REC format\n", Prefix);
+      return false;
+   }
+   sprintf(srcdir, "split.%03d", recno);
+   sprintf(destdir, "clean.%03d", recno);
+
+      // make destdir if we need to, and give all users all permissions.
+      // another group may be making it at the same time, so make, then test.
+   mode_t old_mask = umask(0);
+   mkdir(destdir, S_IRWXU|S_IRWXG|S_IRWXO);
+   umask(old_mask);
+   if (stat(destdir, &info) != 0 || !S_ISDIR(info.st_mode))
+   {
+      printf("Create directory %s failed, %s\n", destdir, strerror(errno));
+      return false;
+   }
+
+   if (snprintf(filename, sizeof(filename), "%s/%s_%s", srcdir, Prefix, NoR ? "" : "r_")
+       >= (int) sizeof(filename))
+   {
+      printf("%s is too long a name\n", Prefix);
+      return false;
+   }
+   npacks = chan_pack_open_pair(filename, packs);
+   for (k = 0; k < GroupCnt; ++k)
+   {
+      Group *g = Groups[k];
+      if (!open_group(g, srcdir, destdir, yr, mon, day, recno, packs, npacks))
+         goto error;
+      TotalSize += g->in_size;
+      TotalDone += g->resumed;
+      if (!g->was_done)
+         printf("Cleaning %d channels of %s using %s\n", g->cnt, Prefix, g->list_name);
+   }
+
+   if (Threads == 0)
+      Threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if (Threads < 1)
+      Threads = 1;
+   workers = calloc(Threads, sizeof(Worker));
+   tid = calloc(Threads, sizeof(pthread_t));
+   if (!workers || !tid)
+   {
+      printf("Out of memory\n");
+      goto error;
+   }
+   for (k = 0; k < Threads; ++k)
+   {
+      Worker *w = &workers[k];
+      w->home = k % GroupCnt;
+      w->inbuf = malloc(sizeof(short) * m);
+      w->tdata = malloc(sizeof(double) * m * MaxCnt);
+      w->cleaned = malloc(sizeof(double) * m * (MaxCnt + CLEAN_EXTRA_CHANS));
+      if (!w->inbuf || !w->tdata || !w->cleaned)
+      {
+         printf("Out of memory\n");
+         goto error;
+      }
+   }
+
+   clean_default_params(&Params);
+   if (GroupCnt > 1 || Threads > 1)
+      printf("Using %d thread%s\n", Threads, Threads == 1 ? "" : "s");
+   for (started = 0; started < Threads; ++started)
+      if (pthread_create(&tid[started], NULL, clean_worker, &workers[started]) != 0)
+      {
+         printf("Can't start a cleaning thread, %s\n", strerror(errno));
+         __atomic_store_n(&Failed, true, __ATOMIC_RELAXED);
+         break;
+      }
+   for (k = 0; k < started; ++k)
+      pthread_join(tid[k], NULL);
+   ret = !Failed;
+   if (ret)
+      printf("\r  100%%   \n");
+
+error:
+   for (k = 0; k < GroupCnt; ++k)
+   {
+      Group *g = Groups[k];
+      if (!close_group(g))
+         ret = false;
+      else if (ret && g->written != g->in_size)
+      {
+         printf("\n*** WARNING ***\n");
+         printf("Input file is not the same size as output file for %s\n\n", g->list_name);
+      }
+      else if (ret && !g->was_done && !save_progress(g, true))
+         ret = false;
+      for (chan = 0; chan < MAX_LIST; ++chan)
+         free(g->out_name[chan]);
+      free(g->progress);
+   }
+   chan_pack_close(packs[0]);
+   chan_pack_close(packs[1]);
+   for (k = 0; workers && k < Threads; ++k)
+   {
+      free(workers[k].inbuf);
+      free(workers[k].tdata);
+      free(workers[k].cleaned);
+   }
+   free(workers);
+   free(tid);
+   return ret;
+}
+
+
+int main (int argc, char **argv)
+{
+   int k;
+
+   if (!parse_args(argc, argv))
+      exit(3);
+
+   if (Debug)
+   {
+      printf("attach debugger, then press ENTER");
+      getchar();
+   }
+
+   for (k = 0; k < GroupCnt; ++k)
+   {
+      Group *g = calloc(1, sizeof(Group));
+      if (!g)
+      {
+         printf("Out of memory\n");
+         exit(2);
+      }
+      g->list_name = ChanListNames[k];
+      pthread_mutex_init(&g->in_lock, NULL);
+      pthread_mutex_init(&g->out_lock, NULL);
+      Groups[k] = g;
+      if (!read_chanlist(g))
+         exit(2);
+      if (g->cnt > MaxCnt)
+         MaxCnt = g->cnt;
+   }
+
+   if (!clean_groups())
+      exit(2);
+
+   return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Make the .env envelope file for each chan file given, for waveform.tcl to
+   draw zoomed out views with.  See chan_env.h.
+
+      2012-02-21_001_45.chan  ->  2012-02-21_001_45.env
+
+   A chan can be read from a .chan file, a .chz file, or a pack file.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <getopt.h>
+#include "chan_pack.h"
+#include "chan_env.h"
+
+#define READ_SAMPS (64 * 1024)
+#define CHAN_EXT ".chan"
+
+bool Debug = false;
+
+static void usage(char *name)
+{
+   printf (
+"\nUsage: %s chan_file...\n"\
+"\n"\
+"Make an envelope file for each chan file, e.g. 2012-02-21_001_45.env for\n"\
+"2012-02-21_001_45.chan.  The envelope holds the min, max, and mean of the\n"\
+"samples at a range of zoom levels so waveform.tcl can draw long stretches\n"\
+"of a recording quickly.\n"\
+"\n"\
+"Compressed .chz chan files can be given too.  If there is no chan file of\n"\
+"the given name, the chan is read from the YYYY-MM-DD_REC_r_1-64.pack or\n"\
+"_65-128.pack file that daq2_split --pack makes, if there is one.\n",
+name
+);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+   static struct option opts[] = { {"d", no_argument, NULL, '1'},
+                                   { 0,0,0,0} };
+   int cmd;
+   int ret = 1;
+   opterr = 0;
+
+   while ((cmd = getopt_long_only(argc, argv, "", opts, NULL )) != -1)
+   {
+      switch (cmd)
+      {
+         case '1':
+               Debug = true;
+               break;
+
+         case '?':
+         default:
+            printf("Unknown argument, aborting. . .\n");
+            ret = 0;
+           break;
+      }
+   }
+
+   if (optind >= argc)
+      ret = 0;
+
+   if (!ret)
+      usage(argv[0]);
+
+   return ret;
+}
+
+
+/* Open the chan in chan_name.  If there is no such .chan or .chz file, look
+   for it in the pack files of the same prefix, e.g. for ..._r_05.chan, chan 5
+   in ..._r_1-64.pack.
+*/
+static bool open_chan(ChanReader *rd, const char *chan_name, ChanPack **packs)
+{
+   char  name[PATH_MAX];
+   char  prefix[PATH_MAX];
+   const char *ext = strrchr(chan_name, '.');
+   const char *num = strrchr(chan_name, '_');
+   int   chan;
+
+   packs[0] = packs[1] = NULL;
+   if (strlen(chan_name) + sizeof(CHAN_EXT) >= sizeof(name))
+      return false;
+      // the reader wants the .chan name, it finds the .chz from that
+   if (ext && strcmp(ext, CHZ_EXT) == 0)
+      sprintf(name, "%.*s%s", (int) (ext - chan_name), chan_name, CHAN_EXT);
+   else
+      strcpy(name, chan_name);
+
+   if (chan_reader_open(rd, name, NULL, 0, 0))
+      return true;
+   if (!num || sscanf(num + 1, "%d", &chan) != 1)
+      return false;
+   sprintf(prefix, "%.*s", (int) (num - chan_name + 1), chan_name);
+   return chan_pack_open_pair(prefix, packs) && chan_reader_open(rd, name, packs, 2, chan);
+}
+
+
+static bool make_env(const char *chan_name, short *buf)
+{
+   ChanReader rd;
+   ChanPack  *packs[2];
+   ChanEnv   *env;
+   char      *env_name;
+   uint64_t   samples, done = 0;
+   size_t     got;
+   bool       ok = true;
+
+   if (!open_chan(&rd, chan_name, packs))
+   {
+      printf("Could not open %s\n", chan_name);
+      chan_pack_close(packs[0]);
+      chan_pack_close(packs[1]);
+      return false;
+   }
+   samples = chan_reader_samples(&rd);
+   if ((env_name = chan_env_name(chan_name)) == NULL
+       || (env = chan_env_create(env_name, samples)) == NULL)
+   {
+      chan_reader_close(&rd);
+      chan_pack_close(packs[0]);
+      chan_pack_close(packs[1]);
+      free(env_name);
+      return false;
+   }
+
+   printf("%s -> %s\n", chan_name, env_name);
+   while (ok && done < samples)
+   {
+      got = chan_reader_read(&rd, buf, READ_SAMPS);
+      if (got == 0)
+      {
+         printf("%s is shorter than it should be\n", chan_name);
+         ok = false;
+         break;
+      }
+      if (got > samples - done)
+         got = samples - done;
+      ok = chan_env_put(env, buf, got);
+      done += got;
+   }
+   if (!chan_env_close(env))
+      ok = false;
+   if (!ok)
+      unlink(env_name);
+
+   chan_reader_close(&rd);
+   chan_pack_close(packs[0]);
+   chan_pack_close(packs[1]);
+   free(env_name);
+   return ok;
+}
+
+
+int main (int argc, char **argv)
+{
+   short *buf;
+   int    bad = 0;
+
+   if (!parse_args(argc, argv))
+      exit(1);
+
+   if (Debug)
+   {
+      printf("attach debugger, then press ENTER");
+      getchar();
+   }
+
+   if ((buf = malloc(READ_SAMPS * sizeof(short))) == NULL)
+   {
+      printf("Out of memory\n");
+      exit(1);
+   }
+   for ( ; optind < argc; ++optind)
+      if (!make_env(argv[optind], buf))
+         ++bad;
+   free(buf);
+
+   return bad ? 1 : 0;
+}
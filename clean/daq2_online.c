@@ -0,0 +1,1223 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Clean a recording while it is being made.  .daq frames come in on stdin,
+   or from a file, fifo, or Unix socket, for one or both halves of the
+   recording, and cleaned frames go out on stdout as fast as they can be
+   made, for a monitor to show.
+
+   The cleaning is the same as clean_data's, but it can't wait for a whole
+   ptspercut piece.  The work is split in two:
+
+   A fit thread keeps taking the last --window seconds of data and runs
+   clean_fit on it, which does all of the expensive parts: the covariances,
+   the eigenvectors, and the spike thresholds.  It runs at the lowest
+   priority, so it only gets the cpu the cleaning itself doesn't need.
+
+   The main thread cleans the frames a block at a time with the newest fit.
+   For each frame that is two matrix times vector products per chanlist
+   group: one for pass 0 to find the spikes, and one for pass 2 to take the
+   pc's out.  Pass 1's noise estimate is needed only where there are
+   spikes.  A spike is replaced along with prepts points before it and
+   postpts after, the same as ReplaceBigStuff does, so a block waits for
+   prepts + 1 frames after it before it is cleaned.
+
+   A frame is written at most --latency ms after it comes in.  The first
+   frame of a block waits for the rest of the block and the prepts + 1
+   after it to come in, then for the block to be cleaned, so the block is
+   sized to leave room for the cleaning inside the limit.  The time to clean
+   a block is measured at the start, with every point replaced, which is
+   the most work a frame can be.  If a frame still waits longer than that
+   says it should, because the reads came in late or something else had
+   the cpu, the extra is kept back from the limit too and the blocks are
+   made smaller.  The extra is forgotten slowly.
+
+   Until the first fit is done, the frames are passed through as they are.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <linux/limits.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include "clean_data.h"
+#include "daq_kernel.h"
+
+#define SAMP_RATE 25000              // frames per second
+#define MAX_INPUTS 2                 // the 1-64 and 65-128 halves
+#define MAX_CHANS (DAQ_CHANS * MAX_INPUTS)
+#define MAX_LIST 256
+#define MAX_GROUPS 10
+#define DEFAULT_LATENCY_MS 100
+#define LATENCY_USE 0.95             // of --latency the blocks are sized to,
+#define LATENCY_SLACK_MS 2           //    less this, for reads and being scheduled
+#define CALIBRATE_RUNS 5
+#define EVICT_BYTES (64 << 20)       // more than the caches hold
+#define RESERVE_DECAY 0.999          // for each block the extra wait kept back is this much less
+#define IN_WORDS (64 * DAQ_FRAME_WORDS * 16)   // read buffer for each input
+#define REFIT_PARTS 4                // fit again after a quarter of a window of new data
+#define PACE_WORDS (SAMP_RATE / 1000 * DAQ_FRAME_WORDS)   // --pace reads 1 ms at a time
+
+typedef struct
+{
+   const char *name;
+   int       fd;
+   uint16_t *buf;          // read in, not split yet
+   size_t    len;          // words
+   bool      started;      // found the first frame
+   bool      synced;       // buf starts at a frame
+   bool      eof;
+   int       fill;         // positions of the work window filled from here
+   unsigned long long words;    // read so far
+   unsigned long long skipped;  // words skipped since the last good frame
+   unsigned long long pad;      // lost frames still to be filled in
+   unsigned long long lost;
+} Input;
+
+typedef struct
+{
+   char      name[PATH_MAX];    // chanlist file
+   int       chans[MAX_LIST];   // 0-based
+   int       cnt;               // not counting the two noise chans
+   CleanFit  fits[3];           // one for each of these three:
+   CleanFit *cur;               //    in use by the main thread
+   CleanFit *ready;             //    the newest fit, handed over under FitLock
+   CleanFit *next;              //    being made by the fit thread
+   bool      fresh;             // ready is newer than cur
+   bool      fitted;            // cur has been filled in
+   double   *x;                 // the work window for these chans, cnt x Len
+   double   *c;                 // centered data, cnt x Len
+   double   *acc;               // one chan, Len
+   unsigned char *flag;         // spikes, cnt x Len
+   unsigned char *rep;          // points to replace, cnt x Len
+   unsigned char *any;          // positions with a point to replace, Len
+   short    *row;               // one cleaned chan, Len
+   double   *tdata;             // the fit thread's copy of the window
+} Group;
+
+bool  Debug = false;
+bool  Listen = false;
+bool  Pace = false;
+int   LatencyMs = DEFAULT_LATENCY_MS;
+double WindowSecs = (double) CLEAN_PTS_PER_CUT / SAMP_RATE;
+
+Input  Inputs[MAX_INPUTS];
+int    InputCnt;
+Group  Groups[MAX_GROUPS];
+int    GroupCnt;
+CleanParams Params;
+
+   // The work window.  Position p is frame Start - Post + p, so the block
+   // being cleaned is Post to Post + Block, after postpts frames that are
+   // already out and before Look frames that are waited for, Need
+   // positions in all.  The window has room for Len positions, the most
+   // Block can be is BlockMax, the least BlockMin.
+int    Post, Block, BlockMin, BlockMax, Look, Need, Len;
+   // The blocks are sized by these.  Cleaning a block of n frames takes at
+   // most BlockCost + n * FrameCost seconds, and a frame can wait Reserve
+   // seconds more than that and the time for the frames to come in.
+double BlockCost, FrameCost, Reserve;
+unsigned long long Start;
+short *Work[MAX_CHANS];
+double *Arrive;                 // when each position came in
+short *OutBuf;                  // cleaned frames, interleaved
+
+   // The last Window frames of every chan, for the fit thread, in a ring
+   // of RingLen.  The fit thread copies them out without holding FitLock,
+   // so the main thread isn't held up, and the room past Window is what
+   // can be added while it does.
+int    Window, RingLen;
+short *Ring[MAX_CHANS];
+unsigned long long RingTotal;   // frames ever put in the ring
+bool   InGroup[MAX_CHANS];
+pthread_mutex_t FitLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  FitCond = PTHREAD_COND_INITIALIZER;
+bool   StopFit = false;
+int    Fits;
+
+static void usage(char *name)
+{
+   fprintf(stderr,
+"\nUsage: %s [--in SOURCE] [--in2 SOURCE] [--listen] [--latency MS]\n"\
+"          [--window SECONDS] [--pace] chanlist_filename...\n"\
+"\n"\
+"Clean a recording as it is made.  The .daq frames for chans 1-64 are read\n"\
+"from stdin, or from SOURCE, and those for chans 65-128 from the --in2\n"\
+"SOURCE if there is one.  A SOURCE is a .daq file or a fifo, or with\n"\
+"--listen, a Unix socket that is made and waited on for the recorder to\n"\
+"connect to.\n"\
+"\n"\
+"The cleaned frames go to stdout, one signed short for each chan, 1-64 or\n"\
+"1-128, in chan order, with no markers.  Chans in a chanlist are cleaned,\n"\
+"the rest are passed through.  The noise chans in the chanlists are not\n"\
+"written.\n"\
+"\n"\
+"--latency  the longest from a frame coming in until it is written, %d ms by\n"\
+"           default.  The time it takes to clean the frames counts, so this\n"\
+"           has to be a few ms at least.\n"\
+"--window   how much data the cleaning is worked out from, %.0f second by\n"\
+"           default, which is the same as the offline cleaner.\n"\
+"--pace     read no faster than the data was recorded, to replay a .daq\n"\
+"           file as if it were live.\n"\
+"\n"\
+"Until there is a window of data, the frames are passed through uncleaned.\n"\
+"When the input ends, the latency and throughput are printed on stderr.\n",
+name, DEFAULT_LATENCY_MS, (double) CLEAN_PTS_PER_CUT / SAMP_RATE
+);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+   static struct option opts[] = { {"in", required_argument, NULL, '1'},
+                                   {"in2", required_argument, NULL, '2'},
+                                   {"listen", no_argument, NULL, '3'},
+                                   {"latency", required_argument, NULL, '4'},
+                                   {"window", required_argument, NULL, '5'},
+                                   {"pace", no_argument, NULL, '6'},
+                                   {"d", no_argument, NULL, '7'},
+                                   { 0,0,0,0} };
+   int cmd;
+   int ret = 1;
+   opterr = 0;
+
+   Inputs[0].name = "-";
+   InputCnt = 1;
+   while ((cmd = getopt_long_only(argc, argv, "", opts, NULL )) != -1)
+   {
+      switch (cmd)
+      {
+         case '1':
+               Inputs[0].name = optarg;
+               break;
+
+         case '2':
+               Inputs[1].name = optarg;
+               InputCnt = 2;
+               break;
+
+         case '3':
+               Listen = true;
+               break;
+
+         case '4':
+               if ((LatencyMs = atoi(optarg)) < 1)
+               {
+                  fprintf(stderr, "--latency needs a number of ms greater than 0\n");
+                  ret = 0;
+               }
+               break;
+
+         case '5':
+               if ((WindowSecs = atof(optarg)) < .01)
+               {
+                  fprintf(stderr, "--window needs at least .01 seconds\n");
+                  ret = 0;
+               }
+               break;
+
+         case '6':
+               Pace = true;
+               break;
+
+         case '7':
+               Debug = true;
+               break;
+
+         case '?':
+         default:
+            fprintf(stderr, "Unknown argument, aborting. . .\n");
+            ret = 0;
+           break;
+      }
+   }
+
+   if (optind == argc)
+      ret = 0;
+   else if (Listen && (strcmp(Inputs[0].name, "-") == 0
+                       || (InputCnt == 2 && strcmp(Inputs[1].name, "-") == 0)))
+   {
+      fprintf(stderr, "--listen needs a socket name for each --in\n");
+      ret = 0;
+   }
+
+   if (!ret)
+      usage(argv[0]);
+
+   return ret;
+}
+
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static bool read_chanlist(Group *g, const char *name)
+{
+   FILE *fd;
+   int   list[MAX_LIST];
+   int   cnt = 0, chan;
+
+   snprintf(g->name, sizeof(g->name), "%s", name);
+   if ((fd = fopen(name, "r")) == NULL)
+   {
+      fprintf(stderr, "Could not open chanlist file %s\n", name);
+      return false;
+   }
+   while (cnt < MAX_LIST && fscanf(fd, "%d", &list[cnt]) == 1)
+      ++cnt;
+   fclose(fd);
+
+   g->cnt = cnt - CLEAN_EXTRA_CHANS;
+   if (g->cnt < 3)
+   {
+      fprintf(stderr, "The chanlist file %s must have at least 3 channels plus the 2 noise channels\n",
+              name);
+      return false;
+   }
+   for (chan = 0; chan < g->cnt; ++chan)
+   {
+      if (list[chan] < 1 || list[chan] > InputCnt * DAQ_CHANS)
+      {
+         fprintf(stderr, "Channel %d in %s is not in the range 1-%d\n", list[chan], name,
+                 InputCnt * DAQ_CHANS);
+         return false;
+      }
+      if (InGroup[list[chan] - 1])
+      {
+         fprintf(stderr, "Channel %d in %s is in another chanlist too\n", list[chan], name);
+         return false;
+      }
+      InGroup[list[chan] - 1] = true;
+      g->chans[chan] = list[chan] - 1;
+   }
+   return true;
+}
+
+
+/* Open an input.  With --listen, make the socket and wait for one
+   connection to it.
+*/
+static bool open_input(Input *in)
+{
+   struct sockaddr_un addr;
+   int    sock;
+
+   if (!Listen)
+   {
+      in->fd = strcmp(in->name, "-") == 0 ? STDIN_FILENO : open(in->name, O_RDONLY);
+      if (in->fd == -1)
+         fprintf(stderr, "Could not open %s, %s\n", in->name, strerror(errno));
+      return in->fd != -1;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(in->name) >= sizeof(addr.sun_path))
+   {
+      fprintf(stderr, "The socket name %s is too long\n", in->name);
+      return false;
+   }
+   strcpy(addr.sun_path, in->name);
+   unlink(in->name);
+   if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+       || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(sock, 1) != 0)
+   {
+      fprintf(stderr, "Could not make the socket %s, %s\n", in->name, strerror(errno));
+      if (sock != -1)
+         close(sock);
+      return false;
+   }
+   fprintf(stderr, "Waiting for the recorder to connect to %s\n", in->name);
+   while ((in->fd = accept(sock, NULL, NULL)) == -1 && errno == EINTR)
+      ;
+   if (in->fd == -1)
+      fprintf(stderr, "Could not take a connection on %s, %s\n", in->name, strerror(errno));
+   close(sock);
+   unlink(in->name);
+   return in->fd != -1;
+}
+
+
+/* Split the frames read in from one input into its chans of the work
+   window, as far as the window goes.  A bad stretch is skipped to the next
+   good frame and the frames it should have held are filled with zeros, the
+   same as daq2_split --salvage does, so the two halves stay lined up.
+*/
+static void take_frames(Input *in, int half, const DaqKernel *kernel)
+{
+   size_t pos = 0;
+
+   while (in->fill < Need)
+   {
+      int16_t *dest[DAQ_CHANS];
+      size_t   want, got;
+      int      chan;
+
+      if (in->pad)
+      {
+         for (chan = 0; chan < DAQ_CHANS; ++chan)
+            Work[half * DAQ_CHANS + chan][in->fill] = 0;
+         ++in->fill;
+         --in->pad;
+         continue;
+      }
+      if (!in->synced)
+      {
+         size_t skip = kernel->find_marker(in->buf + pos, in->len - pos);
+
+            // keep a last zero, it may be the first half of a marker
+         if (skip == in->len - pos && skip && in->buf[in->len - 1] == 0)
+            --skip;
+         pos += skip;
+         if (in->started)
+            in->skipped += skip;
+         if (pos == in->len || in->len - pos < 2)
+            break;
+         in->synced = true;
+         if (in->started && in->skipped)
+         {
+            in->pad = (in->skipped + DAQ_FRAME_WORDS / 2) / DAQ_FRAME_WORDS;
+            in->lost += in->pad;
+            in->skipped = 0;
+            continue;
+         }
+      }
+
+      want = (in->len - pos) / DAQ_FRAME_WORDS;
+      if ((size_t) (Need - in->fill) < want)
+         want = Need - in->fill;
+      if (want == 0)
+         break;
+      for (chan = 0; chan < DAQ_CHANS; ++chan)
+         dest[chan] = Work[half * DAQ_CHANS + chan] + in->fill;
+      got = kernel->split(in->buf + pos, want, dest, true);
+      in->fill += got;
+      pos += got * DAQ_FRAME_WORDS;
+      if (got)
+         in->started = true;
+      if (got < want)
+      {
+            // a bad frame, start looking for the next one past its first word
+         in->synced = false;
+         ++pos;
+         if (in->started)
+            ++in->skipped;
+      }
+   }
+   memmove(in->buf, in->buf + pos, (in->len - pos) * sizeof(*in->buf));
+   in->len -= pos;
+}
+
+
+/* Read what there is from the inputs that need more for the block.  With
+   --pace, read no more than has been recorded by now, counting from Begin.
+   Returns false when an input has ended or can't be read.
+*/
+static bool read_inputs(const DaqKernel *kernel, double begin)
+{
+   struct pollfd pfd[MAX_INPUTS];
+   int    which[MAX_INPUTS];
+   int    cnt = 0, k, wait = -1;
+   double when = now();
+
+   for (k = 0; k < InputCnt; ++k)
+   {
+      Input *in = &Inputs[k];
+      size_t room = IN_WORDS - in->len;
+
+      if (in->eof)
+         return false;
+      if (in->fill >= Need || room == 0)
+         continue;
+      if (Pace)
+      {
+         double allowed = (when - begin) * SAMP_RATE * DAQ_FRAME_WORDS - in->words;
+         double least = room < PACE_WORDS ? room : PACE_WORDS;
+         if (allowed < least)
+         {
+            int ms = ceil((least - allowed) * 1000.0 / (SAMP_RATE * DAQ_FRAME_WORDS));
+            if (wait == -1 || ms < wait)
+               wait = ms;
+            continue;
+         }
+      }
+      pfd[cnt].fd = in->fd;
+      pfd[cnt].events = POLLIN;
+      which[cnt++] = k;
+   }
+   if (cnt == 0 && wait == -1)
+      return true;
+   if (poll(pfd, cnt, cnt ? -1 : wait) < 0 && errno != EINTR)
+   {
+      fprintf(stderr, "Error waiting for input, %s\n", strerror(errno));
+      return false;
+   }
+
+   when = now();
+   for (k = 0; k < cnt; ++k)
+   {
+      Input *in = &Inputs[which[k]];
+      size_t  want = IN_WORDS - in->len;
+      ssize_t got;
+      char   *dest = (char *) in->buf + in->len * sizeof(*in->buf);
+
+      if (!(pfd[k].revents & (POLLIN | POLLHUP | POLLERR)))
+         continue;
+      if (Pace)
+      {
+         double allowed = (when - begin) * SAMP_RATE * DAQ_FRAME_WORDS - in->words;
+         if (allowed < want)
+            want = allowed;
+      }
+      got = read(in->fd, dest, want * sizeof(*in->buf));
+      if (got < 0 && errno != EINTR && errno != EAGAIN)
+      {
+         fprintf(stderr, "Error reading %s, %s\n", in->name, strerror(errno));
+         in->eof = true;
+      }
+      else if (got == 0)
+         in->eof = true;
+      else if (got > 0)
+      {
+            // a read can end in the middle of a word, finish it
+         while (got % sizeof(*in->buf))
+         {
+            ssize_t more = read(in->fd, dest + got, 1);
+            if (more <= 0)
+            {
+               in->eof = true;
+               got -= got % sizeof(*in->buf);
+               break;
+            }
+            got += more;
+         }
+         in->len += got / sizeof(*in->buf);
+         in->words += got / sizeof(*in->buf);
+      }
+      take_frames(in, which[k], kernel);
+   }
+   for (k = 0; k < InputCnt; ++k)
+      if (Inputs[k].eof)
+         return false;
+   return true;
+}
+
+
+   // the newest fit for a group, if the fit thread has one
+static void take_fit(Group *g)
+{
+   pthread_mutex_lock(&FitLock);
+   if (g->fresh)
+   {
+      CleanFit *old = g->cur;
+      g->cur = g->ready;
+      g->ready = old;
+      g->fresh = false;
+      g->fitted = true;
+   }
+   pthread_mutex_unlock(&FitLock);
+}
+
+
+/* Clean the block, positions Post to Post + cnt, of one group into OutBuf.
+   fill is how many positions there are, which is all of them except at the
+   end of the input.
+*/
+static void clean_block(Group *g, int cnt, int fill, int *flagged)
+{
+   const CleanFit *fit;
+   int    n = g->cnt;
+   int    nout = InputCnt * DAQ_CHANS;
+   int    i, j, p, first = *flagged;
+
+   take_fit(g);
+   fit = g->cur;
+   if (!g->fitted)
+   {
+      for (i = 0; i < n; ++i)
+         for (p = 0; p < cnt; ++p)
+            OutBuf[(size_t) p * nout + g->chans[i]] = Work[g->chans[i]][Post + p];
+      *flagged = fill;
+      return;
+   }
+
+   for (i = 0; i < n; ++i)
+   {
+      const short *src = Work[g->chans[i]];
+      double *x = g->x + (size_t) i * Len;
+      for (p = 0; p < fill; ++p)
+         x[p] = src[p];
+   }
+
+      // pass 0 on the positions that are new, to find the spikes
+   for (j = 0; j < n; ++j)
+   {
+      const double *x = g->x + (size_t) j * Len;
+      double *c = g->c + (size_t) j * Len;
+      double mean = fit->mean[0][j];
+      for (p = first; p < fill; ++p)
+         c[p] = x[p] - mean;
+   }
+   for (i = 0; i < n; ++i)
+   {
+      double *acc = g->acc;
+      unsigned char *flag = g->flag + (size_t) i * Len;
+      memcpy(acc + first, g->c + (size_t) i * Len + first, sizeof(double) * (fill - first));
+      for (j = 0; j < n; ++j)
+      {
+         const double *c = g->c + (size_t) j * Len;
+         double wt = fit->wts[0][j * n + i];
+         if (wt == 0)
+            continue;
+         for (p = first; p < fill; ++p)
+            acc[p] -= wt * c[p];
+      }
+      for (p = first; p < fill; ++p)
+         flag[p] = acc[p] < fit->lo[i] || acc[p] > fit->hi[i];
+   }
+   *flagged = fill;
+
+      // a point is replaced if there is a spike from Look after it back to
+      // Post before it
+   memset(g->any + Post, 0, cnt);
+   for (i = 0; i < n; ++i)
+   {
+      const unsigned char *flag = g->flag + (size_t) i * Len;
+      unsigned char *rep = g->rep + (size_t) i * Len;
+      int near = 0;
+
+      for (p = 0; p <= Post + Look && p < fill; ++p)
+         near += flag[p];
+      for (p = Post; p < Post + cnt; ++p)
+      {
+         rep[p] = near > 0;
+         g->any[p] |= rep[p];
+         near -= flag[p - Post];
+         if (p + Look + 1 < fill)
+            near += flag[p + Look + 1];
+      }
+   }
+
+      // replace them with the noise estimate from pass 1, then center the
+      // result for pass 2
+   for (i = 0; i < n; ++i)
+      memcpy(g->c + (size_t) i * Len + Post, g->x + (size_t) i * Len + Post, sizeof(double) * cnt);
+   for (p = Post; p < Post + cnt; ++p)
+   {
+      if (!g->any[p])
+         continue;
+      for (i = 0; i < n; ++i)
+      {
+         double y;
+         if (!g->rep[(size_t) i * Len + p])
+            continue;
+         y = fit->mean[1][i];
+         for (j = 0; j < n; ++j)
+         {
+            double z = g->rep[(size_t) j * Len + p] ? 0 : g->x[(size_t) j * Len + p];
+            y += fit->wts[1][j * n + i] * (z - fit->mean[1][j]);
+         }
+         g->c[(size_t) i * Len + p] = y;
+      }
+   }
+   for (i = 0; i < n; ++i)
+   {
+      double *c = g->c + (size_t) i * Len;
+      double mean = fit->mean[2][i];
+      for (p = Post; p < Post + cnt; ++p)
+         c[p] -= mean;
+   }
+
+      // pass 2
+   for (i = 0; i < n; ++i)
+   {
+      double *acc = g->acc;
+      memcpy(acc + Post, g->x + (size_t) i * Len + Post, sizeof(double) * cnt);
+      for (j = 0; j < n; ++j)
+      {
+         const double *c = g->c + (size_t) j * Len;
+         double wt = fit->wts[2][j * n + i];
+         if (wt == 0)
+            continue;
+         for (p = Post; p < Post + cnt; ++p)
+            acc[p] -= wt * c[p];
+      }
+      clean_to_short(acc + Post, cnt, g->row);
+      for (p = 0; p < cnt; ++p)
+         OutBuf[(size_t) p * nout + g->chans[i]] = g->row[p];
+   }
+}
+
+
+/* Hand the frames of the block to the fit thread.
+*/
+static void add_to_ring(int cnt)
+{
+   int chan, p;
+
+   pthread_mutex_lock(&FitLock);
+   for (p = 0; p < cnt; ++p)
+   {
+      size_t at = (RingTotal + p) % RingLen;
+      for (chan = 0; chan < InputCnt * DAQ_CHANS; ++chan)
+         if (InGroup[chan])
+            Ring[chan][at] = Work[chan][Post + p];
+   }
+   RingTotal += cnt;
+   pthread_cond_signal(&FitCond);
+   pthread_mutex_unlock(&FitLock);
+}
+
+
+/* Fit each group to the newest window of data, over and over, at the
+   lowest priority.
+*/
+static void *fit_thread(void *arg)
+{
+   short *snap[MAX_CHANS] = { NULL };
+   unsigned long long last = 0, total;
+   int    chan, g, i, t;
+
+   (void) arg;
+      // SCHED_IDLE runs only when the cpu would be idle, nice 19 still
+      // takes a slice now and then
+   struct sched_param sp = { .sched_priority = 0 };
+   if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp) != 0)
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+   for (chan = 0; chan < MAX_CHANS; ++chan)
+      if (InGroup[chan] && (snap[chan] = malloc(sizeof(short) * Window)) == NULL)
+      {
+         fprintf(stderr, "Out of memory, the data will not be cleaned\n");
+         goto done;
+      }
+
+   while (true)
+   {
+      pthread_mutex_lock(&FitLock);
+      while (!StopFit && (RingTotal < (unsigned long long) Window
+                          || RingTotal - last < (unsigned long long) Window / REFIT_PARTS))
+         pthread_cond_wait(&FitCond, &FitLock);
+      if (StopFit)
+      {
+         pthread_mutex_unlock(&FitLock);
+         break;
+      }
+      total = RingTotal;
+      pthread_mutex_unlock(&FitLock);
+
+         // oldest first
+      for (chan = 0; chan < MAX_CHANS; ++chan)
+         if (snap[chan])
+         {
+            size_t old = (total - Window) % RingLen;
+            size_t len = RingLen - old < (size_t) Window ? RingLen - old : (size_t) Window;
+            memcpy(snap[chan], Ring[chan] + old, sizeof(short) * len);
+            memcpy(snap[chan] + len, Ring[chan], sizeof(short) * (Window - len));
+         }
+      pthread_mutex_lock(&FitLock);
+         // too much came in while copying, the oldest were written over
+      if (RingTotal - total > (unsigned long long) (RingLen - Window))
+      {
+         pthread_mutex_unlock(&FitLock);
+         continue;
+      }
+      last = total;
+      pthread_mutex_unlock(&FitLock);
+
+      for (g = 0; g < GroupCnt && !StopFit; ++g)
+      {
+         Group *grp = &Groups[g];
+         for (i = 0; i < grp->cnt; ++i)
+            for (t = 0; t < Window; ++t)
+               grp->tdata[(size_t) i * Window + t] = snap[grp->chans[i]][t];
+         if (!clean_fit(&Params, grp->tdata, Window, grp->cnt, grp->next))
+            continue;
+         pthread_mutex_lock(&FitLock);
+         CleanFit *done = grp->next;
+         grp->next = grp->ready;
+         grp->ready = done;
+         grp->fresh = true;
+         ++Fits;
+         pthread_mutex_unlock(&FitLock);
+      }
+   }
+
+done:
+   for (chan = 0; chan < MAX_CHANS; ++chan)
+      free(snap[chan]);
+   return NULL;
+}
+
+
+static bool write_all(const short *buf, size_t cnt)
+{
+   const char *p = (const char *) buf;
+   size_t len = cnt * sizeof(short);
+
+   while (len)
+   {
+      ssize_t res = write(STDOUT_FILENO, p, len);
+      if (res < 0 && errno == EINTR)
+         continue;
+      if (res <= 0)
+      {
+         if (errno != EPIPE)
+            fprintf(stderr, "Error writing the cleaned frames, %s\n", strerror(errno));
+         return false;
+      }
+      p += res;
+      len -= res;
+   }
+   return true;
+}
+
+
+   // seconds of --latency the blocks are sized to
+static double latency_budget(void)
+{
+   return (LatencyMs * LATENCY_USE - LATENCY_SLACK_MS) / 1000.0;
+}
+
+   // the --latency that leaves secs
+static int latency_for(double secs)
+{
+   return (int) ceil((secs * 1000 + LATENCY_SLACK_MS) / LATENCY_USE);
+}
+
+
+static bool setup(void)
+{
+   int chan, g, k;
+   bool ok = true;
+
+   Look = Params.prepts + 1;
+   Post = Params.postpts;
+   BlockMax = (int) (latency_budget() * SAMP_RATE) - Look;
+   if (BlockMax < 1)
+   {
+      fprintf(stderr, "--latency must be at least %d ms to wait for the points after a spike\n",
+              latency_for((Look + 1.0) / SAMP_RATE));
+      return false;
+   }
+   Block = BlockMax;
+   Len = Need = Post + BlockMax + Look;
+   Window = WindowSecs * SAMP_RATE;
+   RingLen = Window + Window / REFIT_PARTS;
+
+   for (chan = 0; chan < InputCnt * DAQ_CHANS; ++chan)
+   {
+      ok = ok && (Work[chan] = calloc(Len, sizeof(short))) != NULL;
+      if (InGroup[chan])
+         ok = ok && (Ring[chan] = calloc(RingLen, sizeof(short))) != NULL;
+   }
+   ok = ok && (Arrive = calloc(Len, sizeof(double))) != NULL;
+   ok = ok && (OutBuf = malloc(sizeof(short) * BlockMax * InputCnt * DAQ_CHANS)) != NULL;
+   for (k = 0; k < InputCnt; ++k)
+   {
+      ok = ok && (Inputs[k].buf = malloc(IN_WORDS * sizeof(uint16_t))) != NULL;
+      Inputs[k].fill = Post;      // the positions before the start
+   }
+   for (g = 0; g < GroupCnt && ok; ++g)
+   {
+      Group *grp = &Groups[g];
+      size_t sz = (size_t) grp->cnt * Len;
+      for (k = 0; k < 3; ++k)
+         ok = ok && clean_fit_alloc(&grp->fits[k], grp->cnt);
+      grp->cur = &grp->fits[0];
+      grp->ready = &grp->fits[1];
+      grp->next = &grp->fits[2];
+      ok = ok && (grp->x = malloc(sizeof(double) * sz)) != NULL
+              && (grp->c = malloc(sizeof(double) * sz)) != NULL
+              && (grp->acc = malloc(sizeof(double) * Len)) != NULL
+              && (grp->flag = calloc(sz, 1)) != NULL
+              && (grp->rep = calloc(sz, 1)) != NULL
+              && (grp->any = calloc(Len, 1)) != NULL
+              && (grp->row = malloc(sizeof(short) * Len)) != NULL
+              && (grp->tdata = malloc(sizeof(double) * grp->cnt * Window)) != NULL;
+   }
+   if (!ok)
+      fprintf(stderr, "Out of memory\n");
+   return ok;
+}
+
+
+/* The biggest block that is written within the latency: the first frame
+   of a block waits for Block + Look frames to come in, for Reserve, and for
+   the block to be cleaned.  0 if not even one frame can be.
+*/
+static int block_for(void)
+{
+   double budget = latency_budget() - BlockCost - Reserve;
+   int    blk = (int) floor(budget / (1.0 / SAMP_RATE + FrameCost)) - Look;
+
+   if (blk < 0)
+      return 0;
+   return blk < BlockMax ? blk : BlockMax;
+}
+
+
+/* The quickest of CALIBRATE_RUNS cleanings of cnt frames, the others had
+   something else in the way, which is what Reserve is for.  Between blocks
+   the fit thread fills the caches with its own data, so they are emptied
+   before each one.
+*/
+static double time_clean(int cnt, char *evict)
+{
+   int    nout = InputCnt * DAQ_CHANS;
+   int    chan, g, p, run, flagged;
+   double best = 0;
+
+   for (run = 0; run < CALIBRATE_RUNS; ++run)
+   {
+      double start, secs;
+      if (evict)
+         memset(evict, run, EVICT_BYTES);
+      start = now();
+      for (chan = 0; chan < nout; ++chan)
+         if (!InGroup[chan])
+            for (p = 0; p < cnt; ++p)
+               OutBuf[(size_t) p * nout + chan] = Work[chan][Post + p];
+      for (g = 0; g < GroupCnt; ++g)
+      {
+         flagged = Post;
+         clean_block(&Groups[g], cnt, Post + cnt + Look, &flagged);
+      }
+      secs = now() - start;
+      if (run == 0 || secs < best)
+         best = secs;
+   }
+   return best;
+}
+
+
+/* Time cleaning a whole block and a small one of made up data with every
+   point replaced, so every pass does all of its work, and size the blocks
+   by it.  Returns false if --latency is too short for even one frame.
+*/
+static bool calibrate(void)
+{
+   int    g, i, k, small = BlockMax / 10 > 0 ? BlockMax / 10 : 1;
+   double full, part;
+
+   for (g = 0; g < GroupCnt; ++g)
+   {
+      Group *grp = &Groups[g];
+      CleanFit *fit = grp->cur;
+      int n = grp->cnt;
+      for (k = 0; k < CLEAN_PASSES; ++k)
+         for (i = 0; i < n; ++i)
+         {
+            int j;
+            fit->mean[k][i] = 0;
+            for (j = 0; j < n; ++j)
+               fit->wts[k][j * n + i] = 1e-3;
+         }
+         // 0 is past both
+      for (i = 0; i < n; ++i)
+      {
+         fit->lo[i] = 1;
+         fit->hi[i] = -1;
+      }
+      grp->fitted = true;
+   }
+   char *evict = malloc(EVICT_BYTES);
+   full = time_clean(BlockMax, evict);
+   part = time_clean(small, evict);
+   free(evict);
+   for (g = 0; g < GroupCnt; ++g)
+   {
+      Group *grp = &Groups[g];
+      grp->fitted = false;
+      memset(grp->flag, 0, (size_t) grp->cnt * Len);
+   }
+
+   if (BlockMax > small && full > part)
+   {
+      FrameCost = (full - part) / (BlockMax - small);
+      BlockCost = part - FrameCost * small;
+   }
+   else
+      FrameCost = full / BlockMax;
+   if (BlockCost < 0)
+      BlockCost = 0;
+   if (FrameCost >= 1.0 / SAMP_RATE)
+   {
+      fprintf(stderr, "Cleaning takes longer than recording on this machine, use fewer chans\n");
+      return false;
+   }
+      // smaller blocks would spend so long on each one that the cleaning
+      // falls behind
+   BlockMin = ceil(2 * BlockCost / (1.0 / SAMP_RATE - FrameCost));
+   if (BlockMin < 1)
+      BlockMin = 1;
+   Block = block_for();
+   Need = Post + Block + Look;
+   if (Block < BlockMin)
+   {
+      fprintf(stderr, "--latency must be at least %d ms to clean the frames in time on this machine\n",
+              latency_for((BlockMin + Look) * (1.0 / SAMP_RATE + FrameCost) + BlockCost));
+      return false;
+   }
+   return true;
+}
+
+
+static void cleanup(void)
+{
+   int chan, g, k;
+
+   for (chan = 0; chan < MAX_CHANS; ++chan)
+   {
+      free(Work[chan]);
+      free(Ring[chan]);
+   }
+   free(Arrive);
+   free(OutBuf);
+   for (k = 0; k < InputCnt; ++k)
+   {
+      free(Inputs[k].buf);
+      if (Inputs[k].fd > STDIN_FILENO)
+         close(Inputs[k].fd);
+   }
+   for (g = 0; g < GroupCnt; ++g)
+   {
+      Group *grp = &Groups[g];
+      for (k = 0; k < 3; ++k)
+         clean_fit_free(&grp->fits[k]);
+      free(grp->x);
+      free(grp->c);
+      free(grp->acc);
+      free(grp->flag);
+      free(grp->rep);
+      free(grp->any);
+      free(grp->row);
+      free(grp->tdata);
+   }
+}
+
+
+/* Read, clean, and write blocks until an input ends, then clean what is
+   left with as much of the look ahead as there is.
+*/
+static bool run(void)
+{
+   const DaqKernel *kernel = daq_kernel();
+   int    nout = InputCnt * DAQ_CHANS;
+   int    flagged[MAX_GROUPS];
+   int    complete = Post;          // positions in from all inputs
+   double begin = now(), worst = 0, total_wait = 0;
+   unsigned long long blocks = 0, over = 0, cleaned = 0;
+   int    first = Block, smallest = Block;
+   pthread_t tid;
+   bool   more = true, ok = true;
+   int    chan, g, k, p;
+
+   for (g = 0; g < GroupCnt; ++g)
+      flagged[g] = Post;
+   if (pthread_create(&tid, NULL, fit_thread, NULL) != 0)
+   {
+      fprintf(stderr, "Can't start the fit thread, %s\n", strerror(errno));
+      return false;
+   }
+
+   while (ok)
+   {
+      int fill = Len, valid = 0, cnt, used;
+      bool fitted = false;
+
+      for (k = 0; k < InputCnt; ++k)
+         if (Inputs[k].fill < fill)
+            fill = Inputs[k].fill;
+      if (fill < Need && more)
+      {
+         more = read_inputs(kernel, begin);
+         for (k = 0, fill = Len; k < InputCnt; ++k)
+            if (Inputs[k].fill < fill)
+               fill = Inputs[k].fill;
+      }
+      if (fill > complete)
+      {
+         double when = now();
+         for (p = complete; p < fill; ++p)
+            Arrive[p] = when;
+         complete = fill;
+      }
+      if (fill < Need && more)
+         continue;
+
+         // at the end, what is left, with as much look ahead as there is
+      cnt = fill - Post < Block ? fill - Post : Block;
+      if (cnt <= 0)
+         break;
+      used = fill < Post + cnt + Look ? fill : Post + cnt + Look;
+      for (chan = 0; chan < nout; ++chan)
+         if (!InGroup[chan])
+            for (p = 0; p < cnt; ++p)
+               OutBuf[(size_t) p * nout + chan] = Work[chan][Post + p];
+      for (g = 0; g < GroupCnt; ++g)
+      {
+         clean_block(&Groups[g], cnt, used, &flagged[g]);
+         fitted |= Groups[g].fitted;
+      }
+      ok = write_all(OutBuf, (size_t) cnt * nout);
+      add_to_ring(cnt);
+
+      double done = now(), wait = done - Arrive[Post];
+      if (wait > worst)
+         worst = wait;
+      total_wait += wait;
+      ++blocks;
+      if (wait * 1000 > LatencyMs)
+         ++over;
+      if (fitted)
+         cleaned += cnt;
+         // a frame that waited longer than the block was sized for, from
+         // late reads, something else having the cpu, or slow cleaning,
+         // means keeping that much more back for a while
+      double extra = wait - (double) (cnt + Look) / SAMP_RATE - (BlockCost + FrameCost * cnt);
+      Reserve *= RESERVE_DECAY;
+      if (more && extra > Reserve)
+         Reserve = extra;
+      if ((Block = block_for()) < BlockMin)
+         Block = BlockMin;
+      Need = Post + Block + Look;
+      if (Block < smallest)
+         smallest = Block;
+      Start += cnt;
+
+         // slide the window along, as far as it is filled
+      for (k = 0; k < InputCnt; ++k)
+         if (Inputs[k].fill > valid)
+            valid = Inputs[k].fill;
+      for (chan = 0; chan < nout; ++chan)
+         memmove(Work[chan], Work[chan] + cnt, sizeof(short) * (valid - cnt));
+      memmove(Arrive, Arrive + cnt, sizeof(double) * (valid - cnt));
+      for (g = 0; g < GroupCnt; ++g)
+      {
+         Group *grp = &Groups[g];
+         for (k = 0; k < grp->cnt; ++k)
+            memmove(grp->flag + (size_t) k * Len, grp->flag + (size_t) k * Len + cnt,
+                    flagged[g] - cnt);
+         flagged[g] -= cnt;
+      }
+      for (k = 0; k < InputCnt; ++k)
+      {
+         Inputs[k].fill -= cnt;
+         take_frames(&Inputs[k], k, kernel);
+      }
+      complete -= cnt;
+   }
+
+   double secs = now() - begin;
+
+      // a fit under way is finished first
+   pthread_mutex_lock(&FitLock);
+   StopFit = true;
+   pthread_cond_signal(&FitCond);
+   pthread_mutex_unlock(&FitLock);
+   pthread_join(tid, NULL);
+
+   unsigned long long lost = 0;
+   for (k = 0; k < InputCnt; ++k)
+      lost += Inputs[k].lost;
+   fprintf(stderr, "%llu frames, %.1f seconds of data in %.1f seconds", Start,
+           (double) Start / SAMP_RATE, secs);
+      // frames passed through say nothing about how fast the cleaning is
+   if (cleaned == Start && secs > 0)
+      fprintf(stderr, ", %.1f times real time\n", Start / (SAMP_RATE * secs));
+   else if (cleaned)
+      fprintf(stderr, "\n%llu frames were passed through uncleaned before the first fit\n",
+              Start - cleaned);
+   else
+      fprintf(stderr, "\nNo frames were cleaned, there was no fit, they were all passed through\n");
+   fprintf(stderr, "latency: most %.1f ms, mean %.1f ms, limit %d ms", worst * 1000,
+           blocks ? total_wait * 1000 / blocks : 0, LatencyMs);
+   if (over)
+      fprintf(stderr, ", %llu of %llu blocks over", over, blocks);
+   fprintf(stderr, "\nblocks of %d frames, %d at the smallest, %.1f us to clean a frame\n", first,
+           smallest, FrameCost * 1e6);
+   fprintf(stderr, "%d fits of %d groups", Fits, GroupCnt);
+   if (lost)
+      fprintf(stderr, ", %llu frames lost to bad data and filled with zeros", lost);
+   fprintf(stderr, "\n");
+   return ok;
+}
+
+
+int main (int argc, char **argv)
+{
+   int k;
+   bool ok;
+
+   if (!parse_args(argc, argv))
+      exit(1);
+
+   if (Debug)
+   {
+      fprintf(stderr, "attach debugger, then press ENTER");
+      getchar();
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+   clean_default_params(&Params);
+   for ( ; optind < argc && GroupCnt < MAX_GROUPS; ++optind)
+      if (!read_chanlist(&Groups[GroupCnt++], argv[optind]))
+         exit(1);
+   if (optind < argc)
+   {
+      fprintf(stderr, "At most %d chanlist files can be given\n", MAX_GROUPS);
+      exit(1);
+   }
+   if (!setup() || !calibrate())
+      exit(1);
+   for (k = 0; k < InputCnt; ++k)
+      if (!open_input(&Inputs[k]))
+         exit(1);
+
+   ok = run();
+   cleanup();
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,587 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Split, clean, and make a .bin file in one pass over the .daq files.
+
+   This does what split_all.sh, clean_rec.sh, and chans_to_bin do, but the
+   raw data is never written to disk and read back.  Both halves of the
+   recording are memory mapped and taken one ptspercut piece at a time.
+   Each piece is split into channels, each chanlist group is cleaned in its
+   own thread, the nocleanlist chans are passed through, and the results
+   are appended to:
+
+      clean.REC/YYYY-MM-DD_REC_CH.chan           unless --no_chan
+      clean.REC/YYYY-MM-DD_REC_spike2_128.bin    with --bin
+      split.REC/YYYY-MM-DD_REC_r_CH.chan         with --raw
+
+   The cleaned files are the same as daq2_clean makes from the split files.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <error.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include "clean_data.h"
+#include "daq_kernel.h"
+#include "daq_map.h"
+
+#define MAX_CHANS (DAQ_CHANS * 2)
+#define MAX_LIST 256
+#define MAX_GROUPS 10            // chanlist_REC_1 to chanlist_REC_10, as in clean_rec.sh
+
+typedef struct
+{
+   char     name[PATH_MAX];     // chanlist file
+   int      list[MAX_LIST];     // chans, then the two noise chans
+   int      cnt;                // chans to clean, not counting the noise chans
+   FILE    *out_fd[MAX_LIST];
+   double  *tdata;
+   double  *cleaned;
+   short   *outbuf[MAX_LIST];
+   bool     ok;
+   pthread_t tid;
+   bool     started;
+} Group;
+
+bool Raw = false;
+bool Chan = true;
+bool Bin = false;
+bool Debug = false;
+
+Group Groups[MAX_GROUPS];
+int   GroupCnt;
+bool  NoClean[MAX_CHANS];       // from the nocleanlist file
+int   Count;                    // samples in the current piece
+short *Split[MAX_CHANS];        // the current piece, one buffer per chan
+short *Done[MAX_CHANS];         // and what goes in the clean dir for each chan
+
+static void usage(char *name)
+{
+   printf (
+"\nUsage: %s [--raw] [--no_chan] [--bin] REC...\n"\
+"\n"\
+"Split, clean, and optionally make a spike2 .bin file for one or more\n"\
+"recordings, reading each .daq file only once.  This does the same thing as\n"\
+"split_all.sh, clean_rec.sh, and chans_to_bin, without writing the raw chan\n"\
+"files and reading them back.\n"\
+"\n"\
+"This must be run from the YYYY-MM-DD dir with the .daq files and the\n"\
+"chanlist_REC_N and nocleanlist_REC files for each REC, e.g. 001 002.\n"\
+"\n"\
+"OPTIONS\n"\
+"--raw      also write the raw chan files to split.REC/.\n"\
+"--no_chan  do not write the cleaned chan files to clean.REC/.\n"\
+"--bin      write clean.REC/YYYY-MM-DD_REC_spike2_128.bin, with all 128\n"\
+"           chans.  Chans that are not in a chanlist or the nocleanlist\n"\
+"           are zeros.\n",
+name
+);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+   static struct option opts[] = { {"raw", no_argument, NULL, '1'},
+                                   {"no_chan", no_argument, NULL, '2'},
+                                   {"bin", no_argument, NULL, '3'},
+                                   {"d", no_argument, NULL, '4'},
+                                   { 0,0,0,0} };
+   int cmd;
+   int ret = 1;
+   opterr = 0;
+
+   while ((cmd = getopt_long_only(argc, argv, "", opts, NULL )) != -1)
+   {
+      switch (cmd)
+      {
+         case '1':
+               Raw = true;
+               break;
+
+         case '2':
+               Chan = false;
+               break;
+
+         case '3':
+               Bin = true;
+               break;
+
+         case '4':
+               Debug = true;
+               break;
+
+         case '?':
+         default:
+            printf("Unknown argument, aborting. . .\n");
+            ret = 0;
+           break;
+      }
+   }
+
+   if (optind == argc)
+      ret = 0;
+   else if (!Raw && !Chan && !Bin)
+   {
+      printf("--no_chan with nothing else leaves nothing to do\n");
+      ret = 0;
+   }
+
+   if (!ret)
+      usage(argv[0]);
+
+   return ret;
+}
+
+
+static bool make_dir(const char *dirname)
+{
+   struct stat info;
+
+      // another program may be making it at the same time, so make, then test
+   mode_t old_mask = umask(0);
+   mkdir(dirname, S_IRWXU|S_IRWXG|S_IRWXO);
+   umask(old_mask);
+   if (stat(dirname, &info) != 0 || !S_ISDIR(info.st_mode))
+   {
+      printf("Create directory %s failed, %s\n", dirname, strerror(errno));
+      return false;
+   }
+   return true;
+}
+
+
+/* Read the chanlist and nocleanlist files for a recording.  Missing or
+   empty chanlist files are skipped, the same as clean_rec.sh does.
+*/
+static bool read_lists(const char *rec)
+{
+   char  name[PATH_MAX];
+   FILE *fd;
+   int   num, cnt, chan, g, other, k;
+
+   GroupCnt = 0;
+   for (num = 1; num <= MAX_GROUPS; ++num)
+   {
+      Group *grp = &Groups[GroupCnt];
+
+      snprintf(name, sizeof(name), "chanlist_%s_%d", rec, num);
+      if ((fd = fopen(name, "r")) == NULL)
+         continue;
+      memset(grp, 0, sizeof(*grp));
+      strcpy(grp->name, name);
+      cnt = 0;
+      while (cnt < MAX_LIST && fscanf(fd, "%d", &grp->list[cnt]) == 1)
+         ++cnt;
+      fclose(fd);
+      if (cnt == 0)
+         continue;
+
+      grp->cnt = cnt - CLEAN_EXTRA_CHANS;
+      if (grp->cnt < 3)
+      {
+         printf("The chanlist file %s must have at least 3 channels plus the 2 noise channels\n",
+                name);
+         return false;
+      }
+      for (chan = 0; chan < grp->cnt; ++chan)
+         if (grp->list[chan] < 1 || grp->list[chan] > MAX_CHANS)
+         {
+            printf("Channel %d in %s is not in the range 1-%d\n", grp->list[chan], name, MAX_CHANS);
+            return false;
+         }
+      ++GroupCnt;
+   }
+
+      // every output file has to have just one writer
+   for (g = 0; g < GroupCnt; ++g)
+      for (chan = 0; chan < Groups[g].cnt + CLEAN_EXTRA_CHANS; ++chan)
+         for (other = 0; other <= g; ++other)
+            for (k = 0; k < (other == g ? chan : Groups[other].cnt + CLEAN_EXTRA_CHANS); ++k)
+               if (Groups[other].list[k] == Groups[g].list[chan])
+               {
+                  printf("Channel %d is in both %s and %s\n", Groups[g].list[chan],
+                         Groups[other].name, Groups[g].name);
+                  return false;
+               }
+
+   memset(NoClean, false, sizeof(NoClean));
+   snprintf(name, sizeof(name), "nocleanlist_%s", rec);
+   if ((fd = fopen(name, "r")) != NULL)
+   {
+      while (fscanf(fd, "%d", &chan) == 1)
+         if (chan >= 1 && chan <= MAX_CHANS)
+            NoClean[chan-1] = true;
+      fclose(fd);
+   }
+   for (g = 0; g < GroupCnt; ++g)    // cleaning wins
+      for (chan = 0; chan < Groups[g].cnt; ++chan)
+         NoClean[Groups[g].list[chan] - 1] = false;
+
+   if (GroupCnt == 0)
+      printf("There are no chanlist_%s_N files, nothing will be cleaned\n", rec);
+   return true;
+}
+
+
+/* Clean the current piece for one group and append it to its files.
+   The cleaned chans are also left in Done for the .bin file.
+*/
+static void *clean_piece(void *arg)
+{
+   Group *grp = arg;
+   CleanParams params;
+   int    outcnt = grp->cnt + CLEAN_EXTRA_CHANS;
+   int    chan, t;
+
+   clean_default_params(&params);
+   for (chan = 0; chan < grp->cnt; ++chan)
+   {
+      const short *src = Split[grp->list[chan] - 1];
+      for (t = 0; t < Count; ++t)
+         grp->tdata[(size_t)chan*Count + t] = src[t];
+   }
+   if (!clean_data(&params, grp->tdata, Count, grp->cnt, grp->cleaned))
+   {
+      printf("Cleaning %s failed, out of memory?\n", grp->name);
+      grp->ok = false;
+      return NULL;
+   }
+   for (chan = 0; chan < outcnt; ++chan)
+   {
+      clean_to_short(grp->cleaned + (size_t)chan*Count, Count, grp->outbuf[chan]);
+      if (grp->out_fd[chan]
+          && fwrite(grp->outbuf[chan], sizeof(short), Count, grp->out_fd[chan]) != (size_t)Count)
+      {
+         printf("Error writing to output chan %d, %s\n", grp->list[chan], strerror(errno));
+         grp->ok = false;
+         return NULL;
+      }
+   }
+   return NULL;
+}
+
+
+/* What we are here for.  Do one recording from both .daq files to the
+   clean dir.
+*/
+static bool do_recording(const char *rec)
+{
+   char   cwd[PATH_MAX], filename[PATH_MAX + 64];
+   char   srcdir[32], destdir[32];
+   const char *day;
+   int    yr, mon, day_num, recno;
+   DaqMap daq[2];
+   const DaqKernel *kernel = daq_kernel();
+   FILE  *raw_fd[MAX_CHANS] = {NULL};
+   FILE  *chan_fd[MAX_CHANS] = {NULL};
+   FILE  *bin_fd = NULL;
+   short *binbuf = NULL;
+   int    m = CLEAN_PTS_PER_CUT;
+   size_t frames, frame;
+   bool   have[MAX_CHANS];
+   bool   ret = false;
+   int    half, chan, g, k, t;
+
+   memset(daq, 0, sizeof(daq));
+   daq[0].fd = daq[1].fd = -1;
+   memset(Split, 0, sizeof(Split));
+   memset(Done, 0, sizeof(Done));
+
+   if (!getcwd(cwd, sizeof(cwd)))
+   {
+      printf("Can't get the current directory, %s\n", strerror(errno));
+      return false;
+   }
+   day = strrchr(cwd, '/') ? strrchr(cwd, '/') + 1 : cwd;
+   if (sscanf(day, "%d-%d-%d", &yr, &mon, &day_num) != 3 || sscanf(rec, "%d", &recno) != 1)
+   {
+      printf("This must be run from a YYYY-MM-DD dir with a recording number like 001\n");
+      return false;
+   }
+   if (!read_lists(rec))
+      return false;
+
+   for (half = 0; half < 2; ++half)
+   {
+      snprintf(filename, sizeof(filename), "%s_%s_%s.daq", day, rec, half ? "65-128" : "1-64");
+      if (access(filename, F_OK) != 0)
+      {
+         printf("%s does not exist\n", filename);
+         continue;
+      }
+      if (!daq_map_open(&daq[half], filename))
+         goto error;
+   }
+   if (!daq[0].words && !daq[1].words)
+   {
+      printf("Nothing to do for recording %s\n", rec);
+      goto error;
+   }
+   frames = daq[0].words ? daq[0].frames : daq[1].frames;
+   for (half = 0; half < 2; ++half)
+      if (daq[half].words && daq[half].frames < frames)   // really should be the same size
+         frames = daq[half].frames;
+
+   for (chan = 0; chan < MAX_CHANS; ++chan)
+      have[chan] = daq[chan / DAQ_CHANS].words != NULL;
+   for (g = 0; g < GroupCnt; ++g)
+      for (chan = 0; chan < Groups[g].cnt; ++chan)
+         if (!have[Groups[g].list[chan] - 1])
+         {
+            printf("Channel %d in %s is in a .daq file that does not exist\n",
+                   Groups[g].list[chan], Groups[g].name);
+            goto error;
+         }
+
+   snprintf(srcdir, sizeof(srcdir), "split.%03d", recno);
+   snprintf(destdir, sizeof(destdir), "clean.%03d", recno);
+   if ((Raw && !make_dir(srcdir)) || ((Chan || Bin) && !make_dir(destdir)))
+      goto error;
+
+   for (chan = 0; chan < MAX_CHANS; ++chan)
+   {
+      if (!have[chan])
+         continue;
+      if ((Split[chan] = malloc(sizeof(short) * m)) == NULL)
+      {
+         printf("Out of memory\n");
+         goto error;
+      }
+      if (NoClean[chan])
+         Done[chan] = Split[chan];
+      if (Raw)
+      {
+         snprintf(filename, sizeof(filename), "%s/%04d-%02d-%02d_%03d_r_%02d.chan",
+                  srcdir, yr, mon, day_num, recno, chan + 1);
+         if ((raw_fd[chan] = fopen(filename, "w")) == NULL)
+         {
+            printf("can't open %s: %s\n", filename, strerror(errno));
+            goto error;
+         }
+      }
+      if (Chan && NoClean[chan])
+      {
+         snprintf(filename, sizeof(filename), "%s/%04d-%02d-%02d_%03d_%02d.chan",
+                  destdir, yr, mon, day_num, recno, chan + 1);
+         if ((chan_fd[chan] = fopen(filename, "w")) == NULL)
+         {
+            printf("can't open %s: %s\n", filename, strerror(errno));
+            goto error;
+         }
+      }
+   }
+
+   for (g = 0; g < GroupCnt; ++g)
+   {
+      Group *grp = &Groups[g];
+      int    outcnt = grp->cnt + CLEAN_EXTRA_CHANS;
+
+      grp->tdata = malloc(sizeof(double) * m * grp->cnt);
+      grp->cleaned = malloc(sizeof(double) * m * outcnt);
+      if (!grp->tdata || !grp->cleaned)
+      {
+         printf("Out of memory\n");
+         goto error;
+      }
+      for (chan = 0; chan < outcnt; ++chan)
+      {
+         if ((grp->outbuf[chan] = malloc(sizeof(short) * m)) == NULL)
+         {
+            printf("Out of memory\n");
+            goto error;
+         }
+         if (chan < grp->cnt)
+            Done[grp->list[chan] - 1] = grp->outbuf[chan];
+         if (Chan)
+         {
+            snprintf(filename, sizeof(filename), "%s/%04d-%02d-%02d_%03d_%02d.chan",
+                     destdir, yr, mon, day_num, recno, grp->list[chan]);
+            if ((grp->out_fd[chan] = fopen(filename, "w")) == NULL)
+            {
+               printf("can't open %s: %s\n", filename, strerror(errno));
+               goto error;
+            }
+         }
+      }
+   }
+
+   if (Bin)
+   {
+      snprintf(filename, sizeof(filename), "%s/%04d-%02d-%02d_%03d_spike2_%d.bin",
+               destdir, yr, mon, day_num, recno, MAX_CHANS);
+      if ((bin_fd = fopen(filename, "w")) == NULL)
+      {
+         printf("can't open %s: %s\n", filename, strerror(errno));
+         goto error;
+      }
+      if ((binbuf = malloc(sizeof(short) * m * MAX_CHANS)) == NULL)
+      {
+         printf("Out of memory\n");
+         goto error;
+      }
+   }
+
+   printf("Processing recording %s, %zu frames, %d chanlist groups\n", rec, frames, GroupCnt);
+
+   for (frame = 0; frame < frames; frame += Count)
+   {
+      Count = frames - frame < (size_t)m ? frames - frame : (size_t)m;
+
+      for (half = 0; half < 2; ++half)
+      {
+         if (!daq[half].words)
+            continue;
+         if (frame + Count < frames)
+            daq_map_willneed(&daq[half], frame + Count, m);
+         size_t got = kernel->split(daq_map_frame(&daq[half], frame), Count,
+                                    (int16_t *const *)Split + half * DAQ_CHANS, true);
+         if (got < (size_t)Count)
+         {
+            printf("\nBad frame %zu in the %s file, use daq2_split --salvage on it\n",
+                   frame + got, half ? "65-128" : "1-64");
+            goto error;
+         }
+      }
+
+      for (chan = 0; chan < MAX_CHANS; ++chan)
+      {
+         if (raw_fd[chan] && fwrite(Split[chan], sizeof(short), Count, raw_fd[chan]) != (size_t)Count)
+         {
+            printf("Error writing to raw chan %d, %s\n", chan + 1, strerror(errno));
+            goto error;
+         }
+         if (chan_fd[chan] && fwrite(Split[chan], sizeof(short), Count, chan_fd[chan]) != (size_t)Count)
+         {
+            printf("Error writing to output chan %d, %s\n", chan + 1, strerror(errno));
+            goto error;
+         }
+      }
+
+         // the groups don't share any output, so they can all go at once
+      for (g = 0; g < GroupCnt; ++g)
+      {
+         Groups[g].ok = true;
+         Groups[g].started = pthread_create(&Groups[g].tid, NULL, clean_piece, &Groups[g]) == 0;
+         if (!Groups[g].started)
+            clean_piece(&Groups[g]);
+      }
+      for (g = 0; g < GroupCnt; ++g)
+         if (Groups[g].started)
+            pthread_join(Groups[g].tid, NULL);
+      for (g = 0; g < GroupCnt; ++g)
+         if (!Groups[g].ok)
+            goto error;
+
+      if (bin_fd)
+      {
+         for (t = 0; t < Count; ++t)
+            for (k = 0; k < MAX_CHANS; ++k)
+               binbuf[(size_t)t * MAX_CHANS + k] = Done[k] ? Done[k][t] : 0;
+         if (fwrite(binbuf, sizeof(short) * MAX_CHANS, Count, bin_fd) != (size_t)Count)
+         {
+            printf("Error writing to the .bin file, %s\n", strerror(errno));
+            goto error;
+         }
+      }
+
+      printf("\r  %3.0f%%", ((frame + Count) * 100.0) / frames);
+      fflush(stdout);
+   }
+   printf("\r  100%%   \n");
+   ret = true;
+
+error:
+   for (chan = 0; chan < MAX_CHANS; ++chan)
+   {
+      if (raw_fd[chan] && fclose(raw_fd[chan]) != 0)
+      {
+         printf("Error closing raw chan %d, %s\n", chan + 1, strerror(errno));
+         ret = false;
+      }
+      if (chan_fd[chan] && fclose(chan_fd[chan]) != 0)
+      {
+         printf("Error closing output chan %d, %s\n", chan + 1, strerror(errno));
+         ret = false;
+      }
+      free(Split[chan]);
+   }
+   for (g = 0; g < GroupCnt; ++g)
+   {
+      Group *grp = &Groups[g];
+      for (chan = 0; chan < MAX_LIST; ++chan)
+      {
+         if (grp->out_fd[chan] && fclose(grp->out_fd[chan]) != 0)
+         {
+            printf("Error closing output chan %d, %s\n", grp->list[chan], strerror(errno));
+            ret = false;
+         }
+         free(grp->outbuf[chan]);
+      }
+      free(grp->tdata);
+      free(grp->cleaned);
+      memset(grp, 0, sizeof(*grp));
+   }
+   if (bin_fd && fclose(bin_fd) != 0)
+   {
+      printf("Error closing the .bin file, %s\n", strerror(errno));
+      ret = false;
+   }
+   free(binbuf);
+   daq_map_close(&daq[0]);
+   daq_map_close(&daq[1]);
+   return ret;
+}
+
+
+int main (int argc, char **argv)
+{
+   int failed = 0;
+
+   if (!parse_args(argc, argv))
+      exit(3);
+
+   if (Debug)
+   {
+      printf("attach debugger, then press ENTER");
+      getchar();
+   }
+
+   for ( ; optind < argc; ++optind)
+      if (!do_recording(argv[optind]))
+      {
+         printf("Recording %s FAILED\n", argv[optind]);
+         ++failed;
+      }
+
+   return failed ? 2 : 0;
+}
@@ -0,0 +1,438 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Find the threshold crossings in each chan of a recording and write their
+   times to a file per chan, so spike sorting can start from them instead
+   of going over every sample again.  See spike_detect.h.
+
+      clean.001/  ->  clean.001/2012-02-21_001_45.spk  for chan 45, etc.
+
+   The recording is read with rec_reader, so it can be a dir of chan files,
+   the .daq files themselves, or a .bin file.  It is read a second at a
+   time, and with -xsd the thresholds of each chan are worked out from
+   that second, the same as the cleaner does with its ptspercut pieces.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "rec_reader.h"
+#include "spike_detect.h"
+
+#define SAMP_RATE 25000            // samples per second
+#define GDF_EXT ".gdf"
+#define DUMP_SPIKES 4096           // -dump, spike times read at a time
+
+bool Debug = false;
+bool Gdf = false;
+bool Dump = false;
+int  BinChans = 0;
+double RefractoryMs = 1.0;
+const char *OutDir = NULL;
+CleanParams Params;
+bool SelList[REC_MAX_CHANS];
+
+static void usage(char *name)
+{
+   printf (
+"\nUsage: %s [-xsd SDS | -high HIGH -low LOW] [-refractory MS] [-gdf]\n"\
+"          [-out DIR] [-bin CHANS] RECORDING [CHAN]...\n"\
+"       %s -dump SPKFILE...\n"\
+"\n"\
+"Find the spikes in each chan of RECORDING, and write their times to a\n"\
+"file for each chan, e.g. 2012-02-21_001_45.spk for chan 45.\n"\
+"\n"\
+"RECORDING is a split.REC or clean.REC dir, the YYYY-MM-DD_REC name of the\n"\
+"1-64 and 65-128 .daq files, or a .bin file.  The files go in the dir, or\n"\
+"in the current dir for .daq and .bin files, or in DIR with -out.  Give\n"\
+"the CHAN numbers to look at only those chans.\n"\
+"\n"\
+"A spike is where a sample goes past the thresholds, as long as it is at\n"\
+"least MS ms (default 1) after the spike before it.  The thresholds are\n"\
+"SDS standard deviations above and below 0, worked out for each second of\n"\
+"each chan, the same as the cleaner uses (default %g), or with -high and\n"\
+"-low, fixed values.\n"\
+"\n"\
+"A .spk file has a header and the sample number of each spike, from 0 at\n"\
+"the start of the recording, see spike_detect.h.  -gdf writes a .gdf text\n"\
+"file instead, a line for each spike with the chan number in the first 5\n"\
+"columns and the sample number in the next 10.\n"\
+"\n"\
+"-bin gives the number of chans in a .bin file, if it is not in its name.\n"\
+"\n"\
+"-dump prints the spikes in .spk files in the .gdf format.\n",
+name, name, Params.xsd
+);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+   static struct option opts[] = { {"xsd", required_argument, NULL, '1'},
+                                   {"high", required_argument, NULL, '2'},
+                                   {"low", required_argument, NULL, '3'},
+                                   {"refractory", required_argument, NULL, '4'},
+                                   {"gdf", no_argument, NULL, '5'},
+                                   {"out", required_argument, NULL, '6'},
+                                   {"bin", required_argument, NULL, '7'},
+                                   {"d", no_argument, NULL, '8'},
+                                   {"dump", no_argument, NULL, '9'},
+                                   { 0,0,0,0} };
+   int cmd;
+   int ret = 1;
+   bool high = false, low = false;
+   opterr = 0;
+
+   while ((cmd = getopt_long_only(argc, argv, "", opts, NULL )) != -1)
+   {
+      switch (cmd)
+      {
+         case '1':
+               if ((Params.xsd = atof(optarg)) <= 0)
+               {
+                  printf("-xsd needs a number greater than 0, aborting. . .\n");
+                  ret = 0;
+               }
+               break;
+
+         case '2':
+               Params.highthresh = atof(optarg);
+               Params.use_sd = false;
+               high = true;
+               break;
+
+         case '3':
+               Params.lowthresh = atof(optarg);
+               Params.use_sd = false;
+               low = true;
+               break;
+
+         case '4':
+               if ((RefractoryMs = atof(optarg)) < 0)
+               {
+                  printf("-refractory can't be less than 0, aborting. . .\n");
+                  ret = 0;
+               }
+               break;
+
+         case '5':
+               Gdf = true;
+               break;
+
+         case '6':
+               OutDir = optarg;
+               break;
+
+         case '7':
+               if ((BinChans = atoi(optarg)) < 1 || BinChans > REC_MAX_CHANS)
+               {
+                  printf("-bin needs a number of chans from 1 to %d, aborting. . .\n", REC_MAX_CHANS);
+                  ret = 0;
+               }
+               break;
+
+         case '8':
+               Debug = true;
+               break;
+
+         case '9':
+               Dump = true;
+               break;
+
+         case '?':
+         default:
+            printf("Unknown argument, aborting. . .\n");
+            ret = 0;
+           break;
+      }
+   }
+
+   if (high != low)
+   {
+      printf("-high and -low go together, aborting. . .\n");
+      ret = 0;
+   }
+   else if (high && Params.lowthresh >= Params.highthresh)
+   {
+      printf("-low has to be below -high, aborting. . .\n");
+      ret = 0;
+   }
+
+   if (optind >= argc)
+      ret = 0;
+
+   if (!ret)
+      usage(argv[0]);
+
+   return ret;
+}
+
+
+/* The YYYY-MM-DD_REC part of the recording's name, from the chan files in
+   it for a dir.
+*/
+static bool rec_basename(const char *path, bool dir, char *basename)
+{
+   const char *name = strrchr(path, '/');
+   bool raw;
+   int  yr, mon, day, recno;
+
+   if (dir)
+      return rec_find_chans(path, basename, &raw);
+   name = name ? name + 1 : path;
+   if (sscanf(name, "%d-%d-%d_%d", &yr, &mon, &day, &recno) != 4)
+      return false;
+   sprintf(basename, "%04d-%02d-%02d_%03d", yr, mon, day, recno);
+   return true;
+}
+
+
+typedef struct
+{
+   int           chan;
+   SpikeDetector det;
+   SpikeFile    *spk;
+   FILE         *gdf;
+   int           lo, hi;       // thresholds
+   uint64_t      count;
+} Chan;
+
+
+   // a .gdf line, the chan in 5 columns and the sample number in 10
+static bool put_gdf(FILE *fd, int chan, uint64_t time)
+{
+   return fprintf(fd, "%5d%10llu\n", chan, (unsigned long long) time) >= 0;
+}
+
+
+static bool put_spikes(Chan *ch, const uint64_t *times, size_t n)
+{
+   size_t k;
+
+   ch->count += n;
+   if (!Gdf)
+      return spike_file_put(ch->spk, times, n);
+   for (k = 0; k < n; ++k)
+      if (!put_gdf(ch->gdf, ch->chan, times[k]))
+         return false;
+   return true;
+}
+
+
+/* -dump.  Print the spikes in each of the .spk files in names.
+*/
+static bool dump_spikes(char **names, int cnt)
+{
+   uint32_t   times[DUMP_SPIKES];
+   SpikeFile *sf;
+   uint64_t   at;
+   size_t     got, k;
+   int        i;
+   bool       ok = true;
+
+   for (i = 0; i < cnt; ++i)
+   {
+      if ((sf = spike_file_open(names[i])) == NULL)
+      {
+         ok = false;
+         continue;
+      }
+      for (at = 0; (got = spike_file_read(sf, at, DUMP_SPIKES, times)) > 0; at += got)
+         for (k = 0; k < got; ++k)
+            ok = put_gdf(stdout, sf->hdr.chan, times[k]) && ok;
+      if (at < sf->hdr.count)
+      {
+         printf("%s is cut short\n", names[i]);
+         ok = false;
+      }
+      spike_file_close(sf, 0);
+   }
+   return ok;
+}
+
+
+static bool find_spikes(RecReader *rec, Chan *chans, int nchans, const char *dir,
+                        const char *basename)
+{
+   short    *samps = malloc(sizeof(*samps) * SAMP_RATE);
+   uint64_t *times = malloc(sizeof(*times) * SAMP_RATE);
+   uint64_t  samples = rec_samples(rec), done = 0, total = 0;
+   int       refractory = RefractoryMs * SAMP_RATE / 1000 + 0.5;
+   int       i;
+   size_t    got;
+   char      name[PATH_MAX + 64];
+   bool      ok = true;
+
+   if (!samps || !times)
+   {
+      printf("Out of memory, aborting. . .\n");
+      ok = false;
+      goto done;
+   }
+   for (i = 0; i < nchans; ++i)
+   {
+      Chan *ch = &chans[i];
+      spike_detect_init(&ch->det, refractory);
+      snprintf(name, sizeof(name), "%s/%s_%02d%s", dir, basename, ch->chan, Gdf ? GDF_EXT : SPK_EXT);
+      if (Gdf)
+      {
+         if ((ch->gdf = fopen(name, "w")) == NULL)
+            printf("Error opening %s, aborting. . .\n", name);
+      }
+      else
+         ch->spk = spike_file_create(name, ch->chan, SAMP_RATE, refractory);
+      if (!ch->gdf && !ch->spk)
+      {
+         ok = false;
+         goto done;
+      }
+   }
+
+      // a chan at a time, the reader has the second of all of the chans
+      // in its cache after the first
+   while (ok && done < samples)
+   {
+      size_t want = samples - done < SAMP_RATE ? samples - done : SAMP_RATE;
+      for (i = 0; i < nchans && ok; ++i)
+      {
+         size_t n;
+         if ((got = rec_read(rec, &chans[i].chan, 1, done, want, samps)) < want)
+         {
+            printf("\nThe recording is shorter than it should be, aborting. . .\n");
+            ok = false;
+            break;
+         }
+            // too short a piece at the end to say, keep the last ones
+         if (got > 1 || done == 0)
+            spike_limits(&Params, samps, got, &chans[i].lo, &chans[i].hi);
+         n = spike_detect(&chans[i].det, samps, got, chans[i].lo, chans[i].hi, times);
+         ok = put_spikes(&chans[i], times, n);
+         total += n;
+      }
+      done += want;
+      printf("\r  %3.0f%%", (double) done / samples * 100.0);
+      fflush(stdout);
+   }
+   if (!ok && done < samples)
+      printf("\nError writing the spike files, aborting. . .\n");
+
+done:
+   for (i = 0; i < nchans; ++i)
+   {
+      if (chans[i].spk && !spike_file_close(chans[i].spk, done))
+         ok = false;
+      if (chans[i].gdf && fclose(chans[i].gdf) != 0)
+         ok = false;
+   }
+   if (ok)
+      printf("\r  %llu spikes in %d chans, %.1f seconds\n", (unsigned long long) total,
+             nchans, (double) samples / SAMP_RATE);
+   free(samps);
+   free(times);
+   return ok;
+}
+
+
+int main (int argc, char **argv)
+{
+   RecReader  *rec;
+   Chan       *chans;
+   const char *path, *dir;
+   char        basename[PATH_MAX];
+   struct stat info;
+   bool        is_dir, ok;
+   int         nchans = 0, chan, arg;
+
+   clean_default_params(&Params);
+   if (!parse_args(argc, argv))
+      exit(1);
+
+   if (Debug)
+   {
+      printf("attach debugger, then press ENTER");
+      getchar();
+   }
+
+   if (Dump)
+      return dump_spikes(argv + optind, argc - optind) ? 0 : 1;
+
+   path = argv[optind];
+   is_dir = stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+   if (!rec_basename(path, is_dir, basename))
+   {
+      printf("%s is not a YYYY-MM-DD_REC recording, aborting. . .\n", path);
+      exit(1);
+   }
+   if ((rec = rec_open(path, BinChans)) == NULL)
+      exit(1);
+   if (!Gdf && rec_samples(rec) > UINT32_MAX)
+   {
+      printf("The recording is too long for .spk files, use -gdf, aborting. . .\n");
+      exit(1);
+   }
+   dir = OutDir ? OutDir : is_dir ? path : ".";
+
+   if ((chans = calloc(REC_MAX_CHANS, sizeof(*chans))) == NULL)
+   {
+      printf("Out of memory, aborting. . .\n");
+      exit(1);
+   }
+   if (optind + 1 < argc)
+   {
+      for (arg = optind + 1; arg < argc; ++arg)
+      {
+         chan = atoi(argv[arg]);
+         if (!rec_has_chan(rec, chan))
+            printf("There is no chan %s in %s, skipping it\n", argv[arg], path);
+         else
+            SelList[chan - 1] = true;   // a chan given twice is still one
+      }
+   }
+   else
+   {
+      for (chan = 1; chan <= REC_MAX_CHANS; ++chan)
+         SelList[chan - 1] = rec_has_chan(rec, chan);
+   }
+   for (chan = 1; chan <= REC_MAX_CHANS; ++chan)
+      if (SelList[chan - 1])
+         chans[nchans++].chan = chan;
+   if (nchans == 0)
+   {
+      printf("No chans to look at, aborting. . .\n");
+      exit(1);
+   }
+
+   printf("Finding spikes in %d chans of %s\n", nchans, path);
+   ok = find_spikes(rec, chans, nchans, dir, basename);
+   rec_close(rec);
+   free(chans);
+
+   return ok ? 0 : 1;
+}
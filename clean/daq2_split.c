@@ -23,6 +23,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <error.h>
 #include <string.h>
 #include <stdlib.h>
@@ -30,65 +31,672 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <inttypes.h>
+#include "daq_kernel.h"
+#include "daq_map.h"
+#include "chan_pack.h"
+#include "tool_stats.h"
+#include "uring_io.h"
+#include "nocache.h"
+#include "chan_stats.h"
 
-#define CHANS_PER_FILE 64
+#define CHANS_PER_FILE DAQ_CHANS
+#define WORDS_PER_FRAME DAQ_FRAME_WORDS
+#define CHAN_BUF_SAMPS (64 * 1024)    // samples buffered per chan before a write
+#define MAX_JOBS 2000                 // 999 recordings, two halves each
+#define DEFAULT_IO_PER_DEV 2          // --all mode, files read at once from one disk
+#define ZERO_SAMPLE 0x8000            // offset binary 0, what a lost frame is padded with
+#define SAMP_RATE 25000               // frames per second
+#define FOLLOW_WORDS (1024 * 1024)    // --follow, words read in at a time
+#define FOLLOW_POLL_MS 500            // --follow, longest wait between looks at the file
+#define DEFAULT_FOLLOW_IDLE 60        // --follow, seconds with no new data before stopping
+#define DUMP_SECONDS 256              // --stats-dump, seconds read from the file at a time
 
-int
-main (int argc, char **argv)
+/* The .daq file is memory mapped and read in place.  Each channel's
+   samples are collected in its own buffer, which is written out when it
+   fills up.
+*/
+typedef struct
 {
-  if (argc == 1 || strncmp (argv[1], "-h", 2) == 0 || strncmp (argv[1], "--h", 3) == 0) {
-    printf ("Usage: %s DAQFILE [CHANNEL]...\n"
-            "Extracts channels from DAQFILE.daq into separate .chan files.\n\n"
-            "If one or more CHANNEL's are specified, only those channels\n"
-            "will be extracted, otherwise they all will be.\n"
-            "CHANNEL must be in the range 1-64 for 1-64 daq files,\n"
-            "65-128 for 65-128 daq files, or it wll be ignored.\n\n"
-            "Leave off the .daq extension when specifying DAQFILE (but we'll remove it if you include it).\n"
-            "Existing .chan files will be overwritten.\n\n"
-            "This is backwards compatible, so if an older file without 1-64\n"
-            "or 65-128 in the file name is given, it will assume a 1-64 channel file.\n",
-            argv[0]);
-    return 0;
+  DaqMap map;
+  const unsigned short *buf;
+  size_t pos;
+  size_t len;
+} DaqReader;
+
+typedef struct
+{
+  FILE *fd;
+  ChzWriter *z;                   // --compress, the chan goes here instead of fd
+  ChanPack *pack;                 // --pack, or here
+  UringIo *io;                    // fd is written through this if it is set
+  NoCache nc;                     // --nocache, for fd
+  ChanStats *cstats;              // the samples are added up here first, unless --nochanstats
+  int idx;
+  short *buf;
+  size_t len;
+  unsigned long long written;     // samples written out so far
+  char *name;
+} ChanWriter;
+
+/* Where the split is up to, so that with --follow a file can be split a
+   piece at a time as it is read in.
+*/
+typedef struct
+{
+  bool started;                   // found the first marker
+  int cidx;                       // the chan of the next data word
+  bool sawzero;
+  unsigned long long feedback;    // words split
+  unsigned long long count;       // since the last progress line
+} SplitState;
+
+/* One .daq file to split.  In --all mode there is one of these for each
+   half of each recording and the worker threads take them off the list.
+*/
+typedef enum { JOB_WAITING, JOB_RUNNING, JOB_DONE, JOB_FAILED } JobState;
+
+typedef struct
+{
+  char *base;                     // file name without the .daq
+  int nchans;                     // chans from the command line, 0 for all
+  int *chans;
+  bool quiet;                     // --all mode prints its own progress
+  dev_t dev;
+  off_t size;
+  unsigned long long done_bytes;  // updated as we go for the progress line
+  JobState state;
+  unsigned long long gaps;        // --salvage, bad stretches skipped
+  unsigned long long lost;        // and the frames padded or dropped for them
+  bool reported;
+  int err;
+  char msg[PATH_MAX + 128];
+  const ChanWriter *writers;      // the chans being written, to name one that fails
+} SplitJob;
+
+static SplitJob Jobs[MAX_JOBS];
+static int JobCnt;
+static int IoPerDev = DEFAULT_IO_PER_DEV;
+
+/* What to do about bad data.  The default is to stop.  --salvage skips to
+   the next good frame and pads the lost frames with zeros so the samples
+   stay lined up in time with the other half of the recording, or with
+   --salvage=drop just leaves them out.
+*/
+typedef enum { SALVAGE_OFF, SALVAGE_PAD, SALVAGE_DROP } SalvageMode;
+static SalvageMode Salvage = SALVAGE_OFF;
+
+/* --pack writes one pack file for each .daq file instead of a .chan file
+   for each chan.  See chan_pack.h.
+*/
+static bool Pack = false;
+
+   // --compress writes .chz files instead of .chan files.  See chan_z.h.
+static bool Compress = false;
+
+   // a .cstats file of each chan's statistics for each second, see chan_stats.h
+static bool ChanStatsOn = true;
+
+/* --follow splits a file while it is being recorded.  It stops after
+   FollowIdle seconds without new data, or when it gets one of the signals
+   in follow_split.
+*/
+static bool Follow = false;
+static int FollowIdle = DEFAULT_FOLLOW_IDLE;
+static volatile sig_atomic_t StopFollow = 0;
+
+   // --stats or --stats=FILE, see tool_stats.h.  The report shows all of main's args.
+static bool Stats = false;
+static const char *StatsFile = NULL;
+static int MainArgc;
+static char **MainArgv;
+static pthread_mutex_t JobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t JobCond = PTHREAD_COND_INITIALIZER;
+
+
+static bool
+job_fail (SplitJob *job, int err, const char *fmt, ...)
+{
+  va_list ap;
+  va_start (ap, fmt);
+  vsnprintf (job->msg, sizeof job->msg, fmt, ap);
+  va_end (ap);
+  job->err = err;
+  return false;
+}
+
+static bool
+next_word (DaqReader *rd, unsigned short *word)
+{
+  if (rd->pos == rd->len)
+    return false;
+  *word = rd->buf[rd->pos++];
+  return true;
+}
+
+/* A write through io_uring failed.  It may have been any of the chans,
+   the error only turns up when the next one is written.
+*/
+static bool
+uring_fail (SplitJob *job, UringIo *io)
+{
+  int fd, err = uring_error (io, &fd);
+  const char *name = "a chan file";
+
+  for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
+    if (job->writers[cidx].fd && fileno (job->writers[cidx].fd) == fd)
+      name = job->writers[cidx].name;
+  return job_fail (job, err, "Error writing to %s", name);
+}
+
+static bool
+write_chan (SplitJob *job, ChanWriter *cw)
+{
+  if (cw->len && cw->pack)
+  {
+    if (!chan_pack_put (cw->pack, cw->idx, cw->buf, cw->len))
+      return job_fail (job, 0, "Error writing to %s", cw->name);
+  }
+  else if (cw->len && cw->z)
+  {
+    if (!chz_write (cw->z, cw->buf, cw->len))
+      return job_fail (job, 0, "Error writing to %s", cw->name);
+  }
+  else if (cw->len && cw->io)
+  {
+        // the buffer is written in the background, fill another one
+    bool ok = uring_write (cw->io, fileno (cw->fd), cw->buf, cw->len * sizeof *cw->buf,
+                           cw->written * sizeof *cw->buf);
+    if (!ok || (cw->buf = uring_get (cw->io)) == NULL)
+    {
+      cw->buf = NULL;
+      return uring_fail (job, cw->io);
+    }
+  }
+  else if (cw->len && fwrite (cw->buf, sizeof *cw->buf, cw->len, cw->fd) != cw->len)
+    return job_fail (job, errno, "Error writing to %s", cw->name);
+  cw->written += cw->len;
+  cw->len = 0;
+  nocache_wrote (&cw->nc, cw->written * sizeof *cw->buf);
+  return true;
+}
+
+static bool
+flush_chan (SplitJob *job, ChanWriter *cw)
+{
+  if (cw->len && cw->cstats && !chan_stats_put (cw->cstats, cw->buf, cw->len))
+    return job_fail (job, ENOMEM, "Out of memory for the statistics of %s", cw->name);
+  StatsPhase was = stats_phase (STATS_WRITE);
+  bool ok = write_chan (job, cw);
+  stats_phase (was);
+  return ok;
+}
+
+static inline bool
+put_sample (SplitJob *job, ChanWriter *cw, unsigned short daqbuf)
+{
+  cw->buf[cw->len++] = (int)daqbuf - 32768;
+  if (cw->len == CHAN_BUF_SAMPS)
+    return flush_chan (job, cw);
+  return true;
+}
+
+
+   // --nocache, the mapped .daq file has been split up to rd->pos
+static void
+done_with (DaqReader *rd)
+{
+  if (rd->map.words)
+    nocache_mapped (&rd->map.nc, rd->map.words, rd->pos * sizeof *rd->buf);
+}
+
+static void
+show_progress (SplitJob *job, unsigned long long words, double total_bytes)
+{
+  if (job->quiet)
+    __atomic_store_n (&job->done_bytes, words * 2, __ATOMIC_RELAXED);
+  else if (Follow)
+  {
+    printf("\r  %.0f seconds", (double) (words / WORDS_PER_FRAME) / SAMP_RATE);
+    fflush(stdout);
+  }
+  else
+  {
+    printf("\r  %3.0f%%",((words*2.0)/total_bytes)*100.0);
+    fflush(stdout);
+  }
+}
+
+
+/* Salvage mode.  Find the first good frame at or after word pos: a pair of
+   markers, 64 non-zero data words, and then either another pair of markers
+   or the end of the file.  Returns rd->len if there isn't one.
+*/
+static size_t
+resync (const DaqKernel *kernel, const DaqReader *rd, size_t pos)
+{
+  int16_t *none[CHANS_PER_FILE] = { NULL };
+
+  while (rd->len - pos >= WORDS_PER_FRAME)
+  {
+    pos += kernel->find_marker (rd->buf + pos, rd->len - pos);
+    if (rd->len - pos < WORDS_PER_FRAME)
+      break;
+    const unsigned short *next = rd->buf + pos + WORDS_PER_FRAME;
+    if (kernel->split (rd->buf + pos, 1, none, true) == 1
+        && (rd->len - pos < 2 * WORDS_PER_FRAME || (next[0] == 0 && next[1] == 0)))
+      return pos;
+    pos++;
+  }
+  return rd->len;
+}
+
+
+/* Split a whole file a frame at a time, skipping over anything that isn't a
+   good frame.  Every skipped stretch is listed in gapname, one line each
+   with its byte offset and length and the number of frames it is worth,
+   which is how many are padded.  A partial frame at the end of the file is
+   not worth reporting, the recorder usually leaves one.
+*/
+static bool
+salvage_split (SplitJob *job, DaqReader *rd, const bool *include, ChanWriter *f,
+               const char *gapname)
+{
+  const DaqKernel *kernel = daq_kernel ();
+  unsigned long long count = 0;
+  FILE *gapfd = NULL;
+  bool ok = false;
+
+  unlink (gapname);   // left from an earlier run
+  stats_phase (STATS_CONVERT);
+  while (rd->len - rd->pos >= WORDS_PER_FRAME)
+  {
+    size_t want = (rd->len - rd->pos) / WORDS_PER_FRAME;
+    int16_t *dest[CHANS_PER_FILE];
+    for (int chan = 0; chan < CHANS_PER_FILE; chan++)
+    {
+      dest[chan] = NULL;
+      if (include[chan])
+      {
+        if (CHAN_BUF_SAMPS - f[chan].len < want)
+          want = CHAN_BUF_SAMPS - f[chan].len;
+        dest[chan] = f[chan].buf + f[chan].len;
+      }
+    }
+    size_t got = kernel->split (rd->buf + rd->pos, want, dest, true);
+    for (int chan = 0; chan < CHANS_PER_FILE; chan++)
+      if (include[chan] && (f[chan].len += got) == CHAN_BUF_SAMPS && !flush_chan (job, &f[chan]))
+        goto done;
+    rd->pos += got * WORDS_PER_FRAME;
+    count += got * WORDS_PER_FRAME;
+    if (count >= 1024*1024)
+    {
+      show_progress (job, rd->pos, rd->len * 2.0);
+      done_with (rd);
+      count = 0;
+    }
+    if (got)
+      continue;
+
+    size_t good = resync (kernel, rd, rd->pos);
+    size_t words = good - rd->pos;
+    size_t frames = good == rd->len ? 0 : (words + WORDS_PER_FRAME / 2) / WORDS_PER_FRAME;
+    if (!gapfd)
+    {
+      if ((gapfd = fopen (gapname, "w")) == NULL)
+      {
+        job_fail (job, errno, "Error opening %s for write", gapname);
+        goto done;
+      }
+      fprintf (gapfd, "# offset bytes frames_%s\n", Salvage == SALVAGE_PAD ? "padded" : "dropped");
+    }
+    fprintf (gapfd, "%zu %zu %zu\n", rd->pos * 2, words * 2, frames);
+    job->gaps++;
+    job->lost += frames;
+    if (Salvage == SALVAGE_PAD)
+      for (size_t n = 0; n < frames; n++)
+        for (int chan = 0; chan < CHANS_PER_FILE; chan++)
+          if (include[chan] && !put_sample (job, &f[chan], ZERO_SAMPLE))
+            goto done;
+    rd->pos = good;
+  }
+  ok = true;
+
+done:
+  if (gapfd && fclose (gapfd) != 0 && ok)
+    ok = job_fail (job, errno, "Error writing to %s", gapname);
+  return ok;
+}
+
+
+/* Split the words in rd from rd->pos on.  more says that there is more of
+   the file still to come, which only matters at the start: the first
+   marker and the word after it are waited for.
+*/
+static bool
+split_words (SplitJob *job, DaqReader *rd, const bool *include, ChanWriter *f,
+             SplitState *st, bool more, double percent)
+{
+  const DaqKernel *kernel = daq_kernel ();
+  unsigned short daqbuf;
+
+  stats_phase (STATS_CONVERT);
+  if (!st->started)
+  {
+    bool marker = false;
+    while (!marker && next_word (rd, &daqbuf))
+      marker = daqbuf == 0;
+    if (more && (!marker || rd->pos == rd->len))
+    {
+      if (marker)
+        rd->pos--;
+      return true;
+    }
+    st->started = true;
+    if (next_word (rd, &daqbuf) && daqbuf != 0)
+    {
+      if (include[0] && !put_sample (job, &f[0], daqbuf))
+        return false;
+      st->cidx = 1;
+    }
+  }
+  while (true)
+  {
+        // Fast path.  At a frame boundary, hand all of the whole frames in
+        // the buffer to the frame kernel, which checks the markers and that
+        // none of the data words are zero.  This is the same as running the
+        // frames through the word at a time checks below, which handle
+        // everything else: the start of the file, frames that straddle a
+        // read, and anything the kernel does not like.
+    while (st->cidx == CHANS_PER_FILE && !st->sawzero && rd->len - rd->pos >= WORDS_PER_FRAME)
+    {
+      size_t want = (rd->len - rd->pos) / WORDS_PER_FRAME;
+      int16_t *dest[CHANS_PER_FILE];
+      for (int chan = 0; chan < CHANS_PER_FILE; chan++)
+      {
+        dest[chan] = NULL;
+        if (include[chan])
+        {
+              // included chans are all the same length at a frame boundary
+          if (CHAN_BUF_SAMPS - f[chan].len < want)
+            want = CHAN_BUF_SAMPS - f[chan].len;
+          dest[chan] = f[chan].buf + f[chan].len;
+        }
+      }
+          // --stats: fault in the mapped frames so that it counts as reading
+      stats_phase (STATS_READ);
+      stats_touch (rd->buf + rd->pos, want * WORDS_PER_FRAME * sizeof *rd->buf);
+      stats_phase (STATS_CONVERT);
+      size_t got = kernel->split (rd->buf + rd->pos, want, dest, true);
+      for (int chan = 0; chan < CHANS_PER_FILE; chan++)
+        if (include[chan] && (f[chan].len += got) == CHAN_BUF_SAMPS && !flush_chan (job, &f[chan]))
+          return false;
+      rd->pos += got * WORDS_PER_FRAME;
+      st->feedback += got * WORDS_PER_FRAME;
+      st->count += got * WORDS_PER_FRAME;
+      if (got < want)
+        break;
+    }
+
+    if (st->count >= 1024*1024)
+    {
+      show_progress (job, st->feedback, percent);
+      done_with (rd);
+      st->count = 0;
+    }
+
+    if (!next_word (rd, &daqbuf))
+      break;
+    if (st->cidx == CHANS_PER_FILE && daqbuf != 0)
+    {
+       job_fail (job, 0, " The file appears to be corrupted or it is not a recording file\n");
+       return false;
+    }
+    ++st->feedback;
+    ++st->count;
+
+    if (daqbuf == 0) 
+    {
+      if (st->cidx != (st->sawzero ? 0 : CHANS_PER_FILE))
+      {
+        job_fail (job, 0, "bad data\n");
+        return false;
+      }
+      st->sawzero = true;
+      st->cidx = 0;
+      continue;
+    }
+    st->sawzero = false;
+    if (include[st->cidx] && !put_sample (job, &f[st->cidx], daqbuf))
+      return false;
+    st->cidx++;
+  }
+  return true;
+}
+
+
+/* --follow.  Write out the samples of the frames split so far and push
+   them out of the buffers, so that all of the chan files grow together a
+   frame at a time and can be read while the split goes on.  A chan may
+   already have its sample of the next frame, that one is kept back.
+*/
+static bool
+flush_frames (SplitJob *job, ChanWriter *f, const bool *include)
+{
+  unsigned long long frames = ULLONG_MAX;
+
+  for (int chan = 0; chan < CHANS_PER_FILE; chan++)
+    if (include[chan] && f[chan].written + f[chan].len < frames)
+      frames = f[chan].written + f[chan].len;
+  for (int chan = 0; chan < CHANS_PER_FILE; chan++)
+  {
+    if (!include[chan])
+      continue;
+    size_t keep = f[chan].written + f[chan].len - frames;
+    size_t out = f[chan].len - keep;
+    f[chan].len = out;
+    if (!flush_chan (job, &f[chan]))
+      return false;
+    if (f[chan].z ? !chz_flush (f[chan].z) : fflush (f[chan].fd) != 0)
+      return job_fail (job, errno, "Error writing to %s", f[chan].name);
+    memmove (f[chan].buf, f[chan].buf + out, keep * sizeof *f[chan].buf);
+    f[chan].len = keep;
   }
+  return true;
+}
 
+static void
+stop_follow (int sig)
+{
+  (void) sig;
+  StopFollow = 1;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* --follow.  Split filename as the recorder writes it.  Whatever is in the
+   file is read in and split, a whole word at a time so a word that is
+   only half written waits, and the finished frames are written out.  Then
+   wait for the file to grow, using inotify if we can, or just looking
+   every FOLLOW_POLL_MS.  The file doesn't have to be there yet when we
+   start.
+
+   Stops after FollowIdle seconds with nothing new, or on SIGINT, SIGTERM,
+   or SIGUSR1, which the recording script can send when the recording
+   ends.  Everything written before then is split first, so the chan files
+   end up the same as splitting the finished file.
+*/
+static bool
+follow_split (SplitJob *job, DaqReader *rd, const bool *include, ChanWriter *f,
+              const char *filename)
+{
+  SplitState st = { 0 };
+  struct sigaction act;
+  unsigned short *buf;
+  off_t offset = 0;               // bytes of the file read in
+  double last_new = now ();
+  int fd, watch = -1;
+  bool ok = false;
+  NoCache nc;
+
+  memset (&act, 0, sizeof act);
+  act.sa_handler = stop_follow;   // no SA_RESTART, so a wait ends at once
+  sigaction (SIGINT, &act, NULL);
+  sigaction (SIGTERM, &act, NULL);
+  sigaction (SIGUSR1, &act, NULL);
+
+  while ((fd = open (filename, O_RDONLY)) == -1)
+  {
+    if (errno != ENOENT || StopFollow || now () - last_new >= FollowIdle)
+      return job_fail (job, errno, "Error opening %s for read", filename);
+    poll (NULL, 0, FOLLOW_POLL_MS);
+  }
+  if ((buf = malloc (FOLLOW_WORDS * sizeof *buf)) == NULL)
+  {
+    close (fd);
+    return job_fail (job, errno, "Out of memory");
+  }
+  nocache_open (&nc, fd, 0);
+  if ((watch = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) != -1
+      && inotify_add_watch (watch, filename, IN_MODIFY) == -1)
+  {
+    close (watch);
+    watch = -1;
+  }
+  rd->buf = buf;
+  rd->pos = rd->len = 0;
+
+  while (true)
+  {
+        // decide before reading, so whatever was written before the
+        // signal or the timeout is still read
+    bool last = StopFollow || now () - last_new >= FollowIdle;
+    struct stat info;
+
+    if (fstat (fd, &info) != 0)
+    {
+      job_fail (job, errno, "Error reading the size of %s", filename);
+      goto done;
+    }
+    while (offset + 1 < info.st_size)
+    {
+          // only the start can leave words unsplit, a marker waiting for
+          // the word after it
+      size_t have = rd->len - rd->pos;
+      memmove (buf, buf + rd->pos, have * sizeof *buf);
+      size_t want = (info.st_size - offset) / sizeof *buf;
+      if (want > FOLLOW_WORDS - have)
+        want = FOLLOW_WORDS - have;
+      stats_phase (STATS_READ);
+      ssize_t got = pread (fd, buf + have, want * sizeof *buf, offset);
+      stats_phase (STATS_OTHER);
+      if (got < 0)
+      {
+        job_fail (job, errno, "Error reading %s", filename);
+        goto done;
+      }
+      got /= sizeof *buf;
+      if (got == 0)
+        break;
+      offset += got * sizeof *buf;
+      nocache_read (&nc, offset);
+      rd->pos = 0;
+      rd->len = have + got;
+      last_new = now ();
+      if (!split_words (job, rd, include, f, &st, true, 0))
+        goto done;
+    }
+    if (last)
+      break;
+    if (!flush_frames (job, f, include))
+      goto done;
+    show_progress (job, st.feedback, 0);
+
+    if (watch != -1)
+    {
+      struct pollfd pfd = { watch, POLLIN, 0 };
+      char events[4096];
+      if (poll (&pfd, 1, FOLLOW_POLL_MS) > 0)
+        while (read (watch, events, sizeof events) > 0)
+          ;
+    }
+    else
+      poll (NULL, 0, FOLLOW_POLL_MS);
+  }
+  ok = split_words (job, rd, include, f, &st, false, 0);
+
+done:
+  stats_add (offset, 0, 0);
+  if (watch != -1)
+    close (watch);
+  close (fd);
+  free (buf);
+  rd->buf = NULL;
+  rd->pos = rd->len = 0;
+  return ok;
+}
+
+
+/* Split one .daq file into chan files in split.REC.  Returns false with
+   the reason in job->msg if something goes wrong.  Whatever was split
+   before the problem is still written out.
+*/
+static bool
+split_file (SplitJob *job)
+{
   bool include[CHANS_PER_FILE];
   int offset = 0;
   int yr, mon, day, recno;
   char chans[128];
-  unsigned long long feedback = 0, count = 0;
-
-
-  // Sometimes there is an extension, which breaks all kinds of
-  // things, so remove it if it is there
-  char *ext = strstr(argv[1], ".daq");
-  if (ext)
-     *ext = '\0';
-
   char *dirname;
+  char *gapname = NULL;
+  ChanPack *pack = NULL;
+  char *packname = NULL;
+  UringIo *io = NULL;
   int match;
+  bool ok = false;
 
-  printf("Splitting %s, ",argv[1]);
-  if ((match = sscanf(argv[1],"%d-%d-%d_%d_%s", &yr,&mon,&day,&recno,chans)) == 5)
+  if (!job->quiet)
+    printf("Splitting %s, ",job->base);
+  if ((match = sscanf(job->base,"%d-%d-%d_%d_%s", &yr,&mon,&day,&recno,chans)) == 5)
   {
      if (strcmp(chans,"1-64") == 0)
-        printf("a 1-64 file.\n");
+     {
+        if (!job->quiet)
+           printf("a 1-64 file.\n");
+     }
      else if (strcmp(chans,"65-128") == 0)
      {
-        printf("a 65-128 file.\n");
+        if (!job->quiet)
+           printf("a 65-128 file.\n");
         offset = CHANS_PER_FILE;
      }
-     else
+     else if (!job->quiet)
         printf("a legacy file\n");
   }
-  else
+  else if (!job->quiet)
      printf("a legacy file\n");
 
-  if (argc > 2) 
+  if (job->nchans) 
   {
     memset (include, false, sizeof include);
-    for (int i = 2; i < argc; i++) 
+    for (int i = 0; i < job->nchans; i++) 
     {
-      int chan = atoi (argv[i]) - offset;
+      int chan = job->chans[i] - offset;
       if (chan >= 1 && chan <= CHANS_PER_FILE)
         include[chan - 1] = true;
     }
@@ -96,91 +704,587 @@ main (int argc, char **argv)
   else 
      memset (include, true, sizeof include);
 
-  // Need to make a dir?
+  // Need to make a dir?  The other half of the recording may be making it
+  // at the same time, so it is fine if it is already there.
   asprintf(&dirname,"%s%03d","split.",recno);
   if (access(dirname,F_OK) != 0)
   {
      mode_t old_mask = umask(0);
-     if (mkdir(dirname,S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP|S_IROTH|S_IWOTH|S_IXOTH) == -1)
-        error (1, errno, "Error creating directory %s", dirname);
+     if (mkdir(dirname,S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP|S_IROTH|S_IWOTH|S_IXOTH) == -1 && errno != EEXIST)
+     {
+        umask(old_mask);
+        job_fail (job, errno, "Error creating directory %s", dirname);
+        free (dirname);
+        return false;
+     }
      umask(old_mask);
   }
 
   char *filename;
-  asprintf (&filename, "%s.daq", argv[1]);
+  asprintf (&filename, "%s.daq", job->base);
 
-  FILE *fin = fopen (filename, "rb");
-  if (!fin)
-    error (1, errno, "Error opening %s for read", filename);
-  free (filename);
-  struct stat info;
+  DaqReader rd;
+  memset (&rd, 0, sizeof rd);
+  rd.map.fd = -1;
+      // --follow reads the file as it grows, in follow_split
+  if (!Follow && !daq_map_open (&rd.map, filename))
+  {
+    job_fail (job, 0, "Error opening %s for read", filename);
+    free (filename);
+    free (dirname);
+    return false;
+  }
+  rd.buf = rd.map.words;
+  rd.len = rd.map.nwords;
+  rd.pos = 0;
   double percent;
-  fstat(fileno(fin),&info);
-  percent = info.st_size;
+  percent = rd.len * 2.0;
 
-  FILE *f[CHANS_PER_FILE];
+  ChanWriter f[CHANS_PER_FILE];
+  ChanStats cstats[CHANS_PER_FILE];
+  memset (f, 0, sizeof f);
   for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
-    if (include[cidx]) {
+  {
+    f[cidx].nc.fd = -1;
+    chan_stats_init (&cstats[cidx], SAMP_RATE);
+    if (include[cidx] && ChanStatsOn)
+      f[cidx].cstats = &cstats[cidx];
+  }
+  job->writers = f;
+  if (Pack)
+  {
+    int list[CHANS_PER_FILE], cnt = 0;
+    for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
+      if (include[cidx])
+        list[cnt++] = cidx + 1 + offset;
+    asprintf (&packname, "%s/%04d-%02d-%02d_%03d_r_%s%s", dirname, yr, mon, day, recno,
+              offset ? "65-128" : "1-64", CHAN_PACK_EXT);
+    pack = chan_pack_create (packname, list, cnt);
+    cnt = 0;
+    for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
+      if (include[cidx])
+      {
+        f[cidx].pack = pack;
+        f[cidx].idx = cnt++;
+        f[cidx].name = strdup (packname);
+      }
+    if (!pack)
+    {
+      job_fail (job, 0, "Error creating %s", packname);
+      goto done;
+    }
+  }
+      // Plain .chan files are written with io_uring if we have it, so that
+      // there is a write in flight for every chan at once.  --follow writes
+      // a little at a time and wants it on disk as it goes, so it doesn't.
+  if (!Pack && !Compress && !Follow)
+  {
+    int cnt = 0;
+    for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
+      cnt += include[cidx];
+    io = uring_open (2 * cnt, CHAN_BUF_SAMPS * sizeof *f[0].buf);
+  }
+  for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
+    if (include[cidx] && Pack)
+    {
+      if ((f[cidx].buf = malloc (CHAN_BUF_SAMPS * sizeof *f[cidx].buf)) == NULL)
+      {
+        job_fail (job, errno, "Out of memory");
+        goto done;
+      }
+    }
+    else if (include[cidx]) {
           // strip off the 1-64 or 65-128 because we are adding the
           // explicit chan num to the filename.  Also add in a _r_ to
           // indicate a raw file.
-      asprintf (&filename, "%s/%04d-%02d-%02d_%03d_r_%02d.chan", dirname,yr,mon,day,recno, cidx + 1 + offset);
-      if ((f[cidx] = fopen (filename, "wb")) == NULL)
-        error (1, errno, "Error opening %s for write", filename);
-      free (filename);
+      asprintf (&f[cidx].name, "%s/%04d-%02d-%02d_%03d_r_%02d.chan", dirname,yr,mon,day,recno, cidx + 1 + offset);
+      if (Compress)
+      {
+            // an old .chan file would be read instead of the new .chz
+        unlink (f[cidx].name);
+        char *zname = chz_name (f[cidx].name);
+        free (f[cidx].name);
+        f[cidx].name = zname;
+        if ((f[cidx].z = chz_create (f[cidx].name)) == NULL)
+        {
+          job_fail (job, 0, "Error opening %s for write", f[cidx].name);
+          goto done;
+        }
+      }
+      else if ((f[cidx].fd = fopen (f[cidx].name, "wb")) == NULL)
+      {
+        job_fail (job, errno, "Error opening %s for write", f[cidx].name);
+        goto done;
+      }
+      else    // a sample from each frame, unless --salvage finds junk
+        nocache_open (&f[cidx].nc, fileno (f[cidx].fd), rd.map.frames * sizeof *f[cidx].buf);
+      if (io)
+      {
+        f[cidx].io = io;
+        f[cidx].buf = uring_get (io);
+      }
+      else if ((f[cidx].buf = malloc (CHAN_BUF_SAMPS * sizeof *f[cidx].buf)) == NULL)
+      {
+        job_fail (job, errno, "Out of memory");
+        goto done;
+      }
     }
-  unsigned short daqbuf;
 
-  while (fread (&daqbuf, sizeof daqbuf, 1, fin) == 1)
-    if (daqbuf == 0)
-      break;
-  int cidx = 0;
-  if (fread (&daqbuf, sizeof daqbuf, 1, fin) == 1) 
+  if (Salvage != SALVAGE_OFF)
   {
-    if (daqbuf == 0)
-      cidx = 0;
-    else 
+    const char *name = strrchr (job->base, '/') ? strrchr (job->base, '/') + 1 : job->base;
+    asprintf (&gapname, "%s/%s.gaps", dirname, name);
+    ok = salvage_split (job, &rd, include, f, gapname);
+    goto done;
+  }
+
+  if (Follow)
+    ok = follow_split (job, &rd, include, f, filename);
+  else
+  {
+    SplitState st = { 0 };
+    ok = split_words (job, &rd, include, f, &st, false, percent);
+  }
+
+done:
+  stats_phase (STATS_WRITE);
+  unsigned long long samples = 0, frames = 0;
+  if (io)
+  {
+        // everything has to be written before the files are closed
+    for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
+      if (f[cidx].fd && f[cidx].buf && !flush_chan (job, &f[cidx]))
+        ok = false;
+    if (!uring_drain (io) && ok)
+      ok = uring_fail (job, io);
+  }
+  for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
+    if ((f[cidx].fd || f[cidx].z || f[cidx].pack) && f[cidx].buf)
     {
-      if (include[0]) 
+      if (!flush_chan (job, &f[cidx]))
+        ok = false;
+      if (f[cidx].fd && fflush (f[cidx].fd) == 0)
+        nocache_close (&f[cidx].nc, f[cidx].written * sizeof *f[cidx].buf);
+      if (f[cidx].fd && fclose (f[cidx].fd) != 0 && ok)
+        ok = job_fail (job, errno, "Error closing %s", f[cidx].name);
+      if (f[cidx].z && !chz_close (f[cidx].z) && ok)
+        ok = job_fail (job, 0, "Error closing %s", f[cidx].name);
+      samples += f[cidx].written;
+      if (f[cidx].written > frames)
+        frames = f[cidx].written;
+    }
+    else if (f[cidx].fd)
+      fclose (f[cidx].fd);
+    else if (f[cidx].z)
+      chz_close (f[cidx].z);
+  if (pack && !chan_pack_close (pack) && ok)
+    ok = job_fail (job, 0, "Error finishing %s", packname);
+  {
+    int list[CHANS_PER_FILE], cnt = 0;
+    ChanStats *cs[CHANS_PER_FILE];
+    char *cstname;
+    for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
+      if (f[cidx].cstats)
       {
-        short chanbuf = (int)daqbuf - 32768;
-        fwrite (&chanbuf, sizeof daqbuf, 1, f[0]);
+        list[cnt] = cidx + 1 + offset;
+        cs[cnt++] = f[cidx].cstats;
       }
-      cidx = 1;
-    }
+    asprintf (&cstname, "%s/%04d-%02d-%02d_%03d_r_%s%s", dirname, yr, mon, day, recno,
+              offset ? "65-128" : "1-64", CST_EXT);
+    if (!ChanStatsOn)
+      unlink (cstname);   // left from an earlier run, it wouldn't match the chans
+    else if (cnt && !chan_stats_write (cstname, list, cs, cnt) && ok)
+      ok = job_fail (job, 0, "Error writing %s", cstname);
+    free (cstname);
   }
-  bool sawzero = false;
-  while (fread (&daqbuf, sizeof daqbuf, 1, fin) == 1)
+  stats_phase (STATS_OTHER);
+      // --follow counts what it read in follow_split
+  stats_add (Follow ? 0 : rd.len * sizeof *rd.buf, samples * sizeof *f[0].buf, frames);
+  stats_flush ();
+  free (packname);
+  for (int cidx = 0; cidx < CHANS_PER_FILE; cidx++)
   {
-    if (cidx == CHANS_PER_FILE && daqbuf != 0)
-       error(1, 0, " The file appears to be corrupted or it is not a recording file\n");
-    ++feedback;
-    ++count;
+    if (!io)
+      free (f[cidx].buf);
+    free (f[cidx].name);
+    chan_stats_free (&cstats[cidx]);
+  }
+  uring_close (io);
+  daq_map_close (&rd.map);
+  free (filename);
+  free(dirname);
+  __atomic_store_n (&job->done_bytes, job->size, __ATOMIC_RELAXED);
+  if (ok && !job->quiet)
+    printf("\r  100%%   \n");
+  if (ok && !job->quiet && job->gaps)
+    printf ("  %llu bad stretches skipped, %llu frames %s, see %s\n", job->gaps, job->lost,
+            Salvage == SALVAGE_PAD ? "padded" : "dropped", gapname);
+  free (gapname);
+  return ok;
+}
 
-    if (daqbuf == 0) 
+
+/* The options for both modes: --pack, --compress, --salvage or
+   --salvage=pad or --salvage=drop, --follow or --follow=SECONDS,
+   --nocache, --nochanstats, and --stats or --stats=FILE.
+   Returns false if arg is something else.
+*/
+static bool
+split_option (const char *arg)
+{
+  if (strncmp (arg, "--", 2) == 0)
+    arg++;
+  if (strcmp (arg, "-pack") == 0 || strcmp (arg, "-compress") == 0)
+  {
+    if (arg[1] == 'p')
+      Pack = true;
+    else
+      Compress = true;
+    if (Pack && Compress)
+      error (1, 0, "--pack and --compress can't be used together");
+  }
+  else if (strncmp (arg, "-salvage", 8) == 0)
+  {
+    arg += 8;
+    if (*arg == '\0' || strcmp (arg, "=pad") == 0)
+      Salvage = SALVAGE_PAD;
+    else if (strcmp (arg, "=drop") == 0)
+      Salvage = SALVAGE_DROP;
+    else
+      error (1, 0, "--salvage is --salvage=pad or --salvage=drop");
+  }
+  else if (strcmp (arg, "-nocache") == 0)
+    NoCacheOn = true;
+  else if (strcmp (arg, "-nochanstats") == 0)
+    ChanStatsOn = false;
+  else if (strncmp (arg, "-stats", 6) == 0 && (arg[6] == '\0' || arg[6] == '='))
+  {
+    Stats = true;
+    StatsFile = arg[6] == '=' ? arg + 7 : NULL;
+  }
+  else if (strncmp (arg, "-follow", 7) == 0)
+  {
+    arg += 7;
+    Follow = true;
+    if (*arg == '=' && (FollowIdle = atoi (arg + 1)) < 1)
+      error (1, 0, "--follow=SECONDS needs a number greater than 0");
+    else if (*arg != '\0' && *arg != '=')
+      return false;
+  }
+  else
+    return false;
+
+      // a pack file can't grow a bit at a time, and salvage needs to see
+      // past a bad stretch to know where it ends
+  if (Follow && (Pack || Salvage != SALVAGE_OFF))
+    error (1, 0, "--follow can't be used with --pack or --salvage");
+  return true;
+}
+
+
+/* --all mode worker.  Take the next waiting job whose disk isn't already
+   busy with IoPerDev other jobs.
+*/
+static void *
+split_worker (void *arg)
+{
+  while (true)
+  {
+    SplitJob *job = NULL;
+
+    pthread_mutex_lock (&JobLock);
+    while (true)
     {
-      if (cidx != (sawzero ? 0 : CHANS_PER_FILE))
-        error(1, 0, "bad data\n");
-      sawzero = true;
-      cidx = 0;
+      bool waiting = false;
+      for (int j = 0; j < JobCnt && !job; j++)
+      {
+        if (Jobs[j].state != JOB_WAITING)
+          continue;
+        waiting = true;
+        int busy = 0;
+        for (int k = 0; k < JobCnt; k++)
+          if (Jobs[k].state == JOB_RUNNING && Jobs[k].dev == Jobs[j].dev)
+            busy++;
+        if (busy < IoPerDev)
+          job = &Jobs[j];
+      }
+      if (job || !waiting)
+        break;
+      pthread_cond_wait (&JobCond, &JobLock);
+    }
+    if (job)
+      job->state = JOB_RUNNING;
+    pthread_mutex_unlock (&JobLock);
+
+    if (!job)
+      return NULL;
+
+    bool ok = split_file (job);
+
+    pthread_mutex_lock (&JobLock);
+    job->state = ok ? JOB_DONE : JOB_FAILED;
+    pthread_cond_broadcast (&JobCond);
+    pthread_mutex_unlock (&JobLock);
+  }
+}
+
+
+/* Split both halves of a list of recordings in the current dir, the same
+   files split_all.sh would do, using a pool of threads.  One progress
+   line covers all of the files.  argv is what follows --all.
+*/
+static int
+split_all (int argc, char **argv)
+{
+  int threads = sysconf (_SC_NPROCESSORS_ONLN);
+  char cwd[PATH_MAX];
+  const char *day;
+  int failed = 0;
+
+  if (!getcwd (cwd, sizeof cwd))
+    error (1, errno, "Can't get the current directory");
+  day = strrchr (cwd, '/') ? strrchr (cwd, '/') + 1 : cwd;
+
+  for (int i = 0; i < argc; i++)
+  {
+    if (split_option (argv[i]))
+      continue;
+    if ((strcmp (argv[i], "-j") == 0 || strcmp (argv[i], "--io") == 0) && i + 1 < argc)
+    {
+      int val = atoi (argv[i + 1]);
+      if (val < 1)
+        error (1, 0, "%s needs a number greater than 0", argv[i]);
+      if (argv[i][1] == 'j')
+        threads = val;
+      else
+        IoPerDev = val;
+      i++;
       continue;
     }
-    sawzero = false;
-    if (include[cidx]) 
+      // only the raw files, a tagged name like _clean_65-128.daq is some
+      // other tool's output and would be split over the raw chans
+    for (int half = 0; half < 2; half++)
     {
-      short chanbuf = (int)daqbuf - 32768;
-      fwrite (&chanbuf, sizeof daqbuf, 1, f[cidx]);
+      char *base;
+      struct stat info;
+      asprintf (&base, "%s_%s_%s", day, argv[i], half ? "65-128" : "1-64");
+      char *filename;
+      asprintf (&filename, "%s.daq", base);
+      if (stat (filename, &info) != 0)
+      {
+        printf ("%s does not exist\n", filename);
+        free (base);
+      }
+      else if (JobCnt < MAX_JOBS)
+      {
+        SplitJob *job = &Jobs[JobCnt++];
+        job->base = base;
+        job->quiet = true;
+        job->dev = info.st_dev;
+        job->size = info.st_size;
+        job->state = JOB_WAITING;
+      }
+      free (filename);
     }
-    cidx++;
-    if (count >= 1024*1024)
+  }
+  if (Follow)
+    error (1, 0, "--follow splits one DAQFILE, run one for each half of the recording");
+  if (Stats && !stats_start (StatsFile, MainArgc, MainArgv))
+    error (1, errno, "Can't start --stats");
+  if (JobCnt == 0)
+  {
+    printf ("Nothing to split\n");
+    return 1;
+  }
+  if (threads > JobCnt)
+    threads = JobCnt;
+
+  printf ("Splitting %d files using %d threads, at most %d at a time from each disk\n",
+          JobCnt, threads, IoPerDev);
+
+  pthread_t tid[threads];
+  for (int t = 0; t < threads; t++)
+    if (pthread_create (&tid[t], NULL, split_worker, NULL) != 0)
+      error (1, errno, "Can't start a split thread");
+
+  bool all_done = false;
+  while (!all_done)
+  {
+    struct timespec nap = { 0, 500 * 1000 * 1000 };
+    unsigned long long total = 0, done = 0;
+    int finished = 0;
+
+    nanosleep (&nap, NULL);
+    pthread_mutex_lock (&JobLock);
+    for (int j = 0; j < JobCnt; j++)
     {
-      printf("\r  %3.0f%%",((feedback*2.0)/percent)*100.0);
-      fflush(stdout);
-      count = 0;
+      SplitJob *job = &Jobs[j];
+      total += job->size;
+      done += __atomic_load_n (&job->done_bytes, __ATOMIC_RELAXED);
+      if (job->state == JOB_DONE || job->state == JOB_FAILED)
+      {
+        finished++;
+        if (!job->reported)
+        {
+          if (job->state == JOB_DONE && job->gaps)
+            printf ("\r  %s.daq done, %llu bad stretches skipped, %llu frames %s\n", job->base,
+                    job->gaps, job->lost, Salvage == SALVAGE_PAD ? "padded" : "dropped");
+          else if (job->state == JOB_DONE)
+            printf ("\r  %s.daq done                    \n", job->base);
+          else
+          {
+            job->msg[strcspn (job->msg, "\n")] = '\0';
+            printf ("\r  %s.daq FAILED: %s%s%s\n", job->base, job->msg,
+                    job->err ? ": " : "", job->err ? strerror (job->err) : "");
+            failed++;
+          }
+          job->reported = true;
+        }
+      }
     }
+    pthread_mutex_unlock (&JobLock);
+    printf ("\r  %d of %d files, %3.0f%%", finished, JobCnt, total ? done * 100.0 / total : 100.0);
+    fflush (stdout);
+    all_done = finished == JobCnt;
   }
+  printf ("\n");
 
-  free(dirname);
-  printf("\r  100%%   \n");
+  for (int t = 0; t < threads; t++)
+    pthread_join (tid[t], NULL);
+  return failed ? 1 : 0;
+}
+
+
+/* --stats-dump.  Print the statistics of the chans in a .cstats file, all
+   of them or the ones in chans, a line for each second.
+*/
+static int
+dump_chan_stats (const char *name, char **chans, int nchans)
+{
+  ChanStatsFile *csf = chan_stats_open (name);
+  ChanStatsRec recs[DUMP_SECONDS];
+  bool ok = true;
+
+  if (!csf)
+    return 1;
+  printf ("# %s, %u samples per second\n", name, csf->hdr.rate);
+  printf ("# chan second mean sd min max clip_lo clip_hi zeros zero_run\n");
+  for (int i = 0; i < (nchans ? nchans : (int) csf->hdr.nchans); i++)
+  {
+    int idx = nchans ? chan_stats_find (csf, atoi (chans[i])) : i;
+    uint64_t sec = 0;
+    size_t got;
+
+    if (idx == -1)
+    {
+      fprintf (stderr, "Chan %s is not in %s\n", chans[i], name);
+      ok = false;
+      continue;
+    }
+    while ((got = chan_stats_read (csf, idx, sec, DUMP_SECONDS, recs)) > 0)
+      for (size_t r = 0; r < got; r++, sec++)
+        printf ("%d %" PRIu64 " %.2f %.2f %d %d %u %u %u %u\n", csf->dir[idx].chan, sec,
+                recs[r].mean, recs[r].sd, recs[r].min, recs[r].max, recs[r].clip_lo,
+                recs[r].clip_hi, recs[r].zeros, recs[r].zero_run);
+  }
+  chan_stats_close (csf);
+  return ok ? 0 : 1;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc == 1 || strncmp (argv[1], "-h", 2) == 0 || strncmp (argv[1], "--h", 3) == 0) {
+    printf ("Usage: %s [--pack|--compress] [--salvage[=pad|drop]] [--follow[=SECONDS]] [--nocache]\n"
+            "          [--nochanstats] [--stats[=FILE]] DAQFILE [CHANNEL]...\n"
+            "       %s [--pack|--compress] [--salvage[=pad|drop]] [--nocache] [--nochanstats]\n"
+            "          [--stats[=FILE]] --all [-j THREADS] [--io STREAMS] RECORDING...\n"
+            "       %s --stats-dump CSTATSFILE [CHANNEL]...\n"
+            "Extracts channels from DAQFILE.daq into separate .chan files.\n\n"
+            "If one or more CHANNEL's are specified, only those channels\n"
+            "will be extracted, otherwise they all will be.\n"
+            "CHANNEL must be in the range 1-64 for 1-64 daq files,\n"
+            "65-128 for 65-128 daq files, or it wll be ignored.\n\n"
+            "Leave off the .daq extension when specifying DAQFILE (but we'll remove it if you include it).\n"
+            "Existing .chan files will be overwritten.\n\n"
+            "This is backwards compatible, so if an older file without 1-64\n"
+            "or 65-128 in the file name is given, it will assume a 1-64 channel file.\n\n"
+            "--all splits the 1-64 and 65-128 files of each RECORDING number, e.g.\n"
+            "001 002 003, in the current dir, which must be named YYYY-MM-DD.\n"
+            "The files are split in parallel by THREADS threads, one per cpu by\n"
+            "default, but no more than STREAMS files (default %d) are read at once\n"
+            "from any one disk.\n\n"
+            "A damaged file normally stops the split at the first bad frame.\n"
+            "--salvage skips ahead to the next good frame instead and fills in\n"
+            "the lost frames with zeros, or leaves them out with --salvage=drop.\n"
+            "The skipped stretches are listed in split.REC/DAQFILE.gaps.\n\n"
+            "--pack writes all of the channels to one split.REC/YYYY-MM-DD_REC_r_1-64.pack\n"
+            "or _r_65-128.pack file instead of a .chan file for each channel.\n"
+            "daq2_clean, daq2_unsplit, and chans_to_bin read these as if they\n"
+            "were the .chan files.\n\n"
+            "--compress writes losslessly compressed .chz files instead of .chan\n"
+            "files.  They are read the same way.\n\n"
+            "--follow splits DAQFILE while it is still being recorded.  The chan\n"
+            "files grow as the .daq file does.  It stops when the .daq file has\n"
+            "not grown for SECONDS (default %d), or on ^C, SIGTERM, or SIGUSR1,\n"
+            "after splitting everything that was recorded.  Run one for each half\n"
+            "of the recording.  It can't be used with --pack, --salvage, or --all.\n\n"
+            "--nocache keeps the .daq and .chan files from filling up the page\n"
+            "cache, for a shared machine.  What has been read or written is let\n"
+            "go a few MB behind.  The .chan files get their space up front.\n\n"
+            "The mean, standard deviation, min, max, clipped samples, and runs of\n"
+            "zeros of each channel for each second go in split.REC/\n"
+            "YYYY-MM-DD_REC_r_1-64.cstats or _r_65-128.cstats, for finding dead or\n"
+            "saturated channels without reading them again.  --nochanstats leaves it out.\n"
+            "--stats-dump prints a .cstats file, a line for each second of each\n"
+            "channel, or of each CHANNEL given.\n\n"
+            "--stats writes a line of JSON to stderr, or appends it to FILE, at the\n"
+            "end with the bytes and frames split, the time spent reading, converting,\n"
+            "and writing, the number of read and write calls, and the throughput.\n",
+            argv[0], argv[0], argv[0], DEFAULT_IO_PER_DEV, DEFAULT_FOLLOW_IDLE);
+    return 0;
+  }
+
+  if (strcmp (argv[1], "--stats-dump") == 0 || strcmp (argv[1], "-stats-dump") == 0)
+  {
+    if (argc < 3)
+      error (1, 0, "No .cstats file given");
+    return dump_chan_stats (argv[2], argv + 3, argc - 3);
+  }
+
+  MainArgc = argc;
+  MainArgv = argv;
+  int arg = 1;
+  while (arg < argc && split_option (argv[arg]))
+    arg++;
+  if (arg == argc)
+    error (1, 0, "No DAQFILE given");
+
+  if (strcmp (argv[arg], "--all") == 0 || strcmp (argv[arg], "-all") == 0)
+    return split_all (argc - arg - 1, argv + arg + 1);
+
+  if (Stats && !stats_start (StatsFile, MainArgc, MainArgv))
+    error (1, errno, "Can't start --stats");
+  SplitJob *job = &Jobs[0];
+
+  // Sometimes there is an extension, which breaks all kinds of
+  // things, so remove it if it is there
+  char *ext = strstr(argv[arg], ".daq");
+  if (ext)
+     *ext = '\0';
+  job->base = argv[arg];
+
+  if (argc > arg + 1) 
+  {
+    job->nchans = argc - arg - 1;
+    job->chans = malloc (sizeof (int) * job->nchans);
+    for (int i = arg + 1; i < argc; i++) 
+      job->chans[i - arg - 1] = atoi (argv[i]);
+  }
+
+  if (!split_file (job))
+    error (1, job->err, "%s", job->msg);
+  free (job->chans);
   return 0;
 }
@@ -23,6 +23,11 @@
    Take a bunch of chan files and put them all back together in the .daq file
    format.  Typically, this is used to create a play-able file of cleaned
    channels using the play_daq2 utility.  Can also be used for old Datamax chan files.
+
+   A block of samples is read from each chan at a time, the frames are
+   built from them with the daq_kernel unsplit routine, and the block of
+   frames, about a MB, is written at once.  The 1-64 and 65-128 files are
+   made at the same time, each on its own thread.
 */
 
 
@@ -43,8 +48,17 @@
 #include <getopt.h>
 #include <errno.h>
 #include <dirent.h> 
+#include <time.h>
+#include <pthread.h>
+#include "chan_pack.h"
+#include "rec_reader.h"
+#include "daq_kernel.h"
+#include "tool_stats.h"
+#include "nocache.h"
 
 #define CHANS_PER_FILE 64
+#define MAX_CHANS 128
+#define UNSPLIT_BLOCK_FRAMES (8 * 1024)   // frames built and written at a time, about 1 MB
 
 bool DoOne = true;
 bool DoTwo = true;
@@ -52,6 +66,30 @@ bool OverWrite = false;
 bool HaveRaw = false;
 char OutTag[2048] = "clean";
 bool Debug = false;
+bool Stats = false;
+char *StatsFile = NULL;
+bool SelList[MAX_CHANS];
+int  SelChans = MAX_CHANS;
+
+typedef struct
+{
+   char       outname[PATH_MAX];
+   int        chan_start;
+   ChanReader rd[CHANS_PER_FILE];
+   bool       have[CHANS_PER_FILE];
+   int        chan_files;
+   ChanPack  *packs[2];
+   UringIo   *io;
+   FILE      *out_fd;
+   NoCache    out_nc;
+   double     percent;                  // frames in the chan files
+   unsigned long long frames;           // frames written so far
+   unsigned long long samples;
+   int        err;                      // errno of a failed write
+   bool       done;
+   bool       started;
+   pthread_t  tid;
+} UnsplitJob;
 
 #define RAW_TAG "_r_"
 #define DAQ_EXT ".daq"
@@ -60,7 +98,8 @@ bool Debug = false;
 static void usage(char *name)
 {
    printf (
-"\nUsage: %s [-1] [-2] [-t tag] [-f]\n"\
+"\nUsage: %s [-1] [-2] [-t tag] [-f] [-nocache] [-stats[=FILE]]\n"\
+"          [subset of chans, e.g. 2 3 7-19 119 127]\n"\
 "\n"\
 "Combine a set of 1-64 and 65-128 chan files from split recordings\n"\
 "into two .daq format files.\n"\
@@ -78,6 +117,19 @@ static void usage(char *name)
 "-2 means combine only the 65-128 chan files.\n"\
 "-t tag adds \"tag\" to the output name instead of \"_clean\".\n"\
 "-f to force over-writing existing output files.\n"\
+"-nocache keeps the files from filling up the page cache, for a shared\n"\
+"       machine.  What has been read or written is let go a few MB behind,\n"\
+"       and the output file gets its space up front.\n"\
+"-stats writes a line of JSON to stderr, or appends it to FILE, at the end\n"\
+"       with the bytes and frames written, the time spent reading, converting,\n"\
+"       and writing, the number of read and write calls, and the throughput.\n"\
+"List of chan numbers in the range of 1-128 to put only those chans in the\n"\
+"       .daq files.  The other chans are zero.  A .daq file with none of the\n"\
+"       chans in it is not made.  Ranges of numbers are supported, e.g., 16-32.\n"\
+"\n"\
+"Compressed .chz chan files are read the same as .chan files.  Chans that\n"\
+"are in neither are read from the YYYY-MM-DD_REC_r_1-64.pack and\n"\
+"_r_65-128.pack files that daq2_split --pack makes, if they are there.\n"\
 "\n"\
 "It is not an error for chan files to be missing.  A default value of zero\n"\
 "will be written to the .daq file for those channels.\n",
@@ -92,11 +144,16 @@ static int parse_args(int argc, char *argv[])
                                    {"f", no_argument, NULL, '3'},
                                    {"tag", required_argument, NULL, '4'},
                                    {"d", no_argument, NULL, '5'},
+                                   {"stats", optional_argument, NULL, '6'},
+                                   {"nocache", no_argument, NULL, '7'},
                                    { 0,0,0,0} };
    int cmd;
    bool have_1 = false, have_2 = false;
    int ret = 1;
    opterr = 0;
+   int sel_index;
+   int sel_start = -1;
+   int sel_end = -1;
 
    while ((cmd = getopt_long_only(argc, argv, "", opts, NULL )) != -1)
    {
@@ -122,6 +179,15 @@ static int parse_args(int argc, char *argv[])
                Debug = true;
                break;
 
+         case '6':
+               Stats = true;
+               StatsFile = optarg;
+               break;
+
+         case '7':
+               NoCacheOn = true;
+               break;
+
          case '?':
          default:
             ret = 0;
@@ -141,6 +207,50 @@ static int parse_args(int argc, char *argv[])
    }
      // otherwise always look for both sets of chans
 
+   if (ret && optind < argc)
+   {
+      memset(SelList, false, sizeof(SelList)); // include only selected chans
+      SelChans = 0;
+      for ( ; optind < argc; ++optind)
+      {
+         if (sscanf(argv[optind],"%d-%d",&sel_start,&sel_end) == 2)
+         {
+            if (sel_start < 1 || sel_end > MAX_CHANS || sel_end < sel_start)
+            {
+               printf("Numbers are out of range, aborting. . .\n");
+               ret = 0;
+               break;
+            }
+         }
+         else if (sscanf(argv[optind],"%d",&sel_start) == 1)
+         {
+            if (sel_start < 1 || sel_start > MAX_CHANS)
+            {
+               printf("Argument is out of range, aborting. . .\n");
+               ret = 0;
+               break;
+            }
+            sel_end = sel_start;
+         }
+         else
+         {
+            printf("Argument is not a number, aborting. . .\n");
+            ret = 0;
+            break;
+         }
+         for (sel_index = sel_start; sel_index <= sel_end; ++sel_index)
+         {
+            if (SelList[sel_index-1] == false)  // don't count duplicates
+            {
+               SelList[sel_index-1] = true;
+               ++SelChans;
+            }
+         }
+      }
+      if (ret)
+         printf("%d channels selected\n",SelChans);
+   }
+
    if (!ret)
       usage(argv[0]); 
 
@@ -148,72 +258,26 @@ static int parse_args(int argc, char *argv[])
 }
 
 
-/* Find a chan file in the current dir if there is one,
-   then return the basename minus the .chan extenstion.
-   Also note if it is a raw file for later.
-   Returns true of it finds one.
-           false otherwise.
-*/
-static bool find_chan(char *basename)
-{
-   DIR    *curr_dir;
-   struct dirent *dir;
-   bool   ret = false;
-   int    match, yr, mon, day, recno;
-   
-   curr_dir = opendir(".");
-   if (curr_dir)
-   {
-       while ((dir = readdir(curr_dir)) != NULL)
-       {
-          if (strstr(dir->d_name,CHAN_EXT))
-          {
-             if (strstr(dir->d_name,RAW_TAG))
-                HaveRaw = true;
-
-             match = sscanf(dir->d_name,"%d-%d-%d_%d", &yr,&mon,&day,&recno);
-             if (match == 4)
-             {
-                sprintf(basename,"%04d-%02d-%02d_%03d", yr,mon,day,recno);
-                ret = true;
-                break;
-             }
-             else
-             {
-                printf("The chan file %s is not in the correct filename format\n",dir->d_name);
-                break;
-             }
-          }
-      }
-      closedir(curr_dir);
-   }
-   return ret;
-}
       
       
-/* What we are here for.  Read all of the chan files for the current
-   section, 1-64 or 65-128 and combine them all back into a .daq file that
-   looks like a recording.  
-   The format is a set of blocks.  The first two words in the block are 0000 0000.
-   Then, in order, the value of the channels from 1-64 or 65-128.
+/* Get ready to make a .daq file from the chan files for the current
+   section, 1-64 or 65-128: open the selected chans and the output file.
+   Returns false if there are no chan files with data.  If the user does
+   not want the output file replaced, returns true with no output file.
 */
-static bool create_daq(char *outname, char* basename, int chan_start)
+static bool open_job(UnsplitJob *job, char *basename, int chan_start)
 {
-   FILE  *out_fd;
-   FILE *in_fd[CHANS_PER_FILE];
-   int chan, chan_files = 0;
+   int npacks, chan;
    char channame[PATH_MAX];
-   unsigned long long feedback = 0, count = 0;
-   struct stat info;
-   double percent;
    char input[256];
-   unsigned short marker[1] = {0};
-   unsigned short word_to_write[1];
-   size_t res;
-   bool  done = false;
-   bool need_marker = true;
+
+   memset(job, 0, sizeof(*job));
+   job->chan_start = chan_start;
+   sprintf(job->outname,"%s_%s_%d-%d%s",basename,OutTag,chan_start,chan_start+CHANS_PER_FILE-1,DAQ_EXT);
 
         // any chan files?
+   sprintf(channame,"%s%s",basename,HaveRaw ? RAW_TAG : "_");
+   npacks = chan_pack_open_pair(channame,job->packs);
    for (chan = 0; chan < CHANS_PER_FILE ; chan++)
    {
       if (HaveRaw)
@@ -221,125 +285,184 @@ static bool create_daq(char *outname, char* basename, int chan_start)
       else
          sprintf(channame,"%s_%02d%s",basename,chan_start+chan,CHAN_EXT);
 
-      if ((in_fd[chan] = fopen(channame,"r")))
+      if (SelList[chan_start+chan-1]
+          && (job->have[chan] = chan_reader_open(&job->rd[chan],channame,job->packs,npacks,chan_start+chan)))
       {
-         if (!chan_files)  // get 1st chan file size, assumes all are same size
-         {
-            fstat(fileno(in_fd[chan]),&info);
-            percent = info.st_size/2;  // # words in file
-         }
-         ++chan_files;
+         if (!job->chan_files)  // get 1st chan file size, assumes all are same size
+            job->percent = chan_reader_samples(&job->rd[chan]);  // # words in file
+         ++job->chan_files;
       }
    }
 
-   if (chan_files == 0)
+   if (job->chan_files == 0)
    {
       printf("Could not find any chan files.\n");
-      return false; 
+      return false;
    }
 
-   if (percent == 0)
+   if (job->percent == 0)
    {
-      printf("Could not find any chan files with data, skipping %s\n",outname);
-      return false; 
+      printf("Could not find any chan files with data, skipping %s\n",job->outname);
+      return false;
    }
 
-   if (!OverWrite && access(outname,F_OK) == 0)
+   if (!OverWrite && access(job->outname,F_OK) == 0)
    {
-      printf("WARNING:  The file %s already exists.\n  Okay to over-write (Y/N)?  ",outname);
+      printf("WARNING:  The file %s already exists.\n  Okay to over-write (Y/N)?  ",job->outname);
       fgets(input,sizeof(input),stdin);
       if (tolower(input[0]) != 'y')
       {
          printf("File is unchanged, channels %d-%d skipped\n",chan_start,chan_start+63);
-         goto error;
+         return true;
       }
    }
 
-   out_fd = fopen(outname, "w");
-   if (!out_fd)
+   job->out_fd = fopen(job->outname, "w");
+   if (!job->out_fd)
+   {
+      printf("Problem opening output file %s, skipping. . .\n",job->outname);
+      return true;
+   }
+
+   nocache_open(&job->out_nc, fileno(job->out_fd), job->percent * DAQ_FRAME_BYTES);
+
+      // read ahead on all of the .chan files at once if we can
+   job->io = uring_open(2 * job->chan_files, CHAN_AHEAD_SAMPS * sizeof(short));
+   for (chan = 0; chan < CHANS_PER_FILE ; chan++)
+   {
+      if (job->have[chan])
+         chan_reader_ahead(&job->rd[chan], job->io);
+   }
+   return true;
+}
+
+
+/* What we are here for.  Read all of the chan files of a job and combine
+   them all back into a .daq file that looks like a recording.
+   The format is a set of frames.  The first two words in the frame are 0000 0000.
+   Then, in order, the value of the channels from 1-64 or 65-128.
+   It stops at the end of the shortest chan, so there are only whole frames.
+*/
+static void *unsplit_job(void *arg)
+{
+   UnsplitJob *job = arg;
+   const DaqKernel *kernel = daq_kernel();
+   int16_t  *bufs, *chans[CHANS_PER_FILE];
+   uint16_t *frames;
+   size_t   n = UNSPLIT_BLOCK_FRAMES, got;
+   int      chan;
+
+   bufs = malloc(sizeof(*bufs) * UNSPLIT_BLOCK_FRAMES * CHANS_PER_FILE);
+   frames = malloc(DAQ_FRAME_BYTES * UNSPLIT_BLOCK_FRAMES);
+   if (!bufs || !frames)
    {
-      printf("Problem opening output file %s, skipping. . .\n",outname);
-      goto error;
+      job->err = ENOMEM;
+      n = 0;
    }
+   for (chan = 0; chan < CHANS_PER_FILE ; chan++)   // a missing chan is the zero value
+      chans[chan] = job->have[chan] ? bufs + chan * UNSPLIT_BLOCK_FRAMES : NULL;
 
-   while (!done)
+   while (n == UNSPLIT_BLOCK_FRAMES)
    {
+        // a block of each chan, as much of it as there is
+      stats_phase(STATS_READ);
       for (chan = 0; chan < CHANS_PER_FILE ; chan++)
       {
-         if (in_fd[chan])
-         {
-            res = fread(word_to_write,sizeof(word_to_write),1,in_fd[chan]);
-            if (res == 0)
-            {
-               done = true;
-               break;
-            }
-            *word_to_write += 0x8000;   // convert to daq board's data format
-         }
-         else
-            *word_to_write = 0x8000;   // daq file's zero value
-
-        if (need_marker)
-        {
-           fwrite(marker,sizeof(marker),1,out_fd);    // block header of 0000 0000 
-           fwrite(marker,sizeof(marker),1,out_fd);
-           need_marker = false;
-           ++feedback;
-           ++count;
-        }
-         errno = 0;
-         res = fwrite(word_to_write,sizeof(word_to_write),1,out_fd);
-         if (res != 1)
-         {
-            printf("Error writing to output file %s\n",outname);
-            printf("   errno is %d   res is %d \n",errno,res);
-            char *errstr = strerror(errno);
-            printf("   %s\n",errstr);
-            printf("   Note that %s will be incomplete.\n",outname);
-            done = true;
-            break;
-         }
+         if (chans[chan] && (got = chan_reader_read(&job->rd[chan],chans[chan],n)) < n)
+            n = got;
       }
-      need_marker = true;   // start new block
- 
-      if (count > 1024)
+      if (n == 0)
+         break;
+
+      stats_phase(STATS_CONVERT);
+      kernel->unsplit(chans, n, frames);
+
+      stats_phase(STATS_WRITE);
+      errno = 0;
+      if (fwrite(frames,DAQ_FRAME_BYTES,n,job->out_fd) != n)
       {
-         printf("\r  %3.0f%%",(feedback/percent)*100.0);
-         fflush(stdout);
-         count = 0;
+         job->err = errno ? errno : EIO;
+         break;
       }
+      job->samples += n * job->chan_files;
+      __atomic_store_n(&job->frames, job->frames + n, __ATOMIC_RELAXED);
+      nocache_wrote(&job->out_nc, job->frames * DAQ_FRAME_BYTES);
+      stats_phase(STATS_OTHER);
    }
 
-   if (out_fd)
+   if (!job->err)
    {
-      printf("\r  %3.0f%%",(feedback/percent)*100.0);
-      printf("\nCompleting write. . .\n"); // there can be a lot buffered data, 
-      fflush(stdout);                      // closing can take many seconds, so reassure user
-      fclose(out_fd);
-      printf("Creation of %s is complete.\n", outname);
-      fflush(stdout);
+      stats_phase(STATS_WRITE);
+      if (fflush(job->out_fd) != 0)
+         job->err = errno;
+      else
+         nocache_close(&job->out_nc, job->frames * DAQ_FRAME_BYTES);
    }
+   stats_phase(STATS_OTHER);
+   stats_flush();
+   free(bufs);
+   free(frames);
+   __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+   return NULL;
+}
+
 
-error:
+static void close_job(UnsplitJob *job)
+{
+   int chan;
+
+   if (job->out_fd)
+   {
+      if (job->err)
+      {
+         printf("Error writing to output file %s\n",job->outname);
+         printf("   %s\n",strerror(job->err));
+         printf("   Note that %s will be incomplete.\n",job->outname);
+      }
+      fclose(job->out_fd);
+      stats_add(job->samples * sizeof(short), job->frames * DAQ_FRAME_BYTES, job->frames);
+      printf("Creation of %s is complete.\n", job->outname);
+      fflush(stdout);
+   }
    for (chan = 0; chan < CHANS_PER_FILE ; chan++)
    {
-      if (in_fd[chan])
-         fclose(in_fd[chan]);
+      if (job->have[chan])
+         chan_reader_close(&job->rd[chan]);
    }
+   chan_pack_close(job->packs[0]);
+   chan_pack_close(job->packs[1]);
+   uring_close(job->io);
+}
 
-   return true;
+
+   // any of the chans of this section selected?
+static bool selected(int chan_start)
+{
+   int chan;
+
+   for (chan = 0; chan < CHANS_PER_FILE ; chan++)
+   {
+      if (SelList[chan_start+chan-1])
+         return true;
+   }
+   return false;
 }
 
 
 int main (int argc, char **argv)
 {
    char basename[PATH_MAX];
-   char daq1name[PATH_MAX];
-   char daq65name[PATH_MAX];
-   int  complain;
+   UnsplitJob jobs[2];
+   int  njobs = 0, j;
+   int  complain = 0;
+   bool all_done = false;
+
+   memset(SelList, true, sizeof(SelList)); // all chans by default
 
    if (!parse_args(argc, argv))
       exit(1);
+   if (Stats && !stats_start(StatsFile, argc, argv))
+      error(1, errno, "Can't start -stats");
 
    if (Debug)
    {
@@ -347,23 +470,68 @@ int main (int argc, char **argv)
       getchar();
    }
 
-   if (!find_chan(basename))
+   if (!rec_find_chans(".", basename, &HaveRaw))
    {
       printf("\nCould not find any chan files, exiting. . .\n");
       usage(argv[0]);
       exit(1);
    }
 
-   if (DoOne)
+      // ask about over-writing before starting either one
+   if (DoOne && selected(1))
+   {
+      complain += !open_job(&jobs[njobs], basename, 1);
+      ++njobs;
+   }
+   if (DoTwo && selected(CHANS_PER_FILE + 1))
+   {
+      complain += !open_job(&jobs[njobs], basename, CHANS_PER_FILE + 1);
+      ++njobs;
+   }
+
+   for (j = 0; j < njobs; j++)
    {
-      sprintf(daq1name,"%s_%s%s%s",basename,OutTag,"_1-64",DAQ_EXT);
-      complain = !create_daq(daq1name, basename, 1);
+      if (jobs[j].out_fd)
+      {
+         if (pthread_create(&jobs[j].tid, NULL, unsplit_job, &jobs[j]) != 0)
+            error(1, errno, "Can't start a thread for %s", jobs[j].outname);
+         jobs[j].started = true;
+      }
+   }
+
+   while (!all_done)
+   {
+      struct timespec nap = { 0, 250 * 1000 * 1000 };
+      unsigned long long done = 0;
+      double total = 0;
+
+      all_done = true;
+      for (j = 0; j < njobs; j++)
+      {
+         if (jobs[j].started)
+         {
+            total += jobs[j].percent;
+            done += __atomic_load_n(&jobs[j].frames, __ATOMIC_RELAXED);
+            if (!__atomic_load_n(&jobs[j].done, __ATOMIC_ACQUIRE))
+               all_done = false;
+         }
+      }
+      if (total > 0)
+      {
+         printf("\r  %3.0f%%",(done/total)*100.0);
+         fflush(stdout);
+      }
+      if (!all_done)
+         nanosleep(&nap, NULL);
    }
+   printf("\nCompleting write. . .\n"); // there can be a lot buffered data, 
+   fflush(stdout);                      // closing can take many seconds, so reassure user
 
-   if (DoTwo)
+   for (j = 0; j < njobs; j++)
    {
-      sprintf(daq65name,"%s_%s%s%s",basename,OutTag,"_65-128",DAQ_EXT);
-      complain += !create_daq(daq65name, basename, 65);
+      if (jobs[j].started)
+         pthread_join(jobs[j].tid, NULL);
+      close_job(&jobs[j]);
    }
 
    if (complain)
@@ -0,0 +1,457 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Make a synthetic recording, a YYYY-MM-DD_REC_1-64.daq and
+   _65-128.daq pair, to try out and time the tools without a real one.
+
+   Each chan has its own background noise, a slow wave, and zero to three
+   units firing at random.  On top of that is what the cleaning is for,
+   noise that all of the chans pick up, each at its own gain: 60 Hz hum and
+   now and then a large ringing artifact.  The two halves are one
+   recording, so the artifacts are at the same times in both.
+
+   The same seed makes the same files, and a chan's data does not depend on
+   which halves are written.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <linux/limits.h>
+#include <getopt.h>
+#include <errno.h>
+#include "daq_kernel.h"
+
+#define SAMP_RATE 25000
+#define BLOCK_FRAMES SAMP_RATE      // made a second at a time
+#define SPIKE_LEN 32                // samples in a spike
+#define MAX_UNITS 3
+#define REFRACTORY (SAMP_RATE / 500)
+#define ART_LEN (SAMP_RATE / 25)    // an artifact rings for up to 40 ms
+#define ART_RATE 0.5                // artifacts per second
+#define HUM_AMP 40.0
+#define NORMAL_BITS 16              // the noise comes from a table of this many normals
+
+typedef struct
+{
+   double rate;                // spikes per second
+   double shape[SPIKE_LEN];
+   unsigned long long next;    // frame of the next spike
+} Unit;
+
+typedef struct
+{
+   uint64_t rng;
+   uint64_t bits;              // random bits not used yet, and
+   int      nbits;             //    how many
+   double   noise_sd, ar, last;
+   double   wave_amp, wave_re, wave_im;   // the slow wave, turned by
+   double   turn_re, turn_im;             //    this much each frame
+   double   hum_gain, art_gain, offset;
+   int      units;
+   Unit     unit[MAX_UNITS];
+   double  *buf;               // BLOCK_FRAMES plus a spike's tail from the last block
+} Chan;
+
+double Seconds = 60;
+char   Date[16] = "2000-01-01";
+char   Rec[16] = "001";
+unsigned long Seed = 1;
+bool   DoOne = true, DoTwo = true;
+bool   OverWrite = false;
+
+Chan   Chans[2 * DAQ_CHANS];
+double Normals[1 << NORMAL_BITS];
+
+static void usage(char *name)
+{
+   printf (
+"\nUsage: %s [-seconds N] [-date YYYY-MM-DD] [-r REC] [-seed N] [-1] [-2] [-f]\n"\
+"\n"\
+"Make a synthetic recording, YYYY-MM-DD_REC_1-64.daq and _65-128.daq, in\n"\
+"the current dir, for trying out and timing the other tools.  The chans\n"\
+"have noise, spikes, 60 Hz hum, and large artifacts on all chans at once.\n"\
+"\n"\
+"-seconds N is how long the recording is, default %.0f.  The files are\n"\
+"   3.3 MB per second each.\n"\
+"-date and -r name the files, default %s and %s.\n"\
+"-seed N makes a different recording.  The same seed makes the same files.\n"\
+"-1 means make only the 1-64 file.\n"\
+"-2 means make only the 65-128 file.\n"\
+"-f to force over-writing existing files.\n",
+name, Seconds, Date, Rec
+);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+   static struct option opts[] = { {"seconds", required_argument, NULL, '1'},
+                                   {"date", required_argument, NULL, '2'},
+                                   {"r", required_argument, NULL, '3'},
+                                   {"seed", required_argument, NULL, '4'},
+                                   {"1", no_argument, NULL, '5'},
+                                   {"2", no_argument, NULL, '6'},
+                                   {"f", no_argument, NULL, '7'},
+                                   { 0,0,0,0} };
+   int cmd;
+   bool have_1 = false, have_2 = false;
+   int ret = 1;
+   char *end;
+   opterr = 0;
+
+   while ((cmd = getopt_long_only(argc, argv, "", opts, NULL )) != -1)
+   {
+      switch (cmd)
+      {
+         case '1':
+               Seconds = strtod(optarg, &end);
+               if (*end || Seconds <= 0)
+               {
+                  fprintf(stderr, "-seconds must be a number more than zero\n");
+                  ret = 0;
+               }
+               break;
+
+         case '2':
+               snprintf(Date, sizeof(Date), "%s", optarg);
+               break;
+
+         case '3':
+               snprintf(Rec, sizeof(Rec), "%s", optarg);
+               break;
+
+         case '4':
+               Seed = strtoul(optarg, NULL, 0);
+               break;
+
+         case '5':
+               have_1 = true;
+               break;
+
+         case '6':
+               have_2 = true;
+               break;
+
+         case '7':
+               OverWrite = true;
+               break;
+
+         case '?':
+         default:
+            ret = 0;
+           break;
+      }
+   }
+   if (optind < argc)
+      ret = 0;
+
+   if (have_1 != have_2)
+   {
+      DoOne = have_1;
+      DoTwo = have_2;
+   }
+
+   if (!ret)
+      usage(argv[0]);
+
+   return ret;
+}
+
+
+   // xorshift64*, seeded through splitmix64 so nearby seeds are unrelated
+static uint64_t seed_rng(uint64_t x)
+{
+   x += 0x9e3779b97f4a7c15ULL;
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+   x ^= x >> 31;
+   return x ? x : 1;
+}
+
+static double uniform(uint64_t *s)
+{
+   *s ^= *s >> 12;
+   *s ^= *s << 25;
+   *s ^= *s >> 27;
+   return ((*s * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double between(uint64_t *s, double lo, double hi)
+{
+   return lo + (hi - lo) * uniform(s);
+}
+
+/* The normal distribution's quantiles at the middle of 1 << NORMAL_BITS
+   equal steps, by Newton's method on erfc.  Noise from the table is a lot
+   faster than Box-Muller and looks the same, it just has no tails past
+   4.4 sd.
+*/
+static void make_normals(void)
+{
+   int    n = 1 << NORMAL_BITS, k, i;
+   double x = 0;
+
+   for (k = n / 2; k < n; ++k)
+   {
+      double p = (k + 0.5) / n;
+      for (i = 0; i < 50; ++i)
+      {
+         double err = 1 - 0.5 * erfc(x / M_SQRT2) - p;
+         double dens = exp(-x * x / 2) / sqrt(2 * M_PI);
+         x -= err / dens;
+         if (fabs(err) < 1e-13)
+            break;
+      }
+      Normals[k] = x;
+      Normals[n - 1 - k] = -x;
+   }
+}
+
+static double normal(Chan *c)
+{
+   double v;
+
+   if (c->nbits < NORMAL_BITS)
+   {
+      uniform(&c->rng);
+      c->bits = c->rng * 0x2545f4914f6cdd1dULL;
+      c->nbits = 64;
+   }
+   v = Normals[c->bits & ((1 << NORMAL_BITS) - 1)];
+   c->bits >>= NORMAL_BITS;
+   c->nbits -= NORMAL_BITS;
+   return v;
+}
+
+   // frames until the next spike of a unit
+static unsigned long long interval(Chan *c, const Unit *u)
+{
+   return REFRACTORY - log(1.0 - uniform(&c->rng)) * SAMP_RATE / u->rate;
+}
+
+
+static bool setup_chans(void)
+{
+   int chan, k, t;
+
+   for (chan = 0; chan < 2 * DAQ_CHANS; ++chan)
+   {
+      Chan *c = &Chans[chan];
+
+      c->rng = seed_rng(Seed * 1000 + chan + 1);
+      c->noise_sd = between(&c->rng, 15, 40);
+      c->ar = between(&c->rng, 0.3, 0.7);
+      double hz = between(&c->rng, 1, 12), ph = between(&c->rng, 0, 2 * M_PI);
+      c->wave_amp = between(&c->rng, 20, 150);
+      c->wave_re = cos(ph);
+      c->wave_im = sin(ph);
+      c->turn_re = cos(2 * M_PI * hz / SAMP_RATE);
+      c->turn_im = sin(2 * M_PI * hz / SAMP_RATE);
+      c->hum_gain = between(&c->rng, 0.5, 1.5);
+      c->art_gain = between(&c->rng, 0.3, 1.2);
+      c->offset = between(&c->rng, -200, 200);
+      c->units = uniform(&c->rng) * (MAX_UNITS + 1);
+      for (k = 0; k < c->units; ++k)
+      {
+         Unit  *u = &c->unit[k];
+         double amp = between(&c->rng, 80, 600);
+         double w1 = between(&c->rng, 1.5, 3), w2 = between(&c->rng, 3, 6);
+         double gap = between(&c->rng, 5, 9), rebound = between(&c->rng, 0.3, 0.5);
+
+         u->rate = between(&c->rng, 1, 30);
+         for (t = 0; t < SPIKE_LEN; ++t)
+         {
+            double a = (t - 8) / w1, b = (t - 8 - gap) / w2;
+            u->shape[t] = amp * (-exp(-a * a) + rebound * exp(-b * b));
+         }
+         u->next = interval(c, u);
+      }
+      if ((c->buf = calloc(BLOCK_FRAMES + SPIKE_LEN, sizeof(double))) == NULL)
+         return false;
+   }
+   return true;
+}
+
+
+/* The noise all of the chans share, for frames first to first + cnt.  The
+   artifacts started in earlier blocks are already in art.
+*/
+static void make_common(uint64_t *rng, unsigned long long *next_art,
+                        unsigned long long first, int cnt, double *hum, double *art)
+{
+   int t;
+
+   for (t = 0; t < cnt; ++t)
+   {
+      double secs = (double) (first + t) / SAMP_RATE;
+      hum[t] = HUM_AMP * (sin(2 * M_PI * 60 * secs) + 0.3 * sin(2 * M_PI * 180 * secs));
+   }
+   while (*next_art < first + cnt)
+   {
+      int    at = *next_art - first;
+      double amp = between(rng, 500, 3000) * (uniform(rng) < 0.5 ? -1 : 1);
+      double tau = between(rng, 0.002, 0.008) * SAMP_RATE;
+      double hz = between(rng, 200, 800);
+
+      for (t = 0; t < ART_LEN; ++t)
+         art[at + t] += amp * exp(-t / tau) * sin(2 * M_PI * hz * t / SAMP_RATE + M_PI / 2);
+      *next_art += 1 - log(1.0 - uniform(rng)) * SAMP_RATE / ART_RATE;
+   }
+}
+
+
+/* One block of one chan, as it goes in the .daq file.
+*/
+static void make_chan(Chan *c, unsigned long long first, int cnt,
+                      const double *hum, const double *art, int16_t *out)
+{
+   double *buf = c->buf;
+   double  step = sqrt(1 - c->ar * c->ar) * c->noise_sd;
+   double  re = c->wave_re, im = c->wave_im, mag;
+   int     k, t;
+
+   for (k = 0; k < c->units; ++k)
+   {
+      Unit *u = &c->unit[k];
+      while (u->next < first + cnt)
+      {
+         int at = u->next - first;
+         for (t = 0; t < SPIKE_LEN; ++t)
+            buf[at + t] += u->shape[t];
+         u->next += interval(c, u);
+      }
+   }
+   for (t = 0; t < cnt; ++t)
+   {
+      double v, next_re;
+
+      c->last = c->ar * c->last + step * normal(c);
+      v = buf[t] + c->last + c->offset + c->wave_amp * im
+        + c->hum_gain * hum[t] + c->art_gain * art[t];
+      v = nearbyint(v);
+         // -32768 would be written as a zero word, which is a marker
+      out[t] = v < -32767 ? -32767 : v > 32767 ? 32767 : v;
+      next_re = re * c->turn_re - im * c->turn_im;
+      im = re * c->turn_im + im * c->turn_re;
+      re = next_re;
+   }
+      // keep the rounding from growing or shrinking the wave
+   mag = sqrt(re * re + im * im);
+   c->wave_re = re / mag;
+   c->wave_im = im / mag;
+   memmove(buf, buf + cnt, sizeof(double) * SPIKE_LEN);
+   memset(buf + SPIKE_LEN, 0, sizeof(double) * cnt);
+}
+
+
+static FILE *open_half(const char *half)
+{
+   char  name[PATH_MAX];
+   FILE *fd;
+
+   snprintf(name, sizeof(name), "%s_%s_%s.daq", Date, Rec, half);
+   if (!OverWrite && access(name, F_OK) == 0)
+   {
+      fprintf(stderr, "%s already exists, use -f to over-write it\n", name);
+      return NULL;
+   }
+   if ((fd = fopen(name, "w")) == NULL)
+      fprintf(stderr, "Could not create %s, %s\n", name, strerror(errno));
+   return fd;
+}
+
+
+int main (int argc, char **argv)
+{
+   const DaqKernel *kernel = daq_kernel();
+   unsigned long long frames, first, next_art;
+   uint64_t  rng;
+   FILE     *fds[2] = { NULL, NULL };
+   double   *hum, *art;
+   int16_t  *chans[2 * DAQ_CHANS];
+   uint16_t *out;
+   int       chan, half;
+   bool      ok = true;
+
+   if (!parse_args(argc, argv))
+      exit(1);
+
+   frames = Seconds * SAMP_RATE;
+   hum = malloc(sizeof(double) * BLOCK_FRAMES);
+   art = calloc(BLOCK_FRAMES + ART_LEN, sizeof(double));
+   out = malloc(sizeof(uint16_t) * BLOCK_FRAMES * DAQ_FRAME_WORDS);
+   ok = hum && art && out && setup_chans();
+   for (chan = 0; chan < 2 * DAQ_CHANS && ok; ++chan)
+      ok = (chans[chan] = malloc(sizeof(int16_t) * BLOCK_FRAMES)) != NULL;
+   if (!ok)
+   {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+   }
+   if ((DoOne && (fds[0] = open_half("1-64")) == NULL)
+       || (DoTwo && (fds[1] = open_half("65-128")) == NULL))
+      exit(1);
+
+   make_normals();
+   rng = seed_rng(Seed);
+   next_art = -log(1.0 - uniform(&rng)) * SAMP_RATE / ART_RATE;
+   for (first = 0; first < frames && ok; first += BLOCK_FRAMES)
+   {
+      int cnt = frames - first < BLOCK_FRAMES ? frames - first : BLOCK_FRAMES;
+
+      make_common(&rng, &next_art, first, cnt, hum, art);
+      for (half = 0; half < 2 && ok; ++half)
+      {
+         if (!fds[half])
+            continue;
+         for (chan = 0; chan < DAQ_CHANS; ++chan)
+            make_chan(&Chans[half * DAQ_CHANS + chan], first, cnt, hum, art,
+                      chans[half * DAQ_CHANS + chan]);
+         kernel->unsplit(chans + half * DAQ_CHANS, cnt, out);
+         if (fwrite(out, sizeof(uint16_t) * DAQ_FRAME_WORDS, cnt, fds[half]) != (size_t) cnt)
+         {
+            fprintf(stderr, "Error writing the .daq file, %s\n", strerror(errno));
+            ok = false;
+         }
+      }
+      memmove(art, art + cnt, sizeof(double) * ART_LEN);
+      memset(art + ART_LEN, 0, sizeof(double) * cnt);
+   }
+
+   for (half = 0; half < 2; ++half)
+      if (fds[half] && fclose(fds[half]) != 0)
+      {
+         fprintf(stderr, "Error closing the .daq file, %s\n", strerror(errno));
+         ok = false;
+      }
+   if (ok)
+      printf("%s_%s: %llu frames, %.1f seconds\n", Date, Rec, frames, (double) frames / SAMP_RATE);
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,432 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Frame <-> channel conversion.  There is a plain C version, and SSE2 and
+   AVX2 versions that are picked at run time if the cpu has them.
+
+   The vector versions treat a batch of frames as a matrix with one row per
+   frame and one column per channel and transpose it 8 channels at a time.
+   SSE2 does 8 frames x 8 channels per step.  AVX2 does 16 frames by putting
+   frames 0-7 in the low lane and frames 8-15 in the high lane, so after the
+   in-lane transpose each register is 16 samples in a row for one channel.
+   Flipping the high bit converts between offset binary and signed.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "daq_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#define OFFSET_BIT 0x8000
+
+
+/* Plain C. Also used by the vector versions for the leftover frames and to
+   find exactly where a bad frame is.
+*/
+static size_t split_scalar(const uint16_t *frames, size_t nframes, int16_t *const *chans, bool check)
+{
+   size_t f;
+   int    chan;
+
+   for (f = 0; f < nframes; ++f)
+   {
+      const uint16_t *frame = frames + f * DAQ_FRAME_WORDS;
+      const uint16_t *data = frame + DAQ_MARKER_LEN;
+
+      if (check)
+      {
+         bool good = frame[0] == 0 && frame[1] == 0;
+         for (chan = 0; good && chan < DAQ_CHANS; ++chan)
+            good = data[chan] != 0;
+         if (!good)
+            break;
+      }
+      for (chan = 0; chan < DAQ_CHANS; ++chan)
+         if (chans[chan])
+            chans[chan][f] = data[chan] ^ OFFSET_BIT;
+   }
+   return f;
+}
+
+static void unsplit_scalar(int16_t *const *chans, size_t nframes, uint16_t *frames)
+{
+   size_t f;
+   int    chan;
+
+   for (f = 0; f < nframes; ++f)
+   {
+      uint16_t *frame = frames + f * DAQ_FRAME_WORDS;
+      frame[0] = frame[1] = 0;
+      for (chan = 0; chan < DAQ_CHANS; ++chan)
+         frame[DAQ_MARKER_LEN + chan] = chans[chan] ? chans[chan][f] ^ OFFSET_BIT : OFFSET_BIT;
+   }
+}
+
+
+static size_t find_marker_scalar(const uint16_t *words, size_t nwords)
+{
+   size_t w;
+
+   for (w = 0; w + 1 < nwords; ++w)
+      if (words[w] == 0 && words[w+1] == 0)
+         return w;
+   return nwords;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+/* Hand the frames the vector loop did not get to to the plain C version,
+   with the channel pointers moved up to match.
+*/
+static size_t split_tail(const uint16_t *frames, size_t done, size_t nframes, int16_t *const *chans, bool check)
+{
+   int16_t *rest[DAQ_CHANS];
+   int      chan;
+
+   for (chan = 0; chan < DAQ_CHANS; ++chan)
+      rest[chan] = chans[chan] ? chans[chan] + done : NULL;
+   return done + split_scalar(frames + done * DAQ_FRAME_WORDS, nframes - done, rest, check);
+}
+
+static void unsplit_tail(int16_t *const *chans, size_t done, size_t nframes, uint16_t *frames)
+{
+   int16_t *rest[DAQ_CHANS];
+   int      chan;
+
+   for (chan = 0; chan < DAQ_CHANS; ++chan)
+      rest[chan] = chans[chan] ? chans[chan] + done : NULL;
+   unsplit_scalar(rest, nframes - done, frames + done * DAQ_FRAME_WORDS);
+}
+
+static bool markers_ok(const uint16_t *frames, size_t nframes)
+{
+   uint32_t any = 0;
+   size_t   f;
+
+   for (f = 0; f < nframes; ++f)
+   {
+      uint32_t marker;
+      memcpy(&marker, frames + f * DAQ_FRAME_WORDS, sizeof(marker));
+      any |= marker;
+   }
+   return any == 0;
+}
+
+
+__attribute__((target("sse2")))
+static inline void transpose_sse2(__m128i *r)
+{
+   __m128i t0 = _mm_unpacklo_epi16(r[0], r[1]);
+   __m128i t1 = _mm_unpackhi_epi16(r[0], r[1]);
+   __m128i t2 = _mm_unpacklo_epi16(r[2], r[3]);
+   __m128i t3 = _mm_unpackhi_epi16(r[2], r[3]);
+   __m128i t4 = _mm_unpacklo_epi16(r[4], r[5]);
+   __m128i t5 = _mm_unpackhi_epi16(r[4], r[5]);
+   __m128i t6 = _mm_unpacklo_epi16(r[6], r[7]);
+   __m128i t7 = _mm_unpackhi_epi16(r[6], r[7]);
+   __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+   __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+   __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+   __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+   __m128i u4 = _mm_unpacklo_epi32(t4, t6);
+   __m128i u5 = _mm_unpackhi_epi32(t4, t6);
+   __m128i u6 = _mm_unpacklo_epi32(t5, t7);
+   __m128i u7 = _mm_unpackhi_epi32(t5, t7);
+   r[0] = _mm_unpacklo_epi64(u0, u4);
+   r[1] = _mm_unpackhi_epi64(u0, u4);
+   r[2] = _mm_unpacklo_epi64(u1, u5);
+   r[3] = _mm_unpackhi_epi64(u1, u5);
+   r[4] = _mm_unpacklo_epi64(u2, u6);
+   r[5] = _mm_unpackhi_epi64(u2, u6);
+   r[6] = _mm_unpacklo_epi64(u3, u7);
+   r[7] = _mm_unpackhi_epi64(u3, u7);
+}
+
+__attribute__((target("sse2")))
+static size_t split_sse2(const uint16_t *frames, size_t nframes, int16_t *const *chans, bool check)
+{
+   const __m128i flip = _mm_set1_epi16((short)OFFSET_BIT);
+   const __m128i zero = _mm_setzero_si128();
+   size_t f;
+   int    grp, k;
+
+   for (f = 0; f + 8 <= nframes; f += 8)
+   {
+      const uint16_t *base = frames + f * DAQ_FRAME_WORDS + DAQ_MARKER_LEN;
+      __m128i bad = zero;
+
+      if (check && !markers_ok(frames + f * DAQ_FRAME_WORDS, 8))
+         break;
+      for (grp = 0; grp < DAQ_CHANS; grp += 8)
+      {
+         __m128i r[8];
+         for (k = 0; k < 8; ++k)
+         {
+            r[k] = _mm_loadu_si128((const __m128i *)(base + k * DAQ_FRAME_WORDS + grp));
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi16(r[k], zero));
+         }
+         transpose_sse2(r);
+         for (k = 0; k < 8; ++k)
+            if (chans[grp + k])
+               _mm_storeu_si128((__m128i *)(chans[grp + k] + f), _mm_xor_si128(r[k], flip));
+      }
+      if (check && _mm_movemask_epi8(bad))
+         break;     // the plain C version will find which frame it is
+   }
+   return split_tail(frames, f, nframes, chans, check);
+}
+
+__attribute__((target("sse2")))
+static void unsplit_sse2(int16_t *const *chans, size_t nframes, uint16_t *frames)
+{
+   const __m128i flip = _mm_set1_epi16((short)OFFSET_BIT);
+   size_t f;
+   int    grp, k;
+
+   for (f = 0; f + 8 <= nframes; f += 8)
+   {
+      uint16_t *base = frames + f * DAQ_FRAME_WORDS;
+
+      for (k = 0; k < 8; ++k)
+         base[k * DAQ_FRAME_WORDS] = base[k * DAQ_FRAME_WORDS + 1] = 0;
+      for (grp = 0; grp < DAQ_CHANS; grp += 8)
+      {
+         __m128i r[8];
+         for (k = 0; k < 8; ++k)
+            r[k] = chans[grp + k] ? _mm_loadu_si128((const __m128i *)(chans[grp + k] + f))
+                                  : _mm_setzero_si128();
+         transpose_sse2(r);
+         for (k = 0; k < 8; ++k)
+            _mm_storeu_si128((__m128i *)(base + k * DAQ_FRAME_WORDS + DAQ_MARKER_LEN + grp),
+                             _mm_xor_si128(r[k], flip));
+      }
+   }
+   unsplit_tail(chans, f, nframes, frames);
+}
+
+
+/* Compare a run of words and the same run moved up by one word against zero.
+   A bit set in both masks is a zero followed by a zero.
+*/
+__attribute__((target("sse2")))
+static size_t find_marker_sse2(const uint16_t *words, size_t nwords)
+{
+   const __m128i zero = _mm_setzero_si128();
+   size_t w;
+
+   for (w = 0; w + 9 <= nwords; w += 8)
+   {
+      __m128i here = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(words + w)), zero);
+      __m128i next = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(words + w + 1)), zero);
+      unsigned int mask = _mm_movemask_epi8(_mm_and_si128(here, next));
+      if (mask)
+         return w + __builtin_ctz(mask) / 2;
+   }
+   return w + find_marker_scalar(words + w, nwords - w);
+}
+
+__attribute__((target("avx2")))
+static size_t find_marker_avx2(const uint16_t *words, size_t nwords)
+{
+   const __m256i zero = _mm256_setzero_si256();
+   size_t w;
+
+   for (w = 0; w + 17 <= nwords; w += 16)
+   {
+      __m256i here = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(words + w)), zero);
+      __m256i next = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(words + w + 1)), zero);
+      unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(here, next));
+      if (mask)
+         return w + __builtin_ctz(mask) / 2;
+   }
+   return w + find_marker_scalar(words + w, nwords - w);
+}
+
+
+__attribute__((target("avx2")))
+static inline void transpose_avx2(__m256i *r)
+{
+   __m256i t0 = _mm256_unpacklo_epi16(r[0], r[1]);
+   __m256i t1 = _mm256_unpackhi_epi16(r[0], r[1]);
+   __m256i t2 = _mm256_unpacklo_epi16(r[2], r[3]);
+   __m256i t3 = _mm256_unpackhi_epi16(r[2], r[3]);
+   __m256i t4 = _mm256_unpacklo_epi16(r[4], r[5]);
+   __m256i t5 = _mm256_unpackhi_epi16(r[4], r[5]);
+   __m256i t6 = _mm256_unpacklo_epi16(r[6], r[7]);
+   __m256i t7 = _mm256_unpackhi_epi16(r[6], r[7]);
+   __m256i u0 = _mm256_unpacklo_epi32(t0, t2);
+   __m256i u1 = _mm256_unpackhi_epi32(t0, t2);
+   __m256i u2 = _mm256_unpacklo_epi32(t1, t3);
+   __m256i u3 = _mm256_unpackhi_epi32(t1, t3);
+   __m256i u4 = _mm256_unpacklo_epi32(t4, t6);
+   __m256i u5 = _mm256_unpackhi_epi32(t4, t6);
+   __m256i u6 = _mm256_unpacklo_epi32(t5, t7);
+   __m256i u7 = _mm256_unpackhi_epi32(t5, t7);
+   r[0] = _mm256_unpacklo_epi64(u0, u4);
+   r[1] = _mm256_unpackhi_epi64(u0, u4);
+   r[2] = _mm256_unpacklo_epi64(u1, u5);
+   r[3] = _mm256_unpackhi_epi64(u1, u5);
+   r[4] = _mm256_unpacklo_epi64(u2, u6);
+   r[5] = _mm256_unpackhi_epi64(u2, u6);
+   r[6] = _mm256_unpacklo_epi64(u3, u7);
+   r[7] = _mm256_unpackhi_epi64(u3, u7);
+}
+
+__attribute__((target("avx2")))
+static size_t split_avx2(const uint16_t *frames, size_t nframes, int16_t *const *chans, bool check)
+{
+   const __m256i flip = _mm256_set1_epi16((short)OFFSET_BIT);
+   const __m256i zero = _mm256_setzero_si256();
+   size_t f;
+   int    grp, k;
+
+   for (f = 0; f + 16 <= nframes; f += 16)
+   {
+      const uint16_t *base = frames + f * DAQ_FRAME_WORDS + DAQ_MARKER_LEN;
+      __m256i bad = zero;
+
+      if (check && !markers_ok(frames + f * DAQ_FRAME_WORDS, 16))
+         break;
+      for (grp = 0; grp < DAQ_CHANS; grp += 8)
+      {
+         __m256i r[8];
+         for (k = 0; k < 8; ++k)   // frame k in the low lane, frame k+8 in the high one
+         {
+            const uint16_t *lo = base + k * DAQ_FRAME_WORDS + grp;
+            const uint16_t *hi = lo + 8 * DAQ_FRAME_WORDS;
+            r[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo)),
+                                           _mm_loadu_si128((const __m128i *)hi), 1);
+            bad = _mm256_or_si256(bad, _mm256_cmpeq_epi16(r[k], zero));
+         }
+         transpose_avx2(r);
+         for (k = 0; k < 8; ++k)
+            if (chans[grp + k])
+               _mm256_storeu_si256((__m256i *)(chans[grp + k] + f), _mm256_xor_si256(r[k], flip));
+      }
+      if (check && _mm256_movemask_epi8(bad))
+         break;
+   }
+   return split_tail(frames, f, nframes, chans, check);
+}
+
+__attribute__((target("avx2")))
+static void unsplit_avx2(int16_t *const *chans, size_t nframes, uint16_t *frames)
+{
+   const __m256i flip = _mm256_set1_epi16((short)OFFSET_BIT);
+   size_t f;
+   int    grp, k;
+
+   for (f = 0; f + 16 <= nframes; f += 16)
+   {
+      uint16_t *base = frames + f * DAQ_FRAME_WORDS;
+
+      for (k = 0; k < 16; ++k)
+         base[k * DAQ_FRAME_WORDS] = base[k * DAQ_FRAME_WORDS + 1] = 0;
+      for (grp = 0; grp < DAQ_CHANS; grp += 8)
+      {
+         __m256i r[8];
+         for (k = 0; k < 8; ++k)
+            r[k] = chans[grp + k] ? _mm256_loadu_si256((const __m256i *)(chans[grp + k] + f))
+                                  : _mm256_setzero_si256();
+         transpose_avx2(r);
+         for (k = 0; k < 8; ++k)
+         {
+            __m256i v = _mm256_xor_si256(r[k], flip);
+            uint16_t *lo = base + k * DAQ_FRAME_WORDS + DAQ_MARKER_LEN + grp;
+            _mm_storeu_si128((__m128i *)lo, _mm256_castsi256_si128(v));
+            _mm_storeu_si128((__m128i *)(lo + 8 * DAQ_FRAME_WORDS), _mm256_extracti128_si256(v, 1));
+         }
+      }
+   }
+   unsplit_tail(chans, f, nframes, frames);
+}
+
+#endif
+
+
+static const DaqKernel Kernels[] =
+{
+   { "scalar", split_scalar, unsplit_scalar, find_marker_scalar },
+#ifdef HAVE_X86_KERNELS
+   { "sse2", split_sse2, unsplit_sse2, find_marker_sse2 },
+   { "avx2", split_avx2, unsplit_avx2, find_marker_avx2 },
+#endif
+};
+
+static bool usable(const DaqKernel *kernel)
+{
+#ifdef HAVE_X86_KERNELS
+   __builtin_cpu_init();
+   if (kernel->split == split_sse2)
+      return __builtin_cpu_supports("sse2");
+   if (kernel->split == split_avx2)
+      return __builtin_cpu_supports("avx2");
+#endif
+   return true;
+}
+
+int daq_kernel_list(const DaqKernel **list, int max)
+{
+   int k, cnt = 0;
+
+   for (k = 0; k < (int)(sizeof(Kernels) / sizeof(Kernels[0])) && cnt < max; ++k)
+      if (usable(&Kernels[k]))
+         list[cnt++] = &Kernels[k];
+   return cnt;
+}
+
+static const DaqKernel *Best;
+static pthread_once_t   BestOnce = PTHREAD_ONCE_INIT;
+
+   // pick the kernel, once, before any caller sees it
+static void choose_kernel(void)
+{
+   const DaqKernel *list[8], *best;
+   const char *want;
+   int k, cnt;
+
+   cnt = daq_kernel_list(list, 8);
+   best = list[cnt - 1];
+   if ((want = getenv("DAQ_KERNEL")) != NULL)
+   {
+      for (k = 0; k < cnt; ++k)
+         if (strcmp(list[k]->name, want) == 0)
+            best = list[k];
+   }
+   Best = best;
+}
+
+const DaqKernel *daq_kernel(void)
+{
+   pthread_once(&BestOnce, choose_kernel);
+   return Best;
+}
@@ -0,0 +1,73 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   The .daq frame layout and the routines that move data between frames and
+   per-channel runs of samples.
+
+   A .daq file is a series of frames.  Each frame is two 0000 marker words
+   followed by one word for each of 64 channels.  The words are offset
+   binary, the .chan, .bin, etc. files are signed, so 0x8000 in a .daq file
+   is 0 everywhere else.  A data word of 0000 can't happen in a good file,
+   that is how the markers are found.
+*/
+
+#ifndef DAQ_KERNEL_H
+#define DAQ_KERNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DAQ_CHANS 64
+#define DAQ_MARKER_LEN 2
+#define DAQ_FRAME_WORDS (DAQ_CHANS + DAQ_MARKER_LEN)
+#define DAQ_FRAME_BYTES (DAQ_FRAME_WORDS * 2)
+
+typedef struct
+{
+   const char *name;
+
+      /* Convert nframes frames into per-channel runs of samples.  Channel c
+         goes to chans[c][0..nframes-1], or is skipped if chans[c] is NULL.
+         If check is true, stop at the first frame that does not have two
+         zero markers and 64 non-zero data words.
+         Returns the number of frames converted.
+      */
+   size_t (*split)(const uint16_t *frames, size_t nframes, int16_t *const *chans, bool check);
+
+      /* The other way around.  Build nframes frames, markers included, from
+         per-channel runs.  A NULL chans[c] gets the zero value, 0x8000.
+      */
+   void (*unsplit)(int16_t *const *chans, size_t nframes, uint16_t *frames);
+
+      /* Find the first pair of zero words, i.e. a possible frame marker.
+         Returns the word offset of the first zero, or nwords if there is
+         no pair.
+      */
+   size_t (*find_marker)(const uint16_t *words, size_t nwords);
+} DaqKernel;
+
+   // the fastest kernel this cpu can run, or the one named in $DAQ_KERNEL
+const DaqKernel *daq_kernel(void);
+
+   // all kernels this cpu can run, slowest first
+int daq_kernel_list(const DaqKernel **list, int max);
+
+#endif
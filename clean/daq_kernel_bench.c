@@ -0,0 +1,152 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Time the frame kernels against the word at a time loop daq2_split used to
+   have.  Everything is in memory, so this is cpu time only, on one core.
+   The kernels' output is checked against the old loop's.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "daq_kernel.h"
+
+#define FRAMES (256 * 1024)    // 33 MB of .daq data, about 10 seconds of recording
+#define REPEAT 10
+
+static double now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The old daq2_split inner loop, minus the stdio calls. */
+static size_t split_legacy(const uint16_t *words, size_t nwords, int16_t *const *chans)
+{
+   size_t w, len[DAQ_CHANS] = {0};
+   int    cidx = DAQ_CHANS;
+   bool   sawzero = false;
+
+   for (w = 0; w < nwords; ++w)
+   {
+      unsigned short daqbuf = words[w];
+      if (cidx == DAQ_CHANS && daqbuf != 0)
+         return 0;
+      if (daqbuf == 0)
+      {
+         if (cidx != (sawzero ? 0 : DAQ_CHANS))
+            return 0;
+         sawzero = true;
+         cidx = 0;
+         continue;
+      }
+      sawzero = false;
+      chans[cidx][len[cidx]++] = (int)daqbuf - 32768;
+      cidx++;
+   }
+   return len[0];
+}
+
+static void report(const char *name, const char *what, double secs)
+{
+   double bytes = (double)FRAMES * DAQ_FRAME_BYTES * REPEAT;
+   printf("  %-8s %-8s %7.2f GB/s  %7.1f Mframes/s\n", name, what,
+          bytes / secs / 1e9, FRAMES * (double)REPEAT / secs / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+   uint16_t *frames = malloc(sizeof(uint16_t) * FRAMES * DAQ_FRAME_WORDS);
+   uint16_t *rebuilt = malloc(sizeof(uint16_t) * FRAMES * DAQ_FRAME_WORDS);
+   int16_t  *ref[DAQ_CHANS], *out[DAQ_CHANS];
+   const DaqKernel *list[8];
+   size_t   f;
+   int      chan, k, rep, cnt;
+   double   start;
+
+   if (!frames || !rebuilt)
+   {
+      printf("Out of memory\n");
+      return 1;
+   }
+   srandom(1);
+   for (f = 0; f < FRAMES; ++f)
+   {
+      uint16_t *frame = frames + f * DAQ_FRAME_WORDS;
+      frame[0] = frame[1] = 0;
+      for (chan = 0; chan < DAQ_CHANS; ++chan)
+         frame[DAQ_MARKER_LEN + chan] = 1 + random() % 0xffff;
+   }
+   for (chan = 0; chan < DAQ_CHANS; ++chan)
+   {
+      ref[chan] = malloc(sizeof(int16_t) * FRAMES);
+      out[chan] = malloc(sizeof(int16_t) * FRAMES);
+      if (!ref[chan] || !out[chan])
+      {
+         printf("Out of memory\n");
+         return 1;
+      }
+   }
+
+   printf("%d frames x %d passes, one core\n", FRAMES, REPEAT);
+
+   start = now();
+   for (rep = 0; rep < REPEAT; ++rep)
+      split_legacy(frames, (size_t)FRAMES * DAQ_FRAME_WORDS, ref);
+   report("legacy", "split", now() - start);
+
+   cnt = daq_kernel_list(list, 8);
+   for (k = 0; k < cnt; ++k)
+   {
+      start = now();
+      for (rep = 0; rep < REPEAT; ++rep)
+         if (list[k]->split(frames, FRAMES, out, true) != FRAMES)
+         {
+            printf("%s split stopped early\n", list[k]->name);
+            return 1;
+         }
+      report(list[k]->name, "split", now() - start);
+      for (chan = 0; chan < DAQ_CHANS; ++chan)
+         if (memcmp(ref[chan], out[chan], sizeof(int16_t) * FRAMES) != 0)
+         {
+            printf("%s split does not match the legacy loop on chan %d\n", list[k]->name, chan + 1);
+            return 1;
+         }
+
+      start = now();
+      for (rep = 0; rep < REPEAT; ++rep)
+         list[k]->unsplit(out, FRAMES, rebuilt);
+      report(list[k]->name, "unsplit", now() - start);
+      if (memcmp(frames, rebuilt, sizeof(uint16_t) * FRAMES * DAQ_FRAME_WORDS) != 0)
+      {
+         printf("%s unsplit does not rebuild the original frames\n", list[k]->name);
+         return 1;
+      }
+   }
+   printf("default kernel: %s\n", daq_kernel()->name);
+   return 0;
+}
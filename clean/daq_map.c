@@ -0,0 +1,124 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Memory mapped .daq files.  See daq_map.h.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "daq_map.h"
+
+
+bool daq_map_open(DaqMap *map, const char *name)
+{
+   struct stat info;
+   void  *addr = NULL;
+   size_t w;
+
+   memset(map, 0, sizeof(*map));
+   map->fd = -1;
+   map->nc.fd = -1;
+
+   if ((map->fd = open(name, O_RDONLY)) == -1)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      return false;
+   }
+   if (fstat(map->fd, &info) == -1)
+   {
+      printf("Error reading the size of %s, %s\n", name, strerror(errno));
+      daq_map_close(map);
+      return false;
+   }
+   nocache_open(&map->nc, map->fd, 0);
+   if (info.st_size == 0)
+      return true;
+
+   addr = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, map->fd, 0);
+   if (addr == MAP_FAILED)
+   {
+      printf("Error mapping %s, %s\n", name, strerror(errno));
+      daq_map_close(map);
+      return false;
+   }
+   madvise(addr, info.st_size, MADV_SEQUENTIAL);
+   map->words = addr;
+   map->nwords = info.st_size / sizeof(uint16_t);
+
+      // a recording starts with a frame, but be forgiving and look for the
+      // first pair of markers in case there is junk at the front
+   for (w = 0; w + 1 < map->nwords; ++w)
+      if (map->words[w] == 0 && map->words[w+1] == 0)
+         break;
+   map->first = w;
+   if (map->nwords > map->first)
+      map->frames = (map->nwords - map->first) / DAQ_FRAME_WORDS;
+   return true;
+}
+
+
+void daq_map_close(DaqMap *map)
+{
+   if (map->words)
+      munmap((void *)map->words, map->nwords * sizeof(uint16_t));
+   if (map->fd != -1)
+   {
+      nocache_close(&map->nc, map->nwords * sizeof(uint16_t));
+      close(map->fd);
+   }
+   memset(map, 0, sizeof(*map));
+   map->fd = -1;
+   map->nc.fd = -1;
+}
+
+
+void daq_map_willneed(const DaqMap *map, size_t frame, size_t nframes)
+{
+   long      page = sysconf(_SC_PAGESIZE);
+   uintptr_t start, end;
+
+   if (frame >= map->frames)
+      return;
+   if (nframes > map->frames - frame)
+      nframes = map->frames - frame;
+
+      // madvise wants a page aligned start
+   start = (uintptr_t)daq_map_frame(map, frame) & ~(uintptr_t)(page - 1);
+   end = (uintptr_t)daq_map_frame(map, frame + nframes);
+   madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+
+void daq_map_done(DaqMap *map, size_t frame)
+{
+   if (map->words && frame <= map->frames)
+      nocache_mapped(&map->nc, map->words, (const char *)daq_map_frame(map, frame) - (const char *)map->words);
+}
@@ -0,0 +1,69 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   A memory mapped, read only view of a .daq file as an array of frames.
+   Nothing is copied, frame n is just a pointer into the mapping, so frame n
+   of a 1-64 file and frame n of its 65-128 file are the same point in time.
+*/
+
+#ifndef DAQ_MAP_H
+#define DAQ_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "daq_kernel.h"
+#include "nocache.h"
+
+typedef struct
+{
+   int             fd;
+   const uint16_t *words;     // the whole file
+   size_t          nwords;
+   size_t          first;     // word offset of the first frame's markers
+   size_t          frames;    // whole frames from first to the end of the file
+   NoCache         nc;
+} DaqMap;
+
+/* Map the file and find the first frame.  Prints a message and returns
+   false if the file can't be opened or mapped.  An empty file is fine, it
+   just has no frames.
+*/
+bool daq_map_open(DaqMap *map, const char *name);
+void daq_map_close(DaqMap *map);
+
+   // ask the kernel to start reading these frames in now
+void daq_map_willneed(const DaqMap *map, size_t frame, size_t nframes);
+
+   // done with the frames before this one, with NoCacheOn they are let go
+void daq_map_done(DaqMap *map, size_t frame);
+
+static inline const uint16_t *daq_map_frame(const DaqMap *map, size_t frame)
+{
+   return map->words + map->first + frame * DAQ_FRAME_WORDS;
+}
+
+   // the 64 data words of a frame, after the markers
+static inline const uint16_t *daq_map_data(const DaqMap *map, size_t frame)
+{
+   return daq_map_frame(map, frame) + DAQ_MARKER_LEN;
+}
+
+#endif
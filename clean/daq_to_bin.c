@@ -34,6 +34,8 @@
        chan1 sample 2
            ...
    For subsets of channels, there will be fewer words in each sample block.
+
+   With -smr, a Spike2 .smr file is written instead, see son_write.h.
 */
 
 
@@ -54,12 +56,19 @@
 #include <getopt.h>
 #include <errno.h>
 #include <dirent.h> 
+#include <limits.h>
+#include "daq_map.h"
+#include "rec_reader.h"
+#include "tool_stats.h"
+#include "son_write.h"
 
 #define MAX_CHANS 128
 #define CHANS_PER_SAMP 64
 #define MARKER_LEN 2          // 2 leading 0000 0000 words per sample in daq file
 #define WORDS_PER_SAMP (CHANS_PER_SAMP+MARKER_LEN)
 #define BYTES_PER_SAMP (WORDS_PER_SAMP*2)
+#define BIN_BLOCK_FRAMES (16*1024)  // frames converted per write
+#define SAMP_RATE 25000       // frames per second
 
 bool DoOne = true;
 bool DoTwo = true;
@@ -74,14 +83,22 @@ char RecNo[128];
 char Daq0[PATH_MAX];
 char Daq1[PATH_MAX];
 char Bin[PATH_MAX];
+unsigned long long StartSamp = 0;          // window to convert, in frames
+unsigned long long EndSamp = ULLONG_MAX;
+bool Stats = false;
+char *StatsFile = NULL;
+bool Smr = false;
 
 #define BIN_EXT ".bin"
+#define SMR_EXT ".smr"
 #define DAQ_EXT ".daq"
 
 static void usage(char *name)
 {
    printf (
-"\nUsage: %s -r recording_num [-f] [-t tag_text] [subset of chans, e.g. 2 3 7-19 119 127]\n"\
+"\nUsage: %s -r recording_num [-f] [-t tag_text] [-start time] [-end time] [-smr] [-nocache]\n"\
+"          [-stats[=FILE]]\n"\
+"          [subset of chans, e.g. 2 3 7-19 119 127]\n"\
 "\n"\
 "Scan one or two .daq files and create an interleaved .bin file that can be imported \n"\
 "by the CED spike2 program.\n"\
@@ -98,15 +115,50 @@ static void usage(char *name)
 "OPTIONS\n"\
 "-f to force over-writing existing output file.\n"\
 "-t tag_text to add tag_text to the filename.\n"\
+"-start time and -end time to convert only that part of the recording.  The\n"\
+"   time is in seconds if it ends in s, e.g. 90s or 12.5s, otherwise it is a\n"\
+"   sample number, e.g. 2250000.  There are 25000 samples per second.  The\n"\
+"   end is not included.  Consider a -t tag so the full .bin is not replaced.\n"\
+"-smr writes a Spike2 .smr data file instead of the .bin, which Spike2 opens\n"\
+"   as it is, without importing it.  The chans keep their numbers, and are\n"\
+"   titled from YYYY-MM-DD_REC.lbl if it is here.  A .smr can hold at most\n"\
+"   23.6 hours.\n"\
+"-nocache keeps the files from filling up the page cache, for a shared\n"\
+"   machine.  What has been read or written is let go a few MB behind,\n"\
+"   and the output file gets its space up front.\n"\
+"-stats writes a line of JSON to stderr, or appends it to FILE, at the end\n"\
+"   with the bytes and frames written, the time spent reading, converting,\n"\
+"   and writing, the number of read and write calls, and the throughput.\n"\
 "List of chan numbers in the range of 1-128 to create a .bin with a subset of chans.\n"\
 "Ranges of numbers are supported, e.g., 16-32.\n"\
 "NOTE:  When you import the file in Spike2, you have to tell it the number of channels.\n"\
 "\n"\
-"Example use:   daq_to_bin -f 001 1-10 66-68 100 109 121\n",
+"Example use:   daq_to_bin -f 001 1-10 66-68 100 109 121\n"\
+"               daq_to_bin -r 001 -start 600s -end 660s -t stim1 1-10\n",
 name
 );
 }
 
+/* Parse a -start or -end time, seconds if it ends in s, otherwise a sample
+   number.  Returns false if it is neither.
+*/
+static bool parse_time(const char *arg, unsigned long long *samp)
+{
+   char  *end;
+   double secs;
+
+   if (!isdigit(arg[0]) && arg[0] != '.')
+      return false;
+   secs = strtod(arg, &end);
+   if (end != arg && strcmp(end, "s") == 0)
+   {
+      *samp = secs * SAMP_RATE + 0.5;
+      return true;
+   }
+   *samp = strtoull(arg, &end, 10);
+   return end != arg && *end == 0;
+}
+
 static int parse_args(int argc, char *argv[])
 {
    static struct option opts[] = { 
@@ -114,6 +166,11 @@ static int parse_args(int argc, char *argv[])
                                    {"f", no_argument, NULL, '2'},
                                    {"d", no_argument, NULL, '3'},
                                    {"tag", required_argument, NULL, '4'},
+                                   {"start", required_argument, NULL, '5'},
+                                   {"end", required_argument, NULL, '6'},
+                                   {"stats", optional_argument, NULL, '7'},
+                                   {"nocache", no_argument, NULL, '8'},
+                                   {"smr", no_argument, NULL, '9'},
                                    { 0,0,0,0} };
    int cmd;
    int ret = 0;
@@ -158,6 +215,35 @@ static int parse_args(int argc, char *argv[])
                   // will be taken as the file name tag.
                }
                break;
+
+         case '5':
+               if (!parse_time(optarg,&StartSamp))
+               {
+                  printf("%s is not a valid start time, aborting. . .\n",optarg);
+                  exit(1);
+               }
+               break;
+
+         case '6':
+               if (!parse_time(optarg,&EndSamp))
+               {
+                  printf("%s is not a valid end time, aborting. . .\n",optarg);
+                  exit(1);
+               }
+               break;
+
+         case '7':
+               Stats = true;
+               StatsFile = optarg;
+               break;
+
+         case '8':
+               NoCacheOn = true;
+               break;
+
+         case '9':
+               Smr = true;
+               break;
  
          case '?':
          default:
@@ -167,6 +253,12 @@ static int parse_args(int argc, char *argv[])
       }
    }
 
+   if (ret && EndSamp <= StartSamp)
+   {
+      printf("The end time must be after the start time, aborting. . .\n");
+      ret = 0;
+   }
+
    if (ret)
    {
       if (optind < argc)
@@ -234,50 +326,6 @@ static int parse_args(int argc, char *argv[])
 }
 
 
-/* Find the daq files for the recording number in the current dir,
-   then stick it/them in global name holder vars.
-   Returns true of it finds one.
-           false otherwise.
-*/
-static bool find_daq()
-{
-   DIR    *curr_dir;
-   struct dirent *dir;
-   bool   ret = false;
-   
-   curr_dir = opendir(".");
-   if (curr_dir)
-   {
-           // find .daq file with current RecNo.  
-           // (this can be fooled with sufficiently evil filename.)
-       while ((dir = readdir(curr_dir)) != NULL)
-       {
-          if (strstr(dir->d_name,DAQ_EXT))
-          {
-             if (strstr(dir->d_name,RecNo))
-             {
-                if (strstr(dir->d_name,"1-64"))
-                {
-                   strncpy(Daq0,dir->d_name, sizeof(Daq0)-1);
-                   ret = true;
-                }
-                else if (strstr(dir->d_name,"65-128"))
-                {
-                   strncpy(Daq1,dir->d_name, sizeof(Daq0)-1);
-                   ret = true;
-                }
-                else   // assume old 1-64 daq file
-                {
-                   strncpy(Daq0,dir->d_name, sizeof(Daq0)-1);
-                   ret = true;
-                }
-             }
-          }
-      }
-      closedir(curr_dir);
-   }
-   return ret;
-}
       
       
 /* What we are here for.  Read all of the chan files selected in the SelList array
@@ -290,31 +338,43 @@ static bool find_daq()
 static bool create_bin()
 {
    FILE *bin_fd;
-   FILE *daq0_fd = NULL;
-   FILE *daq1_fd = NULL;
+   DaqMap daq0, daq1;
    int chan;
    unsigned long long feedback = 0, count = 0;
-   struct stat info;
    double percent;
    char input[256];
-   unsigned short sample0[WORDS_PER_SAMP];
-   unsigned short sample1[WORDS_PER_SAMP];
-   size_t res;
    bool  done = false, dec_sel = false;;
    int  yr, mon, day;
-
-   if (Daq0[0] != 0)
+   int  sel0[CHANS_PER_SAMP], sel1[CHANS_PER_SAMP];
+   int  nsel0 = 0, nsel1 = 0;
+   size_t frames, first, frame, block, k;
+   unsigned long long words = 0;
+   short *outbuf;
+   NoCache out_nc;
+   SonChan son_chans[MAX_CHANS];
+   char labels[MAX_CHANS][SON_LABEL_LEN] = {{0}};
+   char recording[PATH_MAX];
+   SonWriter *son = NULL;
+   off_t out_size;
+
+   memset(&daq0, 0, sizeof(daq0));
+   memset(&daq1, 0, sizeof(daq1));
+   daq0.fd = daq1.fd = -1;
+
+   if (Daq0[0] == 0)
    {
-      if ( (daq0_fd = fopen(Daq0,"r")) == NULL)
-      {
-         printf("Error opening %s, aborting. . .\n",Daq0);
-         exit(1);
-      }
+      printf("There is no 1-64 .daq file for recording %s, aborting. . .\n",RecNo);
+      exit(1);
+   }
+   if (!daq_map_open(&daq0, Daq0))
+   {
+      printf("Error opening %s, aborting. . .\n",Daq0);
+      exit(1);
    }
 
    if (Daq1[0] != 0)
    {
-      if ( (daq1_fd = fopen(Daq1,"r")) == NULL)
+      if (!daq_map_open(&daq1, Daq1))
       {
          printf("Error opening %s, aborting. . .\n",Daq1);
          exit(1);
@@ -341,10 +401,11 @@ static bool create_bin()
 
     // assume if here, at least a Daq0 file
    sscanf(Daq0,"%d-%d-%d", &yr,&mon,&day);
+   sprintf(recording,"%04d-%02d-%02d_%s", yr,mon,day,RecNo);
    if (UsrTag[0] !=0)
-      sprintf(Bin,"%04d-%02d-%02d_%s_%s_%d_%s%s", yr,mon,day,RecNo,OutTag,SelChans,UsrTag,BIN_EXT);
+      sprintf(Bin,"%s_%s_%d_%s%s", recording,OutTag,SelChans,UsrTag,Smr ? SMR_EXT : BIN_EXT);
    else
-      sprintf(Bin,"%04d-%02d-%02d_%s_%s_%d%s", yr,mon,day,RecNo,OutTag,SelChans,BIN_EXT);
+      sprintf(Bin,"%s_%s_%d%s", recording,OutTag,SelChans,Smr ? SMR_EXT : BIN_EXT);
 
    printf("%d channels selected\n",SelChans);
    printf("Creating %s file for %s ",Bin, Daq0);
@@ -352,16 +413,31 @@ static bool create_bin()
       printf("\nand for %s",Daq1);
    printf("\n");
 
-
-   fstat(fileno(daq0_fd),&info);
-   percent = info.st_size/(BYTES_PER_SAMP);     // # samples in file
-
-   if (percent == 0)
+   frames = daq0.frames;
+   if (Daq1[0] && daq1.frames < frames)   // really should be the same size, but. . .
+      frames = daq1.frames;
+   if (frames == 0)
    {
       printf("Could not find any .daq files with data, aborting. . . \n");
+      daq_map_close(&daq0);
+      daq_map_close(&daq1);
       return false; 
    }
 
+      // the frames are mapped, so starting partway in is just an offset
+   first = StartSamp;
+   if (EndSamp < frames)
+      frames = EndSamp;
+   if (first >= frames)
+   {
+      printf("The start time is past the end of the recording (%.1f seconds), aborting. . .\n",
+             (double) frames / SAMP_RATE);
+      daq_map_close(&daq0);
+      daq_map_close(&daq1);
+      return false; 
+   }
+   percent = frames - first;     // # samples to convert
+
    if (!OverWrite && access(Bin,F_OK) == 0)
    {
       printf("WARNING:  The file %s already exists.\n  Okay to over-write (Y/N)?  ",Bin);
@@ -380,64 +456,103 @@ static bool create_bin()
       goto error;
    }
 
-         // grab a sample. If the chan is selected in SelList
-         // add it to the .bin file.
-   while (!done)
+   for (chan = 0; chan < CHANS_PER_SAMP; chan++)
+   {
+      if (SelList[chan])
+         sel0[nsel0++] = chan;
+      if (Daq1[0] && SelList[chan + CHANS_PER_SAMP])
+         sel1[nsel1++] = chan;
+   }
+
+   if (Smr)
    {
-      res = fread(sample0,sizeof(sample0),1,daq0_fd);
-      if (res == 0)
+      char lblname[PATH_MAX + sizeof(SON_LBL_EXT)];
+
+      snprintf(lblname, sizeof(lblname), "%s%s", recording, SON_LBL_EXT);
+      son_read_labels(lblname, labels, MAX_CHANS);
+      for (chan = 0; chan < nsel0 + nsel1; chan++)
       {
-         done = true;
-         break;
+         int number = chan < nsel0 ? sel0[chan] + 1 : sel1[chan - nsel0] + CHANS_PER_SAMP + 1;
+         son_chans[chan].number = number;
+         strcpy(son_chans[chan].label, labels[number - 1]);
       }
-      if (daq1_fd)
+      son = son_open(bin_fd, son_chans, nsel0 + nsel1, SAMP_RATE, frames - first, recording);
+      if (!son)
       {
-         res = fread(sample1,sizeof(sample1),1,daq1_fd);
-         if (res == 0) // really shouldn't get here if files same size, but. . .
-         {
-            done = true;
-            break;
-         }
+         if (errno == EFBIG)
+            printf("The recording is too long for a .smr file, use -start and -end, aborting. . .\n");
+         else
+            printf("Problem writing output file %s, aborting. . .\n",Bin);
+         fclose(bin_fd);
+         goto error;
       }
+      nocache_open(&out_nc, fileno(bin_fd), son_file_size(nsel0 + nsel1, frames - first));
+   }
+   else
+      nocache_open(&out_nc, fileno(bin_fd), (frames - first) * (nsel0 + nsel1) * sizeof(short));
 
+   outbuf = malloc(sizeof(short) * BIN_BLOCK_FRAMES * MAX_CHANS);
+   if (!outbuf)
+   {
+      printf("Out of memory, aborting. . .\n");
+      if (son)
+         son_close(son, &out_size);
+      nocache_close(&out_nc, 0);
+      fclose(bin_fd);
+      goto error;
+   }
 
-
-            // 1-64
-      for (chan = 0; chan < CHANS_PER_SAMP ; chan++)
+         // Go through the frames a block at a time, picking the selected
+         // chans straight out of the mapped .daq files into the output
+         // buffer, then write the block.  A frame is already a .bin row, so
+         // this is faster than daq_kernel's split into chan runs.
+   for (frame = first; frame < frames && !done; frame += block)
+   {
+      short *out = outbuf;
+
+      block = frames - frame;
+      if (block > BIN_BLOCK_FRAMES)
+         block = BIN_BLOCK_FRAMES;
+      daq_map_willneed(&daq0, frame + block, BIN_BLOCK_FRAMES);
+      if (Daq1[0])
+         daq_map_willneed(&daq1, frame + block, BIN_BLOCK_FRAMES);
+
+      stats_phase(STATS_READ);
+      stats_touch(daq_map_frame(&daq0, frame), block * DAQ_FRAME_WORDS * sizeof(uint16_t));
+      if (nsel1)
+         stats_touch(daq_map_frame(&daq1, frame), block * DAQ_FRAME_WORDS * sizeof(uint16_t));
+      stats_phase(STATS_CONVERT);
+      for (k = 0; k < block; k++)
       {
-         if (SelList[chan])
+         const unsigned short *sample0 = daq_map_data(&daq0, frame + k);
+         int  sel;
+            // 1-64
+         for (sel = 0; sel < nsel0; sel++)
+            *out++ = (int) sample0[sel0[sel]] - 32768;
+            // 65-128
+         if (nsel1)
          {
-            short chanbuf = (int) sample0[chan+MARKER_LEN] - 32768;
-            res = fwrite(&chanbuf,sizeof(chanbuf),1,bin_fd);
-            if (res != 1)
-            {
-               printf("Error writing to output file %s\n",Bin);
-               done = true;
-               break;
-            }
+            const unsigned short *sample1 = daq_map_data(&daq1, frame + k);
+            for (sel = 0; sel < nsel1; sel++)
+               *out++ = (int) sample1[sel1[sel]] - 32768;
          }
       }
-      // 65-128
-      if (daq1_fd)
+
+      stats_phase(STATS_WRITE);
+      if (son ? !son_write(son, outbuf, block)
+              : fwrite(outbuf, sizeof(short), out - outbuf, bin_fd) != (size_t)(out - outbuf))
       {
-         for (chan = 0; chan < CHANS_PER_SAMP ; chan++)
-         {
-            if (SelList[chan + CHANS_PER_SAMP])   // 64-127
-            {
-               short chanbuf = (int) sample1[chan+MARKER_LEN] - 32768;
-               res = fwrite(&chanbuf,sizeof(chanbuf),1,bin_fd);
-               if (res != 1)
-               {
-                  printf("Error writing to output file %s\n",Bin);
-                  done = true;
-                  break;
-               }
-            }
-         }
+         printf("Error writing to output file %s\n",Bin);
+         done = true;
       }
+      words += out - outbuf;
+      nocache_wrote(&out_nc, son ? son_written(son) : (off_t) (words * sizeof(short)));
+      daq_map_done(&daq0, frame + block);
+      daq_map_done(&daq1, frame + block);
+      stats_phase(STATS_OTHER);
 
-      ++feedback;
-      ++count;
+      feedback += block;
+      count += block;
 
       if (count > 1024)
       {
@@ -446,22 +561,30 @@ static bool create_bin()
          count = 0;
       }
    }
+   free(outbuf);
 
    if (bin_fd)
    {
       printf("\r  %3.0f%%",(feedback/percent)*100.0);
       printf("\nCompleting write. . .\n"); // there can be a lot buffered data, 
       fflush(stdout);                      // closing can take many seconds, so reassure user
+      stats_phase(STATS_WRITE);
+      out_size = words * sizeof(short);
+      if (son && !son_close(son, &out_size))
+         printf("Error writing to output file %s\n",Bin);
+      if (fflush(bin_fd) == 0)
+         nocache_close(&out_nc, out_size);
       fclose(bin_fd);
+      stats_phase(STATS_OTHER);
+      stats_add(feedback * DAQ_FRAME_WORDS * sizeof(uint16_t) * (nsel1 ? 2 : 1),
+                out_size, feedback);
       printf("Creation of %s is complete.\n", Bin);
       fflush(stdout);
    }
 
 error:
-   if (daq0_fd)
-      fclose(daq0_fd);
-   if (daq1_fd)
-      fclose(daq1_fd);
+   daq_map_close(&daq0);
+   daq_map_close(&daq1);
 
    return true;
 }
@@ -475,6 +598,8 @@ int main (int argc, char **argv)
 
    if (!parse_args(argc, argv))
       exit(1);
+   if (Stats && !stats_start(StatsFile, argc, argv))
+      error(1, errno, "Can't start -stats");
 
    if (Debug)
    {
@@ -482,7 +607,7 @@ int main (int argc, char **argv)
       getchar();
    }
 
-   if (!find_daq())
+   if (!rec_find_daq(".", RecNo, Daq0, Daq1, sizeof(Daq0)))
    {
       printf("\nCould not find any .daq files for recording number %s, exiting. . .\n",RecNo);
       usage(argv[0]);
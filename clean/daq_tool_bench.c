@@ -0,0 +1,603 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+   Time the conversion tools, daq2_split, daq2_unsplit, chans_to_bin, and
+   daq_to_bin, on a synthetic recording made by daq_gen.
+
+   Each tool is run as it would be from the shell, a few times, and the best
+   time is kept.  For each one this reports the MB/s of the files it reads,
+   samples per second, the peak RSS, and the read and write calls counted
+   by the kernel in /proc/PID/io.  The tool is then run once more under
+   ptrace to count all of its system calls.  That run is not timed.
+
+   The results can be saved and later runs compared to them, to show that a
+   change made a tool faster, or catch one that made it slower.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <linux/limits.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include "daq_kernel.h"
+
+#define SAMP_RATE 25000
+#define DATE "2000-01-01"
+#define REC "001"
+#define MAX_ARGS 8
+#define MAX_TIDS 1024
+#define TRACE_FAILED 126       // exit code when the child can't be traced
+
+typedef struct
+{
+   const char *name;
+   const char *subdir;         // of the recording's dir, or NULL
+   const char *args[MAX_ARGS]; // args[0] is the program
+   double      bytes;          // read from its input files
+   double      samples;
+} Run;
+
+typedef struct
+{
+   double secs;                // best of the runs
+   long   rss_kb;
+   unsigned long long reads, writes;
+   long long syscalls;         // -1 when they could not be counted
+} Result;
+
+double Seconds = 30;
+int    Repeat = 3;
+int    Tolerance = 10;         // percent
+bool   Cold = false;
+bool   Keep = false;
+bool   Trace = true;
+char   Dir[PATH_MAX] = "bench.dir";
+char   BinDir[PATH_MAX] = ".";
+char  *SaveName, *CompareName;
+char   RecDir[PATH_MAX + 16], LogName[PATH_MAX + 16], YesName[PATH_MAX + 16];
+
+static void usage(char *name)
+{
+   printf (
+"\nUsage: %s [-seconds N] [-repeat N] [-dir DIR] [-bindir DIR] [-cold]\n"\
+"          [-no_trace] [-keep] [-save FILE] [-compare FILE] [-tolerance PCT]\n"\
+"\n"\
+"Make a synthetic recording with daq_gen and time daq2_split, daq2_unsplit,\n"\
+"chans_to_bin, and daq_to_bin on it.  For each, report MB/s of the files\n"\
+"it reads, millions of samples per second, peak RSS, and the counts of\n"\
+"read calls, write calls, and all system calls.\n"\
+"\n"\
+"-seconds N is how long the recording is, default %.0f.  It takes about\n"\
+"   35 MB of disk per second of recording.\n"\
+"-repeat N runs each tool N times and reports the fastest, default %d.\n"\
+"-dir DIR is where to make the recording, default %s.  It is removed at\n"\
+"   the end unless -keep is given.\n"\
+"-bindir DIR is where the tools are, default the current dir.\n"\
+"-cold drops the files from the page cache before each run.  Otherwise the\n"\
+"   input is in memory and the times are cpu and write times.\n"\
+"-no_trace skips counting the system calls, which runs each tool once more\n"\
+"   under ptrace.\n"\
+"-save FILE saves the results to FILE.\n"\
+"-compare FILE compares the results to ones saved in FILE and exits with\n"\
+"   status 1 if a tool's MB/s fell, or its system calls went up, by more\n"\
+"   than PCT percent, default %d.\n",
+name, Seconds, Repeat, Dir, Tolerance
+);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+   static struct option opts[] = { {"seconds", required_argument, NULL, '1'},
+                                   {"repeat", required_argument, NULL, '2'},
+                                   {"dir", required_argument, NULL, '3'},
+                                   {"bindir", required_argument, NULL, '4'},
+                                   {"cold", no_argument, NULL, '5'},
+                                   {"no_trace", no_argument, NULL, '6'},
+                                   {"keep", no_argument, NULL, '7'},
+                                   {"save", required_argument, NULL, '8'},
+                                   {"compare", required_argument, NULL, '9'},
+                                   {"tolerance", required_argument, NULL, 'a'},
+                                   { 0,0,0,0} };
+   int cmd;
+   int ret = 1;
+   opterr = 0;
+
+   while ((cmd = getopt_long_only(argc, argv, "", opts, NULL )) != -1)
+   {
+      switch (cmd)
+      {
+         case '1':
+               if ((Seconds = atof(optarg)) <= 0)
+                  ret = 0;
+               break;
+
+         case '2':
+               if ((Repeat = atoi(optarg)) < 1)
+                  ret = 0;
+               break;
+
+         case '3':
+               snprintf(Dir, sizeof(Dir), "%s", optarg);
+               break;
+
+         case '4':
+               snprintf(BinDir, sizeof(BinDir), "%s", optarg);
+               break;
+
+         case '5':
+               Cold = true;
+               break;
+
+         case '6':
+               Trace = false;
+               break;
+
+         case '7':
+               Keep = true;
+               break;
+
+         case '8':
+               SaveName = optarg;
+               break;
+
+         case '9':
+               CompareName = optarg;
+               break;
+
+         case 'a':
+               if ((Tolerance = atoi(optarg)) < 0)
+                  ret = 0;
+               break;
+
+         case '?':
+         default:
+            ret = 0;
+           break;
+      }
+   }
+   if (optind < argc)
+      ret = 0;
+
+   if (!ret)
+      usage(argv[0]);
+
+   return ret;
+}
+
+
+static double now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* In the child, go to the run's dir, send its output to the log, and
+   start it.  chans_to_bin and daq_to_bin ask before they convert all of the
+   chans, the answer comes from YesName.
+*/
+static void start_tool(const Run *run, bool stop)
+{
+   char dir[PATH_MAX + 32], prog[2 * PATH_MAX];
+   int  fd;
+
+   snprintf(dir, sizeof(dir), "%s%s%s", RecDir, run->subdir ? "/" : "", run->subdir ? run->subdir : "");
+   snprintf(prog, sizeof(prog), "%s/%s", BinDir, run->args[0]);
+   if ((fd = open(YesName, O_RDONLY)) != -1)
+   {
+      dup2(fd, STDIN_FILENO);
+      close(fd);
+   }
+   if ((fd = open(LogName, O_WRONLY | O_APPEND | O_CREAT, 0644)) != -1)
+   {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+   }
+   if (chdir(dir) != 0)
+   {
+      fprintf(stderr, "Could not cd to %s, %s\n", dir, strerror(errno));
+      _exit(127);
+   }
+   if (stop)
+      raise(SIGSTOP);
+   execv(prog, (char *const *) run->args);
+   fprintf(stderr, "Could not run %s, %s\n", prog, strerror(errno));
+   _exit(127);
+}
+
+
+   // the syscr and syscw lines of /proc/PID/io, which a zombie still has
+static void read_io(pid_t pid, Result *res)
+{
+   char  name[64], line[128];
+   FILE *fd;
+
+   snprintf(name, sizeof(name), "/proc/%d/io", (int) pid);
+   if ((fd = fopen(name, "r")) == NULL)
+      return;
+   while (fgets(line, sizeof(line), fd))
+   {
+      sscanf(line, "syscr: %llu", &res->reads);
+      sscanf(line, "syscw: %llu", &res->writes);
+   }
+   fclose(fd);
+}
+
+
+/* Run a tool once.  Returns false if it fails.
+*/
+static bool time_run(const Run *run, double *secs, long *rss_kb, Result *res)
+{
+   struct rusage ru;
+   siginfo_t info;
+   double    start = now();
+   pid_t     pid;
+   int       status;
+
+   if ((pid = fork()) == -1)
+   {
+      fprintf(stderr, "Could not fork, %s\n", strerror(errno));
+      return false;
+   }
+   if (pid == 0)
+      start_tool(run, false);
+
+      // leave it a zombie until its io counts are read
+   while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0 && errno == EINTR)
+      ;
+   *secs = now() - start;
+   read_io(pid, res);
+   if (wait4(pid, &status, 0, &ru) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      return false;
+   *rss_kb = ru.ru_maxrss;
+   return true;
+}
+
+
+/* Run a tool once more under ptrace and count its system calls, in all of
+   its threads.  Returns -1 if it can't be traced.
+*/
+static long long count_syscalls(const Run *run)
+{
+   struct { pid_t tid; bool in; } tids[MAX_TIDS];
+   int       ntids = 0, status, k;
+   long long count = 0;
+   pid_t     pid, tid;
+
+   if ((pid = fork()) == -1)
+      return -1;
+   if (pid == 0)
+   {
+      if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+         _exit(TRACE_FAILED);
+      start_tool(run, true);
+   }
+   if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status))
+   {
+      waitpid(pid, &status, 0);
+      return -1;
+   }
+   ptrace(PTRACE_SETOPTIONS, pid, NULL,
+          (void *) (long) (PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK
+                           | PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL));
+   tids[ntids].tid = pid;
+   tids[ntids++].in = false;
+   ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+   while ((tid = waitpid(-1, &status, __WALL)) > 0)
+   {
+      int sig = 0;
+
+      for (k = 0; k < ntids && tids[k].tid != tid; ++k)
+         ;
+      if (WIFEXITED(status) || WIFSIGNALED(status))
+      {
+         if (k < ntids)
+            tids[k] = tids[--ntids];
+         if (tid == pid && (WIFSIGNALED(status) || WEXITSTATUS(status) != 0))
+            count = -1;
+         continue;
+      }
+      if (k == ntids && ntids < MAX_TIDS)
+      {
+            // a new thread or child, its first stop is a SIGSTOP to drop
+         tids[ntids].tid = tid;
+         tids[ntids++].in = false;
+         if (WSTOPSIG(status) == SIGSTOP)
+         {
+            ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+            continue;
+         }
+      }
+      if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+      {
+            // stops come in pairs, going into the call and coming out
+         if (k < ntids && (tids[k].in = !tids[k].in) && count >= 0)
+            ++count;
+      }
+      else if (status >> 16 == 0)
+         sig = WSTOPSIG(status);
+      ptrace(PTRACE_SYSCALL, tid, NULL, (void *) (long) sig);
+   }
+   return count;
+}
+
+
+   // fsync and drop each file in a dir from the page cache
+static void drop_dir(const char *dir)
+{
+   DIR *dp;
+   struct dirent *ent;
+
+   if ((dp = opendir(dir)) == NULL)
+      return;
+   while ((ent = readdir(dp)) != NULL)
+   {
+      char name[PATH_MAX];
+      int  fd;
+
+      snprintf(name, sizeof(name), "%s/%s", dir, ent->d_name);
+      if (ent->d_type == DT_REG && (fd = open(name, O_RDONLY)) != -1)
+      {
+         fdatasync(fd);
+         posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+         close(fd);
+      }
+   }
+   closedir(dp);
+}
+
+static void drop_cache(void)
+{
+   char split[PATH_MAX + 32];
+
+   snprintf(split, sizeof(split), "%s/split." REC, RecDir);
+   drop_dir(RecDir);
+   drop_dir(split);
+}
+
+
+static bool bench(const Run *run, Result *res)
+{
+   int rep;
+
+   memset(res, 0, sizeof(*res));
+   res->secs = -1;
+   for (rep = 0; rep < Repeat; ++rep)
+   {
+      double secs;
+      long   rss_kb = 0;
+
+      if (Cold)
+         drop_cache();
+      if (!time_run(run, &secs, &rss_kb, res))
+      {
+         fprintf(stderr, "%s failed, see %s\n", run->name, LogName);
+         return false;
+      }
+      if (res->secs < 0 || secs < res->secs)
+         res->secs = secs;
+      if (rss_kb > res->rss_kb)
+         res->rss_kb = rss_kb;
+   }
+   res->syscalls = Trace ? count_syscalls(run) : -1;
+   return true;
+}
+
+
+static void show(const Run *run, const Result *res)
+{
+   char calls[32] = "-";
+
+   if (res->syscalls >= 0)
+      snprintf(calls, sizeof(calls), "%lld", res->syscalls);
+   printf("%-18s %8.1f %9.1f %7.2f %9.1f %9llu %9llu %9s\n", run->name,
+          run->bytes / res->secs / 1e6, run->samples / res->secs / 1e6, res->secs,
+          res->rss_kb / 1024.0, res->reads, res->writes, calls);
+}
+
+
+/* Compare to the saved results, tab separated lines of name, MB/s, peak RSS
+   KB, and system calls.  Returns false if anything got worse by more than
+   Tolerance.
+*/
+static bool compare(const Run *runs, const Result *res, int cnt)
+{
+   FILE *fd;
+   char  line[256];
+   bool  ok = true;
+   int   k;
+
+   if ((fd = fopen(CompareName, "r")) == NULL)
+   {
+      fprintf(stderr, "Could not open %s, %s\n", CompareName, strerror(errno));
+      return false;
+   }
+   printf("\nCompared to %s:\n", CompareName);
+   while (fgets(line, sizeof(line), fd))
+   {
+      char     *name = strtok(line, "\t"), *mbps = strtok(NULL, "\t");
+      char     *rss = strtok(NULL, "\t"), *calls = strtok(NULL, "\t\n");
+      double    was_mbps, is_mbps;
+      long long was_calls;
+
+      if (!name || !mbps || !rss || !calls || name[0] == '#')
+         continue;
+      for (k = 0; k < cnt && strcmp(runs[k].name, name) != 0; ++k)
+         ;
+      if (k == cnt)
+         continue;
+      was_mbps = atof(mbps);
+      is_mbps = runs[k].bytes / res[k].secs / 1e6;
+      was_calls = atoll(calls);
+      printf("%-18s %+6.1f%% MB/s  %+6.1f%% peak RSS", name, (is_mbps / was_mbps - 1) * 100,
+             (res[k].rss_kb / atof(rss) - 1) * 100);
+      if (was_calls > 0 && res[k].syscalls >= 0)
+         printf("  %+6.1f%% syscalls", ((double) res[k].syscalls / was_calls - 1) * 100);
+      if (is_mbps < was_mbps * (100 - Tolerance) / 100)
+      {
+         printf("  SLOWER");
+         ok = false;
+      }
+      if (was_calls > 0 && res[k].syscalls > was_calls * (100 + Tolerance) / 100)
+      {
+         printf("  MORE SYSCALLS");
+         ok = false;
+      }
+      printf("\n");
+   }
+   fclose(fd);
+   return ok;
+}
+
+static bool save(const Run *runs, const Result *res, int cnt)
+{
+   FILE *fd;
+   int   k;
+
+   if ((fd = fopen(SaveName, "w")) == NULL)
+   {
+      fprintf(stderr, "Could not create %s, %s\n", SaveName, strerror(errno));
+      return false;
+   }
+   fprintf(fd, "# daq_tool_bench -seconds %g%s: name, MB/s, peak RSS KB, syscalls\n",
+           Seconds, Cold ? " -cold" : "");
+   for (k = 0; k < cnt; ++k)
+      fprintf(fd, "%s\t%.1f\t%ld\t%lld\n", runs[k].name, runs[k].bytes / res[k].secs / 1e6,
+              res[k].rss_kb, res[k].syscalls);
+   return fclose(fd) == 0;
+}
+
+
+static int remove_one(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+   (void) sb; (void) flag; (void) ftw;
+   return remove(path);
+}
+
+
+int main (int argc, char **argv)
+{
+   char   seconds[32], bindir[PATH_MAX];
+   double frames, daq_bytes, chan_bytes, secs;
+   long   rss_kb;
+   FILE  *fd;
+   bool   ok = true;
+   int    cnt, k;
+
+   if (!parse_args(argc, argv))
+      exit(1);
+
+   if (realpath(BinDir, bindir) == NULL)
+   {
+      fprintf(stderr, "Could not find %s, %s\n", BinDir, strerror(errno));
+      exit(1);
+   }
+   snprintf(BinDir, sizeof(BinDir), "%s", bindir);
+   snprintf(seconds, sizeof(seconds), "%g", Seconds);
+   frames = (unsigned long long) (Seconds * SAMP_RATE);
+   daq_bytes = frames * DAQ_FRAME_BYTES;
+   chan_bytes = frames * DAQ_CHANS * sizeof(int16_t);
+
+   Run gen = { "daq_gen", NULL, { "daq_gen", "-seconds", seconds, "-f", NULL }, 0, 0 };
+   Run runs[] = {
+      { "daq2_split 1-64", NULL, { "daq2_split", DATE "_" REC "_1-64", NULL },
+        daq_bytes, frames * DAQ_CHANS },
+      { "daq2_split 65-128", NULL, { "daq2_split", DATE "_" REC "_65-128", NULL },
+        daq_bytes, frames * DAQ_CHANS },
+      { "daq2_unsplit", "split." REC, { "daq2_unsplit", "-f", NULL },
+        2 * chan_bytes, 2 * frames * DAQ_CHANS },
+      { "chans_to_bin", "split." REC, { "chans_to_bin", "-f", NULL },
+        2 * chan_bytes, 2 * frames * DAQ_CHANS },
+      { "daq_to_bin", NULL, { "daq_to_bin", "-r", REC, "-f", NULL },
+        2 * daq_bytes, 2 * frames * DAQ_CHANS },
+   };
+   Result res[sizeof(runs) / sizeof(runs[0])];
+   cnt = sizeof(runs) / sizeof(runs[0]);
+
+      // the tools run in RecDir, so the names must not be relative
+   if ((mkdir(Dir, 0755) != 0 && errno != EEXIST) || realpath(Dir, bindir) == NULL)
+   {
+      fprintf(stderr, "Could not make %s, %s\n", Dir, strerror(errno));
+      exit(1);
+   }
+   snprintf(RecDir, sizeof(RecDir), "%s/" DATE, bindir);
+   snprintf(LogName, sizeof(LogName), "%s/bench.log", bindir);
+   snprintf(YesName, sizeof(YesName), "%s/yes", bindir);
+   if (mkdir(RecDir, 0755) != 0 && errno != EEXIST)
+   {
+      fprintf(stderr, "Could not make %s, %s\n", RecDir, strerror(errno));
+      exit(1);
+   }
+   unlink(LogName);
+   if ((fd = fopen(YesName, "w")) == NULL || fputs("y\n", fd) == EOF || fclose(fd) != 0)
+   {
+      fprintf(stderr, "Could not create %s, %s\n", YesName, strerror(errno));
+      exit(1);
+   }
+
+   printf("Making %s seconds of recording in %s\n", seconds, RecDir);
+   fflush(stdout);
+   if (!time_run(&gen, &secs, &rss_kb, &res[0]))
+   {
+      fprintf(stderr, "daq_gen failed, see %s\n", LogName);
+      exit(1);
+   }
+
+   printf("%s, best of %d runs%s, kernel %s\n\n", "Conversion tools", Repeat,
+          Cold ? ", cold cache" : "", daq_kernel()->name);
+   printf("%-18s %8s %9s %7s %9s %9s %9s %9s\n", "tool", "MB/s", "Msamp/s", "secs",
+          "RSS MB", "reads", "writes", "syscalls");
+   for (k = 0; k < cnt && ok; ++k)
+   {
+      fflush(stdout);
+      if ((ok = bench(&runs[k], &res[k])))
+         show(&runs[k], &res[k]);
+   }
+
+   if (ok && SaveName)
+      ok = save(runs, res, cnt);
+   if (ok && CompareName)
+      ok = compare(runs, res, cnt);
+   if (!Keep && nftw(Dir, remove_one, 16, FTW_DEPTH | FTW_PHYS) != 0)
+      fprintf(stderr, "Could not remove %s, %s\n", Dir, strerror(errno));
+   return ok ? 0 : 1;
+}
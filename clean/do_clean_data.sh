@@ -64,9 +64,16 @@ opt_arg=$3
 
 echo $prefix $chanlist_filename $opt_arg
 
-((n = 0))
-while do_clean_data2.m $prefix $chanlist_filename $n $opt_arg; do
-    ((n++))
-done
+# daq2_clean does the same cleaning as do_clean_data2.m in a single pass over
+# the whole recording.  Fall back to the octave chunk loop if it is not
+# installed.
+if command -v daq2_clean > /dev/null ; then
+    daq2_clean $opt_arg $prefix $chanlist_filename
+else
+    ((n = 0))
+    while do_clean_data2.m $prefix $chanlist_filename $n $opt_arg; do
+        ((n++))
+    done
+fi
 
 echo $0 done
@@ -71,7 +71,11 @@ echo "Copy files that do not need cleaning to $destdir"
       else
          srcname=`printf "%s/%s_r_%02d.chan" $srcdir $1 ${line[chan]}`
       fi
-      cp -v $srcname  $destname
+      if [ ! -e $srcname ] && [ -e ${srcname%.chan}.chz ] ; then
+         cp -v ${srcname%.chan}.chz ${destname%.chan}.chz    # daq2_split --compress
+      else
+         cp -v $srcname  $destname
+      fi
     done
 done < $2
 
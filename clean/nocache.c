@@ -0,0 +1,114 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Keeping big files out of the page cache.  See nocache.h.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "nocache.h"
+
+#define NOCACHE_CHUNK (4 * 1024 * 1024)   // bytes, how far behind the cache is let go
+
+bool NoCacheOn = false;
+
+
+static off_t page_down(off_t off)
+{
+   static long page;
+
+   if (!page)
+      page = sysconf(_SC_PAGESIZE);
+   return off / page * page;
+}
+
+
+void nocache_open(NoCache *nc, int fd, off_t size)
+{
+   memset(nc, 0, sizeof(*nc));
+   nc->fd = fd;
+   if (!NoCacheOn || fd == -1)
+      return;
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+   if (size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+      nc->reserved = size;
+}
+
+
+void nocache_read(NoCache *nc, off_t end)
+{
+   if (!NoCacheOn || nc->fd == -1 || end - nc->dropped < NOCACHE_CHUNK)
+      return;
+   end = page_down(end);
+   posix_fadvise(nc->fd, nc->dropped, end - nc->dropped, POSIX_FADV_DONTNEED);
+   nc->dropped = end;
+}
+
+
+void nocache_mapped(NoCache *nc, const void *base, off_t end)
+{
+   if (!NoCacheOn || nc->fd == -1 || end - nc->dropped < NOCACHE_CHUNK)
+      return;
+      // the pages are still mapped here, and the cache won't drop those
+   end = page_down(end);
+   madvise((char *) base + nc->dropped, end - nc->dropped, MADV_DONTNEED);
+   nocache_read(nc, end);
+}
+
+
+void nocache_wrote(NoCache *nc, off_t end)
+{
+   if (!NoCacheOn || nc->fd == -1 || end - nc->started < NOCACHE_CHUNK)
+      return;
+   end = page_down(end);
+      // the last piece should be on its way to the disk by now
+   if (nc->started > nc->dropped)
+   {
+      sync_file_range(nc->fd, nc->dropped, nc->started - nc->dropped,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(nc->fd, nc->dropped, nc->started - nc->dropped, POSIX_FADV_DONTNEED);
+      nc->dropped = nc->started;
+   }
+   sync_file_range(nc->fd, nc->started, end - nc->started, SYNC_FILE_RANGE_WRITE);
+   nc->started = end;
+}
+
+
+void nocache_close(NoCache *nc, off_t size)
+{
+   if (!NoCacheOn || nc->fd == -1)
+      return;
+   if (size > nc->dropped)
+      sync_file_range(nc->fd, nc->dropped, size - nc->dropped,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      // all of it, pages that were still being read in when their part was
+      // dropped were skipped
+   posix_fadvise(nc->fd, 0, 0, POSIX_FADV_DONTNEED);
+      // setting the size again frees the blocks reserved past it
+   if (nc->reserved > size && ftruncate(nc->fd, size) == 0)
+      nc->reserved = size;
+   nc->fd = -1;
+}
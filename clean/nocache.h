@@ -0,0 +1,80 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   -nocache for the conversion tools.  Converting a 20 GB recording
+   normally leaves all 20 GB of it, and of what was written, in the page
+   cache, pushing out everything the other jobs on the machine had there.
+   With NoCacheOn, a file is dropped from the cache a few MB behind where
+   the tool is reading or writing it, so the tool takes up about that much
+   of the cache however big the file is.
+
+   Reading, the pages that have been read are let go with posix_fadvise
+   DONTNEED, and madvise for a mapped file.  Writing, dirty pages can't be
+   dropped until they are on the disk, so the writeback of each piece is
+   started as soon as it is written with sync_file_range, and it is waited
+   for and dropped a piece later.  That also keeps the dirty pages from
+   piling up and being written all at once.
+
+   Output files whose size is known are given their space up front with
+   fallocate, so a file that grows a bit at a time along with 63 others
+   is not scattered over the disk.  The space is reserved past the end of
+   the file, the file's size is still what has been written, and what is
+   not used is given back when the file is closed.
+
+   Everything here is advice.  If the file system can't do it, it is
+   skipped and the tool goes on as normal.
+*/
+
+#ifndef NOCACHE_H
+#define NOCACHE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+extern bool NoCacheOn;
+
+typedef struct
+{
+   int   fd;
+   off_t reserved;   // fallocated up to here
+   off_t started;    // writeback started up to here
+   off_t dropped;    // let go from the cache up to here
+} NoCache;
+
+   // start on fd, and if size is more than 0, reserve that much space
+void nocache_open(NoCache *nc, int fd, off_t size);
+
+   // the file has been read up to end
+void nocache_read(NoCache *nc, off_t end);
+
+   // the same for a file mapped at base
+void nocache_mapped(NoCache *nc, const void *base, off_t end);
+
+   // the file has been written up to end
+void nocache_wrote(NoCache *nc, off_t end);
+
+/* Done with the file, which is size bytes.  Drops the rest of what was
+   read or written and gives back the space that was reserved and not
+   used.  Call it after the last write has reached the file, and after
+   unmapping it, and before closing it.
+*/
+void nocache_close(NoCache *nc, off_t size);
+
+#endif
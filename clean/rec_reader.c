@@ -0,0 +1,593 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Random access to recordings.  See rec_reader.h.
+
+   A recording is read as one or more streams.  A .daq file is a stream of
+   64 chans, a .bin file is one stream of all of its chans, and each .chan
+   file is a stream of its own.  A block of a stream has REC_BLOCK_SAMPS
+   samples of each of its chans, one chan after another, so a block of a
+   .daq file is split once and then any of its chans can be read from it.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include "rec_reader.h"
+#include "daq_kernel.h"
+#include "daq_map.h"
+#include "chan_pack.h"
+
+#define REC_HASH 1024           // cache hash buckets
+#define RAW_TAG "_r_"
+#define CHAN_EXT ".chan"
+#define DAQ_EXT ".daq"
+#define BIN_EXT ".bin"
+#define BIN_TAG "_spike2_"
+
+typedef struct RecBlock
+{
+   struct RecBlock *hash_next;
+   struct RecBlock *newer, *older;     // least recently used list
+   int              stream;
+   uint64_t         block;
+   size_t           len;               // samples per chan
+   size_t           bytes;
+   int16_t          data[];            // a chan after another, REC_BLOCK_SAMPS each
+} RecBlock;
+
+typedef struct
+{
+   int        width;                   // chans in the stream
+   DaqMap     map;                     // REC_DAQ
+   ChanReader rd;                      // REC_CHANS
+   uint64_t   at;                      // the next sample rd will read
+   uint64_t   last;                    // the last block read, for read ahead
+   bool       open;
+} RecStream;
+
+struct RecReader
+{
+   RecFormat        format;
+   int              nchans;
+   uint64_t         samples;
+   RecStream       *streams;
+   int              nstreams;
+   int              stream_of[REC_MAX_CHANS + 1];   // -1 if a chan is not there
+   int              col_of[REC_MAX_CHANS + 1];
+   const DaqKernel *kernel;
+   ChanPack        *packs[2];
+   UringIo         *io;
+   int              bin_fd;
+   int16_t         *bin_buf;
+   RecBlock        *hash[REC_HASH];
+   RecBlock        *newest, *oldest;
+   size_t           cached;            // bytes of blocks
+};
+
+
+static bool ends_with(const char *str, const char *end)
+{
+   size_t len = strlen(str), elen = strlen(end);
+   return len >= elen && strcmp(str + len - elen, end) == 0;
+}
+
+bool rec_find_chans(const char *dir, char *basename, bool *raw)
+{
+   DIR    *curr_dir;
+   struct dirent *ent;
+   bool   ret = false;
+   int    match, yr, mon, day, recno;
+
+   *raw = false;
+   curr_dir = opendir(dir);
+   if (curr_dir)
+   {
+      while ((ent = readdir(curr_dir)) != NULL)
+      {
+         if (strstr(ent->d_name,CHAN_EXT) || strstr(ent->d_name,CHZ_EXT)
+             || strstr(ent->d_name,CHAN_PACK_EXT))
+         {
+            if (strstr(ent->d_name,RAW_TAG))
+               *raw = true;
+
+            match = sscanf(ent->d_name,"%d-%d-%d_%d", &yr,&mon,&day,&recno);
+            if (match == 4)
+            {
+               sprintf(basename,"%04d-%02d-%02d_%03d", yr,mon,day,recno);
+               ret = true;
+            }
+            else
+               printf("The chan file %s is not in the correct filename format\n",ent->d_name);
+            break;
+         }
+      }
+      closedir(curr_dir);
+   }
+   return ret;
+}
+
+
+/* The name has to be YYYY-MM-DD_REC followed by _1-64.daq, _65-128.daq, or
+   just .daq, with maybe a tag before the chans, e.g. _clean_1-64.daq.  If
+   there is more than one, the one with the shortest tag wins.
+*/
+int rec_find_daq(const char *dir, const char *recno, char *daq0, char *daq1, size_t len)
+{
+   DIR    *curr_dir;
+   struct dirent *ent;
+   char  *end;
+   long   want = strtol(recno, &end, 10);
+   int    yr, mon, day, num, at;
+
+   daq0[0] = daq1[0] = '\0';
+   if (end == recno || *end != '\0' || (curr_dir = opendir(dir)) == NULL)
+      return 0;
+   while ((ent = readdir(curr_dir)) != NULL)
+   {
+      const char *rest;
+      char *into = NULL;
+
+      at = 0;
+      if (sscanf(ent->d_name, "%d-%d-%d_%d%n", &yr, &mon, &day, &num, &at) != 4 || num != want)
+         continue;
+      rest = ent->d_name + at;
+      if (ends_with(rest, "_65-128" DAQ_EXT))
+         into = daq1;
+      else if (ends_with(rest, "_1-64" DAQ_EXT) || strcmp(rest, DAQ_EXT) == 0)
+         into = daq0;
+      if (into && (into[0] == '\0' || strlen(ent->d_name) < strlen(into)))
+         snprintf(into, len, "%s", ent->d_name);
+   }
+   closedir(curr_dir);
+   return (daq0[0] != '\0') + (daq1[0] != '\0');
+}
+
+
+static bool open_daq(RecReader *rec, const char *path)
+{
+   char prefix[PATH_MAX], name[PATH_MAX + 16];
+   int  half;
+   bool single = false;
+
+   snprintf(prefix, sizeof(prefix), "%s", path);
+   if (ends_with(prefix, "_1-64" DAQ_EXT))
+      prefix[strlen(prefix) - strlen("_1-64" DAQ_EXT)] = '\0';
+   else if (ends_with(prefix, "_65-128" DAQ_EXT))
+      prefix[strlen(prefix) - strlen("_65-128" DAQ_EXT)] = '\0';
+   else if (ends_with(prefix, DAQ_EXT))
+      single = true;        // an old file, 1-64 with no chans in the name
+
+   rec->format = REC_DAQ;
+   if ((rec->streams = calloc(2, sizeof(*rec->streams))) == NULL)
+      return false;
+   rec->nstreams = 2;
+   rec->samples = UINT64_MAX;
+   for (half = 0; half < 2; ++half)
+   {
+      RecStream *st = &rec->streams[half];
+      int chan;
+
+      if (single && half == 0)
+         snprintf(name, sizeof(name), "%s", path);
+      else if (single)
+         break;
+      else
+         snprintf(name, sizeof(name), "%s_%s%s", prefix, half ? "65-128" : "1-64", DAQ_EXT);
+      if (access(name, F_OK) != 0)
+         continue;
+      if (!daq_map_open(&st->map, name))
+         return false;
+      st->open = true;
+      st->width = DAQ_CHANS;
+      st->last = UINT64_MAX;
+      if (st->map.frames < rec->samples)
+         rec->samples = st->map.frames;
+      for (chan = 0; chan < DAQ_CHANS; ++chan)
+      {
+         rec->stream_of[half * DAQ_CHANS + chan + 1] = half;
+         rec->col_of[half * DAQ_CHANS + chan + 1] = chan;
+      }
+      rec->nchans = (half + 1) * DAQ_CHANS;
+   }
+   if (rec->nchans == 0)
+   {
+      printf("Could not find the .daq files for %s\n", path);
+      return false;
+   }
+   return true;
+}
+
+
+static bool open_chans(RecReader *rec, const char *dir)
+{
+   char basename[PATH_MAX], name[PATH_MAX + 64];
+   bool raw;
+   int  npacks, chan;
+
+   if (!rec_find_chans(dir, basename, &raw))
+   {
+      printf("Could not find any chan files in %s\n", dir);
+      return false;
+   }
+   rec->format = REC_CHANS;
+   snprintf(name, sizeof(name), "%s/%s%s", dir, basename, raw ? RAW_TAG : "_");
+   npacks = chan_pack_open_pair(name, rec->packs);
+   if ((rec->streams = calloc(REC_MAX_CHANS, sizeof(*rec->streams))) == NULL)
+      return false;
+   rec->samples = UINT64_MAX;
+   for (chan = 1; chan <= REC_MAX_CHANS; ++chan)
+   {
+      RecStream *st = &rec->streams[rec->nstreams];
+      uint64_t samples;
+
+      snprintf(name, sizeof(name), "%s/%s%s%02d%s", dir, basename, raw ? RAW_TAG : "_", chan, CHAN_EXT);
+      if (!chan_reader_open(&st->rd, name, rec->packs, npacks, chan))
+         continue;
+      st->open = true;
+      st->width = 1;
+      st->last = UINT64_MAX;
+      if ((samples = chan_reader_samples(&st->rd)) < rec->samples)
+         rec->samples = samples;
+      rec->stream_of[chan] = rec->nstreams++;
+      rec->nchans = chan > DAQ_CHANS ? REC_MAX_CHANS : DAQ_CHANS;
+   }
+   if (rec->nstreams == 0)
+   {
+      printf("Could not open any chan files in %s\n", dir);
+      return false;
+   }
+      // the chans are read ahead through this once they are read in order
+   rec->io = uring_open(2 * rec->nstreams, CHAN_AHEAD_SAMPS * sizeof(short));
+   return true;
+}
+
+
+static bool open_bin(RecReader *rec, const char *path, int nchans)
+{
+   const char *tag = strstr(path, BIN_TAG);
+   struct stat info;
+   int chan;
+
+   if (nchans <= 0 && (!tag || sscanf(tag + strlen(BIN_TAG), "%d", &nchans) != 1))
+   {
+      printf("The number of chans in %s is needed\n", path);
+      return false;
+   }
+   if (nchans < 1 || nchans > REC_MAX_CHANS)
+   {
+      printf("%s can't have %d chans\n", path, nchans);
+      return false;
+   }
+   rec->format = REC_BIN;
+   if ((rec->bin_fd = open(path, O_RDONLY)) == -1 || fstat(rec->bin_fd, &info) == -1)
+   {
+      printf("Error opening %s, %s\n", path, strerror(errno));
+      return false;
+   }
+   posix_fadvise(rec->bin_fd, 0, 0, POSIX_FADV_RANDOM);
+   rec->bin_buf = malloc(sizeof(*rec->bin_buf) * REC_BLOCK_SAMPS * nchans);
+   rec->streams = calloc(1, sizeof(*rec->streams));
+   if (!rec->bin_buf || !rec->streams)
+      return false;
+   rec->nstreams = 1;
+   rec->streams[0].open = true;
+   rec->streams[0].width = nchans;
+   rec->streams[0].last = UINT64_MAX;
+   rec->samples = info.st_size / (sizeof(int16_t) * nchans);
+   for (chan = 1; chan <= nchans; ++chan)
+   {
+      rec->stream_of[chan] = 0;
+      rec->col_of[chan] = chan - 1;
+   }
+   rec->nchans = nchans;
+   return true;
+}
+
+
+RecReader *rec_open(const char *path, int bin_chans)
+{
+   RecReader  *rec;
+   struct stat info;
+   bool        ok;
+   int         chan;
+
+   if ((rec = calloc(1, sizeof(*rec))) == NULL)
+   {
+      printf("Out of memory opening %s\n", path);
+      return NULL;
+   }
+   rec->bin_fd = -1;
+   rec->kernel = daq_kernel();
+   for (chan = 0; chan <= REC_MAX_CHANS; ++chan)
+      rec->stream_of[chan] = -1;
+
+   if (stat(path, &info) == 0 && S_ISDIR(info.st_mode))
+      ok = open_chans(rec, path);
+   else if (ends_with(path, BIN_EXT))
+      ok = open_bin(rec, path, bin_chans);
+   else
+      ok = open_daq(rec, path);
+   if (!ok)
+   {
+      rec_close(rec);
+      return NULL;
+   }
+   return rec;
+}
+
+
+static void drop_block(RecReader *rec, RecBlock *blk)
+{
+   RecBlock **link = &rec->hash[(blk->stream * 31 + blk->block) % REC_HASH];
+
+   while (*link != blk)
+      link = &(*link)->hash_next;
+   *link = blk->hash_next;
+   if (blk->newer)
+      blk->newer->older = blk->older;
+   else
+      rec->newest = blk->older;
+   if (blk->older)
+      blk->older->newer = blk->newer;
+   else
+      rec->oldest = blk->newer;
+   rec->cached -= blk->bytes;
+   free(blk);
+}
+
+
+void rec_close(RecReader *rec)
+{
+   int s;
+
+   if (!rec)
+      return;
+   while (rec->oldest)
+      drop_block(rec, rec->oldest);
+   for (s = 0; s < rec->nstreams; ++s)
+   {
+      RecStream *st = &rec->streams[s];
+      if (st->open && rec->format == REC_DAQ)
+         daq_map_close(&st->map);
+      else if (st->open && rec->format == REC_CHANS)
+         chan_reader_close(&st->rd);
+   }
+   chan_pack_close(rec->packs[0]);
+   chan_pack_close(rec->packs[1]);
+   uring_close(rec->io);
+   if (rec->bin_fd != -1)
+      close(rec->bin_fd);
+   free(rec->bin_buf);
+   free(rec->streams);
+   free(rec);
+}
+
+
+RecFormat rec_format(const RecReader *rec)
+{
+   return rec->format;
+}
+
+int rec_chans(const RecReader *rec)
+{
+   return rec->nchans;
+}
+
+bool rec_has_chan(const RecReader *rec, int chan)
+{
+   return chan >= 1 && chan <= REC_MAX_CHANS && rec->stream_of[chan] != -1;
+}
+
+uint64_t rec_samples(const RecReader *rec)
+{
+   return rec->samples;
+}
+
+
+   // read block blk->block of stream st, returns the samples per chan
+static size_t fill_block(RecReader *rec, RecStream *st, RecBlock *blk)
+{
+   uint64_t first = blk->block * REC_BLOCK_SAMPS;
+   size_t   n = rec->samples - first < REC_BLOCK_SAMPS ? rec->samples - first : REC_BLOCK_SAMPS;
+   size_t   rows, k;
+   ssize_t  got;
+   int      chan;
+
+   switch (rec->format)
+   {
+      case REC_DAQ:
+      {
+         int16_t *dest[DAQ_CHANS];
+         for (chan = 0; chan < DAQ_CHANS; ++chan)
+            dest[chan] = blk->data + chan * REC_BLOCK_SAMPS;
+         return rec->kernel->split(daq_map_frame(&st->map, first), n, dest, false);
+      }
+
+      case REC_CHANS:
+         if (st->at != first && !chan_reader_seek(&st->rd, first))
+            return 0;
+         rows = chan_reader_read(&st->rd, blk->data, n);
+         st->at = first + rows;
+         return rows;
+
+      case REC_BIN:
+         got = pread(rec->bin_fd, rec->bin_buf, n * st->width * sizeof(int16_t),
+                     first * st->width * sizeof(int16_t));
+         if (got <= 0)
+            return 0;
+         rows = got / (st->width * sizeof(int16_t));
+         for (chan = 0; chan < st->width; ++chan)
+         {
+            int16_t *to = blk->data + chan * REC_BLOCK_SAMPS;
+            for (k = 0; k < rows; ++k)
+               to[k] = rec->bin_buf[k * st->width + chan];
+         }
+         return rows;
+   }
+   return 0;
+}
+
+
+   // block b of stream st was just read after the block before it
+static void read_ahead(RecReader *rec, RecStream *st, uint64_t b)
+{
+   uint64_t next = (b + 1) * REC_BLOCK_SAMPS;
+
+   if (next >= rec->samples)
+      return;
+   switch (rec->format)
+   {
+      case REC_DAQ:
+         daq_map_willneed(&st->map, next, REC_AHEAD_BLOCKS * REC_BLOCK_SAMPS);
+         break;
+
+      case REC_CHANS:
+            // from here on the reader keeps a read in flight ahead of it,
+            // a .chz or pack file has its own buffering
+         if (!st->rd.io)
+            chan_reader_ahead(&st->rd, rec->io);
+         break;
+
+      case REC_BIN:
+         posix_fadvise(rec->bin_fd, next * st->width * sizeof(int16_t),
+                       REC_AHEAD_BLOCKS * REC_BLOCK_SAMPS * st->width * sizeof(int16_t),
+                       POSIX_FADV_WILLNEED);
+         break;
+   }
+}
+
+
+static RecBlock *get_block(RecReader *rec, int stream, uint64_t b)
+{
+   RecStream *st = &rec->streams[stream];
+   RecBlock **bucket = &rec->hash[(stream * 31 + b) % REC_HASH];
+   RecBlock  *blk;
+   size_t     bytes;
+
+   for (blk = *bucket; blk; blk = blk->hash_next)
+   {
+      if (blk->stream == stream && blk->block == b)
+      {
+         if (blk != rec->newest)     // move it to the front
+         {
+            blk->newer->older = blk->older;
+            if (blk->older)
+               blk->older->newer = blk->newer;
+            else
+               rec->oldest = blk->newer;
+            blk->older = rec->newest;
+            blk->newer = NULL;
+            rec->newest->newer = blk;
+            rec->newest = blk;
+         }
+         return blk;
+      }
+   }
+
+   bytes = sizeof(*blk) + sizeof(int16_t) * REC_BLOCK_SAMPS * st->width;
+   while (rec->oldest && rec->cached + bytes > REC_CACHE_BYTES)
+      drop_block(rec, rec->oldest);
+   if ((blk = malloc(bytes)) == NULL)
+      return NULL;
+   blk->stream = stream;
+   blk->block = b;
+   blk->bytes = bytes;
+   if ((blk->len = fill_block(rec, st, blk)) == 0)
+   {
+      free(blk);
+      return NULL;
+   }
+   if (b == st->last + 1)
+      read_ahead(rec, st, b);
+   st->last = b;
+
+   blk->hash_next = *bucket;
+   *bucket = blk;
+   blk->newer = NULL;
+   blk->older = rec->newest;
+   if (rec->newest)
+      rec->newest->newer = blk;
+   else
+      rec->oldest = blk;
+   rec->newest = blk;
+   rec->cached += bytes;
+   return blk;
+}
+
+
+size_t rec_read(RecReader *rec, const int *chans, int nchans, uint64_t start,
+                size_t count, int16_t *out)
+{
+   size_t rows, k;
+   int    i;
+
+   if (start >= rec->samples)
+      return 0;
+   if (count > rec->samples - start)
+      count = rec->samples - start;
+   rows = count;
+
+   for (i = 0; i < nchans; ++i)
+   {
+      int      stream = rec_has_chan(rec, chans[i]) ? rec->stream_of[chans[i]] : -1;
+      uint64_t pos = start;
+
+      if (stream == -1)
+      {
+         for (k = 0; k < count; ++k)
+            out[k * nchans + i] = 0;
+         continue;
+      }
+      while (pos < start + rows)
+      {
+         uint64_t b = pos / REC_BLOCK_SAMPS;
+         RecBlock *blk = get_block(rec, stream, b);
+         size_t   off = pos - b * REC_BLOCK_SAMPS, n;
+         const int16_t *from;
+         int16_t *to;
+
+         if (!blk || blk->len <= off)
+         {
+            rows = pos - start;    // a short read, stop here for all of them
+            break;
+         }
+         n = blk->len - off;
+         if (n > start + rows - pos)
+            n = start + rows - pos;
+         from = blk->data + rec->col_of[chans[i]] * REC_BLOCK_SAMPS + off;
+         to = out + (pos - start) * nchans + i;
+         for (k = 0; k < n; ++k)
+            to[k * nchans] = from[k];
+         pos += n;
+      }
+   }
+   return rows;
+}
@@ -0,0 +1,102 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Reading any part of a recording, whatever it is stored as, without
+   converting it first.  A recording can be:
+
+      a .daq file, or the 1-64 and 65-128 pair, given as either file or as
+         the YYYY-MM-DD_REC name the pair has in common
+      a split.REC/ or clean.REC/ dir of .chan files, which can also be
+         .chz files or pack files, see chan_pack.h
+      a Spike2 .bin file, with the number of chans in it given, or taken
+         from the _spike2_N in its name
+
+   Samples come out as signed shorts, the same as in a .chan file, for any
+   set of chans, starting at any sample.
+
+   The samples are read in blocks of REC_BLOCK_SAMPS per chan, and the
+   blocks are kept in a cache, least recently used out, so looking at a
+   window and then at one that overlaps it reads only what is new.  When
+   the reads go forward through the recording, the next blocks are asked
+   for ahead of time, from the kernel for a .daq or .bin file and through
+   io_uring for .chan files, so the disk is busy while the samples are used.
+
+   The file discovery the tools share is here too.
+
+   A RecReader is not thread safe, use one per thread.
+*/
+
+#ifndef REC_READER_H
+#define REC_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REC_MAX_CHANS 128
+#define REC_BLOCK_SAMPS (16 * 1024)            // samples per chan in a block
+#define REC_CACHE_BYTES (32 * 1024 * 1024)     // blocks kept
+#define REC_AHEAD_BLOCKS 4                     // how far ahead to read
+
+typedef enum { REC_DAQ, REC_CHANS, REC_BIN } RecFormat;
+
+typedef struct RecReader RecReader;
+
+/* Find a .chan, .chz, or .pack file in dir and put the YYYY-MM-DD_REC part
+   of its name in basename, and whether the names have the _r_ of raw
+   chans in *raw.  Returns false if there are none, or the name is not in
+   that format.
+*/
+bool rec_find_chans(const char *dir, char *basename, bool *raw);
+
+/* Find the .daq files for recording number recno in dir, e.g. 001.  The
+   1-64 file, or a file with no chan numbers in its name, goes in daq0 and
+   the 65-128 file in daq1, each len long.  The one not found is left
+   empty.  Returns how many were found.
+*/
+int rec_find_daq(const char *dir, const char *recno, char *daq0, char *daq1, size_t len);
+
+/* Open a recording.  bin_chans is the number of chans in a .bin file, or
+   0 to take it from the name.  Prints a message and returns NULL if the
+   recording can't be found or read.
+*/
+RecReader *rec_open(const char *path, int bin_chans);
+void rec_close(RecReader *rec);
+
+RecFormat rec_format(const RecReader *rec);
+
+   // the highest chan number, 64 or 128, or the number in a .bin file
+int rec_chans(const RecReader *rec);
+
+   // chan 1 - rec_chans() is in the recording, the others read as zeros
+bool rec_has_chan(const RecReader *rec, int chan);
+
+   // samples per chan, the shortest chan's if they differ
+uint64_t rec_samples(const RecReader *rec);
+
+/* Read count samples of each of the nchans chans in chans, starting at
+   sample start, into out as rows of nchans, the same as in a .bin file.
+   Returns the number of rows read, fewer than count at the end of the
+   recording or if a read fails.
+*/
+size_t rec_read(RecReader *rec, const int *chans, int nchans, uint64_t start,
+                size_t count, int16_t *out);
+
+#endif
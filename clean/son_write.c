@@ -0,0 +1,398 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Writing Spike2 .smr files.  See son_write.h.
+
+   The SON structures are packed and little endian on disk, so they are
+   put together a field at a time at their offsets, not written as C
+   structs.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include "son_write.h"
+
+#define SON_DISK_BLOCK   512
+#define SON_FILE_HEAD    512            // the file header, then the channel headers
+#define SON_CHAN_HEAD    140
+#define SON_MIN_CHANS    32             // Spike2 files have at least this many channels
+#define SON_BLOCK_BYTES  (127 * SON_DISK_BLOCK)   // the most a block's WORD size can hold
+#define SON_BLOCK_HEAD   20
+#define SON_BLOCK_SAMPS  ((SON_BLOCK_BYTES - SON_BLOCK_HEAD) / 2)
+#define SON_MAX_BLOCKS   65535          // per channel
+#define SON_SMALL_MAX    INT32_MAX      // byte offsets past this need a big file
+#define SON_SMALL_VER    6
+#define SON_BIG_VER      9
+#define SON_ADC          1              // channel kinds
+#define SON_TITLE_LEN    9
+#define SON_UNITS_LEN    5
+#define SON_COMMENT_LEN  79
+
+struct SonWriter
+{
+   FILE              *fd;
+   const SonChan     *chans;
+   int                nchans;
+   int                slots;           // channel headers, at least the highest chan number
+   double             rate;
+   char               recording[64];
+   bool               big;             // version 9, offsets in disk blocks
+   off_t              first_data;      // where the first block goes
+   unsigned char     *round;           // a block for each chan
+   unsigned long long rounds;          // rounds written
+   size_t             items;           // samples in each block of this round
+   off_t              written;
+   bool               failed;
+};
+
+
+static void put16(unsigned char *p, unsigned v)
+{
+   p[0] = v;
+   p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+   p[0] = v;
+   p[1] = v >> 8;
+   p[2] = v >> 16;
+   p[3] = v >> 24;
+}
+
+static void put_float(unsigned char *p, float v)
+{
+   uint32_t u;
+   memcpy(&u, &v, sizeof(u));
+   put32(p, u);
+}
+
+static void put_double(unsigned char *p, double v)
+{
+   uint64_t u;
+   memcpy(&u, &v, sizeof(u));
+   put32(p, u);
+   put32(p + 4, u >> 32);
+}
+
+   // a length byte, then up to max chars
+static void put_str(unsigned char *p, const char *str, size_t max)
+{
+   size_t len = strlen(str);
+
+   if (len > max)
+      len = max;
+   p[0] = len;
+   memcpy(p + 1, str, len);
+}
+
+   // a file offset as SON has it, in bytes or in disk blocks
+static uint32_t dof(const SonWriter *sw, off_t off)
+{
+   return sw->big ? off / SON_DISK_BLOCK : off;
+}
+
+
+static off_t data_start(int slots)
+{
+   off_t head = SON_FILE_HEAD + (off_t) slots * SON_CHAN_HEAD;
+   return (head + SON_DISK_BLOCK - 1) / SON_DISK_BLOCK * SON_DISK_BLOCK;
+}
+
+static int slots_for(const SonChan *chans, int nchans)
+{
+   int slots = SON_MIN_CHANS, chan;
+
+   for (chan = 0; chan < nchans; ++chan)
+   {
+      if (chans[chan].number > slots)
+         slots = chans[chan].number;
+   }
+   return slots;
+}
+
+
+static off_t file_size(int slots, int nchans, unsigned long long samples)
+{
+   unsigned long long rounds = (samples + SON_BLOCK_SAMPS - 1) / SON_BLOCK_SAMPS;
+
+   return data_start(slots) + (off_t) (rounds * nchans) * SON_BLOCK_BYTES;
+}
+
+
+off_t son_file_size(int nchans, unsigned long long samples)
+{
+   return file_size(nchans > SON_MIN_CHANS ? nchans : SON_MIN_CHANS, nchans, samples);
+}
+
+
+int son_read_labels(const char *name, char labels[][SON_LABEL_LEN], int max)
+{
+   FILE *fd;
+   char  line[256];
+   int   count = 0;
+   size_t len;
+
+   if ((fd = fopen(name, "r")) == NULL)
+      return 0;
+   while (count < max && fgets(line, sizeof(line), fd))
+   {
+      len = strcspn(line, "\r\n");
+      if (len > SON_LABEL_LEN - 1)
+         len = SON_LABEL_LEN - 1;
+      while (len > 0 && isspace((unsigned char) line[len - 1]))
+         --len;
+      memcpy(labels[count], line, len);
+      labels[count++][len] = '\0';
+   }
+   fclose(fd);
+   return count;
+}
+
+
+   // A title is only 9 chars, so "Pegasus - 12" becomes "Pegasus12".
+static void make_title(char *title, const SonChan *chan)
+{
+   const char *p;
+   int len = 0;
+
+   for (p = chan->label; *p && len < SON_TITLE_LEN; ++p)
+   {
+      if (!isspace((unsigned char) *p) && *p != '-')
+         title[len++] = *p;
+   }
+   title[len] = '\0';
+   if (len == 0)
+      snprintf(title, SON_TITLE_LEN + 1, "Chan %d", chan->number);
+}
+
+
+static void write_head(SonWriter *sw, unsigned char *head)
+{
+   unsigned long long samples = sw->rounds ? (sw->rounds - 1) * SON_BLOCK_SAMPS + sw->items : 0;
+   int  year = 0, mon = 0, day = 0, chan;
+   char comment[SON_COMMENT_LEN + 1];
+
+   put16(head + 0, sw->big ? SON_BIG_VER : SON_SMALL_VER);
+   memcpy(head + 2, "(C) CED 87", 10);
+   memcpy(head + 12, "USFdaq2 ", 8);
+   put16(head + 20, 1e6 / sw->rate + 0.5);      // us per time unit
+   put16(head + 22, 1);                         // time units per ADC tick
+   put16(head + 24, 0);                         // file state, ok
+   put32(head + 26, dof(sw, sw->first_data));
+   put16(head + 30, sw->slots);
+   put16(head + 32, sw->slots * SON_CHAN_HEAD);
+   put16(head + 34, 0);                         // extra data
+   put16(head + 36, 0);
+   put16(head + 38, 0);                         // PC byte order
+   put32(head + 40, samples ? samples - 1 : 0); // last time in the file
+   put_double(head + 44, 1e-6);                 // time base, seconds per us
+   if (sscanf(sw->recording, "%d-%d-%d", &year, &mon, &day) == 3)
+   {
+      head[56] = day;
+      head[57] = mon;
+      put16(head + 58, year);
+   }
+   snprintf(comment, sizeof(comment), "%s from %s", program_invocation_short_name, sw->recording);
+   put_str(head + 112, comment, SON_COMMENT_LEN);
+
+   for (chan = 0; chan < sw->slots; ++chan)
+   {
+      unsigned char *ch = head + SON_FILE_HEAD + chan * SON_CHAN_HEAD;
+      put32(ch + 2, -1);          // no deleted blocks
+      put32(ch + 6, -1);          // no blocks
+      put32(ch + 10, -1);
+      put16(ch + 106, -1);        // no physical chan
+   }
+   for (chan = 0; chan < sw->nchans; ++chan)
+   {
+      const SonChan *sc = &sw->chans[chan];
+      unsigned char *ch = head + SON_FILE_HEAD + (sc->number - 1) * SON_CHAN_HEAD;
+      off_t first = sw->first_data + (off_t) chan * SON_BLOCK_BYTES;
+      off_t last = first + (off_t) ((sw->rounds - 1) * sw->nchans) * SON_BLOCK_BYTES;
+      char  title[SON_TITLE_LEN + 1];
+
+      if (sw->rounds)
+      {
+         put32(ch + 6, dof(sw, first));
+         put32(ch + 10, dof(sw, last));
+      }
+      put16(ch + 14, sw->rounds);                // blocks
+      put16(ch + 22, SON_BLOCK_BYTES);
+      put16(ch + 24, SON_BLOCK_SAMPS);
+      put_str(ch + 26, sc->label, SON_LABEL_LEN - 1);
+      put32(ch + 98, samples ? samples - 1 : 0); // last time on the channel
+      put32(ch + 102, 1);                        // a sample every time unit
+      put16(ch + 106, sc->number - 1);
+      make_title(title, sc);
+      put_str(ch + 108, title, SON_TITLE_LEN);
+      put_float(ch + 118, sw->rate);
+      ch[122] = SON_ADC;
+      put_float(ch + 124, 1.0);                  // scale
+      put_float(ch + 128, 0.0);                  // offset
+      put_str(ch + 132, "volt", SON_UNITS_LEN);
+   }
+}
+
+
+/* Write out the blocks of this round.  The blocks of the next round, if
+   there is going to be one, come right after.
+*/
+static void write_round(SonWriter *sw, bool last)
+{
+   off_t  step = (off_t) sw->nchans * SON_BLOCK_BYTES;
+   off_t  at = sw->first_data + sw->rounds * step;
+   size_t len = (size_t) step;
+   int    chan;
+
+   for (chan = 0; chan < sw->nchans; ++chan, at += SON_BLOCK_BYTES)
+   {
+      unsigned char *block = sw->round + (size_t) chan * SON_BLOCK_BYTES;
+
+      put32(block + 0, sw->rounds ? dof(sw, at - step) : (uint32_t) -1);
+      put32(block + 4, last ? (uint32_t) -1 : dof(sw, at + step));
+      put32(block + 8, sw->rounds * SON_BLOCK_SAMPS);
+      put32(block + 12, sw->rounds * SON_BLOCK_SAMPS + sw->items - 1);
+      put16(block + 16, sw->chans[chan].number);
+      put16(block + 18, sw->items);
+      if (last)
+         memset(block + SON_BLOCK_HEAD + sw->items * 2, 0, (SON_BLOCK_SAMPS - sw->items) * 2);
+   }
+   if (!sw->failed && fwrite(sw->round, 1, len, sw->fd) != len)
+      sw->failed = true;
+   sw->written += len;
+   ++sw->rounds;
+}
+
+
+SonWriter *son_open(FILE *fd, const SonChan *chans, int nchans, double rate,
+                    unsigned long long samples, const char *recording)
+{
+   SonWriter *sw;
+   unsigned char *head;
+
+   if (nchans < 1 || (samples + SON_BLOCK_SAMPS - 1) / SON_BLOCK_SAMPS > SON_MAX_BLOCKS)
+   {
+      errno = EFBIG;
+      return NULL;
+   }
+   if ((sw = calloc(1, sizeof(*sw))) == NULL)
+      return NULL;
+   sw->fd = fd;
+   sw->chans = chans;
+   sw->nchans = nchans;
+   sw->slots = slots_for(chans, nchans);
+   sw->rate = rate;
+   snprintf(sw->recording, sizeof(sw->recording), "%s", recording);
+   sw->first_data = data_start(sw->slots);
+   sw->big = file_size(sw->slots, nchans, samples) > SON_SMALL_MAX;
+   sw->round = malloc((size_t) nchans * SON_BLOCK_BYTES);
+   head = calloc(1, sw->first_data);
+   if (!sw->round || !head)
+   {
+      free(sw->round);
+      free(head);
+      free(sw);
+      errno = ENOMEM;
+      return NULL;
+   }
+      // hold the place of the headers until the end
+   if (fwrite(head, 1, sw->first_data, fd) != (size_t) sw->first_data)
+   {
+      free(sw->round);
+      free(head);
+      free(sw);
+      return NULL;
+   }
+   free(head);
+   sw->written = sw->first_data;
+   return sw;
+}
+
+
+bool son_write(SonWriter *sw, const short *rows, size_t nrows)
+{
+   size_t row, take;
+   int    chan;
+
+   for (row = 0; row < nrows; row += take)
+   {
+      if (sw->items == SON_BLOCK_SAMPS)
+      {
+         write_round(sw, false);
+         sw->items = 0;
+      }
+      take = SON_BLOCK_SAMPS - sw->items;
+      if (take > nrows - row)
+         take = nrows - row;
+         // each chan's samples into its block
+      for (chan = 0; chan < sw->nchans; ++chan)
+      {
+         unsigned char *to = sw->round + (size_t) chan * SON_BLOCK_BYTES + SON_BLOCK_HEAD + sw->items * 2;
+         const short   *from = rows + row * sw->nchans + chan;
+         size_t k;
+
+         for (k = 0; k < take; ++k, to += 2, from += sw->nchans)
+            put16(to, (unsigned short) *from);
+      }
+      sw->items += take;
+   }
+   return !sw->failed;
+}
+
+
+off_t son_written(const SonWriter *sw)
+{
+   return sw->written;
+}
+
+
+bool son_close(SonWriter *sw, off_t *size)
+{
+   unsigned char *head;
+   bool ok;
+
+   if (sw->items)
+      write_round(sw, true);
+   if ((head = calloc(1, sw->first_data)) == NULL)
+      sw->failed = true;
+   else
+   {
+      write_head(sw, head);
+      if (fseeko(sw->fd, 0, SEEK_SET) != 0
+          || fwrite(head, 1, sw->first_data, sw->fd) != (size_t) sw->first_data
+          || fseeko(sw->fd, 0, SEEK_END) != 0)
+         sw->failed = true;
+      free(head);
+   }
+   *size = sw->written;
+   ok = !sw->failed;
+   free(sw->round);
+   free(sw);
+   return ok;
+}
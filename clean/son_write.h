@@ -0,0 +1,94 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Writes a CED Spike2 data file, a .smr, in one pass, so Spike2 can open
+   the recording as it is instead of importing a .bin.  The import reads
+   the whole .bin and writes it all again in this format, which for a few
+   GB takes a long time.
+
+   A .smr is in the SON format.  There is a header for the file, and one for
+   each Spike2 channel with its title, sample rate, and scale.  After that
+   the samples for each channel are in blocks, with each block linked to
+   the channel's block before and after it.  Here every channel is
+   written one block at a time, the same size, in turn, so where every
+   block goes is known before it is written.  The rows of samples, one per
+   chan, are put into the blocks as they come, and the blocks are written
+   out a round at a time.  The headers are written last, when the length is
+   known.
+
+   A chan keeps its number, so chan 119 is Spike2 channel 119.  The time
+   unit is one sample, 40 us at 25000 samples per second, and the samples
+   are scaled the same as Spike2 does when it imports a .bin and is not
+   told otherwise, 6553.6 to a volt.
+
+   Files that will be under 2 GB are version 6 files, which have byte
+   offsets.  Bigger files are version 9, whose offsets count 512 byte disk
+   blocks, which Spike2 6 and later can read up to 1 TB.  Either way a
+   channel can have at most 65535 blocks, 23.6 hours at 25000
+   samples per second.
+*/
+
+#ifndef SON_WRITE_H
+#define SON_WRITE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define SON_LABEL_LEN 72      // a channel comment holds 71 chars
+#define SON_LBL_EXT ".lbl"
+
+typedef struct SonWriter SonWriter;
+
+typedef struct
+{
+   int  number;                  // the chan number, 1-128
+   char label[SON_LABEL_LEN];    // from the .lbl file, or empty
+} SonChan;
+
+/* Read the labels in a .lbl file made by make_label.sh, one per line, the
+   first line for chan 1.  Returns the number read, 0 if there is no file.
+*/
+int son_read_labels(const char *name, char labels[][SON_LABEL_LEN], int max);
+
+   // about how big the file will be for this many chans and rows of samples
+off_t son_file_size(int nchans, unsigned long long samples);
+
+/* Start a .smr in fd, for up to samples rows of nchans samples, taken at
+   rate per second.  The recording's YYYY-MM-DD_REC name gives the file its
+   date and comment.  Returns NULL with errno set if the recording is too
+   long for a .smr, EFBIG, or if it can't write the file.
+*/
+SonWriter *son_open(FILE *fd, const SonChan *chans, int nchans, double rate,
+                    unsigned long long samples, const char *recording);
+
+   // add rows of interleaved samples, one per chan, false on a write error
+bool son_write(SonWriter *sw, const short *rows, size_t nrows);
+
+   // bytes written so far
+off_t son_written(const SonWriter *sw);
+
+/* Write the last blocks and the headers, and free sw.  The file is left
+   open.  Puts the size of the file in *size and returns true if all of it
+   was written.
+*/
+bool son_close(SonWriter *sw, off_t *size);
+
+#endif
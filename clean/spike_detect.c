@@ -0,0 +1,254 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Threshold crossing spike detection and .spk files.  See spike_detect.h.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "spike_detect.h"
+
+#define LIMIT_MAX 40000          // past any short
+#define PUT_TIMES 1024
+
+
+void spike_detect_init(SpikeDetector *det, int refractory)
+{
+   memset(det, 0, sizeof(*det));
+   det->refractory = refractory;
+}
+
+
+   // a whole number t so that x < t is the same as x < lo for a short x
+static int low_limit(double lo)
+{
+   if (lo < -LIMIT_MAX)
+      return -LIMIT_MAX;
+   if (lo > LIMIT_MAX)
+      return LIMIT_MAX;
+   return ceil(lo);
+}
+
+static int high_limit(double hi)
+{
+   if (hi < -LIMIT_MAX)
+      return -LIMIT_MAX;
+   if (hi > LIMIT_MAX)
+      return LIMIT_MAX;
+   return floor(hi);
+}
+
+
+/* FindBigStuff's std(tdata), the standard deviation around the mean, with
+   n - 1.  The sums are exact so they are done in whole numbers.
+*/
+void spike_limits(const CleanParams *params, const short *samps, size_t n, int *lo, int *hi)
+{
+   double s;
+   int64_t sum = 0, sumsq = 0;
+   size_t  t;
+
+   if (!params->use_sd)
+   {
+      *lo = low_limit(params->lowthresh);
+      *hi = high_limit(params->highthresh);
+      return;
+   }
+   for (t = 0; t < n; ++t)
+   {
+      sum += samps[t];
+      sumsq += (int32_t) samps[t] * samps[t];
+   }
+   s = n > 1 ? sqrt(((double) sumsq - (double) sum * sum / n) / (n - 1)) : 0;
+   *lo = low_limit(-s * params->xsd);
+   *hi = high_limit(s * params->xsd);
+}
+
+
+   // is any of the samples past lo or hi, without a branch per sample.
+   // Called with SPIKE_RUN samples but at the end.
+static inline bool any_past(const short *samps, size_t n, int lo, int hi)
+{
+   int    past = 0;
+   size_t t;
+
+   for (t = 0; t < n; ++t)
+      past |= (samps[t] < lo) | (samps[t] > hi);
+   return past != 0;
+}
+
+
+size_t spike_detect(SpikeDetector *det, const short *samps, size_t n, int lo, int hi,
+                    uint64_t *times)
+{
+   size_t i = 0, end, found = 0;
+
+   while (i < n)
+   {
+      bool any;
+      if (n - i >= SPIKE_RUN)
+      {
+         end = i + SPIKE_RUN;
+         any = any_past(samps + i, SPIKE_RUN, lo, hi);
+      }
+      else
+      {
+         end = n;
+         any = any_past(samps + i, n - i, lo, hi);
+      }
+      if (!any)
+      {
+         det->past = false;
+         det->at += end - i;
+         i = end;
+         continue;
+      }
+      for ( ; i < end; ++i, ++det->at)
+      {
+         bool past = samps[i] < lo || samps[i] > hi;
+         if (past && !det->past
+             && (!det->found || det->at - det->last >= (uint64_t) det->refractory))
+         {
+            times[found++] = det->at;
+            det->last = det->at;
+            det->found = true;
+         }
+         det->past = past;
+      }
+   }
+   return found;
+}
+
+
+SpikeFile *spike_file_create(const char *name, int chan, int rate, int refractory)
+{
+   SpikeFile *sf = calloc(1, sizeof(*sf));
+
+   if (!sf)
+   {
+      printf("Out of memory\n");
+      return NULL;
+   }
+   if ((sf->fd = fopen(name, "w")) == NULL)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      free(sf);
+      return NULL;
+   }
+   memcpy(sf->hdr.magic, SPK_MAGIC, sizeof(sf->hdr.magic));
+   sf->hdr.version = SPK_VERSION;
+   sf->hdr.chan = chan;
+   sf->hdr.rate = rate;
+   sf->hdr.refractory = refractory;
+   sf->writing = true;
+      // filled in by spike_file_close
+   if (fwrite(&sf->hdr, sizeof(sf->hdr), 1, sf->fd) != 1)
+   {
+      printf("Error writing %s, %s\n", name, strerror(errno));
+      fclose(sf->fd);
+      free(sf);
+      return NULL;
+   }
+   return sf;
+}
+
+
+bool spike_file_put(SpikeFile *sf, const uint64_t *times, size_t n)
+{
+   uint32_t out[PUT_TIMES];
+   size_t   i, k, len;
+
+   for (i = 0; i < n; i += len)
+   {
+      len = n - i < PUT_TIMES ? n - i : PUT_TIMES;
+      for (k = 0; k < len; ++k)
+         out[k] = times[i + k];
+      if (fwrite(out, sizeof(*out), len, sf->fd) != len)
+         return false;
+   }
+   sf->hdr.count += n;
+   return true;
+}
+
+
+SpikeFile *spike_file_open(const char *name)
+{
+   SpikeFile *sf = calloc(1, sizeof(*sf));
+
+   if (!sf)
+   {
+      printf("Out of memory\n");
+      return NULL;
+   }
+   if ((sf->fd = fopen(name, "r")) == NULL)
+   {
+      printf("Error opening %s, %s\n", name, strerror(errno));
+      free(sf);
+      return NULL;
+   }
+   if (fread(&sf->hdr, sizeof(sf->hdr), 1, sf->fd) != 1
+       || memcmp(sf->hdr.magic, SPK_MAGIC, sizeof(sf->hdr.magic)) != 0
+       || sf->hdr.version != SPK_VERSION)
+   {
+      printf("%s is not a spike file\n", name);
+      fclose(sf->fd);
+      free(sf);
+      return NULL;
+   }
+   return sf;
+}
+
+
+size_t spike_file_read(SpikeFile *sf, uint64_t start, size_t n, uint32_t *times)
+{
+   if (start >= sf->hdr.count)
+      return 0;
+   if (n > sf->hdr.count - start)
+      n = sf->hdr.count - start;
+   if (fseeko(sf->fd, sizeof(sf->hdr) + start * sizeof(*times), SEEK_SET) != 0)
+      return 0;
+   return fread(times, sizeof(*times), n, sf->fd);
+}
+
+
+bool spike_file_close(SpikeFile *sf, uint64_t samples)
+{
+   bool ok = true;
+
+   if (!sf)
+      return true;
+   if (sf->writing)
+   {
+      sf->hdr.samples = samples;
+      ok = fseeko(sf->fd, 0, SEEK_SET) == 0
+           && fwrite(&sf->hdr, sizeof(sf->hdr), 1, sf->fd) == 1;
+   }
+   if (fclose(sf->fd) != 0)
+      ok = false;
+   free(sf);
+   return ok;
+}
@@ -0,0 +1,119 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Threshold crossing spike detection, the same test FindBigStuff in
+   CleanData.m makes, and the .spk files the spike times are kept in.
+
+   A sample is past the thresholds if it is below lo or above hi.  With
+   use_sd, lo and hi are -xsd and +xsd standard deviations of the samples
+   around it, otherwise they are lowthresh and highthresh.  A spike is the
+   first sample past the thresholds after one that is not, as long as it
+   is at least the refractory period after the spike before it.
+
+   Most of the time nothing is past the thresholds, so the samples are
+   checked a run at a time with a loop that has no branches, and only a
+   run with something in it is looked at a sample at a time.
+
+   A .spk file has the spike times of one chan.
+
+      header   "DAQ2SPK1", version, chan, samples per second, refractory
+               period in samples, samples looked at, number of spikes
+      times    the sample number of each spike, counting from 0 at the
+               start of the recording, as 32 bit numbers in the machine's
+               byte order, in order
+
+   32 bits holds 47 hours at 25000 samples per second.
+*/
+
+#ifndef SPIKE_DETECT_H
+#define SPIKE_DETECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "clean_data.h"
+
+#define SPK_MAGIC "DAQ2SPK1"
+#define SPK_VERSION 1
+#define SPK_EXT ".spk"
+#define SPIKE_RUN 64            // samples checked at once
+
+typedef struct
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t chan;
+   uint32_t rate;
+   uint32_t refractory;
+   uint64_t samples;
+   uint64_t count;
+} SpikeHeader;
+
+typedef struct
+{
+   int      refractory;     // samples
+   uint64_t at;             // the sample number of the next sample
+   uint64_t last;           // of the last spike
+   bool     found;          // there has been a spike
+   bool     past;           // the last sample was past the thresholds
+} SpikeDetector;
+
+void spike_detect_init(SpikeDetector *det, int refractory);
+
+/* The thresholds for n samples, from params the way FindBigStuff works them
+   out, as the whole numbers a sample is compared against.
+*/
+void spike_limits(const CleanParams *params, const short *samps, size_t n, int *lo, int *hi);
+
+/* Look for spikes in the next n samples of a chan, putting their sample
+   numbers in times, which must have room for n.  Returns how many.
+*/
+size_t spike_detect(SpikeDetector *det, const short *samps, size_t n, int lo, int hi,
+                    uint64_t *times);
+
+
+typedef struct
+{
+   FILE       *fd;
+   SpikeHeader hdr;
+   bool        writing;
+} SpikeFile;
+
+/* Start a .spk file.  Prints a message and returns NULL if it can't be
+   made.
+*/
+SpikeFile *spike_file_create(const char *name, int chan, int rate, int refractory);
+bool spike_file_put(SpikeFile *sf, const uint64_t *times, size_t n);
+
+/* Open an existing .spk file.  Prints a message and returns NULL if it
+   isn't one.  The header is in sf->hdr.
+*/
+SpikeFile *spike_file_open(const char *name);
+
+   // read n spike times starting at spike start, returns how many there were
+size_t spike_file_read(SpikeFile *sf, uint64_t start, size_t n, uint32_t *times);
+
+/* Close the file.  When writing, samples is how many samples were looked
+   at, and the header is filled in.  Returns false if the writing fails.
+*/
+bool spike_file_close(SpikeFile *sf, uint64_t samples);
+
+#endif
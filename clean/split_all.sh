@@ -20,6 +20,8 @@
 
 
 # a convenience function to automate splitting .daq files into .chan files.
+# daq2_split --all splits all of the files in parallel.  Any extra options,
+# such as -j 4 to use 4 threads, are handed on to it.
 
 if [ $# -lt 1 ] ; then
 	echo usage: $0 recording number[s], such as "$0 001 002 003"
@@ -28,24 +30,4 @@ fi
 
 echo "Start splitting operations"
 
-for rec in "$@"
-do
-    echo "$rec"
-
-   file1=${PWD##*/}_${rec}_1-64
-   file2=${PWD##*/}_${rec}_65-128
-
-   if [ -e $file1.daq ] ; then
-      daq2_split $file1
-   else
-      echo "$file1.daq does not exists"
-   fi
-
-   if [ -e $file2.daq ] ; then
-      daq2_split $file2
-   else
-      echo "$file2.daq does not exists"
-   fi
-
-done
-
+daq2_split --all "$@"
@@ -0,0 +1,294 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Run statistics for --stats.  See tool_stats.h.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/limits.h>
+#include <sys/resource.h>
+#include "tool_stats.h"
+
+#define CPU_READ_SECS 100e-6    // the thread cpu clock is a system call, read it this often
+
+typedef struct
+{
+   bool       started;
+   StatsPhase phase;
+   double     since;            // wall time the phase started
+   double     cpu_wall;         // wall time of the last cpu clock read,
+   double     cpu_mark;         //    and what it read
+   double     pending[STATS_PHASES];   // wall time since then in each phase
+} StatsThread;
+
+typedef struct
+{
+   unsigned long long syscr, syscw, rchar, wchar, read_bytes, write_bytes;
+} ProcIo;
+
+bool StatsOn = false;
+
+static __thread StatsThread Me;
+static pthread_mutex_t StatsLock = PTHREAD_MUTEX_INITIALIZER;
+static double Wall[STATS_PHASES], Cpu[STATS_PHASES];
+static unsigned long long BytesIn, BytesOut, Frames;
+static double Start;
+static char  *FileName;
+static int    Argc;
+static char **Argv;
+
+static const char *PhaseNames[STATS_PHASES] = { "other", "read", "convert", "write" };
+
+
+static double clock_secs(clockid_t id)
+{
+   struct timespec ts;
+   clock_gettime(id, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+   // read the cpu clock and share what it moved among the pending phases
+static void settle(double now)
+{
+   double cpu = clock_secs(CLOCK_THREAD_CPUTIME_ID);
+   double used = cpu - Me.cpu_mark, wall = 0;
+   int    p;
+
+   for (p = 0; p < STATS_PHASES; ++p)
+      wall += Me.pending[p];
+   pthread_mutex_lock(&StatsLock);
+   for (p = 0; p < STATS_PHASES; ++p)
+   {
+      Wall[p] += Me.pending[p];
+      if (wall > 0)
+         Cpu[p] += used * Me.pending[p] / wall;
+   }
+   pthread_mutex_unlock(&StatsLock);
+   memset(Me.pending, 0, sizeof(Me.pending));
+   Me.cpu_mark = cpu;
+   Me.cpu_wall = now;
+}
+
+
+StatsPhase stats_switch(StatsPhase phase)
+{
+   double     now = clock_secs(CLOCK_MONOTONIC);
+   StatsPhase old;
+
+   if (!Me.started)
+   {
+      Me.started = true;
+      Me.phase = STATS_OTHER;
+      Me.since = Me.cpu_wall = now;
+      Me.cpu_mark = clock_secs(CLOCK_THREAD_CPUTIME_ID);
+   }
+   old = Me.phase;
+   Me.pending[old] += now - Me.since;
+   Me.since = now;
+   Me.phase = phase;
+   if (now - Me.cpu_wall >= CPU_READ_SECS)
+      settle(now);
+   return old;
+}
+
+
+void stats_flush(void)
+{
+   double now;
+
+   if (!StatsOn || !Me.started)
+      return;
+   now = clock_secs(CLOCK_MONOTONIC);
+   Me.pending[Me.phase] += now - Me.since;
+   Me.since = now;
+   settle(now);
+}
+
+
+void stats_add(unsigned long long bytes_in, unsigned long long bytes_out,
+               unsigned long long frames)
+{
+   if (!StatsOn)
+      return;
+   pthread_mutex_lock(&StatsLock);
+   BytesIn += bytes_in;
+   BytesOut += bytes_out;
+   Frames += frames;
+   pthread_mutex_unlock(&StatsLock);
+}
+
+
+void stats_touch(const void *addr, size_t len)
+{
+   static long page;
+   const volatile unsigned char *p = addr;
+   unsigned char sum = 0;
+   size_t off;
+
+   if (!StatsOn || len == 0)
+      return;
+   if (!page)
+      page = sysconf(_SC_PAGESIZE);
+   for (off = 0; off < len; off += page)
+      sum += p[off];
+   sum += p[len - 1];
+   (void) sum;
+}
+
+
+static void read_proc_io(ProcIo *io)
+{
+   FILE *fd;
+   char  line[128];
+
+   memset(io, 0, sizeof(*io));
+   if ((fd = fopen("/proc/self/io", "r")) == NULL)
+      return;
+   while (fgets(line, sizeof(line), fd))
+   {
+      sscanf(line, "syscr: %llu", &io->syscr);
+      sscanf(line, "syscw: %llu", &io->syscw);
+      sscanf(line, "rchar: %llu", &io->rchar);
+      sscanf(line, "wchar: %llu", &io->wchar);
+      sscanf(line, "read_bytes: %llu", &io->read_bytes);
+      sscanf(line, "write_bytes: %llu", &io->write_bytes);
+   }
+   fclose(fd);
+}
+
+
+static void json_string(FILE *out, const char *str)
+{
+   fputc('"', out);
+   for ( ; *str; ++str)
+   {
+      unsigned char c = *str;
+      if (c == '"' || c == '\\')
+         fprintf(out, "\\%c", c);
+      else if (c < 0x20)
+         fprintf(out, "\\u%04x", c);
+      else
+         fputc(c, out);
+   }
+   fputc('"', out);
+}
+
+
+/* Write the report, one line of JSON.  The whole line goes out in one
+   write, so runs started at the same time can append to the same file.
+*/
+static void report(int status, void *arg)
+{
+   struct rusage ru;
+   ProcIo io;
+   char   dir[PATH_MAX], when[32];
+   char  *line = NULL;
+   size_t len = 0;
+   FILE  *out;
+   time_t now = time(NULL);
+   double wall, secs;
+   int    p, fd;
+
+   (void) arg;
+   stats_flush();
+   wall = clock_secs(CLOCK_MONOTONIC) - Start;
+   secs = wall > 0 ? wall : 1e-9;
+   read_proc_io(&io);
+   getrusage(RUSAGE_SELF, &ru);
+   if (!getcwd(dir, sizeof(dir)))
+      dir[0] = '\0';
+   strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+   if ((out = open_memstream(&line, &len)) == NULL)
+      return;
+   fprintf(out, "{\"tool\":");
+   json_string(out, strrchr(Argv[0], '/') ? strrchr(Argv[0], '/') + 1 : Argv[0]);
+   fprintf(out, ",\"args\":[");
+   for (p = 1; p < Argc; ++p)
+   {
+      json_string(out, Argv[p]);
+      if (p + 1 < Argc)
+         fputc(',', out);
+   }
+   fprintf(out, "],\"dir\":");
+   json_string(out, dir);
+   fprintf(out, ",\"finished\":\"%s\",\"exit_status\":%d", when, status);
+   fprintf(out, ",\"frames\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu", Frames, BytesIn, BytesOut);
+   fprintf(out, ",\"wall_seconds\":%.6f,\"cpu_user_seconds\":%.6f,\"cpu_system_seconds\":%.6f",
+           wall, ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+   fprintf(out, ",\"phases\":{");
+   for (p = STATS_READ; p < STATS_PHASES + STATS_READ; ++p)
+   {
+      int ph = p % STATS_PHASES;    // other goes last
+      fprintf(out, "%s\"%s\":{\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f}",
+              p == STATS_READ ? "" : ",", PhaseNames[ph], Wall[ph], Cpu[ph]);
+   }
+   fprintf(out, "}");
+   fprintf(out, ",\"read_calls\":%llu,\"write_calls\":%llu", io.syscr, io.syscw);
+   fprintf(out, ",\"read_call_bytes\":%llu,\"write_call_bytes\":%llu", io.rchar, io.wchar);
+   fprintf(out, ",\"disk_read_bytes\":%llu,\"disk_write_bytes\":%llu", io.read_bytes, io.write_bytes);
+   fprintf(out, ",\"major_faults\":%ld,\"minor_faults\":%ld,\"max_rss_kb\":%ld",
+           ru.ru_majflt, ru.ru_minflt, ru.ru_maxrss);
+   fprintf(out, ",\"mb_in_per_second\":%.3f,\"mb_out_per_second\":%.3f,\"frames_per_second\":%.1f}\n",
+           BytesIn / secs / 1e6, BytesOut / secs / 1e6, Frames / secs);
+   if (fclose(out) != 0)
+   {
+      free(line);
+      return;
+   }
+
+   fd = FileName ? open(FileName, O_WRONLY | O_APPEND | O_CREAT, 0644) : STDERR_FILENO;
+   if (fd == -1)
+      fprintf(stderr, "Could not write the stats to %s, %s\n", FileName, strerror(errno));
+   else if (write(fd, line, len) != (ssize_t) len)
+      fprintf(stderr, "Could not write the stats, %s\n", strerror(errno));
+   if (fd > STDERR_FILENO)
+      close(fd);
+   free(line);
+}
+
+
+bool stats_start(const char *file, int argc, char **argv)
+{
+   if (StatsOn)
+      return true;
+   if (file && (FileName = strdup(file)) == NULL)
+      return false;
+   Argc = argc;
+   Argv = argv;
+   Start = clock_secs(CLOCK_MONOTONIC);
+   if (on_exit(report, NULL) != 0)
+      return false;
+   StatsOn = true;
+   return true;
+}
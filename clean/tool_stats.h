@@ -0,0 +1,75 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   --stats for the conversion tools.  Where the time of a run went, split
+   into reading, converting, and writing, and how much was read and
+   written, as one line of JSON when the program exits.
+
+   A tool says which phase it is going into with stats_phase, which is
+   cheap enough to call a few times per frame.  The wall time of each phase
+   is exact.  The cpu time comes from the thread's cpu clock, which is
+   read at most every 100 us and shared out among the phases since the last
+   read by their wall time, so it is exact for longer phases and an
+   estimate for short ones.  With more than one thread the phase times are
+   summed over the threads.
+
+   The read and write calls and bytes are the kernel's counts for the
+   process from /proc/self/io, so they include everything stdio and the
+   libraries did.
+*/
+
+#ifndef TOOL_STATS_H
+#define TOOL_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum { STATS_OTHER, STATS_READ, STATS_CONVERT, STATS_WRITE, STATS_PHASES } StatsPhase;
+
+extern bool StatsOn;
+
+/* Turn the stats on.  The JSON is appended to file, or written to stderr
+   if file is NULL, when the program exits, however it exits.  argv is
+   kept for the report.
+*/
+bool stats_start(const char *file, int argc, char **argv);
+
+StatsPhase stats_switch(StatsPhase phase);
+
+   // go into a phase, returns the one the thread was in
+static inline StatsPhase stats_phase(StatsPhase phase)
+{
+   return StatsOn ? stats_switch(phase) : STATS_OTHER;
+}
+
+   // data bytes taken in and put out, and frames, samples per chan, done
+void stats_add(unsigned long long bytes_in, unsigned long long bytes_out,
+               unsigned long long frames);
+
+/* Touch a page of a memory mapped input at a time, so that the time to
+   read it in from the disk is counted as reading instead of in whatever
+   looks at it first.
+*/
+void stats_touch(const void *addr, size_t len);
+
+   // a thread is done, count its time so far
+void stats_flush(void);
+
+#endif
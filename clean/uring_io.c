@@ -0,0 +1,469 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   io_uring reads and writes.  See uring_io.h.
+*/
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include "uring_io.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+
+#define URING_BATCH 16      // requests queued before they are sent without waiting
+#define BUF_ALIGN 4096
+
+typedef enum { BUF_FREE, BUF_HELD, BUF_BUSY, BUF_DONE } BufState;
+
+typedef struct
+{
+   BufState state;
+   bool     write;
+   int      fd;
+   size_t   len;
+   off_t    offset;
+   ssize_t  res;
+   int      next_free;
+} UringBuf;
+
+struct UringIo
+{
+   int            ring_fd;
+   unsigned      *sq_head, *sq_tail, *sq_mask, *sq_array;
+   unsigned      *cq_head, *cq_tail, *cq_mask;
+   void          *sq_ring, *cq_ring, *sqe_mem;
+   size_t         sq_ring_size, cq_ring_size, sqe_size;
+#ifdef HAVE_URING
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+#endif
+   unsigned       queued;     // filled in, not sent to the kernel yet
+   unsigned       inflight;   // sent, not reaped yet
+   bool           fixed;      // the buffers are registered
+   size_t         bufsize;
+   unsigned       nbufs;
+   char          *mem;
+   UringBuf      *bufs;
+   struct iovec  *iov;
+   int            free_list;
+   int            err, err_fd;
+   bool           broken;     // the ring itself failed, nothing more will finish
+};
+
+
+#ifdef HAVE_URING
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+   return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+   return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+   return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+
+static bool map_rings(UringIo *io, struct io_uring_params *p)
+{
+   io->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+   io->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+   if (p->features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (io->cq_ring_size > io->sq_ring_size)
+         io->sq_ring_size = io->cq_ring_size;
+      io->cq_ring_size = io->sq_ring_size;
+   }
+   io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      io->ring_fd, IORING_OFF_SQ_RING);
+   if (io->sq_ring == MAP_FAILED)
+      return false;
+   if (p->features & IORING_FEAT_SINGLE_MMAP)
+      io->cq_ring = io->sq_ring;
+   else
+   {
+      io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         io->ring_fd, IORING_OFF_CQ_RING);
+      if (io->cq_ring == MAP_FAILED)
+      {
+         io->cq_ring = NULL;
+         return false;
+      }
+   }
+   io->sqe_size = p->sq_entries * sizeof(struct io_uring_sqe);
+   io->sqe_mem = mmap(NULL, io->sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      io->ring_fd, IORING_OFF_SQES);
+   if (io->sqe_mem == MAP_FAILED)
+   {
+      io->sqe_mem = NULL;
+      return false;
+   }
+   io->sqes = io->sqe_mem;
+   io->sq_head = (unsigned *) ((char *) io->sq_ring + p->sq_off.head);
+   io->sq_tail = (unsigned *) ((char *) io->sq_ring + p->sq_off.tail);
+   io->sq_mask = (unsigned *) ((char *) io->sq_ring + p->sq_off.ring_mask);
+   io->sq_array = (unsigned *) ((char *) io->sq_ring + p->sq_off.array);
+   io->cq_head = (unsigned *) ((char *) io->cq_ring + p->cq_off.head);
+   io->cq_tail = (unsigned *) ((char *) io->cq_ring + p->cq_off.tail);
+   io->cq_mask = (unsigned *) ((char *) io->cq_ring + p->cq_off.ring_mask);
+   io->cqes = (struct io_uring_cqe *) ((char *) io->cq_ring + p->cq_off.cqes);
+   return true;
+}
+
+
+static int buf_index(const UringIo *io, const void *buf)
+{
+   return ((const char *) buf - io->mem) / io->bufsize;
+}
+
+
+static void queue(UringIo *io, int idx)
+{
+   UringBuf *b = &io->bufs[idx];
+   unsigned tail = *io->sq_tail, slot = tail & *io->sq_mask;
+   struct io_uring_sqe *sqe = &io->sqes[slot];
+
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->fd = b->fd;
+   sqe->off = b->offset;
+   sqe->user_data = idx;
+   if (io->fixed)
+   {
+      sqe->opcode = b->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->addr = (unsigned long) io->iov[idx].iov_base;
+      sqe->len = b->len;
+      sqe->buf_index = idx;
+   }
+   else
+   {
+      io->iov[idx].iov_len = b->len;
+      sqe->opcode = b->write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->addr = (unsigned long) &io->iov[idx];
+      sqe->len = 1;
+   }
+   io->sq_array[slot] = slot;
+   __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+   b->state = BUF_BUSY;
+   io->queued++;
+}
+
+
+/* Send what is queued, and wait for at least wait requests to finish.
+   If the ring itself fails, which should not happen once it is set up,
+   it is marked broken and everything waiting on it gives up.
+*/
+static void enter(UringIo *io, unsigned wait)
+{
+   int ret;
+
+   while (!io->broken)
+   {
+      ret = sys_enter(io->ring_fd, io->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+      if (ret >= 0)
+      {
+         io->queued -= ret;
+         io->inflight += ret;
+         return;
+      }
+      if (errno == EAGAIN || errno == EBUSY)
+         return;     // the caller reaps and comes back
+      if (errno != EINTR)
+      {
+         if (!io->err)
+            io->err = errno;
+         io->err_fd = -1;
+         io->broken = true;
+      }
+   }
+}
+
+
+/* The rest of a short read or write.  Regular files only come up short at
+   the end of the file or if something is wrong, so this is rare.
+*/
+static ssize_t finish(UringIo *io, int idx, ssize_t done)
+{
+   UringBuf *b = &io->bufs[idx];
+   char *addr = io->mem + (size_t) idx * io->bufsize;
+
+   while (done >= 0 && (size_t) done < b->len)
+   {
+      ssize_t got = b->write ? pwrite(b->fd, addr + done, b->len - done, b->offset + done)
+                             : pread(b->fd, addr + done, b->len - done, b->offset + done);
+      if (got < 0 && errno == EINTR)
+         continue;
+      if (got < 0)
+         return -errno;
+      if (got == 0)
+         break;
+      done += got;
+   }
+   return done;
+}
+
+
+   // take the finished requests off the completion queue
+static void reap(UringIo *io)
+{
+   unsigned head = *io->cq_head;
+   unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+
+   for ( ; head != tail; head++)
+   {
+      struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+      int idx = cqe->user_data;
+      UringBuf *b = &io->bufs[idx];
+      ssize_t res = cqe->res;
+
+      if (res >= 0 && (size_t) res < b->len)
+         res = finish(io, idx, res);
+      io->inflight--;
+      if (b->write)
+      {
+         if ((res < 0 || (size_t) res != b->len) && !io->err)
+         {
+            io->err = res < 0 ? -res : ENOSPC;
+            io->err_fd = b->fd;
+         }
+         b->state = BUF_FREE;
+         b->next_free = io->free_list;
+         io->free_list = idx;
+      }
+      else
+      {
+         b->res = res;
+         b->state = BUF_DONE;
+      }
+   }
+   __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+UringIo *uring_open(unsigned nbufs, size_t bufsize)
+{
+   struct io_uring_params p;
+   const char *env = getenv("DAQ_IO");
+   UringIo *io;
+   unsigned b;
+
+   if ((env && strcmp(env, "stdio") == 0) || nbufs == 0)
+      return NULL;
+   if ((io = calloc(1, sizeof(*io))) == NULL)
+      return NULL;
+   memset(&p, 0, sizeof(p));
+   io->ring_fd = sys_setup(nbufs, &p);
+   if (io->ring_fd < 0)
+   {
+      free(io);
+      return NULL;
+   }
+   io->bufsize = (bufsize + BUF_ALIGN - 1) / BUF_ALIGN * BUF_ALIGN;
+   io->nbufs = nbufs;
+   io->bufs = calloc(nbufs, sizeof(*io->bufs));
+   io->iov = calloc(nbufs, sizeof(*io->iov));
+   if (!map_rings(io, &p) || !io->bufs || !io->iov
+       || posix_memalign((void **) &io->mem, BUF_ALIGN, io->bufsize * nbufs) != 0)
+   {
+      io->mem = NULL;
+      uring_close(io);
+      return NULL;
+   }
+   io->free_list = -1;
+   for (b = nbufs; b-- > 0; )
+   {
+      io->iov[b].iov_base = io->mem + (size_t) b * io->bufsize;
+      io->iov[b].iov_len = io->bufsize;
+      io->bufs[b].next_free = io->free_list;
+      io->free_list = b;
+   }
+      // older kernels count registered buffers against RLIMIT_MEMLOCK,
+      // without them it still works, the kernel just maps each request
+   io->fixed = sys_register(io->ring_fd, IORING_REGISTER_BUFFERS, io->iov, nbufs) == 0;
+   return io;
+}
+
+
+void uring_close(UringIo *io)
+{
+   if (!io)
+      return;
+   if (io->sqe_mem)
+   {
+      uring_drain(io);
+      munmap(io->sqe_mem, io->sqe_size);
+   }
+   if (io->cq_ring && io->cq_ring != io->sq_ring)
+      munmap(io->cq_ring, io->cq_ring_size);
+   if (io->sq_ring && io->sq_ring != MAP_FAILED)
+      munmap(io->sq_ring, io->sq_ring_size);
+   close(io->ring_fd);
+   free(io->mem);
+   free(io->bufs);
+   free(io->iov);
+   free(io);
+}
+
+
+void *uring_get(UringIo *io)
+{
+   int idx;
+
+   while (io->free_list == -1)
+   {
+      if ((io->queued == 0 && io->inflight == 0) || io->broken)
+         return NULL;
+      enter(io, 1);
+      reap(io);
+   }
+   idx = io->free_list;
+   io->free_list = io->bufs[idx].next_free;
+   io->bufs[idx].state = BUF_HELD;
+   return io->mem + (size_t) idx * io->bufsize;
+}
+
+
+void uring_put(UringIo *io, void *buf)
+{
+   int idx = buf_index(io, buf);
+
+   io->bufs[idx].state = BUF_FREE;
+   io->bufs[idx].next_free = io->free_list;
+   io->free_list = idx;
+}
+
+
+bool uring_write(UringIo *io, int fd, void *buf, size_t len, off_t offset)
+{
+   int idx = buf_index(io, buf);
+
+   if (len == 0)
+   {
+      uring_put(io, buf);
+      return !io->err;
+   }
+   io->bufs[idx].write = true;
+   io->bufs[idx].fd = fd;
+   io->bufs[idx].len = len;
+   io->bufs[idx].offset = offset;
+   queue(io, idx);
+   if (io->queued >= URING_BATCH)
+   {
+      enter(io, 0);
+      reap(io);
+   }
+   return !io->err;
+}
+
+
+void uring_read(UringIo *io, int fd, void *buf, size_t len, off_t offset)
+{
+   int idx = buf_index(io, buf);
+
+   io->bufs[idx].write = false;
+   io->bufs[idx].fd = fd;
+   io->bufs[idx].len = len;
+   io->bufs[idx].offset = offset;
+   queue(io, idx);
+   if (io->queued >= URING_BATCH)
+      enter(io, 0);
+}
+
+
+ssize_t uring_wait(UringIo *io, void *buf)
+{
+   UringBuf *b = &io->bufs[buf_index(io, buf)];
+
+   while (b->state == BUF_BUSY)
+   {
+      if (io->broken)
+         return -io->err;
+      enter(io, 1);
+      reap(io);
+   }
+   b->state = BUF_HELD;
+   return b->res;
+}
+
+
+bool uring_drain(UringIo *io)
+{
+   while ((io->queued || io->inflight) && !io->broken)
+   {
+      enter(io, 1);
+      reap(io);
+   }
+   return !io->err;
+}
+
+#else
+
+UringIo *uring_open(unsigned nbufs, size_t bufsize)
+{
+   (void) nbufs;
+   (void) bufsize;
+   return NULL;
+}
+
+   // without io_uring there is never a ring, so these are not called
+void uring_close(UringIo *io) { (void) io; }
+void *uring_get(UringIo *io) { (void) io; return NULL; }
+void uring_put(UringIo *io, void *buf) { (void) io; (void) buf; }
+bool uring_write(UringIo *io, int fd, void *buf, size_t len, off_t offset)
+{
+   (void) io; (void) fd; (void) buf; (void) len; (void) offset;
+   return false;
+}
+void uring_read(UringIo *io, int fd, void *buf, size_t len, off_t offset)
+{
+   (void) io; (void) fd; (void) buf; (void) len; (void) offset;
+}
+ssize_t uring_wait(UringIo *io, void *buf) { (void) io; (void) buf; return -ENOSYS; }
+bool uring_drain(UringIo *io) { (void) io; return false; }
+
+#endif
+
+
+int uring_error(const UringIo *io, int *fd)
+{
+   if (fd)
+      *fd = io->err_fd;
+   return io->err;
+}
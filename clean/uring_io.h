@@ -0,0 +1,88 @@
+/*
+ Copyright 2005-2020 Kendall F. Morris
+
+  This file is part of the USF Neural Recording Cleaning suite.
+
+     The USF Neural Recording Cleaning Simulator suite is free software: you
+     can redistribute it and/or modify it under the terms of the GNU General
+     Public License as published by the Free Software Foundation, either
+     version 3 of the License, or (at your option) any later version.
+
+     The suite is distributed in the hope that it will be useful, but WITHOUT
+     ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+     FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+     more details.
+
+     You should have received a copy of the GNU General Public License along
+     with the suite.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+   Asynchronous reads and writes of many files at once with io_uring, for
+   the tools that write or read a file per chan.  Instead of one blocking
+   read or write at a time, a read or write for every chan can be in flight
+   together, which is what it takes to keep a RAID array busy.
+
+   The ring has a pool of buffers, registered with the kernel so it does
+   not have to map them for every request.  A buffer is taken from the
+   pool, filled, and handed back with uring_write, which queues it and
+   puts it back in the pool when the write is done.  For reading, a buffer
+   is handed to uring_read and uring_wait gives it back full.  Requests are
+   sent to the kernel in batches, and whenever something has to be waited
+   for.
+
+   This uses the system calls directly, liburing is not needed.  If the
+   kernel or the build has no io_uring, or it is turned off, e.g. by
+   /proc/sys/kernel/io_uring_disabled or a container's seccomp filter,
+   uring_open returns NULL and the tools use stdio as before.  DAQ_IO=stdio
+   in the environment does the same.
+*/
+
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct UringIo UringIo;
+
+/* A ring with nbufs buffers of bufsize bytes.  Returns NULL if io_uring
+   can't be used or there is not enough memory.
+*/
+UringIo *uring_open(unsigned nbufs, size_t bufsize);
+
+   // wait for everything in flight, then free the ring and the buffers
+void uring_close(UringIo *io);
+
+/* A free buffer from the pool.  If there isn't one, waits for a write to
+   finish.  Returns NULL if all of them are held for reading.
+*/
+void *uring_get(UringIo *io);
+
+   // put a buffer back in the pool without using it
+void uring_put(UringIo *io, void *buf);
+
+/* Queue a write of len bytes of buf, a buffer from uring_get, to fd at
+   offset.  The buffer goes back to the pool when the write is done.
+   Returns false if an earlier write failed, see uring_error.
+*/
+bool uring_write(UringIo *io, int fd, void *buf, size_t len, off_t offset);
+
+   // queue a read of len bytes from fd at offset into buf
+void uring_read(UringIo *io, int fd, void *buf, size_t len, off_t offset);
+
+/* Wait for the read into buf.  Returns the number of bytes read, which is
+   less than asked for only at the end of the file, or -errno.
+*/
+ssize_t uring_wait(UringIo *io, void *buf);
+
+   // wait for everything in flight, false if a write failed
+bool uring_drain(UringIo *io);
+
+/* The errno of the first write that failed, 0 if none have, and in *fd
+   the file it was to.
+*/
+int uring_error(const UringIo *io, int *fd);
+
+#endif
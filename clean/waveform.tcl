@@ -27,9 +27,11 @@ proc set_dr_times {} {
     set time_right [expr $time_left + $samples_per_width / 25000.0]
     set time_diff [expr $time_right - $time_left]
     update  idletasks
+    env_schedule
 }
 
 square .sq -type 4 -bg white -xscale $xscale -time $sample -bd 0
+canvas .sq.env -highlightthickness 0 -bd 0
 
 frame .sq.fcm -bg red
 frame .sq.fym -bg red
@@ -73,6 +75,114 @@ set sample_count [get_sample_count $chan]
 
 .sq configure -data $chan
 
+# The envelope of the chan, if daq2_envelope has made one.  It has the
+# min, max, and mean of bins of 16 samples, 32 samples, and so on.  When
+# zoomed out to 16 or more samples per pixel, the level with about one bin
+# per pixel is drawn on a canvas over the square widget instead of the
+# samples, so an hour of data costs about the same as one screen of it.
+
+set env_fd ""
+set env_shown 0
+set env_after ""
+
+proc env_open {name} {
+    global env_fd env_shift env_levels env_bins env_offset
+    set fd [open $name r]
+    fconfigure $fd -translation binary
+    if {[binary scan [read $fd 32] a8iiiiw magic version shift levels pad samples] != 6
+	|| $magic != "DAQ2ENV1" || $version != 1} {
+	puts "$name is not an envelope file"
+	close $fd
+	return
+    }
+    set where 32
+    for {set level 0} {$level < $levels} {incr level} {
+	set size [expr {1 << ($shift + $level)}]
+	set env_bins($level) [expr {($samples + $size - 1) / $size}]
+	set env_offset($level) $where
+	incr where [expr {$env_bins($level) * 6}]
+    }
+    set env_shift $shift
+    set env_levels $levels
+    set env_fd $fd
+}
+
+# Redraw once the current event is done, after the .sq configure that
+# usually follows set_dr_times.
+proc env_schedule {} {
+    global env_fd env_after
+    if {$env_fd == ""} return
+    after cancel $env_after
+    set env_after [after 0 env_draw]
+}
+
+proc env_draw {} {
+    global env_fd env_shift env_levels env_bins env_offset env_shown sample xscale ymag
+    set width [winfo width .sq]
+    set height [winfo height .sq]
+    set spp [expr {1.0 / $xscale}]
+    set level -1
+    while {$level + 1 < $env_levels && (1 << ($env_shift + $level + 1)) <= $spp} {
+	incr level
+    }
+    if {$level < 0} {
+	if {$env_shown} {
+	    place forget .sq.env
+	    .sq configure -xscale $xscale
+	    set env_shown 0
+	}
+	return
+    }
+
+    set size [expr {1 << ($env_shift + $level)}]
+    set first [expr {int($sample) / $size}]
+    set last [expr {int($sample + $width * $spp) / $size}]
+    if {$last >= $env_bins($level)} {set last [expr {$env_bins($level) - 1}]}
+    set bins {}
+    if {$first <= $last} {
+	seek $env_fd [expr {$env_offset($level) + $first * 6}]
+	binary scan [read $env_fd [expr {($last - $first + 1) * 6}]] s* bins
+    }
+    set nbins [expr {[llength $bins] / 3}]
+
+    .sq.env configure -bg [.sq cget -bg]
+    .sq.env delete all
+    set yscale [expr {.005 * $ymag}]
+    set mid [expr {$height / 2.0}]
+    set means {}
+    for {set x 0} {$x < $width} {incr x} {
+	set b0 [expr {int($sample + $x * $spp) / $size - $first}]
+	set b1 [expr {int($sample + ($x + 1) * $spp) / $size - $first}]
+	if {$b1 <= $b0} {set b1 [expr {$b0 + 1}]}
+	if {$b1 > $nbins} {set b1 $nbins}
+	if {$b0 >= $b1} break
+	set lo 32767
+	set hi -32768
+	set sum 0
+	for {set b $b0} {$b < $b1} {incr b} {
+	    set i [expr {3 * $b}]
+	    if {[lindex $bins $i] < $lo} {set lo [lindex $bins $i]}
+	    if {[lindex $bins [expr {$i + 1}]] > $hi} {set hi [lindex $bins [expr {$i + 1}]]}
+	    incr sum [lindex $bins [expr {$i + 2}]]
+	}
+	.sq.env create line $x [expr {$mid - $hi * $yscale}] $x [expr {$mid - $lo * $yscale + 1}]
+	lappend means $x [expr {$mid - double($sum) / ($b1 - $b0) * $yscale}]
+    }
+    if {[llength $means] >= 4} {
+	.sq.env create line $means -fill blue
+    }
+    if {!$env_shown} {
+	place .sq.env -in .sq -x 0 -y 0 -relwidth 1.0 -relheight 1.0
+	set env_shown 1
+    }
+    # the samples are covered up, so only have the widget draw a screen of them
+    .sq configure -xscale 1.0
+}
+
+if {[file exists [file rootname $filename].env]} {
+    env_open [file rootname $filename].env
+}
+
 proc new_ymag {val} {
     global ymag
     if {$val == 0} {
@@ -81,19 +191,23 @@ proc new_ymag {val} {
 	set ymag [expr $ymag + $val];
     }
     .sq configure -yscale [expr .005 * $ymag]
+    env_schedule
 }
 
 bind .sq <Motion> {mouse %W %X %Y}
 bind .sq.fcm <Motion> {mouse %W %X %Y}
 bind .sq.fym <Motion> {mouse %W %X %Y}
+bind .sq.env <Motion> {mouse %W %X %Y}
 
 bind .sq <1> {pick %W %X}
 bind .sq.fcm <1> {pick %W %X}
 bind .sq.fym <1> {pick %W %X}
+bind .sq.env <1> {pick %W %X}
 
 bind .sq <Shift-1> {unpick %W %X}
 bind .sq.fcm <Shift-1> {unpick %W %X}
 bind .sq.fym <Shift-1> {unpick %W %X}
+bind .sq.env <Shift-1> {unpick %W %X}
 
 bind all <ButtonRelease> {set nopaint 0}
 #bind all <KeyPress> {puts %K}
@@ -106,6 +220,7 @@ bind all <KeyPress-h> {
     } else {
         .sq configure -bg white
     }
+    env_schedule
 }
 bind all <KeyPress-p> {.sq configure -run 1}
 bind all <KeyPress-s> {.sq configure -run 0}